@@ -0,0 +1,222 @@
+//
+//  amplitude.c
+//  q3302dali
+//
+//  Per second amplitudes of one-second data, see amplitude.h.
+//
+//  The offset is removed with a one pole highpass, y[n] = x[n] - x[n-1] +
+//  r * y[n-1], carried across packets so each second is measured against
+//  the same baseline.  Velocity is the trapezoidal integral of the
+//  filtered acceleration through a leaky integrator with the same corner,
+//  which keeps it from drifting on the offset that is left.  Values are
+//  in counts, converting them to physical units is left to the consumer
+//  who knows the gain.
+//
+//  A gap or rate change restarts the filters at the first sample.  The
+//  state hangs off the stream table entry, and the channels a spec does
+//  not match are remembered there too, so each packet costs one hash
+//  lookup.  Amplitudes are only used from the lib330 callback thread.
+//
+
+#include <stdio.h>
+#include <math.h>
+#include <fnmatch.h>
+#include "amplitude.h"
+#include "streams.h"
+
+typedef struct ampstream_s
+{
+  StreamInfo *stream;
+  int spec;                        /* index of the matching spec, -1 for none */
+  double rate;
+  double r;                        /* highpass pole */
+  double lastin;                   /* previous input sample */
+  double lastout;                  /* previous highpass output */
+  double velocity;
+  hptime_t nexttime;               /* expected time of the next sample */
+} AmpStream;
+
+static AmplitudeSpec *specs = NULL;
+static int numspecs = 0;
+static amplitude_handler handler = NULL;
+
+/***************************************************************************
+ * amplitude_init:
+ *
+ * Keep the amplitude specs, amplitudes are passed to ahandler.
+ *
+ * Returns the number of usable specs.
+ ***************************************************************************/
+int amplitude_init ( AmplitudeSpec *aspecs, int naspecs, amplitude_handler ahandler )
+{
+  int i;
+
+  handler = ahandler;
+  numspecs = 0;
+
+  if ( naspecs <= 0 )
+    return 0;
+
+  if ( ! (specs = (AmplitudeSpec *) calloc (naspecs, sizeof(AmplitudeSpec))) )
+  {
+    ms_log (2, "Cannot allocate amplitude specs\n");
+    return 0;
+  }
+
+  for ( i = 0; i < naspecs; i++ )
+  {
+    if ( aspecs[i].highpass <= 0.0 )
+    {
+      ms_log (2, "Amplitude %s: the highpass corner must be above 0 Hz\n", aspecs[i].source);
+      continue;
+    }
+
+    specs[numspecs++] = aspecs[i];
+    ms_log (0, "Amplitudes of %s%s, highpass %g Hz\n", aspecs[i].source,
+            ( aspecs[i].velocity ) ? " with velocity" : "", aspecs[i].highpass);
+  }
+
+  return numspecs;
+}
+
+/* Find the stream state for a record, creating it on first sight */
+static AmpStream *findstream ( MSRecord *msr )
+{
+  StreamInfo *si;
+  AmpStream *as;
+  char locchan[20];
+  int i;
+
+  if ( ! (si = streams_get (msr->network, msr->station, msr->location, msr->channel)) )
+    return NULL;
+
+  if ( si->amplitude )
+    return (AmpStream *) si->amplitude;
+
+  if ( ! (as = (AmpStream *) calloc (1, sizeof(AmpStream))) )
+    return NULL;
+
+  as->stream = si;
+  as->nexttime = HPTERROR;
+
+  /* A spec with a dot names the location too, an empty one as -- */
+  snprintf (locchan, sizeof(locchan), "%s.%s", ( msr->location[0] ) ? msr->location : "--",
+            msr->channel);
+  as->spec = -1;
+  for ( i = 0; i < numspecs && as->spec < 0; i++ )
+  {
+    if ( ! fnmatch (specs[i].source, ( strchr (specs[i].source, '.') ) ? locchan : msr->channel, 0) )
+      as->spec = i;
+  }
+
+  si->amplitude = as;
+
+  return as;
+}
+
+/* Measure one record */
+static void measurerecord ( AmpStream *as, MSRecord *msr )
+{
+  AmplitudeSpec *spec = &specs[as->spec];
+  int32 *samples = (int32 *) msr->datasamples;
+  double period = 1.0 / msr->samprate;
+  double lastin, lastout, velocity;
+  double sumsq = 0.0;
+  double peak = -1.0;
+  double pgv = 0.0;
+  int64_t peakindex = 0;
+  Amplitudes amp;
+  int64_t i;
+
+  if ( as->rate != msr->samprate )
+  {
+    as->rate = msr->samprate;
+    as->r = exp (-2.0 * M_PI * spec->highpass * period);
+    as->nexttime = HPTERROR;
+  }
+
+  if ( as->nexttime == HPTERROR ||
+       llabs (msr->starttime - as->nexttime) > HPTMODULUS * period / 2 )
+  {
+    as->lastin = samples[0];
+    as->lastout = 0.0;
+    as->velocity = 0.0;
+  }
+
+  lastin = as->lastin;
+  lastout = as->lastout;
+  velocity = as->velocity;
+
+  for ( i = 0; i < msr->numsamples; i++ )
+  {
+    double x = samples[i];
+    double y = x - lastin + as->r * lastout;
+
+    if ( fabs (y) > peak )
+    {
+      peak = fabs (y);
+      peakindex = i;
+    }
+    sumsq += y * y;
+
+    if ( spec->velocity )
+    {
+      velocity = as->r * velocity + (y + lastout) * period / 2.0;
+      if ( fabs (velocity) > pgv )
+        pgv = fabs (velocity);
+    }
+
+    lastin = x;
+    lastout = y;
+  }
+
+  as->lastin = lastin;
+  as->lastout = lastout;
+  as->velocity = velocity;
+  as->nexttime = msr->starttime + (hptime_t) (msr->numsamples * HPTMODULUS * period + 0.5);
+
+  strcpy (amp.network, as->stream->network);
+  strcpy (amp.station, as->stream->station);
+  strcpy (amp.location, as->stream->location);
+  strcpy (amp.channel, as->stream->channel);
+  amp.starttime = msr->starttime;
+  amp.numsamples = (int) msr->numsamples;
+  amp.peak = peak;
+  amp.peaktime = msr->starttime + (hptime_t) (peakindex * HPTMODULUS * period + 0.5);
+  amp.rms = sqrt (sumsq / msr->numsamples);
+  amp.velocity = spec->velocity;
+  amp.pgv = pgv;
+
+  handler (&amp);
+}
+
+/***************************************************************************
+ * amplitude_record:
+ *
+ * Measure a one-second record of integer samples if a spec matches it.
+ ***************************************************************************/
+void amplitude_record ( MSRecord *msr )
+{
+  AmpStream *as;
+
+  if ( numspecs == 0 || msr->samprate <= 0.0 || msr->numsamples <= 0 ||
+       msr->sampletype != 'i' )
+    return;
+
+  if ( (as = findstream (msr)) && as->spec >= 0 )
+    measurerecord (as, msr);
+}
+
+void amplitude_free ( void )
+{
+  StreamInfo *si;
+
+  for ( si = streams_first (); si; si = si->listnext )
+  {
+    free (si->amplitude);
+    si->amplitude = NULL;
+  }
+  free (specs);
+  specs = NULL;
+  numspecs = 0;
+}
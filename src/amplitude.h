@@ -0,0 +1,48 @@
+//
+//  amplitude.h
+//  q3302dali
+//
+//  Ground motion amplitudes per second of one-second data: the peak and
+//  RMS of each packet after removing the offset, and for accelerometers
+//  the peak of the velocity integrated from it.  Consumers of shaking
+//  parameters get a few numbers a second instead of the waveforms.
+//
+
+#ifndef amplitude_h
+#define amplitude_h
+
+#include "q3302dali.h"
+
+#define MAX_AMPLITUDES 32
+
+/* An amplitude spec as read from the config file */
+typedef struct amplitudespec_s
+{
+  char source[16];                 /* CHAN or LOC.CHAN glob of the input */
+  double highpass;                 /* offset removal corner in Hz */
+  int32 velocity;                  /* integrate acceleration to velocity */
+} AmplitudeSpec;
+
+typedef struct amplitudes_s
+{
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+  hptime_t starttime;              /* of the packet */
+  int numsamples;
+  double peak;                     /* largest absolute value, counts */
+  hptime_t peaktime;
+  double rms;                      /* counts */
+  int velocity;                    /* pgv is set */
+  double pgv;                      /* peak velocity, counts * s */
+} Amplitudes;
+
+/* Receives the amplitudes of each packet, on the lib330 callback thread */
+typedef void (*amplitude_handler) ( Amplitudes *amplitudes );
+
+int amplitude_init ( AmplitudeSpec *specs, int numspecs, amplitude_handler handler );
+void amplitude_record ( MSRecord *msr );
+void amplitude_free ( void );
+
+#endif /* amplitude_h */
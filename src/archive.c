@@ -0,0 +1,697 @@
+//
+//  archive.c
+//  q3302dali
+//
+//  Local SDS archive writer, see archive.h.
+//
+//  archive_write() copies a record into the fill buffer under a mutex and
+//  returns.  The archive thread swaps the fill buffer with its own every
+//  write delay, or sooner once the fill buffer is half full, groups the
+//  records of the batch by day file and appends each group with a single
+//  writev().  Day files stay open between batches in a table of cached
+//  descriptors; a file that has not been written for ARCH_IDLE_CLOSE
+//  seconds is closed, which is how the files of the previous day are
+//  closed after midnight.  Dirty files are synced every sync interval.
+//
+//  With io_uring the same writes are queued as one vectored write per
+//  file and the whole batch goes to the kernel with one system call
+//  however many day files it touches.  Buffered appends are usually
+//  handed to kernel worker threads by io_uring, which may cost more than
+//  the system calls saved, compare with outbench before using it.
+//
+//  Nothing here blocks the sending thread on the disk: when the archive
+//  falls behind far enough to fill the buffer, records are dropped and
+//  counted rather than held.
+//
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "archive.h"
+#include "placement.h"
+#include "uring.h"
+#include "trace.h"
+
+#define ARCH_IDLE_CLOSE 900        /* seconds without writes before a file is closed */
+#define ARCH_IOV_MAX 1024          /* iovecs per writev() */
+#define ARCH_PATH_MAX 512
+#define ARCH_URING_ENTRIES 256     /* files written per io_uring submit */
+
+/* Queued record header, the record follows it */
+typedef struct archrec_s
+{
+  hptime_t starttime;
+  int reclen;
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+} ArchRec;
+
+#define ARCH_RECSIZE(reclen) ( ( sizeof(ArchRec) + (reclen) + 7 ) & ~(size_t) 7 )
+
+typedef struct archbuf_s
+{
+  char *data;
+  size_t len;
+  size_t cap;
+} ArchBuf;
+
+typedef struct archfile_s
+{
+  char path[ARCH_PATH_MAX];
+  uint32_t hash;
+  int fd;                          /* -1 if the entry is free */
+  int dirty;                       /* written since the last fsync() */
+  time_t lastwrite;
+  uint64_t lastuse;                /* for least recently used eviction */
+  struct iovec *iov;               /* records of the current batch */
+  int numiov;
+  int maxiov;
+  int failed;                      /* first record of an io_uring write that failed */
+  int partial;                     /* bytes that write wrote */
+  int error;                       /* errno of the failed write, 0 if short */
+} ArchFile;
+
+static char archroot[ARCH_PATH_MAX];
+static int writedelay = 1000;      /* milliseconds */
+static int syncinterval = 60;      /* seconds, 0 leaves syncing to the system */
+
+static ArchBuf buffers[2];
+static ArchBuf *fill = NULL;       /* buffer archive_write() appends to */
+static pthread_mutex_t queuelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queuecond = PTHREAD_COND_INITIALIZER;
+static int wakeup = 0;
+static int stopping = 0;
+static int running = 0;
+static uint64_t dropped = 0;       /* records not queued, queue lock */
+static pthread_t archivethread;
+
+/* Archive thread only */
+static ArchFile *files = NULL;
+static int maxfiles = 0;
+static uint64_t usetick = 0;
+static uint64_t written = 0;
+static uint64_t openfailures = 0;  /* not yet logged */
+static time_t lastopenerror = 0;
+static Uring *ring = NULL;         /* NULL writes with writev() */
+
+static void *archive_thread ( void *arg );
+
+/***************************************************************************
+ * archive_start:
+ *
+ * Start writing records under root.  writedelay is the longest time in
+ * milliseconds a record is held before it is written, syncinterval the
+ * seconds between syncs of written files (0 never syncs explicitly),
+ * maxopenfiles the size of the descriptor cache and buffersize the size
+ * in kilobytes of each of the two queue buffers.  With useuring batches
+ * are written through io_uring where the kernel has it.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int archive_start ( const char *root, int delay, int sync, int maxopenfiles, int buffersize,
+                    int useuring )
+{
+  int i;
+
+  if ( delay <= 0 || sync < 0 || maxopenfiles <= 0 || buffersize <= 0 )
+  {
+    ms_log (2, "Archive write delay, open files and buffer size must be positive\n");
+    return -1;
+  }
+
+  if ( strlen (root) >= sizeof(archroot) - 64 )
+  {
+    ms_log (2, "ArchiveRoot %s is too long\n", root);
+    return -1;
+  }
+  strcpy (archroot, root);
+  writedelay = delay;
+  syncinterval = sync;
+
+  for ( i = 0; i < 2; i++ )
+  {
+    buffers[i].cap = (size_t) buffersize * 1024;
+    buffers[i].len = 0;
+    if ( ! (buffers[i].data = (char *) malloc (buffers[i].cap)) )
+    {
+      ms_log (2, "Cannot allocate archive buffer of %d kilobytes\n", buffersize);
+      return -1;
+    }
+  }
+  fill = &buffers[0];
+
+  if ( useuring )
+  {
+    if ( ! (ring = uring_open (ARCH_URING_ENTRIES)) )
+      ms_log (1, "io_uring is not available (%s), archive writes use writev\n", strerror (errno));
+  }
+
+  if ( ! (files = (ArchFile *) calloc (maxopenfiles, sizeof(ArchFile))) )
+  {
+    ms_log (2, "Cannot allocate archive file table\n");
+    return -1;
+  }
+  for ( i = 0; i < maxopenfiles; i++ )
+    files[i].fd = -1;
+  maxfiles = maxopenfiles;
+
+  stopping = 0;
+
+  if ( pthread_create (&archivethread, NULL, archive_thread, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start archive thread\n");
+    return -1;
+  }
+  running = 1;
+
+  ms_log (0, "Archiving to SDS tree %s, writing with %s\n", archroot, ( ring ) ? "io_uring" : "writev");
+
+  return 0;
+}
+
+/***************************************************************************
+ * archive_write:
+ *
+ * Queue a record for the archive, msr is its parsed header.  Safe to call
+ * from any thread, does nothing if the archive is not running.
+ ***************************************************************************/
+void archive_write ( char *record, int reclen, MSRecord *msr )
+{
+  ArchRec *ar;
+  size_t size = ARCH_RECSIZE (reclen);
+
+  if ( ! running )
+    return;
+
+  pthread_mutex_lock (&queuelock);
+
+  if ( ! running )
+  {
+    pthread_mutex_unlock (&queuelock);
+    return;
+  }
+
+  if ( fill->len + size > fill->cap )
+  {
+    dropped++;
+    pthread_mutex_unlock (&queuelock);
+    return;
+  }
+
+  ar = (ArchRec *) (fill->data + fill->len);
+  ar->starttime = msr->starttime;
+  ar->reclen = reclen;
+  strcpy (ar->network, msr->network);
+  strcpy (ar->station, msr->station);
+  strcpy (ar->location, msr->location);
+  strcpy (ar->channel, msr->channel);
+  memcpy (ar + 1, record, reclen);
+  fill->len += size;
+
+  /* Wake the archive early rather than let the buffer fill up */
+  if ( fill->len >= fill->cap / 2 && ! wakeup )
+  {
+    wakeup = 1;
+    pthread_cond_signal (&queuecond);
+  }
+
+  pthread_mutex_unlock (&queuelock);
+}
+
+static uint32_t pathhash ( const char *path )
+{
+  uint32_t hash = 2166136261u;
+
+  while ( *path )
+    hash = ( hash ^ (unsigned char) *path++ ) * 16777619u;
+
+  return hash;
+}
+
+/* Create the directories leading to path, returns 0 on success */
+static int makedirs ( char *path )
+{
+  char *slash;
+
+  for ( slash = strchr (path + 1, '/'); slash; slash = strchr (slash + 1, '/') )
+  {
+    *slash = '\0';
+    if ( mkdir (path, 0755) < 0 && errno != EEXIST )
+    {
+      *slash = '/';
+      return -1;
+    }
+    *slash = '/';
+  }
+
+  return 0;
+}
+
+/* Append an iovec array to fd, continuing after short writes */
+static int writeall ( int fd, struct iovec *iov, int cnt )
+{
+  ssize_t n;
+
+  while ( cnt > 0 )
+  {
+    if ( (n = writev (fd, iov, ( cnt > ARCH_IOV_MAX ) ? ARCH_IOV_MAX : cnt)) < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      return -1;
+    }
+
+    while ( cnt > 0 && (size_t) n >= iov->iov_len )
+    {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if ( cnt > 0 )
+    {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/* Write the records of the batch queued for a file */
+static void flushfile ( ArchFile *af )
+{
+  if ( ! af->numiov )
+    return;
+
+  if ( writeall (af->fd, af->iov, af->numiov) < 0 )
+  {
+    ms_log (2, "Cannot write %s: %s\n", af->path, strerror (errno));
+  }
+  else
+  {
+    written += af->numiov;
+    af->dirty = 1;
+  }
+  af->numiov = 0;
+  af->lastwrite = time (NULL);
+}
+
+/* Completion of one write of up to ARCH_IOV_MAX records of a file */
+static void ringdone ( uint64_t tag, int result, void *arg )
+{
+  ArchFile *af = &files[tag >> 32];
+  int first = (int) ( tag & 0xffffffff );
+  int cnt = ( af->numiov - first > ARCH_IOV_MAX ) ? ARCH_IOV_MAX : af->numiov - first;
+  size_t len = 0;
+  int i;
+
+  /* Writes linked after a failed one are cancelled, it is the one to report */
+  if ( result == -ECANCELED )
+    return;
+
+  for ( i = first; i < first + cnt; i++ )
+    len += af->iov[i].iov_len;
+
+  if ( result >= 0 && (size_t) result == len )
+    return;
+
+  if ( first < af->failed )
+  {
+    af->failed = first;
+    af->partial = ( result > 0 ) ? result : 0;
+    af->error = ( result < 0 ) ? -result : 0;
+  }
+}
+
+/* Submit queued writes, returns -1 and falls back to writev() on error */
+static int submitring ( void )
+{
+  if ( uring_submit (ring, ringdone, NULL) == 0 )
+    return 0;
+
+  ms_log (2, "io_uring submit failed: %s, records of this batch may not be archived, "
+          "writing with writev from now on\n", strerror (errno));
+  uring_close (ring);
+  ring = NULL;
+
+  return -1;
+}
+
+/* Account the records of a file written through io_uring, finishing short writes */
+static void finishfile ( ArchFile *af )
+{
+  struct iovec *iov;
+  size_t partial = af->partial;
+  int done = af->numiov;
+  int cnt;
+
+  if ( af->failed < af->numiov )
+  {
+    done = af->failed;
+
+    if ( af->error )
+    {
+      ms_log (2, "Cannot write %s: %s\n", af->path, strerror (af->error));
+    }
+    else
+    {
+      /* The rest of a short write goes with writev() */
+      iov = &af->iov[af->failed];
+      cnt = af->numiov - af->failed;
+      while ( cnt > 0 && partial >= iov->iov_len )
+      {
+        partial -= iov->iov_len;
+        iov++;
+        cnt--;
+      }
+      if ( cnt > 0 )
+      {
+        iov->iov_base = (char *) iov->iov_base + partial;
+        iov->iov_len -= partial;
+      }
+
+      if ( writeall (af->fd, iov, cnt) < 0 )
+        ms_log (2, "Cannot write %s: %s\n", af->path, strerror (errno));
+      else
+        done = af->numiov;
+    }
+  }
+
+  written += done;
+  if ( done )
+    af->dirty = 1;
+  af->numiov = 0;
+  af->lastwrite = time (NULL);
+}
+
+/***************************************************************************
+ * flushring:
+ *
+ * Write the records of the batch queued for all files through io_uring,
+ * one vectored write per file and up to ARCH_IOV_MAX records.  The writes
+ * of a file with more records are linked; when the ring is full the
+ * chain is split, which keeps the order as every submit completes
+ * before the next one, and a file with a failed write gets no more
+ * writes in this batch.
+ ***************************************************************************/
+static void flushring ( void )
+{
+  ArchFile *af;
+  int i, j;
+
+  for ( i = 0; i < maxfiles; i++ )
+  {
+    af = &files[i];
+    af->failed = af->numiov;
+    af->partial = 0;
+    af->error = 0;
+  }
+
+  for ( i = 0; i < maxfiles; i++ )
+  {
+    af = &files[i];
+    if ( af->fd < 0 )
+      continue;
+
+    for ( j = 0; j < af->numiov && af->failed == af->numiov; j += ARCH_IOV_MAX )
+    {
+      if ( ! uring_space (ring) )
+      {
+        uring_endlink (ring);
+        if ( submitring () < 0 )
+          goto abandon;
+        if ( af->failed < af->numiov )
+          break;
+      }
+
+      uring_writev (ring, af->fd, &af->iov[j], ( af->numiov - j > ARCH_IOV_MAX ) ? ARCH_IOV_MAX : af->numiov - j,
+                    j + ARCH_IOV_MAX < af->numiov, (uint64_t) i << 32 | j);
+    }
+  }
+
+  if ( submitring () < 0 )
+    goto abandon;
+
+  for ( i = 0; i < maxfiles; i++ )
+    if ( files[i].fd >= 0 && files[i].numiov )
+      finishfile (&files[i]);
+
+  return;
+
+ abandon:
+  for ( i = 0; i < maxfiles; i++ )
+    files[i].numiov = 0;
+}
+
+static void closefile ( ArchFile *af )
+{
+  flushfile (af);
+
+  if ( af->dirty && syncinterval > 0 && fsync (af->fd) < 0 )
+    ms_log (2, "Cannot sync %s: %s\n", af->path, strerror (errno));
+
+  close (af->fd);
+  af->fd = -1;
+  af->dirty = 0;
+}
+
+/***************************************************************************
+ * getfile:
+ *
+ * Find the day file for path in the descriptor cache, opening it and
+ * evicting the least recently used file if needed.
+ *
+ * Returns the file or NULL if it cannot be opened.
+ ***************************************************************************/
+static ArchFile *getfile ( char *path )
+{
+  ArchFile *af;
+  ArchFile *victim = NULL;
+  uint32_t hash = pathhash (path);
+  int fd;
+  int i;
+
+  for ( i = 0; i < maxfiles; i++ )
+  {
+    af = &files[i];
+
+    if ( af->fd < 0 )
+    {
+      if ( ! victim || victim->fd >= 0 )
+        victim = af;
+      continue;
+    }
+
+    if ( af->hash == hash && ! strcmp (af->path, path) )
+    {
+      af->lastuse = ++usetick;
+      return af;
+    }
+
+    if ( ! victim || ( victim->fd >= 0 && af->lastuse < victim->lastuse ) )
+      victim = af;
+  }
+
+  if ( (fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0 && errno == ENOENT )
+  {
+    if ( makedirs (path) == 0 )
+      fd = open (path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  }
+  if ( fd < 0 )
+  {
+    /* Log once a minute, an unwritable archive fails for every record */
+    openfailures++;
+    if ( time (NULL) - lastopenerror >= 60 )
+    {
+      ms_log (2, "Cannot open archive file %s: %s, %llu records not archived\n", path,
+              strerror (errno), (unsigned long long) openfailures);
+      lastopenerror = time (NULL);
+      openfailures = 0;
+    }
+    return NULL;
+  }
+
+  if ( victim->fd >= 0 )
+    closefile (victim);
+
+  strcpy (victim->path, path);
+  victim->hash = hash;
+  victim->fd = fd;
+  victim->dirty = 0;
+  victim->lastwrite = time (NULL);
+  victim->lastuse = ++usetick;
+
+  return victim;
+}
+
+/* Queue one record of a batch to its day file */
+static void archiverecord ( ArchRec *ar )
+{
+  char path[ARCH_PATH_MAX];
+  BTime btime;
+  ArchFile *af;
+
+  if ( ms_hptime2btime (ar->starttime, &btime) < 0 )
+    return;
+
+  snprintf (path, sizeof(path), "%s/%04d/%s/%s/%s.D/%s.%s.%s.%s.D.%04d.%03d",
+            archroot, btime.year, ar->network, ar->station, ar->channel,
+            ar->network, ar->station, ar->location, ar->channel, btime.year, btime.day);
+
+  if ( ! (af = getfile (path)) )
+    return;
+
+  if ( af->numiov == af->maxiov )
+  {
+    int maxiov = ( af->maxiov ) ? af->maxiov * 2 : 16;
+    struct iovec *iov = (struct iovec *) realloc (af->iov, maxiov * sizeof(struct iovec));
+
+    if ( ! iov )
+    {
+      ms_log (2, "Cannot allocate archive write list\n");
+      return;
+    }
+    af->iov = iov;
+    af->maxiov = maxiov;
+  }
+
+  af->iov[af->numiov].iov_base = ar + 1;
+  af->iov[af->numiov].iov_len = ar->reclen;
+  af->numiov++;
+}
+
+static void *archive_thread ( void *arg )
+{
+  ArchBuf *batch;
+  ArchFile *af;
+  struct timespec deadline;
+  time_t lastsync = time (NULL);
+  time_t now;
+  uint64_t lost;
+  uint64_t span;
+  size_t offset;
+  int done = 0;
+  int i;
+
+  placement_enter (THREAD_ARCHIVE, "archive");
+
+  while ( ! done )
+  {
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += writedelay / 1000;
+    deadline.tv_nsec += ( writedelay % 1000 ) * 1000000L;
+    if ( deadline.tv_nsec >= 1000000000L )
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock (&queuelock);
+    while ( ! stopping && ! wakeup )
+    {
+      if ( pthread_cond_timedwait (&queuecond, &queuelock, &deadline) == ETIMEDOUT )
+        break;
+    }
+    wakeup = 0;
+    done = stopping;
+    batch = fill;
+    fill = ( fill == &buffers[0] ) ? &buffers[1] : &buffers[0];
+    lost = dropped;
+    dropped = 0;
+    pthread_mutex_unlock (&queuelock);
+
+    if ( lost )
+      ms_log (2, "Archive buffer full, %llu records were not archived\n", (unsigned long long) lost);
+
+    /* Group the batch by file, then one write per file or one submit for all */
+    TRACE_BEGIN (span, archive, batch->len);
+    for ( offset = 0; offset < batch->len; offset += ARCH_RECSIZE (((ArchRec *) (batch->data + offset))->reclen) )
+      archiverecord ((ArchRec *) (batch->data + offset));
+
+    if ( ring )
+    {
+      flushring ();
+    }
+    else
+    {
+      for ( i = 0; i < maxfiles; i++ )
+        if ( files[i].fd >= 0 )
+          flushfile (&files[i]);
+    }
+    TRACE_END (span, TRACE_ARCHIVE, archive, batch->len);
+
+    batch->len = 0;
+
+    now = time (NULL);
+    if ( syncinterval > 0 && now - lastsync >= syncinterval )
+    {
+      for ( i = 0; i < maxfiles; i++ )
+      {
+        af = &files[i];
+        if ( af->fd >= 0 && af->dirty )
+        {
+          if ( fsync (af->fd) < 0 )
+            ms_log (2, "Cannot sync %s: %s\n", af->path, strerror (errno));
+          af->dirty = 0;
+        }
+      }
+      lastsync = now;
+    }
+
+    for ( i = 0; i < maxfiles; i++ )
+      if ( files[i].fd >= 0 && now - files[i].lastwrite >= ARCH_IDLE_CLOSE )
+        closefile (&files[i]);
+  }
+
+  /* The last batch was taken after stopping was set, nothing is left */
+  for ( i = 0; i < maxfiles; i++ )
+    if ( files[i].fd >= 0 )
+      closefile (&files[i]);
+
+  return NULL;
+}
+
+/***************************************************************************
+ * archive_stop:
+ *
+ * Write all queued records, sync and close the day files and stop the
+ * archive thread.
+ ***************************************************************************/
+void archive_stop ( void )
+{
+  int i;
+
+  if ( ! running )
+    return;
+
+  pthread_mutex_lock (&queuelock);
+  running = 0;
+  stopping = 1;
+  pthread_cond_signal (&queuecond);
+  pthread_mutex_unlock (&queuelock);
+  pthread_join (archivethread, NULL);
+
+  ms_log (1, "Archived %llu records\n", (unsigned long long) written);
+
+  uring_close (ring);
+  ring = NULL;
+
+  for ( i = 0; i < maxfiles; i++ )
+    free (files[i].iov);
+  free (files);
+  files = NULL;
+  maxfiles = 0;
+
+  for ( i = 0; i < 2; i++ )
+  {
+    free (buffers[i].data);
+    buffers[i].data = NULL;
+  }
+  fill = NULL;
+}
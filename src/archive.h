@@ -0,0 +1,22 @@
+//
+//  archive.h
+//  q3302dali
+//
+//  Local SDS archive writer.  Records are appended to
+//  ROOT/YEAR/NET/STA/CHAN.D/NET.STA.LOC.CHAN.D.YEAR.DOY day files by a
+//  thread of its own; the sending thread only copies each record into a
+//  queue buffer.  Batches are written with writev() or, optionally,
+//  io_uring.
+//
+
+#ifndef archive_h
+#define archive_h
+
+#include "q3302dali.h"
+
+int archive_start ( const char *root, int writedelay, int syncinterval,
+                    int maxopenfiles, int buffersize, int useuring );
+void archive_write ( char *record, int reclen, MSRecord *msr );
+void archive_stop ( void );
+
+#endif /* archive_h */
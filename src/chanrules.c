@@ -0,0 +1,330 @@
+//
+//  chanrules.c
+//  q3302dali
+//
+//  Channel selection and renaming rules, see chanrules.h.
+//
+//  A channel is accepted when there are no include rules or it matches at
+//  least one, and it matches no exclude rule.  The first matching rename
+//  rule is applied to accepted channels.  The lookup table is only used
+//  from the lib330 callback thread and is not locked.
+//
+
+#include <stdio.h>
+#include <fnmatch.h>
+#include "chanrules.h"
+
+/* A rule split into its four fields */
+typedef struct chanpattern_s
+{
+  int type;
+  char match[4][16];
+  char replace[4][16];
+} ChanPattern;
+
+typedef struct chanentry_s
+{
+  char key[48];                    /* NET.STA.LOC.CHAN as received */
+  ChanResult result;
+} ChanEntry;
+
+struct chanrules_s
+{
+  ChanPattern *patterns;
+  int numpatterns;
+  int numincludes;
+  ChanEntry *table;
+  int tablesize;                   /* power of two */
+  int tableused;
+};
+
+/***************************************************************************
+ * splitfields:
+ *
+ * Split a NET.STA.LOC.CHAN string into four fields.
+ *
+ * Returns 0 on success and -1 if there are not exactly four fields.
+ ***************************************************************************/
+static int splitfields ( const char *spec, char fields[4][16] )
+{
+  int field = 0;
+  int len = 0;
+
+  memset (fields, 0, 4 * 16);
+
+  for ( ; *spec; spec++ )
+  {
+    if ( *spec == '.' )
+    {
+      if ( ++field > 3 )
+        return -1;
+      len = 0;
+    }
+    else if ( len < 15 )
+    {
+      fields[field][len++] = *spec;
+    }
+  }
+
+  return ( field == 3 ) ? 0 : -1;
+}
+
+static uint32_t keyhash ( const char *key )
+{
+  uint32_t hash = 2166136261u;
+
+  while ( *key )
+  {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/***************************************************************************
+ * chanrules_compile:
+ *
+ * Build the rule set from the config rules.
+ *
+ * Returns a new rule set, or NULL if there are no rules or on error.
+ ***************************************************************************/
+ChanRules *chanrules_compile ( ChanRule *rules, int numrules )
+{
+  ChanRules *cr;
+  int i;
+
+  if ( numrules <= 0 )
+    return NULL;
+
+  if ( ! (cr = (ChanRules *) calloc (1, sizeof(ChanRules))) ||
+       ! (cr->patterns = (ChanPattern *) calloc (numrules, sizeof(ChanPattern))) )
+  {
+    ms_log (2, "Cannot allocate channel rules\n");
+    chanrules_free (cr);
+    return NULL;
+  }
+
+  for ( i = 0; i < numrules; i++ )
+  {
+    ChanPattern *cp = &cr->patterns[cr->numpatterns];
+
+    cp->type = rules[i].type;
+    if ( splitfields (rules[i].pattern, cp->match) < 0 )
+    {
+      ms_log (2, "Channel rule pattern '%s' is not NET.STA.LOC.CHAN, ignored\n", rules[i].pattern);
+      continue;
+    }
+    if ( cp->type == CHANRULE_RENAME && splitfields (rules[i].replace, cp->replace) < 0 )
+    {
+      ms_log (2, "Channel rename '%s' is not NET.STA.LOC.CHAN, ignored\n", rules[i].replace);
+      continue;
+    }
+    if ( cp->type == CHANRULE_INCLUDE )
+      cr->numincludes++;
+    cr->numpatterns++;
+  }
+
+  cr->tablesize = 256;
+  if ( ! (cr->table = (ChanEntry *) calloc (cr->tablesize, sizeof(ChanEntry))) )
+  {
+    ms_log (2, "Cannot allocate channel rule table\n");
+    chanrules_free (cr);
+    return NULL;
+  }
+
+  return cr;
+}
+
+void chanrules_free ( ChanRules *cr )
+{
+  if ( ! cr )
+    return;
+
+  free (cr->patterns);
+  free (cr->table);
+  free (cr);
+}
+
+static int patternmatches ( ChanPattern *cp, const char *ids[4] )
+{
+  int i;
+
+  for ( i = 0; i < 4; i++ )
+    if ( fnmatch (cp->match[i], ids[i], 0) != 0 )
+      return 0;
+
+  return 1;
+}
+
+/* Apply a rename field, '*' keeps the field and '?' keeps one character */
+static void renamefield ( char *dest, const char *replace, const char *orig, int maxlen )
+{
+  int origlen = strlen (orig);
+  int i;
+
+  if ( replace[0] == '*' && replace[1] == '\0' )
+  {
+    strncpy (dest, orig, maxlen);
+    dest[maxlen] = '\0';
+    return;
+  }
+
+  for ( i = 0; replace[i] && i < maxlen; i++ )
+    dest[i] = ( replace[i] == '?' ) ? ( i < origlen ? orig[i] : ' ' ) : replace[i];
+  dest[i] = '\0';
+}
+
+/* Evaluate all rules for a channel seen for the first time */
+static void resolve ( ChanRules *cr, const char *ids[4], ChanResult *result )
+{
+  int included = ( cr->numincludes == 0 );
+  int i;
+
+  memset (result, 0, sizeof(ChanResult));
+  strncpy (result->network, ids[0], 10);
+  strncpy (result->station, ids[1], 10);
+  strncpy (result->location, ids[2], 10);
+  strncpy (result->channel, ids[3], 10);
+
+  for ( i = 0; i < cr->numpatterns; i++ )
+  {
+    ChanPattern *cp = &cr->patterns[i];
+
+    if ( cp->type == CHANRULE_INCLUDE && ! included )
+      included = patternmatches (cp, ids);
+    else if ( cp->type == CHANRULE_EXCLUDE && patternmatches (cp, ids) )
+    {
+      result->accept = 0;
+      return;
+    }
+  }
+  result->accept = included;
+
+  if ( ! result->accept )
+    return;
+
+  for ( i = 0; i < cr->numpatterns; i++ )
+  {
+    ChanPattern *cp = &cr->patterns[i];
+
+    if ( cp->type == CHANRULE_RENAME && patternmatches (cp, ids) )
+    {
+      renamefield (result->network, cp->replace[0], ids[0], 2);
+      renamefield (result->station, cp->replace[1], ids[1], 5);
+      renamefield (result->location, cp->replace[2], ids[2], 2);
+      renamefield (result->channel, cp->replace[3], ids[3], 3);
+      result->renamed = 1;
+      break;
+    }
+  }
+}
+
+/* Double the table size and reinsert all entries */
+static int growtable ( ChanRules *cr )
+{
+  ChanEntry *old = cr->table;
+  int oldsize = cr->tablesize;
+  int i;
+
+  if ( ! (cr->table = (ChanEntry *) calloc (oldsize * 2, sizeof(ChanEntry))) )
+  {
+    cr->table = old;
+    return -1;
+  }
+  cr->tablesize = oldsize * 2;
+
+  for ( i = 0; i < oldsize; i++ )
+  {
+    uint32_t slot;
+
+    if ( ! old[i].key[0] )
+      continue;
+
+    slot = keyhash (old[i].key) & (cr->tablesize - 1);
+    while ( cr->table[slot].key[0] )
+      slot = (slot + 1) & (cr->tablesize - 1);
+    cr->table[slot] = old[i];
+  }
+
+  free (old);
+  return 0;
+}
+
+/***************************************************************************
+ * chanrules_lookup:
+ *
+ * Find the outcome for a channel, resolving and caching it on first use.
+ *
+ * Returns the cached result, valid until the next lookup, or NULL on error.
+ ***************************************************************************/
+const ChanResult *chanrules_lookup ( ChanRules *cr, const char *net, const char *sta,
+                                     const char *loc, const char *chan )
+{
+  const char *ids[4];
+  char key[48];
+  uint32_t slot;
+
+  snprintf (key, sizeof(key), "%s.%s.%s.%s", net, sta, loc, chan);
+
+  slot = keyhash (key) & (cr->tablesize - 1);
+  while ( cr->table[slot].key[0] )
+  {
+    if ( ! strcmp (cr->table[slot].key, key) )
+      return &cr->table[slot].result;
+    slot = (slot + 1) & (cr->tablesize - 1);
+  }
+
+  /* Keep the table at most half full */
+  if ( (cr->tableused + 1) * 2 > cr->tablesize )
+  {
+    if ( growtable (cr) < 0 )
+    {
+      ms_log (2, "Cannot grow channel rule table\n");
+      return NULL;
+    }
+    return chanrules_lookup (cr, net, sta, loc, chan);
+  }
+
+  ids[0] = net;
+  ids[1] = sta;
+  ids[2] = loc;
+  ids[3] = chan;
+
+  strcpy (cr->table[slot].key, key);
+  resolve (cr, ids, &cr->table[slot].result);
+  cr->tableused++;
+
+  if ( cr->table[slot].result.renamed )
+    ms_log (0, "Channel %s accepted as %s.%s.%s.%s\n", key,
+            cr->table[slot].result.network, cr->table[slot].result.station,
+            cr->table[slot].result.location, cr->table[slot].result.channel);
+  else
+    ms_log (0, "Channel %s %s\n", key,
+            cr->table[slot].result.accept ? "accepted" : "excluded");
+
+  return &cr->table[slot].result;
+}
+
+/* Copy a field into a space padded fixed width header field */
+static void padfield ( char *dest, const char *src, int width )
+{
+  int i;
+
+  for ( i = 0; i < width; i++ )
+    dest[i] = ( *src ) ? *src++ : ' ';
+}
+
+/***************************************************************************
+ * chanrules_rewriteheader:
+ *
+ * Overwrite the station, location, channel and network of a miniSEED
+ * fixed section data header with the renamed identifiers.
+ ***************************************************************************/
+void chanrules_rewriteheader ( char *record, const ChanResult *result )
+{
+  padfield (record + 8, result->station, 5);
+  padfield (record + 13, result->location, 2);
+  padfield (record + 15, result->channel, 3);
+  padfield (record + 18, result->network, 2);
+}
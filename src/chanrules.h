@@ -0,0 +1,48 @@
+//
+//  chanrules.h
+//  q3302dali
+//
+//  Channel selection and renaming rules.  Rules are glob patterns on
+//  NET.STA.LOC.CHAN, evaluated once per distinct channel and cached in a
+//  lookup table so the per-packet cost is a single hash lookup.
+//
+
+#ifndef chanrules_h
+#define chanrules_h
+
+#include "q3302dali.h"
+
+#define MAX_CHAN_RULES 128
+
+#define CHANRULE_INCLUDE 1
+#define CHANRULE_EXCLUDE 2
+#define CHANRULE_RENAME  3
+
+/* A rule as read from the config file */
+typedef struct chanrule_s
+{
+  int32 type;
+  char pattern[64];                /* NET.STA.LOC.CHAN glob */
+  char replace[64];                /* NET.STA.LOC.CHAN, '*' or '?' keep original */
+} ChanRule;
+
+/* Resolved outcome for one channel */
+typedef struct chanresult_s
+{
+  int accept;
+  int renamed;
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+} ChanResult;
+
+typedef struct chanrules_s ChanRules;
+
+ChanRules *chanrules_compile ( ChanRule *rules, int numrules );
+void chanrules_free ( ChanRules *cr );
+const ChanResult *chanrules_lookup ( ChanRules *cr, const char *net, const char *sta,
+                                     const char *loc, const char *chan );
+void chanrules_rewriteheader ( char *record, const ChanResult *result );
+
+#endif /* chanrules_h */
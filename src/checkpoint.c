@@ -0,0 +1,448 @@
+//
+//  checkpoint.c
+//  q3302dali
+//
+//  Trace buffer checkpoints, see checkpoint.h.
+//
+//  The checkpoint thread has each pack context serialized into a private
+//  buffer under the context lock, idle or not, and swaps it with the one
+//  ready for writing, so the data path never waits on the disk, only for
+//  the copy of the samples.  The file is written to a temporary name,
+//  synced and renamed over the previous checkpoint, and the directory
+//  synced, so a crash at any point leaves either the old or the new
+//  checkpoint.
+//
+//  Only integer samples are kept, which is all lib330 and the decimators
+//  produce.
+//
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "packpool.h"
+#include "streams.h"
+#include "placement.h"
+
+#define CHECKPOINT_MAGIC "q3302dali ckpt1\n"
+
+/* File layout: the header, then for each trace a CheckpointTrace and its samples */
+typedef struct checkpointheader_s
+{
+  char magic[16];
+  int64_t written;                 /* time_t of the capture */
+  int32_t traces;
+} CheckpointHeader;
+
+typedef struct checkpointtrace_s
+{
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+  int32_t timingqual;
+  int64_t starttime;
+  double samprate;
+  int32_t numsamples;
+} CheckpointTrace;
+
+typedef struct checkpointbuf_s
+{
+  char *data;
+  size_t len;
+  size_t cap;
+  int traces;
+} CheckpointBuf;
+
+/* Per pack context, building is used under the context lock */
+typedef struct checkpointslot_s
+{
+  CheckpointBuf building;
+  CheckpointBuf ready;
+} CheckpointSlot;
+
+static CheckpointSlot slots[PACKPOOL_MAX_WORKERS];
+static int numslots = 0;
+static char ckptpath[1100];
+static int ckptinterval = 10;
+static CheckpointCapture capturefunc = NULL;
+
+static pthread_mutex_t ckptlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ckptcond;    /* stopping */
+static int stopping = 0;
+static int running = 0;
+static pthread_t ckptthread;
+
+static void *checkpoint_thread ( void *arg );
+
+static int bufappend ( CheckpointBuf *buf, const void *data, size_t len )
+{
+  size_t cap;
+  char *newdata;
+
+  if ( buf->len + len > buf->cap )
+  {
+    cap = ( buf->cap ) ? buf->cap : 65536;
+    while ( cap < buf->len + len )
+      cap *= 2;
+    if ( ! (newdata = (char *) realloc (buf->data, cap)) )
+      return -1;
+    buf->data = newdata;
+    buf->cap = cap;
+  }
+
+  memcpy (buf->data + buf->len, data, len);
+  buf->len += len;
+
+  return 0;
+}
+
+/* Deadline seconds from now on CLOCK_MONOTONIC */
+static void deadlinein ( struct timespec *ts, int seconds )
+{
+  clock_gettime (CLOCK_MONOTONIC, ts);
+  ts->tv_sec += seconds;
+}
+
+/***************************************************************************
+ * checkpoint_start:
+ *
+ * Start checkpointing the buffers of contexts pack contexts to path
+ * every interval seconds, calling capture for each context.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int checkpoint_start ( const char *path, int interval, int contexts, CheckpointCapture capture )
+{
+  pthread_condattr_t attr;
+
+  if ( interval <= 0 || contexts <= 0 || contexts > PACKPOOL_MAX_WORKERS )
+    return -1;
+
+  strncpy (ckptpath, path, sizeof(ckptpath) - 1);
+  ckptinterval = interval;
+  capturefunc = capture;
+  numslots = contexts;
+  memset (slots, 0, sizeof(slots));
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&ckptcond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  stopping = 0;
+
+  if ( pthread_create (&ckptthread, NULL, checkpoint_thread, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start checkpoint thread\n");
+    return -1;
+  }
+  running = 1;
+
+  ms_log (0, "Checkpointing trace buffers to %s every %d seconds\n", path, interval);
+
+  return 0;
+}
+
+/***************************************************************************
+ * checkpoint_capture:
+ *
+ * Copy the integer samples waiting in mstg for the checkpoint, called
+ * with the lock of pack context context held.
+ ***************************************************************************/
+void checkpoint_capture ( int context, MSTraceGroup *mstg )
+{
+  CheckpointSlot *slot = &slots[context];
+  CheckpointBuf swap;
+  CheckpointTrace ct;
+  StreamInfo *si;
+  MSTrace *mst;
+  int failed = 0;
+
+  if ( ! running )
+    return;
+
+  slot->building.len = 0;
+  slot->building.traces = 0;
+
+  for ( mst = mstg->traces; mst && ! failed; mst = mst->next )
+  {
+    if ( mst->numsamples <= 0 || mst->sampletype != 'i' || mst->samprate <= 0.0 )
+      continue;
+
+    memset (&ct, 0, sizeof(ct));
+    strcpy (ct.network, mst->network);
+    strcpy (ct.station, mst->station);
+    strcpy (ct.location, mst->location);
+    strcpy (ct.channel, mst->channel);
+    si = streams_get (mst->network, mst->station, mst->location, mst->channel);
+    ct.timingqual = ( si ) ? si->timingqual : -1;
+    ct.starttime = mst->starttime;
+    ct.samprate = mst->samprate;
+    ct.numsamples = (int32_t) mst->numsamples;
+
+    failed = bufappend (&slot->building, &ct, sizeof(ct)) < 0 ||
+             bufappend (&slot->building, mst->datasamples, mst->numsamples * sizeof(int32_t)) < 0;
+    slot->building.traces++;
+  }
+
+  if ( failed )
+  {
+    ms_log (2, "Cannot allocate checkpoint buffer\n");
+    return;
+  }
+
+  pthread_mutex_lock (&ckptlock);
+  swap = slot->ready;
+  slot->ready = slot->building;
+  slot->building = swap;
+  pthread_mutex_unlock (&ckptlock);
+}
+
+/* Sync the directory holding path so a rename in it is durable */
+static void syncdir ( const char *path )
+{
+  char dir[1100];
+  int fd;
+
+  strncpy (dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+  if ( (fd = open (dirname (dir), O_RDONLY | O_DIRECTORY)) >= 0 )
+  {
+    fsync (fd);
+    close (fd);
+  }
+}
+
+/***************************************************************************
+ * writecheckpoint:
+ *
+ * Replace the checkpoint file with the captures ready, the checkpoint lock
+ * held on entry and exit but not while writing.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int writecheckpoint ( CheckpointBuf *out )
+{
+  CheckpointHeader header;
+  char tmppath[1110];
+  int fd;
+  int i;
+
+  memset (&header, 0, sizeof(header));
+  memcpy (header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.written = (int64_t) time (NULL);
+
+  out->len = 0;
+  if ( bufappend (out, &header, sizeof(header)) < 0 )
+    return -1;
+  for ( i = 0; i < numslots; i++ )
+  {
+    if ( slots[i].ready.len && bufappend (out, slots[i].ready.data, slots[i].ready.len) < 0 )
+      return -1;
+    ((CheckpointHeader *) out->data)->traces += slots[i].ready.traces;
+  }
+
+  pthread_mutex_unlock (&ckptlock);
+
+  snprintf (tmppath, sizeof(tmppath), "%s.tmp", ckptpath);
+  if ( (fd = open (tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+       write (fd, out->data, out->len) != (ssize_t) out->len || fsync (fd) < 0 )
+  {
+    ms_log (2, "Cannot write %s: %s\n", tmppath, strerror (errno));
+    if ( fd >= 0 )
+      close (fd);
+    pthread_mutex_lock (&ckptlock);
+    return -1;
+  }
+  close (fd);
+
+  if ( rename (tmppath, ckptpath) < 0 )
+  {
+    ms_log (2, "Cannot rename %s: %s\n", tmppath, strerror (errno));
+    pthread_mutex_lock (&ckptlock);
+    return -1;
+  }
+  syncdir (ckptpath);
+
+  pthread_mutex_lock (&ckptlock);
+
+  return 0;
+}
+
+static void *checkpoint_thread ( void *arg )
+{
+  CheckpointBuf out;
+  struct timespec deadline;
+  int i;
+
+  placement_enter (THREAD_ARCHIVE, "checkpoint");
+
+  memset (&out, 0, sizeof(out));
+
+  pthread_mutex_lock (&ckptlock);
+
+  while ( ! stopping )
+  {
+    deadlinein (&deadline, ckptinterval);
+    while ( ! stopping && pthread_cond_timedwait (&ckptcond, &ckptlock, &deadline) != ETIMEDOUT )
+      ;
+    if ( stopping )
+      break;
+
+    /* Every context, also one whose buffers were flushed since without new data */
+    pthread_mutex_unlock (&ckptlock);
+    for ( i = 0; i < numslots; i++ )
+      capturefunc (i);
+    pthread_mutex_lock (&ckptlock);
+    if ( stopping )
+      break;
+
+    writecheckpoint (&out);
+  }
+
+  pthread_mutex_unlock (&ckptlock);
+  free (out.data);
+
+  return NULL;
+}
+
+/***************************************************************************
+ * checkpoint_load:
+ *
+ * Read the trace buffers saved in path and hand them to restore, unless
+ * the checkpoint is more than maxage seconds old (maxage 0 for any age).
+ * A missing file is not an error.
+ *
+ * Returns the number of traces restored or -1 on error.
+ ***************************************************************************/
+int checkpoint_load ( const char *path, int maxage, CheckpointRestore restore )
+{
+  CheckpointHeader header;
+  CheckpointTrace ct;
+  MSRecord *msr = NULL;
+  int32_t *samples = NULL;
+  int32_t offset;
+  int64_t age;
+  FILE *fp;
+  int count = 0;
+  int i;
+
+  if ( ! (fp = fopen (path, "r")) )
+  {
+    if ( errno == ENOENT )
+      return 0;
+    ms_log (2, "Cannot read %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+
+  if ( fread (&header, sizeof(header), 1, fp) != 1 ||
+       memcmp (header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) )
+  {
+    ms_log (2, "%s is not a checkpoint file, ignoring it\n", path);
+    fclose (fp);
+    return -1;
+  }
+
+  age = (int64_t) time (NULL) - header.written;
+  if ( maxage > 0 && age > maxage )
+  {
+    ms_log (1, "Checkpoint %s is %lld seconds old, not restoring it\n", path, (long long int) age);
+    fclose (fp);
+    return 0;
+  }
+
+  if ( ! (msr = msr_init (NULL)) )
+  {
+    fclose (fp);
+    return -1;
+  }
+
+  for ( i = 0; i < header.traces; i++ )
+  {
+    if ( fread (&ct, sizeof(ct), 1, fp) != 1 ||
+         ct.numsamples <= 0 || ct.numsamples > (1 << 24) || ct.samprate <= 0.0 )
+    {
+      ms_log (2, "Checkpoint %s is truncated or damaged, restored %d traces\n", path, count);
+      break;
+    }
+    ct.network[10] = ct.station[10] = ct.location[10] = ct.channel[10] = '\0';
+
+    free (samples);
+    if ( ! (samples = (int32_t *) malloc (ct.numsamples * sizeof(int32_t))) ||
+         fread (samples, sizeof(int32_t), ct.numsamples, fp) != (size_t) ct.numsamples )
+    {
+      ms_log (2, "Checkpoint %s is truncated or damaged, restored %d traces\n", path, count);
+      break;
+    }
+
+    /* Handed back in pieces a pack worker queue takes */
+    for ( offset = 0; offset < ct.numsamples; offset += MAX_RATE )
+    {
+      strcpy (msr->network, ct.network);
+      strcpy (msr->station, ct.station);
+      strcpy (msr->location, ct.location);
+      strcpy (msr->channel, ct.channel);
+      msr->starttime = ct.starttime + (hptime_t) (offset / ct.samprate * HPTMODULUS + 0.5);
+      msr->samprate = ct.samprate;
+      msr->sampletype = 'i';
+      msr->datasamples = samples + offset;
+      msr->numsamples = msr->samplecnt = ( ct.numsamples - offset < MAX_RATE ) ? ct.numsamples - offset : MAX_RATE;
+      restore (msr, ct.timingqual);
+    }
+    count++;
+  }
+
+  msr->datasamples = NULL;
+  msr_free (&msr);
+  free (samples);
+  fclose (fp);
+
+  return count;
+}
+
+/***************************************************************************
+ * checkpoint_stop:
+ *
+ * Stop the checkpoint thread.  With flushed set the trace buffers were
+ * packed and sent and the checkpoint is removed, otherwise one last
+ * checkpoint is written from the captures ready.
+ ***************************************************************************/
+void checkpoint_stop ( int flushed )
+{
+  CheckpointBuf out;
+  int i;
+
+  if ( ! running )
+    return;
+
+  pthread_mutex_lock (&ckptlock);
+  stopping = 1;
+  pthread_cond_broadcast (&ckptcond);
+  pthread_mutex_unlock (&ckptlock);
+  pthread_join (ckptthread, NULL);
+
+  if ( flushed )
+  {
+    if ( unlink (ckptpath) < 0 && errno != ENOENT )
+      ms_log (2, "Cannot remove %s: %s\n", ckptpath, strerror (errno));
+  }
+  else
+  {
+    memset (&out, 0, sizeof(out));
+    pthread_mutex_lock (&ckptlock);
+    writecheckpoint (&out);
+    pthread_mutex_unlock (&ckptlock);
+    free (out.data);
+  }
+
+  running = 0;
+  for ( i = 0; i < numslots; i++ )
+  {
+    free (slots[i].building.data);
+    free (slots[i].ready.data);
+  }
+  memset (slots, 0, sizeof(slots));
+}
@@ -0,0 +1,28 @@
+//
+//  checkpoint.h
+//  q3302dali
+//
+//  Crash-safe checkpoints of the samples waiting in the trace buffers.
+//  A thread of its own has a copy made of the buffers of each pack context
+//  every few seconds and replaces the checkpoint file with them, so after
+//  a crash at most one interval of data already acknowledged to the Q330
+//  is lost instead of every partly filled record.
+//
+
+#ifndef checkpoint_h
+#define checkpoint_h
+
+#include "q3302dali.h"
+
+/* Called with each trace read back, in chunks of at most MAX_RATE samples */
+typedef void (*CheckpointRestore) ( MSRecord *msr, int timingqual );
+
+/* Called on the checkpoint thread to have checkpoint_capture() run for a context */
+typedef void (*CheckpointCapture) ( int context );
+
+int checkpoint_start ( const char *path, int interval, int contexts, CheckpointCapture capture );
+void checkpoint_capture ( int context, MSTraceGroup *mstg );
+int checkpoint_load ( const char *path, int maxage, CheckpointRestore restore );
+void checkpoint_stop ( int flushed );
+
+#endif /* checkpoint_h */
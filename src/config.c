@@ -142,6 +142,10 @@ int readConfig(char *configFile) {
       gConfig.FlushLatency = k_int();
     } else if(k_its("ReconnectInterval")) {
       gConfig.ReconnectInterval = k_int();
+    } else if(k_its("ReconnectMaxInterval")) {
+      gConfig.ReconnectMaxInterval = k_int();
+    } else if(k_its("ConnectTimeout")) {
+      gConfig.ConnectTimeout = k_int();
     } else if(k_its("IPAddress")) {
       strcpy(gConfig.IPAddress, k_str());
     } else if(k_its("BasePort")) {
@@ -150,6 +154,8 @@ int readConfig(char *configFile) {
       gConfig.dataport = k_int();
     } else if(k_its("RegistrationCyclesLimit")) {
       gConfig.RegistrationCyclesLimit = k_int();
+    } else if(k_its("RegistrationTimeout")) {
+      gConfig.RegistrationTimeout = k_int();
     } else if(k_its("SerialNumber")) {
       strcpy(gConfig.serialnumber, k_str());
     } else if(k_its("AuthCode")) {
@@ -213,6 +219,187 @@ int readConfig(char *configFile) {
       gConfig.Dutycycle_BufferLevel = k_int();
     } else if(k_its("ContinuityFileDirectory")) {
       strcpy(gConfig.ContFileDir, k_str());
+    } else if(k_its("PackThreads")) {
+      gConfig.PackThreads = k_int();
+    } else if(k_its("ChannelInclude") || k_its("ChannelExclude") || k_its("ChannelRename")) {
+      readChannelRule();
+    } else if(k_its("ContinuityTolerance")) {
+      gConfig.ContinuityTolerance = k_val();
+    } else if(k_its("ContinuityLog")) {
+      gConfig.ContinuityLog = k_int();
+    } else if(k_its("QuestionableTimingQuality")) {
+      gConfig.QuestionableTimingQuality = k_int();
+    } else if(k_its("DuplicateWindow")) {
+      gConfig.DuplicateWindow = k_int();
+    } else if(k_its("AdaptiveEncoding")) {
+      gConfig.AdaptiveEncoding = k_int();
+    } else if(k_its("MemoryLimit")) {
+      gConfig.MemoryLimit = k_int();
+    } else if(k_its("StreamMemoryLimit")) {
+      gConfig.StreamMemoryLimit = k_int();
+    } else if(k_its("CheckpointInterval")) {
+      gConfig.CheckpointInterval = k_int();
+    } else if(k_its("CheckpointMaxAge")) {
+      gConfig.CheckpointMaxAge = k_int();
+    } else if(k_its("ShutdownTimeout")) {
+      gConfig.ShutdownTimeout = k_int();
+      if(gConfig.ShutdownTimeout != 0 && gConfig.ShutdownTimeout < 4) {
+        fprintf(stderr, "%s: ShutdownTimeout must be 0 or at least 4 seconds, using 4 (%s)\n", Q3302DALI_NAME, k_com());
+        gConfig.ShutdownTimeout = 4;
+      }
+    } else if(k_its("DataLinkRate")) {
+      gConfig.DataLinkRate = k_int();
+    } else if(k_its("DataLinkBurst")) {
+      gConfig.DataLinkBurst = k_int();
+    } else if(k_its("DataLinkQueueRecords")) {
+      gConfig.DataLinkQueueRecords = k_int();
+    } else if(k_its("BackfillAge")) {
+      gConfig.BackfillAge = k_int();
+    } else if(k_its("SohChannel")) {
+      if(gConfig.numSohChannels >= MAX_SOH_CHANNELS) {
+        fprintf(stderr, "%s: Too many SohChannel lines, max is %d (%s)\n", Q3302DALI_NAME, MAX_SOH_CHANNELS, k_com());
+      } else {
+        strncpy(gConfig.SohChannels[gConfig.numSohChannels], k_str(), sizeof(gConfig.SohChannels[0]) - 1);
+        gConfig.numSohChannels++;
+      }
+    } else if(k_its("SohInterval")) {
+      gConfig.SohInterval = k_int();
+    } else if(k_its("RecordLength")) {
+      gConfig.RecordLength = k_int();
+      if(gConfig.RecordLength < 256 || gConfig.RecordLength > 8192 ||
+         (gConfig.RecordLength & (gConfig.RecordLength - 1))) {
+        fprintf(stderr, "%s: RecordLength must be a power of two from 256 to 8192, using 512 (%s)\n", Q3302DALI_NAME, k_com());
+        gConfig.RecordLength = 512;
+      }
+    } else if(k_its("SeedLinkPort")) {
+      gConfig.SeedLinkPort = k_int();
+    } else if(k_its("SeedLinkRingRecords")) {
+      gConfig.SeedLinkRingRecords = k_int();
+    } else if(k_its("SeedLinkMaxClients")) {
+      gConfig.SeedLinkMaxClients = k_int();
+    } else if(k_its("ShmRingPath")) {
+      strcpy(gConfig.ShmRingPath, k_str());
+    } else if(k_its("ShmRingSlots")) {
+      gConfig.ShmRingSlots = k_int();
+    } else if(k_its("ShmRingSlotSize")) {
+      gConfig.ShmRingSlotSize = k_int();
+    } else if(k_its("StatsPath")) {
+      strcpy(gConfig.StatsPath, k_str());
+    } else if(k_its("StatsStreams")) {
+      gConfig.StatsStreams = k_int();
+    } else if(k_its("ControlSocket")) {
+      strcpy(gConfig.ControlSocket, k_str());
+    } else if(k_its("ThreadCPUs")) {
+      char *role = k_str();
+      char *cpus = k_str();
+      int r = (role) ? placement_role(role) : -1;
+      if(r < 0 || cpus == NULL || strlen(cpus) >= sizeof(gConfig.Threads[0].cpus) ||
+         placement_checkcpus(cpus) < 0) {
+        fprintf(stderr, "%s: ThreadCPUs needs main, lib330, pack, datalink, server or archive and a CPU list such as 2-3,6 (%s)\n", Q3302DALI_NAME, k_com());
+      } else {
+        strcpy(gConfig.Threads[r].cpus, cpus);
+      }
+    } else if(k_its("ThreadScheduler")) {
+      char *role = k_str();
+      char *policy = k_str();
+      int r = (role) ? placement_role(role) : -1;
+      int p = (policy) ? placement_policy(policy) : -1;
+      int prio = (p == SCHED_FIFO || p == SCHED_RR) ? k_int() : 0;
+      if(r < 0 || p < 0 || k_err() || ((p == SCHED_FIFO || p == SCHED_RR) && (prio < 1 || prio > 99))) {
+        fprintf(stderr, "%s: ThreadScheduler needs a role, other or fifo or rr with a priority from 1 to 99 (%s)\n", Q3302DALI_NAME, k_com());
+      } else {
+        gConfig.Threads[r].policy = p;
+        gConfig.Threads[r].priority = prio;
+      }
+    } else if(k_its("LockMemory")) {
+      gConfig.LockMemory = k_int();
+    } else if(k_its("TraceEvents")) {
+      gConfig.TraceEvents = k_int();
+    } else if(k_its("TraceSample")) {
+      gConfig.TraceSample = k_int();
+    } else if(k_its("TraceDir")) {
+      strcpy(gConfig.TraceDir, k_str());
+    } else if(k_its("ArchiveRoot")) {
+      strcpy(gConfig.ArchiveRoot, k_str());
+    } else if(k_its("ArchiveWriteDelay")) {
+      gConfig.ArchiveWriteDelay = k_int();
+    } else if(k_its("ArchiveSyncInterval")) {
+      gConfig.ArchiveSyncInterval = k_int();
+    } else if(k_its("ArchiveMaxOpenFiles")) {
+      gConfig.ArchiveMaxOpenFiles = k_int();
+    } else if(k_its("ArchiveBufferSize")) {
+      gConfig.ArchiveBufferSize = k_int();
+    } else if(k_its("ArchiveEngine")) {
+      char *engine = k_str();
+      if(engine && !strcmp(engine, "uring")) {
+        gConfig.ArchiveUring = 1;
+      } else if(engine && !strcmp(engine, "writev")) {
+        gConfig.ArchiveUring = 0;
+      } else {
+        fprintf(stderr, "%s: ArchiveEngine must be writev or uring (%s)\n", Q3302DALI_NAME, k_com());
+      }
+    } else if(k_its("Decimate")) {
+      if(gConfig.numDecimators >= MAX_DECIMATORS) {
+        fprintf(stderr, "%s: Too many decimators, max is %d (%s)\n", Q3302DALI_NAME, MAX_DECIMATORS, k_com());
+      } else {
+        DecimateSpec *spec = &gConfig.Decimators[gConfig.numDecimators];
+        char *src = k_str();
+        char *out = k_str();
+        spec->factor = k_int();
+        if(src == NULL || out == NULL || k_err()) {
+          fprintf(stderr, "%s: Decimate needs source, output and factor (%s)\n", Q3302DALI_NAME, k_com());
+        } else {
+          strncpy(spec->source, src, sizeof(spec->source) - 1);
+          strncpy(spec->output, out, sizeof(spec->output) - 1);
+          gConfig.numDecimators++;
+        }
+      }
+    } else if(k_its("Trigger")) {
+      if(gConfig.numTriggers >= MAX_TRIGGERS) {
+        fprintf(stderr, "%s: Too many triggers, max is %d (%s)\n", Q3302DALI_NAME, MAX_TRIGGERS, k_com());
+      } else {
+        TriggerSpec *spec = &gConfig.Triggers[gConfig.numTriggers];
+        char *src = k_str();
+        char *corner;
+        memset(spec, 0, sizeof(TriggerSpec));
+        spec->sta = k_val();
+        spec->lta = k_val();
+        spec->on = k_val();
+        spec->off = k_val();
+        if(src == NULL || k_err()) {
+          fprintf(stderr, "%s: Trigger needs source, STA, LTA, on and off (%s)\n", Q3302DALI_NAME, k_com());
+        } else {
+          strncpy(spec->source, src, sizeof(spec->source) - 1);
+          spec->lowcorner = ((corner = k_str())) ? atof(corner) : 1.0;
+          spec->highcorner = (corner && (corner = k_str())) ? atof(corner) : 0.0;
+          k_err();
+          gConfig.numTriggers++;
+        }
+      }
+    } else if(k_its("Amplitude")) {
+      if(gConfig.numAmplitudes >= MAX_AMPLITUDES) {
+        fprintf(stderr, "%s: Too many Amplitude lines, max is %d (%s)\n", Q3302DALI_NAME, MAX_AMPLITUDES, k_com());
+      } else {
+        AmplitudeSpec *spec = &gConfig.Amplitudes[gConfig.numAmplitudes];
+        char *src = k_str();
+        char *opt;
+        memset(spec, 0, sizeof(AmplitudeSpec));
+        spec->highpass = 0.075;
+        if(src == NULL) {
+          fprintf(stderr, "%s: Amplitude needs a source (%s)\n", Q3302DALI_NAME, k_com());
+        } else {
+          strncpy(spec->source, src, sizeof(spec->source) - 1);
+          while((opt = k_str()) != NULL) {
+            if(!strcmp(opt, "velocity")) {
+              spec->velocity = 1;
+            } else {
+              spec->highpass = atof(opt);
+            }
+          }
+          k_err();
+          gConfig.numAmplitudes++;
+        }
+      }
     } else {
       fprintf(stderr, "%s: Unknown config command (%s)\n", Q3302DALI_NAME, k_get());
     }
@@ -222,13 +409,59 @@ int readConfig(char *configFile) {
 }
 
 
+/*
+ * Parse a ChannelInclude, ChannelExclude or ChannelRename line, the
+ * command has already been read by k_str()
+ */
+void readChannelRule() {
+  ChanRule *rule;
+  char *str;
+
+  if(gConfig.numChanRules >= MAX_CHAN_RULES) {
+    fprintf(stderr, "%s: Too many channel rules, max is %d (%s)\n", Q3302DALI_NAME, MAX_CHAN_RULES, k_com());
+    return;
+  }
+  rule = &gConfig.ChanRules[gConfig.numChanRules];
+  memset(rule, 0, sizeof(ChanRule));
+
+  if(k_its("ChannelInclude")) {
+    rule->type = CHANRULE_INCLUDE;
+  } else if(k_its("ChannelExclude")) {
+    rule->type = CHANRULE_EXCLUDE;
+  } else {
+    rule->type = CHANRULE_RENAME;
+  }
+
+  if((str = k_str()) == NULL) {
+    fprintf(stderr, "%s: Missing channel pattern (%s)\n", Q3302DALI_NAME, k_com());
+    return;
+  }
+  strncpy(rule->pattern, str, sizeof(rule->pattern) - 1);
+
+  if(rule->type == CHANRULE_RENAME) {
+    if((str = k_str()) == NULL) {
+      fprintf(stderr, "%s: Missing channel rename (%s)\n", Q3302DALI_NAME, k_com());
+      return;
+    }
+    strncpy(rule->replace, str, sizeof(rule->replace) - 1);
+  }
+
+  gConfig.numChanRules++;
+}
+
 /**
  * Set all of the config items to rational defaults
  */
 void setupDefaultConfiguration() {
+  int i;
+
   gConfig.RegistrationCyclesLimit = 5;
+  gConfig.RegistrationTimeout = 30;
   gConfig.HeartbeatInt = 10;
   gConfig.ReconnectInterval = 10;
+  gConfig.ReconnectMaxInterval = 300;
+  gConfig.ConnectTimeout = 10;
+  gConfig.FlushLatency = 300;
   gConfig.LogFile = 2;
   gConfig.baseport = 5330;
   gConfig.dataport = 2;
@@ -245,14 +478,101 @@ void setupDefaultConfiguration() {
   gConfig.Dutycycle_BufferLevel = 0;
   gConfig.miniseedMode = 0;
   gConfig.onesecMode = 1; // OSF_ALL
+  gConfig.PackThreads = 0;
+  gConfig.numChanRules = 0;
+  gConfig.numDecimators = 0;
+  gConfig.numTriggers = 0;
+  gConfig.numAmplitudes = 0;
+  gConfig.ContinuityTolerance = 0.5;
+  gConfig.ContinuityLog = 1;
+  gConfig.QuestionableTimingQuality = 0;
+  gConfig.DuplicateWindow = 0;
+  gConfig.AdaptiveEncoding = 0;
+  gConfig.MemoryLimit = 0;
+  gConfig.StreamMemoryLimit = 0;
+  gConfig.CheckpointInterval = 10;
+  gConfig.CheckpointMaxAge = 3600;
+  gConfig.ShutdownTimeout = 30;
+  gConfig.DataLinkRate = 0;
+  gConfig.DataLinkBurst = 16384;
+  gConfig.DataLinkQueueRecords = 2000;
+  gConfig.BackfillAge = 600;
+  gConfig.numSohChannels = 0;
+  gConfig.SohInterval = 0;
+  gConfig.RecordLength = 512;
+  gConfig.SeedLinkPort = 0;
+  gConfig.SeedLinkRingRecords = 10000;
+  gConfig.SeedLinkMaxClients = 32;
+  strcpy(gConfig.ShmRingPath, "");
+  gConfig.ShmRingSlots = 16384;
+  gConfig.ShmRingSlotSize = 512;
+  strcpy(gConfig.StatsPath, "");
+  gConfig.StatsStreams = 1024;
+  strcpy(gConfig.ControlSocket, "");
+  memset(gConfig.Threads, 0, sizeof(gConfig.Threads));
+  for(i=0; i < THREAD_ROLES; i++) {
+    gConfig.Threads[i].policy = SCHED_OTHER;
+  }
+  gConfig.LockMemory = 0;
+  gConfig.TraceEvents = 0;
+  gConfig.TraceSample = 1;
+  strcpy(gConfig.TraceDir, "");
+  strcpy(gConfig.ArchiveRoot, "");
+  gConfig.ArchiveWriteDelay = 1000;
+  gConfig.ArchiveSyncInterval = 60;
+  gConfig.ArchiveMaxOpenFiles = 256;
+  gConfig.ArchiveBufferSize = 1024;
+  gConfig.ArchiveUring = 0;
 }
 
 void printConfigStructToLog() {
+  int i;
 
   fprintf(stdout, "+++ Current Configuration:\n");
   fprintf(stdout, "--- ConfigFileName: %s\n", gConfig.ConfigFileName);
     fprintf(stdout, "--- DatalinkHost: %s\n", gConfig.datalinkHost);
     fprintf(stdout, "--- DatalinkPort: %d\n", gConfig.datalinkPort);
+  fprintf(stdout, "--- FlushLatency: %d\n", gConfig.FlushLatency);
+  fprintf(stdout, "--- ReconnectInterval: %d\n", gConfig.ReconnectInterval);
+  fprintf(stdout, "--- ReconnectMaxInterval: %d\n", gConfig.ReconnectMaxInterval);
+  fprintf(stdout, "--- ConnectTimeout: %d\n", gConfig.ConnectTimeout);
+  fprintf(stdout, "--- DataLinkRate: %d\n", gConfig.DataLinkRate);
+  fprintf(stdout, "--- DataLinkBurst: %d\n", gConfig.DataLinkBurst);
+  fprintf(stdout, "--- DataLinkQueueRecords: %d\n", gConfig.DataLinkQueueRecords);
+  fprintf(stdout, "--- BackfillAge: %d\n", gConfig.BackfillAge);
+  for(i=0; i < gConfig.numSohChannels; i++) {
+    fprintf(stdout, "--- SohChannel: %s\n", gConfig.SohChannels[i]);
+  }
+  fprintf(stdout, "--- SohInterval: %d\n", gConfig.SohInterval);
+  fprintf(stdout, "--- RecordLength: %d\n", gConfig.RecordLength);
+  fprintf(stdout, "--- SeedLinkPort: %d\n", gConfig.SeedLinkPort);
+  fprintf(stdout, "--- SeedLinkRingRecords: %d\n", gConfig.SeedLinkRingRecords);
+  fprintf(stdout, "--- SeedLinkMaxClients: %d\n", gConfig.SeedLinkMaxClients);
+  fprintf(stdout, "--- ShmRingPath: %s\n", gConfig.ShmRingPath);
+  fprintf(stdout, "--- ShmRingSlots: %d\n", gConfig.ShmRingSlots);
+  fprintf(stdout, "--- ShmRingSlotSize: %d\n", gConfig.ShmRingSlotSize);
+  fprintf(stdout, "--- StatsPath: %s\n", gConfig.StatsPath);
+  fprintf(stdout, "--- StatsStreams: %d\n", gConfig.StatsStreams);
+  fprintf(stdout, "--- ControlSocket: %s\n", gConfig.ControlSocket);
+  for(i=0; i < THREAD_ROLES; i++) {
+    if(gConfig.Threads[i].cpus[0]) {
+      fprintf(stdout, "--- ThreadCPUs: %s %s\n", placement_rolename(i), gConfig.Threads[i].cpus);
+    }
+    if(gConfig.Threads[i].policy != SCHED_OTHER) {
+      fprintf(stdout, "--- ThreadScheduler: %s %s %d\n", placement_rolename(i),
+              placement_policyname(gConfig.Threads[i].policy), gConfig.Threads[i].priority);
+    }
+  }
+  fprintf(stdout, "--- LockMemory: %d\n", gConfig.LockMemory);
+  fprintf(stdout, "--- TraceEvents: %d\n", gConfig.TraceEvents);
+  fprintf(stdout, "--- TraceSample: %d\n", gConfig.TraceSample);
+  fprintf(stdout, "--- TraceDir: %s\n", gConfig.TraceDir);
+  fprintf(stdout, "--- ArchiveRoot: %s\n", gConfig.ArchiveRoot);
+  fprintf(stdout, "--- ArchiveWriteDelay: %d\n", gConfig.ArchiveWriteDelay);
+  fprintf(stdout, "--- ArchiveSyncInterval: %d\n", gConfig.ArchiveSyncInterval);
+  fprintf(stdout, "--- ArchiveMaxOpenFiles: %d\n", gConfig.ArchiveMaxOpenFiles);
+  fprintf(stdout, "--- ArchiveBufferSize: %d\n", gConfig.ArchiveBufferSize);
+  fprintf(stdout, "--- ArchiveEngine: %s\n", (gConfig.ArchiveUring) ? "uring" : "writev");
   fprintf(stdout, "--- LogFile: %d\n", gConfig.LogFile);
   fprintf(stdout, "--- IPAddress: %s\n", gConfig.IPAddress);
   fprintf(stdout, "--- BasePort: %d\n", gConfig.baseport);
@@ -272,10 +592,41 @@ void printConfigStructToLog() {
   fprintf(stdout, "--- SourcePortControl: %d\n", gConfig.SourcePortControl);
   fprintf(stdout, "--- SourcePortData: %d\n", gConfig.SourcePortData);
   fprintf(stdout, "--- FailedRegistrationsBeforeSleep: %d\n", gConfig.FailedRegistrationsBeforeSleep);
+  fprintf(stdout, "--- RegistrationTimeout: %d\n", gConfig.RegistrationTimeout);
   fprintf(stdout, "--- MinutesToSleepBeforeRetry: %d\n", gConfig.MinutesToSleepBeforeRetry);
   fprintf(stdout, "--- Dutycycle_MaxConnectTime: %d\n", gConfig.Dutycycle_MaxConnectTime);
   fprintf(stdout, "--- Dutycycle_SleepTime: %d\n", gConfig.Dutycycle_SleepTime);
   fprintf(stdout, "--- Dutycycle_BufferLevel: %d\n", gConfig.Dutycycle_BufferLevel);
   fprintf(stdout, "--- onesecMode: %d\n", gConfig.onesecMode);
   fprintf(stdout, "--- miniseedMode: %d\n", gConfig.miniseedMode);
+  fprintf(stdout, "--- PackThreads: %d\n", gConfig.PackThreads);
+  for(i=0; i < gConfig.numChanRules; i++) {
+    fprintf(stdout, "--- %s: %s %s\n",
+            gConfig.ChanRules[i].type == CHANRULE_INCLUDE ? "ChannelInclude" :
+            gConfig.ChanRules[i].type == CHANRULE_EXCLUDE ? "ChannelExclude" : "ChannelRename",
+            gConfig.ChanRules[i].pattern, gConfig.ChanRules[i].replace);
+  }
+  fprintf(stdout, "--- ContinuityTolerance: %g\n", gConfig.ContinuityTolerance);
+  fprintf(stdout, "--- ContinuityLog: %d\n", gConfig.ContinuityLog);
+  fprintf(stdout, "--- QuestionableTimingQuality: %d\n", gConfig.QuestionableTimingQuality);
+  fprintf(stdout, "--- DuplicateWindow: %d\n", gConfig.DuplicateWindow);
+  fprintf(stdout, "--- AdaptiveEncoding: %d\n", gConfig.AdaptiveEncoding);
+  fprintf(stdout, "--- MemoryLimit: %d\n", gConfig.MemoryLimit);
+  fprintf(stdout, "--- StreamMemoryLimit: %d\n", gConfig.StreamMemoryLimit);
+  fprintf(stdout, "--- CheckpointInterval: %d\n", gConfig.CheckpointInterval);
+  fprintf(stdout, "--- CheckpointMaxAge: %d\n", gConfig.CheckpointMaxAge);
+  fprintf(stdout, "--- ShutdownTimeout: %d\n", gConfig.ShutdownTimeout);
+  for(i=0; i < gConfig.numDecimators; i++) {
+    fprintf(stdout, "--- Decimate: %s %s %d\n", gConfig.Decimators[i].source,
+            gConfig.Decimators[i].output, gConfig.Decimators[i].factor);
+  }
+  for(i=0; i < gConfig.numTriggers; i++) {
+    fprintf(stdout, "--- Trigger: %s %g %g %g %g %g %g\n", gConfig.Triggers[i].source,
+            gConfig.Triggers[i].sta, gConfig.Triggers[i].lta, gConfig.Triggers[i].on,
+            gConfig.Triggers[i].off, gConfig.Triggers[i].lowcorner, gConfig.Triggers[i].highcorner);
+  }
+  for(i=0; i < gConfig.numAmplitudes; i++) {
+    fprintf(stdout, "--- Amplitude: %s %g%s\n", gConfig.Amplitudes[i].source,
+            gConfig.Amplitudes[i].highpass, gConfig.Amplitudes[i].velocity ? " velocity" : "");
+  }
 }
@@ -3,6 +3,13 @@
 
 #include "q3302dali.h"
 #include "kom.h"
+#include "chanrules.h"
+#include "decimate.h"
+#include "trigger.h"
+#include "amplitude.h"
+#include "placement.h"
+
+#define MAX_SOH_CHANNELS 32
 
 /* what is in our config */
 typedef struct {
@@ -14,6 +21,8 @@ typedef struct {
   int32 datalinkPort;
   int32 FlushLatency;
   int32 ReconnectInterval;
+  int32 ReconnectMaxInterval;
+  int32 ConnectTimeout;
   long RingKey;
   int32  HeartbeatInt;
   int32  LogFile;
@@ -33,8 +42,56 @@ typedef struct {
   int32 Dutycycle_SleepTime;
   int32 Dutycycle_BufferLevel;
   int32 RegistrationCyclesLimit;
+  int32 RegistrationTimeout;
   int32 miniseedMode;
   int32 onesecMode;
+  int32 PackThreads;
+  ChanRule ChanRules[MAX_CHAN_RULES];
+  int32 numChanRules;
+  DecimateSpec Decimators[MAX_DECIMATORS];
+  int32 numDecimators;
+  TriggerSpec Triggers[MAX_TRIGGERS];
+  int32 numTriggers;
+  AmplitudeSpec Amplitudes[MAX_AMPLITUDES];
+  int32 numAmplitudes;
+  double ContinuityTolerance;
+  int32 ContinuityLog;
+  int32 QuestionableTimingQuality;
+  int32 DuplicateWindow;
+  int32 AdaptiveEncoding;
+  int32 MemoryLimit;
+  int32 StreamMemoryLimit;
+  int32 CheckpointInterval;
+  int32 CheckpointMaxAge;
+  int32 ShutdownTimeout;
+  int32 DataLinkRate;
+  int32 DataLinkBurst;
+  int32 DataLinkQueueRecords;
+  int32 BackfillAge;
+  char SohChannels[MAX_SOH_CHANNELS][16];
+  int32 numSohChannels;
+  int32 SohInterval;
+  int32 RecordLength;
+  int32 SeedLinkPort;
+  int32 SeedLinkRingRecords;
+  int32 SeedLinkMaxClients;
+  char ShmRingPath[255];
+  int32 ShmRingSlots;
+  int32 ShmRingSlotSize;
+  char StatsPath[255];
+  int32 StatsStreams;
+  char ControlSocket[255];
+  ThreadSpec Threads[THREAD_ROLES];
+  int32 LockMemory;
+  int32 TraceEvents;
+  int32 TraceSample;
+  char TraceDir[255];
+  char ArchiveRoot[255];
+  int32 ArchiveWriteDelay;
+  int32 ArchiveSyncInterval;
+  int32 ArchiveMaxOpenFiles;
+  int32 ArchiveBufferSize;
+  int32 ArchiveUring;               /* ArchiveEngine uring */
 } Configuration;
 
 extern Configuration gConfig;
@@ -44,4 +101,5 @@ int32 readConfig(char *);
 
 void printConfigStructToLog();
 void setupDefaultConfiguration();
+void readChannelRule();
 #endif
@@ -0,0 +1,328 @@
+//
+//  coverage.c
+//  q3302dali
+//
+//  Per-stream coverage of sent data, see coverage.h.
+//
+//  Spans are half-open, from the first sample time to the end of the last
+//  sample period, and samples are matched against them with a tolerance of
+//  half a sample period.  Only the lib330 thread filters, so the lock only
+//  keeps coverage_save() from reading a set while it is being changed.
+//
+//  Data accepted into the trace buffers is counted as covered before it
+//  is packed, which catches re-sent packets that have not even been packed
+//  yet.  What is saved is clipped at the end of the latest record sent for
+//  the stream, so after a crash the unsent tail can still be backfilled.
+//
+
+#include <stdio.h>
+#include "coverage.h"
+
+#define COVERAGE_FILE_MAGIC "# q3302dali coverage 1"
+
+static pthread_mutex_t coverlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Index of the span holding the sample at time t, -1 if none */
+static int findspan ( Coverage *cv, hptime_t t, hptime_t tol )
+{
+  int i;
+
+  for ( i = 0; i < cv->count; i++ )
+    if ( t >= cv->start[i] - tol && t < cv->end[i] - tol )
+      return i;
+
+  return -1;
+}
+
+/***************************************************************************
+ * addspan:
+ *
+ * Add a span, merging it with the spans it overlaps or touches.  Spans
+ * ending before oldest are forgotten, as is the oldest span when the set
+ * is full; forgetting only lets duplicates through, merging spans across
+ * a gap would drop the data that fills it.
+ ***************************************************************************/
+static void addspan ( Coverage *cv, hptime_t start, hptime_t end, hptime_t tol, hptime_t oldest )
+{
+  int i, j;
+
+  for ( i = 0; i < cv->count; )
+  {
+    if ( cv->start[i] <= end + tol && start <= cv->end[i] + tol )
+    {
+      if ( cv->start[i] < start )
+        start = cv->start[i];
+      if ( cv->end[i] > end )
+        end = cv->end[i];
+      for ( j = i; j < cv->count - 1; j++ )
+      {
+        cv->start[j] = cv->start[j + 1];
+        cv->end[j] = cv->end[j + 1];
+      }
+      cv->count--;
+    }
+    else
+    {
+      i++;
+    }
+  }
+
+  if ( cv->count == COVERAGE_MAX_SPANS )
+  {
+    for ( j = 0; j < cv->count - 1; j++ )
+    {
+      cv->start[j] = cv->start[j + 1];
+      cv->end[j] = cv->end[j + 1];
+    }
+    cv->count--;
+  }
+
+  for ( i = cv->count; i > 0 && cv->start[i - 1] > start; i-- )
+  {
+    cv->start[i] = cv->start[i - 1];
+    cv->end[i] = cv->end[i - 1];
+  }
+  cv->start[i] = start;
+  cv->end[i] = end;
+  cv->count++;
+
+  if ( oldest != HPTERROR )
+  {
+    for ( i = 0; i < cv->count && cv->end[i] < oldest; i++ )
+      ;
+    if ( i > 0 )
+    {
+      for ( j = i; j < cv->count; j++ )
+      {
+        cv->start[j - i] = cv->start[j];
+        cv->end[j - i] = cv->end[j];
+      }
+      cv->count -= i;
+    }
+  }
+}
+
+/***************************************************************************
+ * coverage_filter:
+ *
+ * Check a packet or record against the coverage of its stream and add
+ * what is kept.  With trim set, samples of a one-second packet ('i'
+ * samples) already covered at its start or end are cut off by adjusting
+ * msr in place; otherwise only data covered completely is dropped.
+ * Spans ending more than window seconds before the newest are forgotten.
+ * Data without a sample rate is always kept.
+ *
+ * Returns 1 to keep the data and 0 to drop it.
+ ***************************************************************************/
+int coverage_filter ( MSRecord *msr, int window, int trim )
+{
+  StreamInfo *si;
+  Coverage *cv;
+  double period;
+  hptime_t tol;
+  int64_t first;
+  int64_t last;
+  int64_t k;
+  int i;
+
+  if ( msr->samprate <= 0.0 || msr->samplecnt <= 0 )
+    return 1;
+
+  if ( ! (si = streams_get (msr->network, msr->station, msr->location, msr->channel)) )
+    return 1;
+
+  cv = &si->coverage;
+  period = HPTMODULUS / msr->samprate;
+  tol = (hptime_t) (period / 2);
+  first = 0;
+  last = msr->samplecnt;
+
+  pthread_mutex_lock (&coverlock);
+
+  /* Skip covered samples from the start, then from the end */
+  while ( first < last &&
+          (i = findspan (cv, msr->starttime + (hptime_t) (first * period), tol)) >= 0 )
+  {
+    k = (int64_t) ((cv->end[i] - msr->starttime) / period + 0.5);
+    first = ( k > first ) ? k : first + 1;
+  }
+  while ( last > first &&
+          (i = findspan (cv, msr->starttime + (hptime_t) ((last - 1) * period), tol)) >= 0 )
+  {
+    k = (int64_t) ((cv->start[i] - msr->starttime) / period + 0.5);
+    last = ( k < last ) ? k : last - 1;
+  }
+  if ( first > last )
+    first = last;
+
+  if ( first == last )
+  {
+    si->duppackets++;
+    si->dupsamples += msr->samplecnt;
+    pthread_mutex_unlock (&coverlock);
+
+    if ( ! si->dropping )
+    {
+      char stime[50];
+      ms_hptime2seedtimestr (msr->starttime, stime, 1);
+      ms_log (1, "%s: dropping data already sent, from %s\n", si->srcname, stime);
+      si->dropping = 1;
+    }
+    return 0;
+  }
+
+  if ( ! trim || msr->sampletype != 'i' )
+  {
+    first = 0;
+    last = msr->samplecnt;
+  }
+
+  addspan (cv, msr->starttime + (hptime_t) (first * period), msr->starttime + (hptime_t) (last * period + 0.5),
+           tol, ( window > 0 ) ? msr->starttime - (hptime_t) window * HPTMODULUS : HPTERROR);
+
+  pthread_mutex_unlock (&coverlock);
+
+  if ( first > 0 || last < msr->samplecnt )
+  {
+    si->dupsamples += msr->samplecnt - ( last - first );
+    msr->datasamples = (int32_t *) msr->datasamples + first;
+    msr->starttime += (hptime_t) (first * period + 0.5);
+    msr->numsamples = msr->samplecnt = last - first;
+  }
+
+  if ( si->dropping )
+  {
+    ms_log (1, "%s: new data, %lld duplicate samples dropped so far\n", si->srcname, (long long int) si->dupsamples);
+    si->dropping = 0;
+  }
+
+  return 1;
+}
+
+/* Note the end of a record sent for a stream, any thread */
+void coverage_sent ( StreamInfo *si, hptime_t endtime )
+{
+  hptime_t prev = __atomic_load_n (&si->coverage.sentend, __ATOMIC_RELAXED);
+
+  while ( ( prev == HPTERROR || endtime > prev ) &&
+          ! __atomic_compare_exchange_n (&si->coverage.sentend, &prev, endtime, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+    ;
+}
+
+/***************************************************************************
+ * coverage_save:
+ *
+ * Write the coverage of every stream to path, replacing the file only
+ * once it is complete.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int coverage_save ( const char *path )
+{
+  char tmppath[1100];
+  StreamInfo *si;
+  Coverage *cv;
+  hptime_t sentend;
+  hptime_t end;
+  FILE *fp;
+  int i;
+
+  snprintf (tmppath, sizeof(tmppath), "%s.tmp", path);
+  if ( ! (fp = fopen (tmppath, "w")) )
+  {
+    ms_log (2, "Cannot write %s: %s\n", tmppath, strerror (errno));
+    return -1;
+  }
+
+  fprintf (fp, "%s\n", COVERAGE_FILE_MAGIC);
+
+  pthread_mutex_lock (&coverlock);
+  for ( si = streams_first (); si; si = si->listnext )
+  {
+    cv = &si->coverage;
+    sentend = __atomic_load_n (&cv->sentend, __ATOMIC_RELAXED);
+    if ( sentend == HPTERROR )
+      continue;
+
+    for ( i = 0; i < cv->count && cv->start[i] < sentend; i++ )
+    {
+      end = ( cv->end[i] < sentend ) ? cv->end[i] : sentend;
+      fprintf (fp, "%s %s %s %s %lld %lld\n", si->network, si->station,
+               ( si->location[0] ) ? si->location : "--", si->channel,
+               (long long int) cv->start[i], (long long int) end);
+    }
+  }
+  pthread_mutex_unlock (&coverlock);
+
+  if ( fflush (fp) || fsync (fileno (fp)) < 0 )
+  {
+    ms_log (2, "Cannot write %s: %s\n", tmppath, strerror (errno));
+    fclose (fp);
+    return -1;
+  }
+  fclose (fp);
+
+  if ( rename (tmppath, path) < 0 )
+  {
+    ms_log (2, "Cannot rename %s: %s\n", tmppath, strerror (errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/***************************************************************************
+ * coverage_load:
+ *
+ * Read coverage saved by coverage_save(), a missing file is not an error.
+ *
+ * Returns the number of spans read or -1 on error.
+ ***************************************************************************/
+int coverage_load ( const char *path )
+{
+  char line[200];
+  char net[11], sta[11], loc[11], chan[11];
+  long long int start, end;
+  StreamInfo *si;
+  FILE *fp;
+  int count = 0;
+
+  if ( ! (fp = fopen (path, "r")) )
+  {
+    if ( errno == ENOENT )
+      return 0;
+    ms_log (2, "Cannot read %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+
+  if ( ! fgets (line, sizeof(line), fp) || strncmp (line, COVERAGE_FILE_MAGIC, strlen (COVERAGE_FILE_MAGIC)) )
+  {
+    ms_log (2, "%s is not a coverage file, ignoring it\n", path);
+    fclose (fp);
+    return -1;
+  }
+
+  pthread_mutex_lock (&coverlock);
+  while ( fgets (line, sizeof(line), fp) )
+  {
+    if ( sscanf (line, "%10s %10s %10s %10s %lld %lld", net, sta, loc, chan, &start, &end) != 6 ||
+         end <= start )
+      continue;
+    if ( ! strcmp (loc, "--") )
+      loc[0] = '\0';
+
+    if ( ! (si = streams_get (net, sta, loc, chan)) )
+      break;
+
+    addspan (&si->coverage, start, end, 0, HPTERROR);
+    if ( si->coverage.sentend == HPTERROR || end > si->coverage.sentend )
+      si->coverage.sentend = end;
+    count++;
+  }
+  pthread_mutex_unlock (&coverlock);
+
+  fclose (fp);
+
+  return count;
+}
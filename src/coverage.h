@@ -0,0 +1,22 @@
+//
+//  coverage.h
+//  q3302dali
+//
+//  Duplicate suppression.  Each stream keeps a small set of time spans
+//  already accepted for sending; data the Q330 re-sends from its buffer
+//  after a reconnect is dropped or trimmed against it before it is packed
+//  or forwarded.  The spans are saved next to the lib330 continuity files
+//  so suppression also holds across a restart.
+//
+
+#ifndef coverage_h
+#define coverage_h
+
+#include "streams.h"
+
+int coverage_filter ( MSRecord *msr, int window, int trim );
+void coverage_sent ( StreamInfo *si, hptime_t endtime );
+int coverage_save ( const char *path );
+int coverage_load ( const char *path );
+
+#endif /* coverage_h */
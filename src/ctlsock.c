@@ -0,0 +1,706 @@
+//
+//  ctlsock.c
+//  q3302dali
+//
+//  Runtime control socket, see ctlsock.h.
+//
+//  Every command is one line, answered with any number of lines and a last
+//  line of "OK" or "ERR reason".  Status and statistics are read here from
+//  the stream and connection counters like the statistics segment does,
+//  reconnecting is left to the DataLink connection thread.  A flush is
+//  published as a pattern under a sequence counter that is odd while the
+//  pattern is written; the flush timer compares the counter with the last
+//  one it acted on, flushes every pack context under its lock and reports
+//  the counter back, and the reply waits for that.  A pause is a flag per
+//  destination checked for each record, except that DataLink is paused by
+//  holding the shaper queues, which spill to the spool once full and are
+//  replayed on resume, and a new verbosity is picked up by the main loop.
+//  A trace dump is written from this thread.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "ctlsock.h"
+#include "streams.h"
+#include "trace.h"
+#include "shaper.h"
+#include "spool.h"
+#include "dlconn.h"
+#include "slserver.h"
+#include "encoding.h"
+#include "memacct.h"
+#include "placement.h"
+
+#define CTL_MAX_CLIENTS 4
+#define CTL_LINE_MAX 256
+#define CTL_SEND_TIMEOUT 5         /* seconds a client may take to read a reply */
+#define CTL_FLUSH_TIMEOUT 30       /* seconds to wait for a flush to be done */
+
+typedef struct ctlclient_s
+{
+  int fd;                          /* -1 when unused */
+  char inbuf[CTL_LINE_MAX];
+  int inlen;
+} CtlClient;
+
+/* Reply being built */
+typedef struct ctlreply_s
+{
+  char *data;
+  size_t len;
+  size_t cap;
+} CtlReply;
+
+static const char *destnames[CTL_DESTINATIONS] = { "datalink", "seedlink", "shmring", "archive" };
+
+static char sockpath[108] = "";
+static int listenfd = -1;
+static int wakefd[2] = { -1, -1 };
+static CtlClient clients[CTL_MAX_CLIENTS];
+static int configured = 0;         /* destinations that may be paused, a bit each */
+static int stopping = 0;
+static int running = 0;
+static pthread_t ctlthread;
+
+/* Handed to other threads, all accessed atomically */
+static int paused[CTL_DESTINATIONS];
+static int64_t skipped[CTL_DESTINATIONS];
+static uint32_t flushseq = 0;      /* odd while flushpattern is written */
+static char flushpattern[CTL_PATTERN_MAX];
+static uint32_t flushdone = 0;     /* last flush done, under flushlock */
+static pthread_mutex_t flushlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushcond = PTHREAD_COND_INITIALIZER;
+static int verbosity = -1;         /* requested level, -1 for none */
+
+static void *ctlsock_thread ( void *arg );
+
+/***************************************************************************
+ * ctlsock_start:
+ *
+ * Listen for control clients on a Unix-domain socket at path.  A socket
+ * file left by an earlier run is replaced, one still answering is not.
+ * destinations has a bit (1 << CTL_DATALINK etc.) set for each
+ * destination in use, only those may be paused.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int ctlsock_start ( const char *path, int destinations )
+{
+  struct sockaddr_un addr;
+  int probe;
+  int i;
+
+  memset (&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if ( strlen (path) >= sizeof(addr.sun_path) )
+  {
+    ms_log (2, "ControlSocket path is longer than %d characters: %s\n",
+            (int) sizeof(addr.sun_path) - 1, path);
+    return -1;
+  }
+  strcpy (addr.sun_path, path);
+
+  if ( (probe = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0 )
+  {
+    if ( connect (probe, (struct sockaddr *) &addr, sizeof(addr)) == 0 )
+    {
+      ms_log (2, "ControlSocket %s is in use by another process\n", path);
+      close (probe);
+      return -1;
+    }
+    close (probe);
+    if ( errno == ECONNREFUSED )
+      unlink (path);
+  }
+
+  if ( (listenfd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+  {
+    ms_log (2, "Cannot create control socket: %s\n", strerror (errno));
+    return -1;
+  }
+
+  /* Only the owner and group may control the process */
+  if ( bind (listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+       chmod (path, 0660) < 0 ||
+       listen (listenfd, CTL_MAX_CLIENTS) < 0 )
+  {
+    ms_log (2, "Cannot listen on control socket %s: %s\n", path, strerror (errno));
+    close (listenfd);
+    listenfd = -1;
+    return -1;
+  }
+  fcntl (listenfd, F_SETFL, fcntl (listenfd, F_GETFL) | O_NONBLOCK);
+  strcpy (sockpath, path);
+
+  if ( pipe (wakefd) < 0 )
+  {
+    ms_log (2, "Cannot create control socket wakeup pipe: %s\n", strerror (errno));
+    return -1;
+  }
+  fcntl (wakefd[0], F_SETFL, fcntl (wakefd[0], F_GETFL) | O_NONBLOCK);
+  fcntl (wakefd[1], F_SETFL, fcntl (wakefd[1], F_GETFL) | O_NONBLOCK);
+
+  for ( i = 0; i < CTL_MAX_CLIENTS; i++ )
+    clients[i].fd = -1;
+  configured = destinations;
+  stopping = 0;
+
+  if ( pthread_create (&ctlthread, NULL, ctlsock_thread, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start control socket thread\n");
+    return -1;
+  }
+  running = 1;
+
+  ms_log (0, "Control socket listening on %s\n", path);
+
+  return 0;
+}
+
+/***************************************************************************
+ * ctlsock_skip:
+ *
+ * Check whether records for a destination are paused, called for every
+ * record just before it would be written there.
+ *
+ * Returns 1 if the record is to be skipped, counting it, 0 otherwise.
+ ***************************************************************************/
+int ctlsock_skip ( int destination )
+{
+  if ( ! __atomic_load_n (&paused[destination], __ATOMIC_RELAXED) )
+    return 0;
+
+  __atomic_add_fetch (&skipped[destination], 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/***************************************************************************
+ * ctlsock_flushwanted:
+ *
+ * Check for a flush requested since the one recorded in seen.  The
+ * stream pattern, a NET_STA_LOC_CHAN glob or empty for all streams, is
+ * copied to pattern.  A flush being published meanwhile is picked up on
+ * a later call.  Once done, seen is passed to ctlsock_flushdone().
+ *
+ * Returns 1 if the context should flush, 0 otherwise.
+ ***************************************************************************/
+int ctlsock_flushwanted ( uint32_t *seen, char *pattern, size_t patternlen )
+{
+  uint32_t seq = __atomic_load_n (&flushseq, __ATOMIC_ACQUIRE);
+
+  if ( seq == *seen || ( seq & 1 ) )
+    return 0;
+
+  strncpy (pattern, flushpattern, patternlen - 1);
+  pattern[patternlen - 1] = '\0';
+
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  if ( __atomic_load_n (&flushseq, __ATOMIC_RELAXED) != seq )
+    return 0;
+
+  *seen = seq;
+  return 1;
+}
+
+/* The flush of seen has been done, let its reply go */
+void ctlsock_flushdone ( uint32_t seen )
+{
+  pthread_mutex_lock (&flushlock);
+  flushdone = seen;
+  pthread_cond_broadcast (&flushcond);
+  pthread_mutex_unlock (&flushlock);
+}
+
+/* Verbosity requested on the socket and not yet applied, -1 for none */
+int ctlsock_verbosity ( void )
+{
+  return __atomic_exchange_n (&verbosity, -1, __ATOMIC_ACQ_REL);
+}
+
+/* Append formatted text to a reply, dropped if it cannot grow */
+static void replyf ( CtlReply *reply, const char *format, ... )
+{
+  va_list ap;
+  size_t cap;
+  char *data;
+  int len;
+
+  va_start (ap, format);
+  len = vsnprintf (NULL, 0, format, ap);
+  va_end (ap);
+  if ( len < 0 )
+    return;
+
+  if ( reply->len + len >= reply->cap )
+  {
+    for ( cap = ( reply->cap ) ? reply->cap : 4096; cap <= reply->len + len; cap *= 2 )
+      ;
+    if ( ! (data = (char *) realloc (reply->data, cap)) )
+      return;
+    reply->data = data;
+    reply->cap = cap;
+  }
+
+  va_start (ap, format);
+  vsnprintf (reply->data + reply->len, reply->cap - reply->len, format, ap);
+  va_end (ap);
+  reply->len += len;
+}
+
+static int destination ( const char *name )
+{
+  int i;
+
+  for ( i = 0; i < CTL_DESTINATIONS; i++ )
+    if ( ! strcmp (name, destnames[i]) )
+      return i;
+
+  return -1;
+}
+
+static void cmdstatus ( CtlReply *reply )
+{
+  DLConnStats conn;
+  ShaperStats queue;
+  MemStats mem;
+  int i;
+
+  dlconn_stats (&conn);
+  replyf (reply, "datalink %s %s, %lld connects, %lld failed, %lld lost\n",
+          dlconn_statename (conn.state), ( conn.addr[0] ) ? conn.addr : "-",
+          (long long) conn.connects, (long long) conn.failures, (long long) conn.disconnects);
+
+  for ( i = 0; shaper_running () && i < SHAPER_CLASSES; i++ )
+  {
+    shaper_stats (i, &queue, 0);
+    replyf (reply, "queue %s %d records waiting, %lld sent, %lld failed, %lld dropped\n", shaper_classname (i),
+            queue.queued, (long long) queue.records, (long long) queue.failed, (long long) queue.dropped);
+  }
+
+  memacct_stats (&mem);
+  replyf (reply, "memory %lld bytes in trace buffers, %lld queued, peak %lld, %lld early flushes\n",
+          (long long) mem.current[MEM_TRACES], (long long) mem.current[MEM_QUEUE],
+          (long long) mem.peaktotal, (long long) mem.flushes);
+  replyf (reply, "seedlink %d clients\n", slserver_clients ());
+  replyf (reply, "streams %d\n", streams_count ());
+
+  for ( i = 0; i < CTL_DESTINATIONS; i++ )
+    if ( i == CTL_DATALINK && ( configured & (1 << i) ) )
+      replyf (reply, "%s %s\n", destnames[i],
+              ( __atomic_load_n (&paused[i], __ATOMIC_RELAXED) ) ? "paused, records queued, then spooled" : "running");
+    else if ( configured & (1 << i) )
+      replyf (reply, "%s %s, %lld records skipped\n", destnames[i],
+              ( __atomic_load_n (&paused[i], __ATOMIC_RELAXED) ) ? "paused" : "running",
+              (long long) __atomic_load_n (&skipped[i], __ATOMIC_RELAXED));
+}
+
+/* Counters are owned by the pack threads, read like the statistics segment does */
+static int cmdstats ( CtlReply *reply, const char *pattern )
+{
+  StreamInfo *si;
+  double now = (double) dlp_time () / HPTMODULUS;
+  int count = 0;
+
+  replyf (reply, "%-22s %9s %8s %6s %6s %6s %6s %7s %7s %6s %-7s\n",
+          "STREAM", "PACKETS", "RECORDS", "GAPS", "OVERLP", "TEARS", "DUPS",
+          "LAT", "AGE", "B/SMP", "ENC");
+
+  for ( si = streams_first (); si; si = si->listnext )
+  {
+    char age[16];
+
+    if ( pattern[0] && fnmatch (pattern, si->srcname, 0) )
+      continue;
+
+    if ( si->lastpacket > 0 )
+      snprintf (age, sizeof(age), "%.1f", now - (double) si->lastpacket / HPTMODULUS);
+    else
+      strcpy (age, "-");
+
+    replyf (reply, "%-22s %9lld %8lld %6lld %6lld %6lld %6lld %7.2f %7s %6.2f %-7s\n",
+            si->srcname, (long long) si->packets, (long long) si->records,
+            (long long) si->gaps, (long long) si->overlaps, (long long) si->tears,
+            (long long) si->duppackets, si->latency, age,
+            ( si->recsamples > 0 ) ? (double) si->recbytes / si->recsamples : 0.0,
+            ( si->lastencoding ) ? encoding_name (si->lastencoding) : "-");
+    count++;
+  }
+
+  return count;
+}
+
+/* Publish a flush and wait for it, returns 0 once done and -1 on timeout */
+static int cmdflush ( const char *pattern )
+{
+  uint32_t seq = __atomic_load_n (&flushseq, __ATOMIC_RELAXED);
+  struct timespec deadline;
+  int rv = 0;
+
+  __atomic_store_n (&flushseq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  strncpy (flushpattern, pattern, sizeof(flushpattern) - 1);
+  flushpattern[sizeof(flushpattern) - 1] = '\0';
+  __atomic_store_n (&flushseq, seq + 2, __ATOMIC_RELEASE);
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += CTL_FLUSH_TIMEOUT;
+
+  pthread_mutex_lock (&flushlock);
+  while ( flushdone != seq + 2 && rv == 0 && ! __atomic_load_n (&stopping, __ATOMIC_ACQUIRE) )
+    if ( pthread_cond_timedwait (&flushcond, &flushlock, &deadline) == ETIMEDOUT )
+      rv = -1;
+  if ( flushdone != seq + 2 )
+    rv = -1;
+  pthread_mutex_unlock (&flushlock);
+
+  return rv;
+}
+
+/***************************************************************************
+ * command:
+ *
+ * Run one command line and build its reply.
+ *
+ * Returns 0 to keep the client, -1 to close it after the reply.
+ ***************************************************************************/
+static int command ( char *line, CtlReply *reply )
+{
+  char *argv[4] = { "", "", "", "" };
+  char *save = NULL;
+  char *word;
+  char *end;
+  double seconds;
+  int argc = 0;
+  int count;
+  int dest;
+  int level;
+
+  while ( argc < 4 && (word = strtok_r ( ( argc ) ? NULL : line, " \t\r", &save )) )
+    argv[argc++] = word;
+
+  if ( argc == 0 )
+    return 0;
+
+  if ( ! strcmp (argv[0], "help") )
+  {
+    replyf (reply, "status                 connections, queues and pauses\n"
+                   "stats [pattern]        counters of the streams matching a NET_STA_LOC_CHAN glob\n"
+                   "flush [pattern]        pack and send what is buffered for the matching streams\n"
+                   "reconnect              drop and remake the DataLink connection\n"
+                   "pause <destination>    stop sending to datalink, seedlink, shmring or archive\n"
+                   "resume <destination>   send to it again\n"
+                   "verbose <level>        set Verbosity until the next reload\n"
+                   "trace on|off           start or stop the tracer set up with TraceEvents\n"
+                   "trace dump <file> [s]  write the spans of the last s seconds, 10 by default,\n"
+                   "                       as a Chrome trace to a file in TraceDir\n"
+                   "quit                   close this connection\n");
+  }
+  else if ( ! strcmp (argv[0], "status") )
+  {
+    cmdstatus (reply);
+  }
+  else if ( ! strcmp (argv[0], "stats") )
+  {
+    if ( ! cmdstats (reply, argv[1]) && argv[1][0] )
+    {
+      replyf (reply, "ERR no stream matches %s\n", argv[1]);
+      return 0;
+    }
+  }
+  else if ( ! strcmp (argv[0], "flush") )
+  {
+    if ( strlen (argv[1]) >= CTL_PATTERN_MAX )
+    {
+      replyf (reply, "ERR pattern longer than %d characters\n", CTL_PATTERN_MAX - 1);
+      return 0;
+    }
+    ms_log (1, "Control: flush of %s requested\n", ( argv[1][0] ) ? argv[1] : "all streams");
+    if ( cmdflush (argv[1]) < 0 )
+    {
+      replyf (reply, "ERR flush not done within %d seconds\n", CTL_FLUSH_TIMEOUT);
+      return 0;
+    }
+  }
+  else if ( ! strcmp (argv[0], "reconnect") )
+  {
+    if ( dlconn_reconnect () < 0 )
+    {
+      replyf (reply, "ERR no DataLink server configured\n");
+      return 0;
+    }
+    ms_log (1, "Control: DataLink reconnect requested\n");
+  }
+  else if ( ! strcmp (argv[0], "pause") || ! strcmp (argv[0], "resume") )
+  {
+    int pause = ! strcmp (argv[0], "pause");
+
+    if ( (dest = destination (argv[1])) < 0 )
+    {
+      replyf (reply, "ERR destination must be datalink, seedlink, shmring or archive\n");
+      return 0;
+    }
+    if ( ! ( configured & (1 << dest) ) )
+    {
+      replyf (reply, "ERR %s is not configured\n", destnames[dest]);
+      return 0;
+    }
+    __atomic_store_n (&paused[dest], pause, __ATOMIC_RELAXED);
+    if ( dest == CTL_DATALINK )
+    {
+      shaper_hold (pause);
+      if ( ! pause )
+        spool_replay ();
+    }
+    ms_log (1, "Control: %s %s\n", ( pause ) ? "paused" : "resumed", destnames[dest]);
+  }
+  else if ( ! strcmp (argv[0], "verbose") )
+  {
+    level = (int) strtol (argv[1], &end, 10);
+    if ( ! argv[1][0] || *end || level < 0 )
+    {
+      replyf (reply, "ERR verbose needs a level of 0 or more\n");
+      return 0;
+    }
+    __atomic_store_n (&verbosity, level, __ATOMIC_RELEASE);
+  }
+  else if ( ! strcmp (argv[0], "trace") && ( ! strcmp (argv[1], "on") || ! strcmp (argv[1], "off") ) )
+  {
+    if ( trace_enable (! strcmp (argv[1], "on")) < 0 )
+    {
+      replyf (reply, "ERR the tracer is not set up, TraceEvents is 0\n");
+      return 0;
+    }
+    ms_log (1, "Control: tracing %s\n", argv[1]);
+  }
+  else if ( ! strcmp (argv[0], "trace") && ! strcmp (argv[1], "dump") )
+  {
+    seconds = ( argv[3][0] ) ? strtod (argv[3], &end) : 10.0;
+    if ( ! argv[2][0] || ( argv[3][0] && *end ) || seconds <= 0.0 )
+    {
+      replyf (reply, "ERR trace dump needs a file name and a positive number of seconds\n");
+      return 0;
+    }
+    if ( (count = trace_dump (argv[2], seconds)) < 0 )
+    {
+      replyf (reply, "ERR cannot write %s: %s\n", argv[2],
+              ( errno == ENODATA ) ? "the tracer is not set up, TraceEvents is 0" :
+              ( errno == EPERM ) ? "no TraceDir is configured" :
+              ( errno == EINVAL ) ? "not a plain file name" : strerror (errno));
+      return 0;
+    }
+    replyf (reply, "%d spans of the last %g seconds written to %s in TraceDir\n", count, seconds, argv[2]);
+  }
+  else if ( ! strcmp (argv[0], "trace") )
+  {
+    replyf (reply, "ERR trace needs on, off or dump <file> [seconds]\n");
+    return 0;
+  }
+  else if ( ! strcmp (argv[0], "quit") )
+  {
+    replyf (reply, "OK\n");
+    return -1;
+  }
+  else
+  {
+    replyf (reply, "ERR unknown command %s, try help\n", argv[0]);
+    return 0;
+  }
+
+  replyf (reply, "OK\n");
+  return 0;
+}
+
+/* Send a whole reply, returns -1 if the client is gone or too slow */
+static int sendreply ( int fd, CtlReply *reply )
+{
+  size_t sent = 0;
+  ssize_t rv;
+
+  while ( sent < reply->len )
+  {
+    if ( (rv = send (fd, reply->data + sent, reply->len - sent, MSG_NOSIGNAL)) < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      return -1;
+    }
+    sent += rv;
+  }
+
+  return 0;
+}
+
+static void clientclose ( CtlClient *cl )
+{
+  close (cl->fd);
+  cl->fd = -1;
+  cl->inlen = 0;
+}
+
+/* Read from a client and run complete lines, returns -1 to close it */
+static int clientread ( CtlClient *cl, CtlReply *reply )
+{
+  char *newline;
+  ssize_t rv;
+  int keep = 0;
+
+  rv = recv (cl->fd, cl->inbuf + cl->inlen, sizeof(cl->inbuf) - 1 - cl->inlen, MSG_DONTWAIT);
+  if ( rv == 0 || ( rv < 0 && errno != EAGAIN && errno != EINTR ) )
+    return -1;
+  if ( rv < 0 )
+    return 0;
+  cl->inlen += rv;
+  cl->inbuf[cl->inlen] = '\0';
+
+  while ( keep == 0 && (newline = strchr (cl->inbuf, '\n')) )
+  {
+    *newline = '\0';
+    reply->len = 0;
+    keep = command (cl->inbuf, reply);
+    if ( sendreply (cl->fd, reply) < 0 )
+      return -1;
+
+    cl->inlen -= newline + 1 - cl->inbuf;
+    memmove (cl->inbuf, newline + 1, cl->inlen + 1);
+  }
+
+  if ( cl->inlen >= (int) sizeof(cl->inbuf) - 1 )
+  {
+    reply->len = 0;
+    replyf (reply, "ERR line longer than %d characters\n", CTL_LINE_MAX - 1);
+    sendreply (cl->fd, reply);
+    return -1;
+  }
+
+  return keep;
+}
+
+static void clientaccept ( void )
+{
+  struct timeval tv;
+  int fd;
+  int i;
+
+  if ( (fd = accept (listenfd, NULL, NULL)) < 0 )
+    return;
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+  for ( i = 0; i < CTL_MAX_CLIENTS; i++ )
+  {
+    if ( clients[i].fd < 0 )
+    {
+      /* Replies block, but not for long on a client that stopped reading */
+      tv.tv_sec = CTL_SEND_TIMEOUT;
+      tv.tv_usec = 0;
+      setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      clients[i].fd = fd;
+      clients[i].inlen = 0;
+      return;
+    }
+  }
+
+  ms_log (1, "Control socket has %d clients, refusing another\n", CTL_MAX_CLIENTS);
+  if ( send (fd, "ERR too many clients\n", 21, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 )
+    ms_log (1, "Cannot refuse control client: %s\n", strerror (errno));
+  close (fd);
+}
+
+/***************************************************************************
+ * ctlsock_thread:
+ *
+ * Accept clients and run their commands until ctlsock_stop() is called.
+ ***************************************************************************/
+static void *ctlsock_thread ( void *arg )
+{
+  struct pollfd fds[CTL_MAX_CLIENTS + 2];
+  int index[CTL_MAX_CLIENTS + 2];
+  CtlReply reply = { NULL, 0, 0 };
+  char drain[64];
+  int nfds;
+  int i;
+
+  placement_enter (THREAD_SERVER, "control");
+
+  while ( ! __atomic_load_n (&stopping, __ATOMIC_ACQUIRE) )
+  {
+    fds[0].fd = listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakefd[0];
+    fds[1].events = POLLIN;
+    nfds = 2;
+
+    for ( i = 0; i < CTL_MAX_CLIENTS; i++ )
+    {
+      if ( clients[i].fd < 0 )
+        continue;
+      fds[nfds].fd = clients[i].fd;
+      fds[nfds].events = POLLIN;
+      index[nfds] = i;
+      nfds++;
+    }
+
+    if ( poll (fds, nfds, -1) < 0 )
+    {
+      if ( errno != EINTR )
+        ms_log (2, "Control socket poll error: %s\n", strerror (errno));
+      continue;
+    }
+
+    if ( fds[1].revents & POLLIN )
+      while ( read (wakefd[0], drain, sizeof(drain)) > 0 )
+        ;
+
+    for ( i = 2; i < nfds; i++ )
+    {
+      CtlClient *cl = &clients[index[i]];
+
+      if ( ( fds[i].revents & (POLLERR | POLLNVAL) ) ||
+           ( ( fds[i].revents & (POLLIN | POLLHUP) ) && clientread (cl, &reply) < 0 ) )
+        clientclose (cl);
+    }
+
+    if ( fds[0].revents & POLLIN )
+      clientaccept ();
+  }
+
+  for ( i = 0; i < CTL_MAX_CLIENTS; i++ )
+    if ( clients[i].fd >= 0 )
+      clientclose (&clients[i]);
+  free (reply.data);
+
+  return NULL;
+}
+
+/***************************************************************************
+ * ctlsock_stop:
+ *
+ * Stop the control thread, disconnect the clients and remove the socket.
+ ***************************************************************************/
+void ctlsock_stop ( void )
+{
+  if ( ! running )
+    return;
+
+  running = 0;
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock (&flushlock);
+  pthread_cond_broadcast (&flushcond);
+  pthread_mutex_unlock (&flushlock);
+  if ( write (wakefd[1], "s", 1) < 0 && errno != EAGAIN )
+    ms_log (2, "Cannot wake control socket thread: %s\n", strerror (errno));
+  pthread_join (ctlthread, NULL);
+
+  close (listenfd);
+  close (wakefd[0]);
+  close (wakefd[1]);
+  listenfd = wakefd[0] = wakefd[1] = -1;
+  unlink (sockpath);
+}
@@ -0,0 +1,33 @@
+//
+//  ctlsock.h
+//  q3302dali
+//
+//  Runtime control over a Unix-domain socket.  A thread of its own reads
+//  line commands from local clients, answers the ones it can from the
+//  counters and hands the others to the data path and the main loop
+//  through atomic variables, so nothing the data path does waits for an
+//  operator.  Try "help" with e.g. socat - UNIX-CONNECT:path.
+//
+
+#ifndef ctlsock_h
+#define ctlsock_h
+
+#include "q3302dali.h"
+
+/* Destinations that may be paused */
+#define CTL_DATALINK     0
+#define CTL_SEEDLINK     1
+#define CTL_SHMRING      2
+#define CTL_ARCHIVE      3
+#define CTL_DESTINATIONS 4
+
+#define CTL_PATTERN_MAX 64         /* longest stream pattern of a flush */
+
+int ctlsock_start ( const char *path, int destinations );
+void ctlsock_stop ( void );
+int ctlsock_skip ( int destination );
+int ctlsock_flushwanted ( uint32_t *seen, char *pattern, size_t patternlen );
+void ctlsock_flushdone ( uint32_t seen );
+int ctlsock_verbosity ( void );
+
+#endif /* ctlsock_h */
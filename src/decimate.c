@@ -0,0 +1,479 @@
+//
+//  decimate.c
+//  q3302dali
+//
+//  FIR decimation of one-second data, see decimate.h.
+//
+//  Each stage is a Blackman windowed sinc lowpass with 28 * factor + 1
+//  symmetric taps, cutoff at the output Nyquist frequency and unity gain
+//  at DC, so every stage is a plain linear phase FIR that can be described
+//  in a SEED response.  Stages only compute the samples they keep, which
+//  is the polyphase form of a decimator.  The delay line is stored twice
+//  so the filter window is always contiguous and the inner product runs
+//  four taps at a time with GCC/clang vector extensions.
+//
+//  Output sample times are the input times corrected for the group delay
+//  of the cascade, and the start is aligned to a multiple of the output
+//  sample period where the input sampling allows.  A gap or rate change
+//  restarts the filters, primed with the first sample.
+//
+//  Decimators are only used from the lib330 callback thread.
+//
+
+#include <stdio.h>
+#include <math.h>
+#include "decimate.h"
+
+#define MAX_STAGES 8
+#define TAPS_PER_FACTOR 28
+
+typedef struct firstage_s
+{
+  int factor;
+  int ntaps;                       /* padded to a multiple of 4 */
+  double *coef;                    /* ntaps, zero padding at the oldest end */
+  double *hist;                    /* 2 * ntaps, each sample stored twice */
+  int pos;                         /* where the next sample is written */
+  int phase;                       /* inputs until the next output */
+  double delay;                    /* group delay in input samples */
+} FirStage;
+
+typedef struct decimator_s
+{
+  int spec;                        /* index of the config spec */
+  char network[11];
+  char station[11];
+  char srclocation[11];
+  char location[11];               /* output location */
+  char channel[11];                /* output channel */
+  double inrate;
+  int factor;
+  int numstages;
+  FirStage stages[MAX_STAGES];
+  hptime_t nexttime;               /* expected time of the next input sample */
+  hptime_t delay;                  /* group delay of the cascade */
+  int skip;                        /* inputs to drop to align the output */
+  int32 out[MAX_RATE];
+} Decimator;
+
+/* A config spec with the location and channel split out */
+typedef struct decimatematch_s
+{
+  char srcloc[11];
+  char srcchan[11];
+  int anysrcloc;
+  char outloc[11];
+  char outchan[11];
+  int keeploc;
+  int factor;
+  int numfactors;
+  int factors[MAX_STAGES];
+} DecimateMatch;
+
+static DecimateMatch *matches = NULL;
+static int nummatches = 0;
+static Decimator **decimators = NULL;
+static int numdecimators = 0;
+static decimate_handler handler = NULL;
+static MSRecord *outmsr = NULL;
+
+#if defined(__GNUC__)
+typedef double v4df __attribute__ ((vector_size (32)));
+
+static double firdot ( const double *coef, const double *win, int ntaps )
+{
+  v4df acc = { 0.0, 0.0, 0.0, 0.0 };
+  v4df c, w;
+  int i;
+
+  for ( i = 0; i < ntaps; i += 4 )
+  {
+    memcpy (&c, coef + i, sizeof(c));
+    memcpy (&w, win + i, sizeof(w));
+    acc += c * w;
+  }
+
+  return acc[0] + acc[1] + acc[2] + acc[3];
+}
+#else
+static double firdot ( const double *coef, const double *win, int ntaps )
+{
+  double acc0 = 0.0, acc1 = 0.0, acc2 = 0.0, acc3 = 0.0;
+  int i;
+
+  for ( i = 0; i < ntaps; i += 4 )
+  {
+    acc0 += coef[i] * win[i];
+    acc1 += coef[i+1] * win[i+1];
+    acc2 += coef[i+2] * win[i+2];
+    acc3 += coef[i+3] * win[i+3];
+  }
+
+  return acc0 + acc1 + acc2 + acc3;
+}
+#endif
+
+/***************************************************************************
+ * designstage:
+ *
+ * Compute the lowpass coefficients for a stage decimating by factor.
+ *
+ * Returns 0 on success and -1 on allocation error.
+ ***************************************************************************/
+static int designstage ( FirStage *st, int factor )
+{
+  int ntaps = TAPS_PER_FACTOR * factor + 1;
+  int pad = (4 - ntaps % 4) % 4;
+  double fc = 0.5 / factor;
+  double center = (ntaps - 1) / 2.0;
+  double sum = 0.0;
+  int n;
+
+  memset (st, 0, sizeof(FirStage));
+  st->factor = factor;
+  st->ntaps = ntaps + pad;
+  st->delay = center;
+
+  if ( ! (st->coef = (double *) calloc (st->ntaps, sizeof(double))) ||
+       ! (st->hist = (double *) calloc (2 * st->ntaps, sizeof(double))) )
+    return -1;
+
+  for ( n = 0; n < ntaps; n++ )
+  {
+    double x = n - center;
+    double sinc = ( x == 0.0 ) ? 2.0 * fc : sin (2.0 * M_PI * fc * x) / (M_PI * x);
+    double window = 0.42 - 0.5 * cos (2.0 * M_PI * n / (ntaps - 1))
+      + 0.08 * cos (4.0 * M_PI * n / (ntaps - 1));
+
+    st->coef[pad + n] = sinc * window;
+    sum += st->coef[pad + n];
+  }
+
+  for ( n = pad; n < st->ntaps; n++ )
+    st->coef[n] /= sum;
+
+  return 0;
+}
+
+/* Push one sample into a stage, returns 1 and sets *y when it emits one */
+static int stagepush ( FirStage *st, double x, double *y )
+{
+  st->hist[st->pos] = x;
+  st->hist[st->pos + st->ntaps] = x;
+  if ( ++st->pos == st->ntaps )
+    st->pos = 0;
+
+  if ( st->phase > 0 )
+  {
+    st->phase--;
+    return 0;
+  }
+
+  *y = firdot (st->coef, st->hist + st->pos, st->ntaps);
+  st->phase = st->factor - 1;
+
+  return 1;
+}
+
+/***************************************************************************
+ * resetdecimator:
+ *
+ * Restart the filters at an input sample time, priming the delay lines
+ * with value, and choose how many input samples to skip so output times
+ * fall on multiples of the output period.
+ ***************************************************************************/
+static void resetdecimator ( Decimator *d, hptime_t starttime, double value )
+{
+  double period = HPTMODULUS / d->inrate;
+  hptime_t outperiod = (hptime_t) (period * d->factor + 0.5);
+  hptime_t best = outperiod;
+  double rate = d->inrate;
+  double delay = 0.0;
+  int i, j, s;
+
+  for ( i = 0; i < d->numstages; i++ )
+  {
+    FirStage *st = &d->stages[i];
+
+    for ( j = 0; j < 2 * st->ntaps; j++ )
+      st->hist[j] = value;
+    st->pos = 0;
+    st->phase = 0;
+    delay += st->delay / rate;
+    rate /= st->factor;
+  }
+  d->delay = (hptime_t) (delay * HPTMODULUS + 0.5);
+
+  d->skip = 0;
+  for ( s = 0; s < d->factor && outperiod > 0; s++ )
+  {
+    hptime_t t = starttime + (hptime_t) (s * period + 0.5) - d->delay;
+    hptime_t r = ((t % outperiod) + outperiod) % outperiod;
+    hptime_t dist = ( r < outperiod - r ) ? r : outperiod - r;
+
+    if ( dist < best )
+    {
+      best = dist;
+      d->skip = s;
+    }
+  }
+}
+
+/* Split CHAN or LOC.CHAN, an empty location is written as .CHAN or --.CHAN */
+static void splitlocchan ( const char *spec, char *loc, char *chan, int *anyloc )
+{
+  const char *dot = strchr (spec, '.');
+
+  if ( dot )
+  {
+    int len = dot - spec;
+    if ( len > 2 )
+      len = 2;
+    strncpy (loc, spec, len);
+    loc[len] = '\0';
+    if ( ! strcmp (loc, "--") )
+      loc[0] = '\0';
+    strncpy (chan, dot + 1, 3);
+    chan[3] = '\0';
+    *anyloc = 0;
+  }
+  else
+  {
+    loc[0] = '\0';
+    strncpy (chan, spec, 3);
+    chan[3] = '\0';
+    *anyloc = 1;
+  }
+}
+
+/***************************************************************************
+ * decimate_init:
+ *
+ * Parse the decimator specs, derived records are passed to dhandler.
+ *
+ * Returns the number of usable decimators.
+ ***************************************************************************/
+int decimate_init ( DecimateSpec *specs, int numspecs, decimate_handler dhandler )
+{
+  int i;
+
+  handler = dhandler;
+  nummatches = 0;
+
+  if ( numspecs <= 0 )
+    return 0;
+
+  if ( ! (matches = (DecimateMatch *) calloc (numspecs, sizeof(DecimateMatch))) ||
+       ! (outmsr = msr_init (NULL)) )
+  {
+    ms_log (2, "Cannot allocate decimators\n");
+    return 0;
+  }
+
+  for ( i = 0; i < numspecs; i++ )
+  {
+    DecimateMatch *dm = &matches[nummatches];
+    int remaining = specs[i].factor;
+    int f;
+
+    memset (dm, 0, sizeof(DecimateMatch));
+    splitlocchan (specs[i].source, dm->srcloc, dm->srcchan, &dm->anysrcloc);
+    splitlocchan (specs[i].output, dm->outloc, dm->outchan, &dm->keeploc);
+    dm->factor = specs[i].factor;
+
+    /* Largest factors first keeps the later, longer stages at low rates */
+    for ( f = 5; f >= 2 && remaining > 1; )
+    {
+      if ( remaining % f == 0 && dm->numfactors < MAX_STAGES )
+      {
+        dm->factors[dm->numfactors++] = f;
+        remaining /= f;
+      }
+      else
+      {
+        f--;
+      }
+    }
+
+    if ( dm->factor < 2 || remaining != 1 )
+    {
+      ms_log (2, "Decimate %s %s %d: factor must be a product of 2, 3, 4 and 5\n",
+              specs[i].source, specs[i].output, specs[i].factor);
+      continue;
+    }
+
+    ms_log (0, "Decimating %s to %s by %d in %d stages\n",
+            specs[i].source, specs[i].output, dm->factor, dm->numfactors);
+    nummatches++;
+  }
+
+  return nummatches;
+}
+
+/* Find or create the decimator for a spec and input stream */
+static Decimator *finddecimator ( int spec, MSRecord *msr )
+{
+  DecimateMatch *dm = &matches[spec];
+  Decimator **grown;
+  Decimator *d;
+  int i;
+
+  for ( i = 0; i < numdecimators; i++ )
+  {
+    d = decimators[i];
+    if ( d->spec == spec && ! strcmp (d->network, msr->network) &&
+         ! strcmp (d->station, msr->station) &&
+         ! strcmp (d->srclocation, msr->location) )
+      return d;
+  }
+
+  if ( ! (grown = (Decimator **) realloc (decimators, (numdecimators + 1) * sizeof(Decimator *))) )
+    return NULL;
+  decimators = grown;
+
+  if ( ! (d = (Decimator *) calloc (1, sizeof(Decimator))) )
+    return NULL;
+
+  d->spec = spec;
+  strcpy (d->network, msr->network);
+  strcpy (d->station, msr->station);
+  strcpy (d->srclocation, msr->location);
+  strcpy (d->location, ( dm->keeploc ) ? msr->location : dm->outloc);
+  strcpy (d->channel, dm->outchan);
+  d->factor = dm->factor;
+  d->nexttime = HPTERROR;
+
+  for ( i = 0; i < dm->numfactors; i++ )
+  {
+    if ( designstage (&d->stages[i], dm->factors[i]) < 0 )
+    {
+      ms_log (2, "Cannot allocate decimation filter\n");
+      return NULL;
+    }
+    d->numstages++;
+  }
+
+  decimators[numdecimators++] = d;
+
+  return d;
+}
+
+/* Run one record through a decimator, emitting any output samples */
+static void decimaterecord ( Decimator *d, MSRecord *msr )
+{
+  int32 *samples = (int32 *) msr->datasamples;
+  double period = HPTMODULUS / msr->samprate;
+  hptime_t outstart = HPTERROR;
+  int nout = 0;
+  int64_t i;
+  int j;
+
+  if ( d->inrate != msr->samprate )
+  {
+    d->inrate = msr->samprate;
+    d->nexttime = HPTERROR;
+  }
+
+  if ( d->nexttime == HPTERROR || llabs (msr->starttime - d->nexttime) > period / 2 )
+  {
+    if ( d->nexttime != HPTERROR )
+      ms_log (1, "Restarting decimation for %s_%s_%s_%s\n",
+              d->network, d->station, d->location, d->channel);
+    resetdecimator (d, msr->starttime, samples[0]);
+  }
+
+  for ( i = 0; i < msr->numsamples; i++ )
+  {
+    double y = samples[i];
+
+    if ( d->skip > 0 )
+    {
+      d->skip--;
+      continue;
+    }
+
+    for ( j = 0; j < d->numstages; j++ )
+      if ( ! stagepush (&d->stages[j], y, &y) )
+        break;
+
+    if ( j == d->numstages && nout < MAX_RATE )
+    {
+      if ( nout == 0 )
+        outstart = msr->starttime + (hptime_t) (i * period + 0.5) - d->delay;
+      d->out[nout++] = (int32) lrint (y);
+    }
+  }
+
+  d->nexttime = msr->starttime + (hptime_t) (msr->numsamples * period + 0.5);
+
+  if ( nout == 0 )
+    return;
+
+  strcpy (outmsr->network, d->network);
+  strcpy (outmsr->station, d->station);
+  strcpy (outmsr->location, d->location);
+  strcpy (outmsr->channel, d->channel);
+  outmsr->starttime = outstart;
+  outmsr->samprate = d->inrate / d->factor;
+  outmsr->numsamples = nout;
+  outmsr->samplecnt = nout;
+  outmsr->datasamples = d->out;
+  outmsr->sampletype = 'i';
+
+  handler (outmsr);
+
+  outmsr->datasamples = NULL;
+}
+
+/***************************************************************************
+ * decimate_record:
+ *
+ * Feed a one-second record of integer samples to every decimator whose
+ * source matches it.
+ ***************************************************************************/
+void decimate_record ( MSRecord *msr )
+{
+  Decimator *d;
+  int i;
+
+  if ( nummatches == 0 || msr->samprate <= 0.0 || msr->numsamples <= 0 ||
+       msr->sampletype != 'i' )
+    return;
+
+  for ( i = 0; i < nummatches; i++ )
+  {
+    if ( strcmp (matches[i].srcchan, msr->channel) ||
+         ( ! matches[i].anysrcloc && strcmp (matches[i].srcloc, msr->location) ) )
+      continue;
+
+    if ( (d = finddecimator (i, msr)) )
+      decimaterecord (d, msr);
+  }
+}
+
+void decimate_free ( void )
+{
+  int i, j;
+
+  for ( i = 0; i < numdecimators; i++ )
+  {
+    for ( j = 0; j < decimators[i]->numstages; j++ )
+    {
+      free (decimators[i]->stages[j].coef);
+      free (decimators[i]->stages[j].hist);
+    }
+    free (decimators[i]);
+  }
+  free (decimators);
+  free (matches);
+  decimators = NULL;
+  matches = NULL;
+  numdecimators = 0;
+  nummatches = 0;
+
+  if ( outmsr )
+  {
+    outmsr->datasamples = NULL;
+    msr_free (&outmsr);
+  }
+}
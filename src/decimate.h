@@ -0,0 +1,32 @@
+//
+//  decimate.h
+//  q3302dali
+//
+//  FIR decimation of one-second data into derived lower rate channels.
+//  Each decimator is a cascade of linear phase lowpass FIR stages with
+//  factors of 2 to 5, only the retained output samples are computed.
+//
+
+#ifndef decimate_h
+#define decimate_h
+
+#include "q3302dali.h"
+
+#define MAX_DECIMATORS 64
+
+/* A decimator as read from the config file */
+typedef struct decimatespec_s
+{
+  char source[16];                 /* CHAN or LOC.CHAN of the input */
+  char output[16];                 /* CHAN or LOC.CHAN of the output */
+  int32 factor;
+} DecimateSpec;
+
+/* Receives derived records, the record is only valid during the call */
+typedef void (*decimate_handler) ( MSRecord *msr );
+
+int decimate_init ( DecimateSpec *specs, int numspecs, decimate_handler handler );
+void decimate_record ( MSRecord *msr );
+void decimate_free ( void );
+
+#endif /* decimate_h */
@@ -0,0 +1,803 @@
+//
+//  dlconn.c
+//  q3302dali
+//
+//  DataLink connection management, see dlconn.h.
+//
+//  The connection thread waits in epoll_wait() on an eventfd, used to wake
+//  it, and while connecting also on the socket of a non-blocking connect,
+//  so a stop or reload interrupts even a slow connect.  Only this thread
+//  connects, disconnects after a reload or replaces the DataLink handle;
+//  a writer uses the handle only while the state is CONNECTED and marks
+//  it busy meanwhile.  A failed write disconnects and hands the connection
+//  back to this thread.
+//
+//  Records are written without libdali: each is framed the way dl_write()
+//  frames a WRITE without acknowledgement, "DL", the header length and
+//  the header followed by the record, and a batch goes out as one
+//  sendmsg() of header and record pairs instead of two sends per record.
+//
+//  Retries back off from the initial to the maximum interval, doubling
+//  each time, and each wait is drawn from the upper half of the current
+//  interval so that many instances losing the same server do not all
+//  come back at the same moment.
+//
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include "dlconn.h"
+#include "startup.h"
+#include "placement.h"
+#include "trace.h"
+
+static DLCP *dlcp = NULL;          /* DataLink handle, NULL when disabled */
+static char curaddr[285] = "";     /* address of dlcp */
+static char wantaddr[285] = "";    /* address requested by a reload */
+static int busy = 0;               /* a writer is using dlcp */
+static int state = DLCONN_DISABLED;
+static double nextattempt = 0.0;   /* monotonic seconds, in BACKOFF */
+static double backoff = 0.0;       /* current interval before jitter */
+static int initialbackoff = 10;    /* seconds, 0 gives up instead */
+static int maxbackoff = 300;
+static int connecttimeout = 10;
+static DLConnStats stats;
+static unsigned int seed;
+
+static pthread_mutex_t connlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conncond;    /* state or busy changed */
+static int epfd = -1;
+static int wakefd = -1;
+static int stopping = 0;
+static int reconnecting = 0;       /* drop and remake the connection */
+static int aborted = 0;            /* writes fail at once, see dlconn_abort() */
+static int running = 0;
+static pthread_t connthread;
+
+static void *dlconn_thread ( void *arg );
+
+static double monotime ( void )
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void wake ( void )
+{
+  uint64_t one = 1;
+
+  if ( write (wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN )
+    ms_log (2, "Cannot wake DataLink connection thread: %s\n", strerror (errno));
+}
+
+/* Connection lock held */
+static void setconnstate ( int newstate )
+{
+  state = newstate;
+  stats.since = time (NULL);
+  pthread_cond_broadcast (&conncond);
+}
+
+/* Connection lock held, schedule the next attempt */
+static void retrylater ( void )
+{
+  double delay;
+
+  if ( initialbackoff <= 0 )
+  {
+    setconnstate (DLCONN_FAILED);
+    return;
+  }
+
+  if ( backoff < initialbackoff )
+    backoff = initialbackoff;
+  delay = backoff / 2 + backoff / 2 * ( (double) rand_r (&seed) / RAND_MAX );
+  nextattempt = monotime () + delay;
+  stats.backoff = delay;
+
+  backoff *= 2;
+  if ( backoff > maxbackoff )
+    backoff = ( maxbackoff > initialbackoff ) ? maxbackoff : initialbackoff;
+
+  setconnstate (DLCONN_BACKOFF);
+}
+
+/***************************************************************************
+ * dlconn_start:
+ *
+ * Start the connection thread and connect to addr (host:port), which may
+ * be empty to start without a DataLink server.  The backoff starts at
+ * initialbackoff and grows to maxbackoff seconds; with initialbackoff 0 a
+ * failed connection is not retried.  A connect taking longer than
+ * connecttimeout seconds fails.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int dlconn_start ( const char *addr, int initial, int maximum, int timeout )
+{
+  struct epoll_event ev;
+  pthread_condattr_t attr;
+
+  initialbackoff = initial;
+  maxbackoff = maximum;
+  connecttimeout = ( timeout > 0 ) ? timeout : 10;
+  seed = (unsigned int) time (NULL) ^ (unsigned int) getpid ();
+  memset (&stats, 0, sizeof(stats));
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&conncond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  if ( (epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0 ||
+       (wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 )
+  {
+    ms_log (2, "Cannot create DataLink event loop: %s\n", strerror (errno));
+    return -1;
+  }
+  memset (&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = wakefd;
+  epoll_ctl (epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+  /* The handle exists before the first write so none is dropped */
+  strncpy (wantaddr, addr, sizeof(wantaddr) - 1);
+  strcpy (curaddr, wantaddr);
+  if ( curaddr[0] )
+  {
+    if ( ! (dlcp = dl_newdlcp (curaddr, PACKAGE)) )
+    {
+      ms_log (2, "Cannot allocate DataLink descriptor\n");
+      return -1;
+    }
+    backoff = initialbackoff;
+    setconnstate (DLCONN_CONNECTING);
+  }
+
+  stopping = 0;
+  aborted = 0;
+
+  if ( pthread_create (&connthread, NULL, dlconn_thread, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start DataLink connection thread\n");
+    return -1;
+  }
+  running = 1;
+
+  return 0;
+}
+
+/* Switch to another server, or none with an empty address */
+void dlconn_setaddr ( const char *addr )
+{
+  pthread_mutex_lock (&connlock);
+  strncpy (wantaddr, addr, sizeof(wantaddr) - 1);
+
+  /* Writers wait for the new server rather than drop records */
+  if ( wantaddr[0] && state == DLCONN_DISABLED )
+    setconnstate (DLCONN_CONNECTING);
+  pthread_mutex_unlock (&connlock);
+
+  wake ();
+}
+
+/***************************************************************************
+ * dlconn_reconnect:
+ *
+ * Drop the connection once the current write is done and connect again
+ * at once, also ending a backoff or a failed state.  Writers wait for the
+ * new connection meanwhile, so no record is lost.
+ *
+ * Returns 0 on success and -1 with no DataLink server configured.
+ ***************************************************************************/
+int dlconn_reconnect ( void )
+{
+  pthread_mutex_lock (&connlock);
+  if ( ! wantaddr[0] )
+  {
+    pthread_mutex_unlock (&connlock);
+    return -1;
+  }
+  reconnecting = 1;
+  pthread_mutex_unlock (&connlock);
+
+  wake ();
+
+  return 0;
+}
+
+void dlconn_setbackoff ( int initial, int maximum, int timeout )
+{
+  pthread_mutex_lock (&connlock);
+  initialbackoff = initial;
+  maxbackoff = maximum;
+  connecttimeout = ( timeout > 0 ) ? timeout : 10;
+  pthread_mutex_unlock (&connlock);
+}
+
+/***************************************************************************
+ * waitsocket:
+ *
+ * Wait up to timeoutms for an event on fd, draining wakeups meanwhile.
+ *
+ * Returns 1 on an event, 0 on timeout and -1 when stopping.
+ ***************************************************************************/
+static int waitsocket ( int fd, int timeoutms )
+{
+  struct epoll_event evs[2];
+  double deadline = monotime () + timeoutms / 1000.0;
+  uint64_t count;
+  int remaining;
+  int n, i;
+
+  for (;;)
+  {
+    remaining = (int) ((deadline - monotime ()) * 1000);
+    if ( remaining < 0 )
+      remaining = 0;
+
+    if ( (n = epoll_wait (epfd, evs, 2, remaining)) < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      return -1;
+    }
+    if ( n == 0 )
+      return 0;
+
+    for ( i = 0; i < n; i++ )
+    {
+      if ( evs[i].data.fd == fd )
+        return 1;
+      if ( read (wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN )
+        return -1;
+    }
+
+    if ( __atomic_load_n (&stopping, __ATOMIC_ACQUIRE) )
+      return -1;
+  }
+}
+
+/***************************************************************************
+ * tcpconnect:
+ *
+ * Connect to host:port without blocking the event loop for longer than
+ * timeout seconds.  A description of any error is left in errmsg.
+ *
+ * Returns a connected blocking socket or -1 on error.
+ ***************************************************************************/
+static int tcpconnect ( const char *addr, int timeout, char *errmsg, size_t errlen )
+{
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  struct epoll_event ev;
+  char host[285];
+  char *port;
+  socklen_t len;
+  int fd = -1;
+  int err;
+  int rv;
+
+  strcpy (host, addr);
+  if ( ! (port = strrchr (host, ':')) )
+  {
+    snprintf (errmsg, errlen, "no port in address");
+    return -1;
+  }
+  *port++ = '\0';
+
+  memset (&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ( (err = getaddrinfo (host, port, &hints, &res)) != 0 )
+  {
+    snprintf (errmsg, errlen, "%s", gai_strerror (err));
+    return -1;
+  }
+
+  snprintf (errmsg, errlen, "no usable address");
+  for ( ai = res; ai; ai = ai->ai_next )
+  {
+    if ( (fd = socket (ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol)) < 0 )
+      continue;
+
+    if ( connect (fd, ai->ai_addr, ai->ai_addrlen) == 0 )
+      break;
+
+    if ( errno == EINPROGRESS )
+    {
+      memset (&ev, 0, sizeof(ev));
+      ev.events = EPOLLOUT;
+      ev.data.fd = fd;
+      epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev);
+      rv = waitsocket (fd, timeout * 1000);
+      epoll_ctl (epfd, EPOLL_CTL_DEL, fd, NULL);
+
+      if ( rv > 0 )
+      {
+        len = sizeof(err);
+        if ( getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 )
+          err = errno;
+        if ( err == 0 )
+          break;
+        errno = err;
+      }
+      else
+      {
+        errno = ( rv == 0 ) ? ETIMEDOUT : ECANCELED;
+      }
+    }
+
+    snprintf (errmsg, errlen, "%s", strerror (errno));
+    close (fd);
+    fd = -1;
+    if ( errno == ECANCELED )
+      break;
+  }
+  freeaddrinfo (res);
+
+  /* libdali expects a blocking socket */
+  if ( fd >= 0 )
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+
+  return fd;
+}
+
+/* Swap in the handle for wantaddr, connection lock held */
+static void switchaddr ( void )
+{
+  while ( busy )
+    pthread_cond_wait (&conncond, &connlock);
+
+  if ( dlcp )
+  {
+    if ( dlcp->link != -1 )
+      dl_disconnect (dlcp);
+    dl_freedlcp (dlcp);
+    dlcp = NULL;
+  }
+
+  strcpy (curaddr, wantaddr);
+  backoff = initialbackoff;
+
+  if ( ! curaddr[0] )
+  {
+    ms_log (1, "DataLink output disabled\n");
+    setconnstate (DLCONN_DISABLED);
+  }
+  else if ( ! (dlcp = dl_newdlcp (curaddr, PACKAGE)) )
+  {
+    ms_log (2, "Cannot allocate DataLink descriptor for %s\n", curaddr);
+    setconnstate (DLCONN_DISABLED);
+  }
+  else
+  {
+    setconnstate (DLCONN_CONNECTING);
+  }
+}
+
+/* Drop the connection and connect again, connection lock held */
+static void restart ( void )
+{
+  while ( busy )
+    pthread_cond_wait (&conncond, &connlock);
+
+  if ( ! dlcp )
+    return;
+
+  if ( dlcp->link != -1 )
+  {
+    dl_disconnect (dlcp);
+    ms_log (1, "Disconnected from DataLink server %s on request\n", curaddr);
+  }
+  backoff = initialbackoff;
+  setconnstate (DLCONN_CONNECTING);
+}
+
+static void *dlconn_thread ( void *arg )
+{
+  struct epoll_event ev;
+  struct timeval tv;
+  char addr[285];
+  char errmsg[200];
+  uint64_t count;
+  int timeout;
+  int timeoutms;
+  int fd;
+
+  placement_enter (THREAD_DATALINK, "dlconn");
+
+  pthread_mutex_lock (&connlock);
+
+  while ( ! stopping )
+  {
+    if ( strcmp (wantaddr, curaddr) )
+    {
+      switchaddr ();
+      continue;
+    }
+
+    if ( reconnecting )
+    {
+      reconnecting = 0;
+      restart ();
+      continue;
+    }
+
+    if ( state == DLCONN_BACKOFF && monotime () >= nextattempt )
+      setconnstate (DLCONN_CONNECTING);
+
+    if ( state == DLCONN_CONNECTING )
+    {
+      strcpy (addr, curaddr);
+      timeout = connecttimeout;
+      stats.attempts++;
+      pthread_mutex_unlock (&connlock);
+
+      /* Writers leave the handle alone until the state is CONNECTED */
+      if ( (fd = tcpconnect (addr, timeout, errmsg, sizeof(errmsg))) >= 0 )
+      {
+        tv.tv_sec = dlcp->iotimeout;
+        tv.tv_usec = 0;
+        setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        dlcp->link = fd;
+
+        if ( dl_exchangeIDs (dlcp, 1) < 0 )
+        {
+          snprintf (errmsg, sizeof(errmsg), "DataLink ID exchange failed");
+          dl_disconnect (dlcp);
+          fd = -1;
+        }
+      }
+
+      pthread_mutex_lock (&connlock);
+
+      if ( fd >= 0 )
+      {
+        stats.connects++;
+        stats.maxpktsize = dlcp->maxpktsize;
+        backoff = initialbackoff;
+        setconnstate (DLCONN_CONNECTED);
+        ms_log (1, "Connected to ringserver at %s\n", addr);
+        startup_mark (STARTUP_DATALINK);
+      }
+      else if ( ! stopping )
+      {
+        stats.failures++;
+        retrylater ();
+        if ( state == DLCONN_FAILED )
+          ms_log (2, "Connection to DataLink server %s failed: %s, not retrying\n", addr, errmsg);
+        else
+          ms_log (1, "Connection to DataLink server %s failed: %s, retrying in %.1f seconds\n",
+                  addr, errmsg, stats.backoff);
+      }
+      continue;
+    }
+
+    /* Idle until woken, or until the next attempt is due */
+    timeoutms = ( state == DLCONN_BACKOFF ) ? (int) ((nextattempt - monotime ()) * 1000) + 1 : -1;
+    pthread_mutex_unlock (&connlock);
+
+    if ( epoll_wait (epfd, &ev, 1, timeoutms) > 0 )
+    {
+      if ( read (wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN )
+        ms_log (2, "Cannot read DataLink wakeup: %s\n", strerror (errno));
+    }
+
+    pthread_mutex_lock (&connlock);
+  }
+
+  pthread_mutex_unlock (&connlock);
+
+  return NULL;
+}
+
+/***************************************************************************
+ * dlconn_frame:
+ *
+ * Build the DataLink preheader and WRITE header of a record in header,
+ * which must hold DLCONN_HEADER_MAX bytes.
+ *
+ * Returns the length of the header.
+ ***************************************************************************/
+int dlconn_frame ( char *header, DLConnRecord *record )
+{
+  int len;
+
+  len = snprintf (header + 3, DLCONN_HEADER_MAX - 3, "WRITE %s %lld %lld N %d", record->streamid,
+                  (long long) record->starttime, (long long) record->endtime, record->reclen);
+  if ( len > DLCONN_HEADER_MAX - 4 )
+    len = DLCONN_HEADER_MAX - 4;
+
+  header[0] = 'D';
+  header[1] = 'L';
+  header[2] = (char) (uint8_t) len;
+
+  return len + 3;
+}
+
+/* Send an iovec array in full, continuing after short sends */
+static int sendall ( int fd, struct iovec *iov, int cnt )
+{
+  struct msghdr msg;
+  ssize_t n;
+
+  while ( cnt > 0 )
+  {
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+
+    if ( (n = sendmsg (fd, &msg, MSG_NOSIGNAL)) < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      return -1;
+    }
+
+    while ( cnt > 0 && (size_t) n >= iov->iov_len )
+    {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if ( cnt > 0 )
+    {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/* Send a batch on a connected handle, returns -1 if the connection failed
+ * or the number of records refused */
+static int sendbatch ( DLCP *conn, DLConnRecord *records, int count )
+{
+  char headers[DLCONN_BATCH][DLCONN_HEADER_MAX];
+  struct iovec iov[DLCONN_BATCH * 2];
+  DLConnRecord *r;
+  int refused = 0;
+  int cnt;
+  int i;
+
+  while ( count > 0 )
+  {
+    for ( cnt = 0, i = 0; i < count && i < DLCONN_BATCH; i++ )
+    {
+      r = &records[i];
+
+      /* The server would drop the connection, as dl_write() refuses it */
+      r->refused = ( conn->maxpktsize > 0 && r->reclen > conn->maxpktsize );
+      if ( r->refused )
+      {
+        ms_log (2, "Record of %s is %d bytes, DataLink server accepts %d, not sent\n",
+                r->streamid, r->reclen, conn->maxpktsize);
+        refused++;
+        continue;
+      }
+
+      iov[cnt].iov_base = headers[i];
+      iov[cnt].iov_len = dlconn_frame (headers[i], r);
+      iov[cnt + 1].iov_base = r->record;
+      iov[cnt + 1].iov_len = r->reclen;
+      cnt += 2;
+    }
+
+    if ( cnt && sendall (conn->link, iov, cnt) < 0 )
+    {
+      ms_log (2, "Cannot send to DataLink server: %s\n", strerror (errno));
+      return -1;
+    }
+
+    records += i;
+    count -= i;
+  }
+
+  return refused;
+}
+
+/***************************************************************************
+ * dlconn_writebatch:
+ *
+ * Write records to the DataLink server, in order, waiting up to
+ * waitseconds for a connection.  If the connection fails the batch is
+ * written again in full once it is back, within the same wait, so
+ * records before the failure may reach the server twice as they could
+ * with one write per record.  Writes are serialized.
+ *
+ * Records larger than the server accepts are flagged refused and not
+ * sent, the rest of the batch is.
+ *
+ * Returns 0 on success, DLCONN_EREFUSED if records were refused or one
+ * of the other DLCONN_E error codes.
+ ***************************************************************************/
+int dlconn_writebatch ( DLConnRecord *records, int count, int waitseconds )
+{
+  struct timespec deadline;
+  DLCP *conn;
+  uint64_t span;
+  int rv;
+
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += waitseconds;
+
+  pthread_mutex_lock (&connlock);
+
+  for (;;)
+  {
+    if ( aborted )
+    {
+      pthread_mutex_unlock (&connlock);
+      return DLCONN_EDOWN;
+    }
+
+    if ( busy )
+    {
+      pthread_cond_wait (&conncond, &connlock);
+      continue;
+    }
+
+    if ( state == DLCONN_DISABLED )
+    {
+      pthread_mutex_unlock (&connlock);
+      return DLCONN_ENOLINK;
+    }
+    if ( state == DLCONN_FAILED )
+    {
+      pthread_mutex_unlock (&connlock);
+      return DLCONN_EFAILED;
+    }
+
+    if ( state != DLCONN_CONNECTED )
+    {
+      if ( waitseconds <= 0 || stopping ||
+           pthread_cond_timedwait (&conncond, &connlock, &deadline) == ETIMEDOUT )
+      {
+        pthread_mutex_unlock (&connlock);
+        return DLCONN_EDOWN;
+      }
+      continue;
+    }
+
+    busy = 1;
+    conn = dlcp;
+    pthread_mutex_unlock (&connlock);
+
+    TRACE_BEGIN (span, dlwrite, count);
+    rv = sendbatch (conn, records, count);
+    TRACE_END (span, TRACE_DLWRITE, dlwrite, count);
+
+    /* Disconnected under the lock, dlconn_abort() may shut the socket down */
+    pthread_mutex_lock (&connlock);
+    if ( rv < 0 )
+      dl_disconnect (conn);
+    busy = 0;
+    pthread_cond_broadcast (&conncond);
+
+    if ( rv >= 0 )
+      break;
+
+    /* Lost, the first attempt to reconnect is jittered as well */
+    stats.disconnects++;
+    backoff = initialbackoff;
+    retrylater ();
+    ms_log (1, "Lost connection to DataLink server %s\n", curaddr);
+    wake ();
+  }
+
+  pthread_mutex_unlock (&connlock);
+
+  return ( rv > 0 ) ? DLCONN_EREFUSED : 0;
+}
+
+/***************************************************************************
+ * dlconn_write:
+ *
+ * Write one record, as dlconn_writebatch().
+ *
+ * Returns 0 on success or one of the DLCONN_E error codes.
+ ***************************************************************************/
+int dlconn_write ( char *record, int reclen, char *streamid,
+                   hptime_t starttime, hptime_t endtime, int waitseconds )
+{
+  DLConnRecord r;
+
+  r.record = record;
+  r.reclen = reclen;
+  r.streamid = streamid;
+  r.starttime = starttime;
+  r.endtime = endtime;
+  r.refused = 0;
+
+  return dlconn_writebatch (&r, 1, waitseconds);
+}
+
+/***************************************************************************
+ * dlconn_abort:
+ *
+ * Give up on the DataLink server at shutdown: a write in progress fails
+ * at once, even on a stalled connection, and later writes fail with
+ * DLCONN_EDOWN without waiting.
+ ***************************************************************************/
+void dlconn_abort ( void )
+{
+  pthread_mutex_lock (&connlock);
+  aborted = 1;
+  if ( busy && dlcp && dlcp->link != -1 )
+    shutdown (dlcp->link, SHUT_RDWR);
+  pthread_cond_broadcast (&conncond);
+  pthread_mutex_unlock (&connlock);
+}
+
+void dlconn_stats ( DLConnStats *out )
+{
+  pthread_mutex_lock (&connlock);
+  *out = stats;
+  out->state = state;
+  strcpy (out->addr, curaddr);
+  pthread_mutex_unlock (&connlock);
+}
+
+const char *dlconn_statename ( int s )
+{
+  switch ( s )
+  {
+    case DLCONN_DISABLED:   return "disabled";
+    case DLCONN_CONNECTING: return "connecting";
+    case DLCONN_CONNECTED:  return "connected";
+    case DLCONN_BACKOFF:    return "waiting to reconnect";
+    case DLCONN_FAILED:     return "failed";
+  }
+  return "unknown";
+}
+
+/***************************************************************************
+ * dlconn_stop:
+ *
+ * Stop the connection thread, waking any writer waiting for a connection,
+ * and disconnect.
+ ***************************************************************************/
+void dlconn_stop ( void )
+{
+  if ( ! running )
+    return;
+
+  pthread_mutex_lock (&connlock);
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast (&conncond);
+  pthread_mutex_unlock (&connlock);
+  wake ();
+  pthread_join (connthread, NULL);
+
+  pthread_mutex_lock (&connlock);
+  while ( busy )
+    pthread_cond_wait (&conncond, &connlock);
+  if ( dlcp )
+  {
+    if ( dlcp->link != -1 )
+      dl_disconnect (dlcp);
+    dl_freedlcp (dlcp);
+    dlcp = NULL;
+  }
+  setconnstate (DLCONN_DISABLED);
+  running = 0;
+  pthread_mutex_unlock (&connlock);
+
+  close (epfd);
+  close (wakefd);
+  epfd = wakefd = -1;
+}
@@ -0,0 +1,71 @@
+//
+//  dlconn.h
+//  q3302dali
+//
+//  DataLink connection management.  A thread of its own owns the DataLink
+//  connection handle and (re)connects with a non-blocking connect and an
+//  epoll event loop, waiting an exponentially growing, jittered time
+//  between attempts.  Writers only ever wait for a connection to become
+//  available, they never connect or sleep themselves.  A batch of records
+//  is framed as DataLink WRITE packets and sent with a single sendmsg().
+//
+
+#ifndef dlconn_h
+#define dlconn_h
+
+#include "q3302dali.h"
+
+/* Connection states */
+#define DLCONN_DISABLED   0        /* no DataLink server configured */
+#define DLCONN_CONNECTING 1
+#define DLCONN_CONNECTED  2
+#define DLCONN_BACKOFF    3        /* waiting before the next attempt */
+#define DLCONN_FAILED     4        /* gave up, reconnecting is disabled */
+
+/* dlconn_write() errors */
+#define DLCONN_ENOLINK -1          /* no DataLink server configured */
+#define DLCONN_EDOWN   -2          /* not connected within the wait */
+#define DLCONN_EFAILED -3          /* connection lost and not retried */
+#define DLCONN_EREFUSED -4         /* written but for records flagged refused */
+
+#define DLCONN_BATCH 64            /* records per sendmsg() */
+#define DLCONN_HEADER_MAX 258      /* preheader and longest WRITE header */
+
+/* A record to write, data start and end times as in the WRITE command */
+typedef struct dlconnrecord_s
+{
+  char *record;
+  int reclen;
+  char *streamid;
+  hptime_t starttime;
+  hptime_t endtime;
+  int refused;                     /* larger than the server accepts, not sent */
+} DLConnRecord;
+
+typedef struct dlconnstats_s
+{
+  int state;
+  char addr[285];
+  time_t since;                    /* time of the last state change */
+  double backoff;                  /* seconds before the next attempt */
+  int64_t attempts;
+  int64_t connects;
+  int64_t failures;                /* failed attempts */
+  int64_t disconnects;             /* established connections lost */
+  int maxpktsize;                  /* largest packet the server accepts, 0 if unknown */
+} DLConnStats;
+
+int dlconn_start ( const char *addr, int initialbackoff, int maxbackoff, int connecttimeout );
+void dlconn_setaddr ( const char *addr );
+int dlconn_reconnect ( void );
+void dlconn_setbackoff ( int initialbackoff, int maxbackoff, int connecttimeout );
+int dlconn_write ( char *record, int reclen, char *streamid,
+                   hptime_t starttime, hptime_t endtime, int waitseconds );
+int dlconn_writebatch ( DLConnRecord *records, int count, int waitseconds );
+int dlconn_frame ( char *header, DLConnRecord *record );
+void dlconn_abort ( void );
+void dlconn_stats ( DLConnStats *stats );
+const char *dlconn_statename ( int state );
+void dlconn_stop ( void );
+
+#endif /* dlconn_h */
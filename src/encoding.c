@@ -0,0 +1,157 @@
+//
+//  encoding.c
+//  q3302dali
+//
+//  Trial encoding of integer samples, see encoding.h.
+//
+//  The trial follows the greedy packing of the libmseed Steim encoders:
+//  each 32-bit word takes as many of the following differences as fit
+//  one of its layouts, 4x8, 2x16 or 1x32 bits for Steim1 and 7x4, 6x5,
+//  5x6, 4x8, 3x10, 2x15 or 1x30 for Steim2.  Every 64 byte frame holds a
+//  control word and 15 data words, the other header words per record are
+//  the same for both and left out.  Only the words are counted, nothing
+//  is written, so a trial is a single pass over the window.
+//
+
+#include <stdio.h>
+#include "encoding.h"
+
+/* Bits of a signed value, 33 for differences beyond 32 bits */
+static inline int signedbits ( int64_t value )
+{
+  int bits = 1;
+
+  if ( value < 0 )
+    value = ~value;
+  while ( value && bits < 33 )
+  {
+    value >>= 1;
+    bits++;
+  }
+
+  return bits;
+}
+
+/* Largest of the bit widths of the next count differences */
+static inline int maxbits ( const unsigned char *bits, int64_t count )
+{
+  int max = 0;
+  int64_t i;
+
+  for ( i = 0; i < count; i++ )
+    if ( bits[i] > max )
+      max = bits[i];
+
+  return max;
+}
+
+/* Data words used by Steim1 or Steim2 for the differences, -1 if not possible */
+static int64_t steimwords ( const unsigned char *bits, int64_t count, int steim )
+{
+  static const int steim1[][2] = { { 4, 8 }, { 2, 16 }, { 1, 32 } };
+  static const int steim2[][2] = { { 7, 4 }, { 6, 5 }, { 5, 6 }, { 4, 8 },
+                                   { 3, 10 }, { 2, 15 }, { 1, 30 } };
+  const int (*layouts)[2] = ( steim == 1 ) ? steim1 : steim2;
+  int numlayouts = ( steim == 1 ) ? 3 : 7;
+  int64_t words = 0;
+  int64_t i = 0;
+  int l;
+
+  while ( i < count )
+  {
+    for ( l = 0; l < numlayouts; l++ )
+    {
+      int64_t n = layouts[l][0];
+
+      if ( n <= count - i && maxbits (bits + i, n) <= layouts[l][1] )
+        break;
+    }
+    if ( l == numlayouts )
+      return -1;
+
+    i += layouts[l][0];
+    words++;
+  }
+
+  return words;
+}
+
+/***************************************************************************
+ * encoding_trial:
+ *
+ * Estimate the data bytes per sample the encoding would use for the
+ * samples, DE_INT32, DE_STEIM1 or DE_STEIM2.
+ *
+ * Returns bytes per sample, or -1.0 if the samples cannot be encoded so.
+ ***************************************************************************/
+double encoding_trial ( const int32 *samples, int64_t numsamples, int encoding )
+{
+  unsigned char *bits;
+  int64_t words;
+  int64_t i;
+
+  if ( encoding == DE_INT32 || numsamples <= 1 )
+    return 4.0;
+
+  if ( ! (bits = (unsigned char *) malloc (numsamples)) )
+    return -1.0;
+
+  /* The first difference is against the previous record, count it as 0 */
+  bits[0] = 1;
+  for ( i = 1; i < numsamples; i++ )
+    bits[i] = signedbits ((int64_t) samples[i] - samples[i - 1]);
+
+  words = steimwords (bits, numsamples, ( encoding == DE_STEIM1 ) ? 1 : 2);
+  free (bits);
+
+  if ( words < 0 )
+    return -1.0;
+
+  return 4.0 * words * 16.0 / 15.0 / numsamples;
+}
+
+/***************************************************************************
+ * encoding_choose:
+ *
+ * Pick the most compact of Steim1, Steim2 and INT32 for the samples.
+ * The current encoding is kept unless another one saves at least 2%, so
+ * streams do not switch back and forth on noise.
+ *
+ * Returns the encoding.
+ ***************************************************************************/
+int encoding_choose ( const int32 *samples, int64_t numsamples, int current )
+{
+  static const int candidates[] = { DE_STEIM2, DE_STEIM1, DE_INT32 };
+  double size[3];
+  double currentsize = -1.0;
+  int best = -1;
+  int c;
+
+  for ( c = 0; c < 3; c++ )
+  {
+    size[c] = encoding_trial (samples, numsamples, candidates[c]);
+    if ( candidates[c] == current )
+      currentsize = size[c];
+    if ( size[c] >= 0.0 && ( best < 0 || size[c] < size[best] ) )
+      best = c;
+  }
+
+  if ( currentsize >= 0.0 && size[best] > currentsize * 0.98 )
+    return current;
+
+  return candidates[best];
+}
+
+const char *encoding_name ( int encoding )
+{
+  switch ( encoding )
+  {
+    case DE_INT16:   return "int16";
+    case DE_INT32:   return "int32";
+    case DE_FLOAT32: return "float32";
+    case DE_FLOAT64: return "float64";
+    case DE_STEIM1:  return "steim1";
+    case DE_STEIM2:  return "steim2";
+  }
+  return "other";
+}
@@ -0,0 +1,22 @@
+//
+//  encoding.h
+//  q3302dali
+//
+//  Choice of the encoding for 32-bit integer data by trial.  A window of
+//  samples is run through the Steim1 and Steim2 word packing, counting
+//  the words each would use, and compared with plain INT32, so each
+//  stream can be packed with the encoding that suits its signal.
+//
+
+#ifndef encoding_h
+#define encoding_h
+
+#include "q3302dali.h"
+
+#define ENCODING_MIN_TRIAL 64      /* fewer samples are not a useful trial */
+
+double encoding_trial ( const int32 *samples, int64_t numsamples, int encoding );
+int encoding_choose ( const int32 *samples, int64_t numsamples, int current );
+const char *encoding_name ( int encoding );
+
+#endif /* encoding_h */
@@ -0,0 +1,429 @@
+//
+//  hotbench.c
+//  q3302dali
+//
+//  Benchmarks of the packing and sending hot path.  Synthetic channels at
+//  a mix of sample rates are fed through each stage on its own, the
+//  lib330 callbacks, processMseed(), packtraces() and sendrecord(), and
+//  through the whole one-second path with 0 to N pack workers.  There is
+//  no DataLink connection, so records end in a null sink.
+//
+//  Each run prints one line of key=value pairs for regression tracking:
+//  packets or records fed, records packed, packets/s, records/s,
+//  ns/packet and heap allocations/packet.  Allocations are counted by
+//  wrapping malloc, calloc and realloc at link time.
+//
+//  Usage: hotbench [channels] [seconds] [maxthreads] [rates]
+//         rates is a comma separated sample rate mix, default 1,40,100,200
+//
+
+#include <sys/time.h>
+
+/* Build against the real packing code, including its static functions */
+#define main q3302dali_main
+#include "q3302dali.c"
+#undef main
+
+#define BENCH_RECLEN 512
+#define BENCH_MAX_RATES 16
+
+/* Heap allocations, counted by the --wrap linker options of the bench target */
+static int64_t allocations = 0;
+
+void *__real_malloc ( size_t size );
+void *__real_calloc ( size_t nmemb, size_t size );
+void *__real_realloc ( void *ptr, size_t size );
+
+void *__wrap_malloc ( size_t size )
+{
+  __atomic_add_fetch (&allocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc (size);
+}
+
+void *__wrap_calloc ( size_t nmemb, size_t size )
+{
+  __atomic_add_fetch (&allocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc (nmemb, size);
+}
+
+void *__wrap_realloc ( void *ptr, size_t size )
+{
+  __atomic_add_fetch (&allocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc (ptr, size);
+}
+
+/* Packed records kept for the sendrecord() and miniseed benchmarks */
+typedef struct benchrecords_s
+{
+  char *data;
+  int count;
+  int cap;
+} BenchRecords;
+
+typedef struct benchrun_s
+{
+  const char *name;
+  int threads;
+  int64_t packets;
+  int64_t records;
+  int64_t allocs;
+  double start;
+} BenchRun;
+
+static int rates[BENCH_MAX_RATES];
+static int numrates = 0;
+static char ratemix[100];
+static double timebase = 600000000.0;  /* seconds since 2000, advanced by every run */
+
+static double benchnow ( void )
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void runbegin ( BenchRun *run, const char *name, int threads )
+{
+  memset (run, 0, sizeof(BenchRun));
+  run->name = name;
+  run->threads = threads;
+  run->allocs = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+  run->start = benchnow ();
+}
+
+static void runend ( BenchRun *run, int nchannels )
+{
+  double elapsed = benchnow () - run->start;
+  int64_t allocs = __atomic_load_n (&allocations, __ATOMIC_RELAXED) - run->allocs;
+
+  if ( elapsed <= 0.0 )
+    elapsed = 1e-9;
+
+  printf ("bench=%s rates=%s channels=%d threads=%d packets=%lld records=%lld seconds=%.3f "
+          "packets_per_sec=%.0f records_per_sec=%.0f ns_per_packet=%.0f allocs_per_packet=%.3f\n",
+          run->name, ratemix, nchannels, run->threads, (long long int) run->packets,
+          (long long int) run->records, elapsed, run->packets / elapsed, run->records / elapsed,
+          ( run->packets ) ? elapsed * 1e9 / run->packets : 0.0,
+          ( run->packets ) ? (double) allocs / run->packets : 0.0);
+  fflush (stdout);
+}
+
+/* One-second packets of the channel mix, a random walk per channel */
+static tonesec_call *makecalls ( int nchannels )
+{
+  tonesec_call *calls;
+  int i;
+
+  if ( ! (calls = (tonesec_call *) calloc (nchannels, sizeof(tonesec_call))) )
+    exit (1);
+
+  for ( i = 0; i < nchannels; i++ )
+  {
+    strcpy (calls[i].station_name, "XX-BENCH");
+    strcpy (calls[i].location, "00");
+    sprintf (calls[i].channel, "%c%c%c", 'A' + (i / 260) % 26, 'A' + (i / 10) % 26, '0' + i % 10);
+    calls[i].rate = rates[i % numrates];
+  }
+
+  return calls;
+}
+
+/* Fill one second of a random walk, compresses much like real seismic data */
+static void fillsamples ( tonesec_call *call, unsigned int *seed )
+{
+  int32 last = ( call->rate > 1 ) ? call->samples[call->rate - 1] : call->samples[0];
+  int i;
+
+  for ( i = 0; i < call->rate; i++ )
+  {
+    last += (int32) (rand_r (seed) % 2001) - 1000;
+    call->samples[i] = last;
+  }
+}
+
+/* Pack contexts for nthreads workers, 0 for inline packing */
+static void setuppacking ( int nthreads )
+{
+  if ( initpacking (nthreads) < 0 )
+    exit (1);
+}
+
+static void teardownpacking ( void )
+{
+  int i;
+
+  packpool_stop ();
+  for ( i = 0; i < numpackctx; i++ )
+  {
+    mst_freegroup (&packctx[i].mstg);
+    msr_free (&packctx[i].mstemplate);
+    msr_free (&packctx[i].sendmsr);
+  }
+}
+
+/* The whole path from the lib330 one-second callback, with nthreads workers */
+static void benchonesec ( int nthreads, int nchannels, int seconds )
+{
+  tonesec_call *calls = makecalls (nchannels);
+  unsigned int seed = 12345;
+  BenchRun run;
+  int i, s;
+
+  setuppacking (nthreads);
+
+  runbegin (&run, "onesec", nthreads);
+  for ( s = 0; s < seconds; s++ )
+  {
+    for ( i = 0; i < nchannels; i++ )
+    {
+      calls[i].timestamp = timebase + s;
+      fillsamples (&calls[i], &seed);
+      lib330Interface_1SecCallback (&calls[i]);
+      run.packets++;
+    }
+  }
+  packpool_drain ();
+  run.records = packctx[0].reccount;
+  for ( i = 1; i < numpackctx; i++ )
+    run.records += packctx[i].reccount;
+  runend (&run, nchannels);
+
+  teardownpacking ();
+  timebase += seconds + 1000;
+  free (calls);
+}
+
+/* Build the record for a packet as handleonesec() does, without the callback */
+static void fillrecord ( MSRecord *msr, tonesec_call *call, double timestamp )
+{
+  strcpy (msr->network, "XX");
+  strcpy (msr->station, "BENCH");
+  strcpy (msr->location, call->location);
+  strcpy (msr->channel, call->channel);
+  msr->starttime = MS_EPOCH2HPTIME (janFirst2000 + timestamp);
+  msr->samprate = call->rate;
+  msr->numsamples = msr->samplecnt = call->rate;
+  msr->datasamples = call->samples;
+  msr->sampletype = 'i';
+}
+
+/* processMseed() inline: continuity, trace buffer and packing */
+static void benchprocess ( int nchannels, int seconds )
+{
+  tonesec_call *calls = makecalls (nchannels);
+  MSRecord *msr = msr_init (NULL);
+  unsigned int seed = 12345;
+  BenchRun run;
+  int i, s;
+
+  setuppacking (0);
+
+  runbegin (&run, "processMseed", 0);
+  for ( s = 0; s < seconds; s++ )
+  {
+    for ( i = 0; i < nchannels; i++ )
+    {
+      fillsamples (&calls[i], &seed);
+      fillrecord (msr, &calls[i], timebase + s);
+      processMseed (&packctx[0], msr, -1);
+      run.packets++;
+    }
+  }
+  run.records = packctx[0].reccount;
+  runend (&run, nchannels);
+
+  teardownpacking ();
+  timebase += seconds + 1000;
+  msr->datasamples = NULL;
+  msr_free (&msr);
+  free (calls);
+}
+
+/* packtraces() alone, the trace buffers are filled outside the timing */
+static void benchpack ( int nchannels, int seconds )
+{
+  tonesec_call *calls = makecalls (nchannels);
+  MSRecord *msr = msr_init (NULL);
+  unsigned int seed = 12345;
+  TraceStats *stats;
+  MSTrace *mst;
+  BenchRun run;
+  double packtime = 0.0;
+  double t;
+  int64_t allocs = 0;
+  int64_t a;
+  int i, s;
+
+  setuppacking (0);
+
+  runbegin (&run, "packtraces", 0);
+  for ( s = 0; s < seconds; s++ )
+  {
+    for ( i = 0; i < nchannels; i++ )
+    {
+      fillsamples (&calls[i], &seed);
+      fillrecord (msr, &calls[i], timebase + s);
+      if ( ! (mst = mst_addmsrtogroup (packctx[0].mstg, msr, 1, -1.0, -1.0)) )
+        exit (1);
+      if ( ! mst->prvtptr )
+      {
+        if ( ! (stats = (TraceStats *) calloc (1, sizeof(TraceStats))) )
+          exit (1);
+        stats->earliest = stats->latest = stats->update = stats->xmit = HPTERROR;
+        stats->stream = streams_get (msr->network, msr->station, msr->location, msr->channel);
+        mst->prvtptr = stats;
+      }
+
+      a = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+      t = benchnow ();
+      packtraces (&packctx[0], mst, 0, HPTERROR);
+      packtime += benchnow () - t;
+      allocs += __atomic_load_n (&allocations, __ATOMIC_RELAXED) - a;
+      run.packets++;
+    }
+  }
+  run.records = packctx[0].reccount;
+
+  /* Report the time and allocations inside packtraces() only */
+  run.start = benchnow () - packtime;
+  run.allocs = __atomic_load_n (&allocations, __ATOMIC_RELAXED) - allocs;
+  runend (&run, nchannels);
+
+  teardownpacking ();
+  timebase += seconds + 1000;
+  msr->datasamples = NULL;
+  msr_free (&msr);
+  free (calls);
+}
+
+static void keeprecord ( char *record, int reclen, void *handlerdata )
+{
+  BenchRecords *recs = (BenchRecords *) handlerdata;
+
+  if ( recs->count == recs->cap )
+  {
+    recs->cap = ( recs->cap ) ? recs->cap * 2 : 1024;
+    if ( ! (recs->data = (char *) realloc (recs->data, (size_t) recs->cap * BENCH_RECLEN)) )
+      exit (1);
+  }
+  memcpy (recs->data + (size_t) recs->count * BENCH_RECLEN, record, reclen);
+  recs->count++;
+}
+
+/* Pack the channel mix into records up front, outside any timing */
+static void makerecords ( BenchRecords *recs, int nchannels, int seconds )
+{
+  tonesec_call *calls = makecalls (nchannels);
+  MSRecord *msr = msr_init (NULL);
+  MSTraceGroup *mstg = mst_initgroup (NULL);
+  unsigned int seed = 12345;
+  MSTrace *mst;
+  int i, s;
+
+  memset (recs, 0, sizeof(BenchRecords));
+  for ( s = 0; s < seconds; s++ )
+  {
+    for ( i = 0; i < nchannels; i++ )
+    {
+      fillsamples (&calls[i], &seed);
+      fillrecord (msr, &calls[i], timebase + s);
+      mst_addmsrtogroup (mstg, msr, 1, -1.0, -1.0);
+    }
+  }
+  for ( mst = mstg->traces; mst; mst = mst->next )
+    mst_pack (mst, keeprecord, recs, BENCH_RECLEN, DE_STEIM2, 1, NULL, 1, 0, NULL);
+
+  timebase += seconds + 1000;
+  mst_freegroup (&mstg);
+  msr->datasamples = NULL;
+  msr_free (&msr);
+  free (calls);
+}
+
+/* sendrecord() into the null sink: header parsing, stats and coverage */
+static void benchsend ( int nchannels, int seconds )
+{
+  BenchRecords recs;
+  BenchRun run;
+  int i;
+
+  makerecords (&recs, nchannels, seconds);
+
+  runbegin (&run, "sendrecord", 0);
+  for ( i = 0; i < recs.count; i++ )
+  {
+    sendrecord (recs.data + (size_t) i * BENCH_RECLEN, BENCH_RECLEN, NULL);
+    run.packets++;
+    run.records++;
+  }
+  runend (&run, nchannels);
+
+  free (recs.data);
+}
+
+/* The lib330 miniseed callback: rules, unpacking, duplicate check and send */
+static void benchmini ( int nchannels, int seconds )
+{
+  tminiseed_call call;
+  BenchRecords recs;
+  BenchRun run;
+  int i;
+
+  makerecords (&recs, nchannels, seconds);
+
+  memset (&call, 0, sizeof(call));
+  strcpy (call.station_name, "XX-BENCH");
+  call.data_size = BENCH_RECLEN;
+
+  runbegin (&run, "miniCallback", 0);
+  for ( i = 0; i < recs.count; i++ )
+  {
+    call.data_address = recs.data + (size_t) i * BENCH_RECLEN;
+    lib330Interface_miniCallback (&call);
+    run.packets++;
+    run.records++;
+  }
+  runend (&run, nchannels);
+
+  free (recs.data);
+}
+
+int main ( int argc, char **argv )
+{
+  int nchannels = ( argc > 1 ) ? atoi (argv[1]) : 60;
+  int seconds = ( argc > 2 ) ? atoi (argv[2]) : 300;
+  int maxthreads = ( argc > 3 ) ? atoi (argv[3]) : 4;
+  char mix[100];
+  char *tok;
+  int t;
+
+  ms_loginit (&print_timelog, NULL, &print_timelog, NULL);
+  setupDefaultConfiguration ();
+  runconfig_publish (runconfig_build (&gConfig));
+  verbose = 0;
+
+  strncpy (ratemix, ( argc > 4 ) ? argv[4] : "1,40,100,200", sizeof(ratemix) - 1);
+  strcpy (mix, ratemix);
+  for ( tok = strtok (mix, ","); tok && numrates < BENCH_MAX_RATES; tok = strtok (NULL, ",") )
+    rates[numrates++] = atoi (tok);
+
+  for ( t = 0; t < numrates; t++ )
+    if ( rates[t] <= 0 || rates[t] > MAX_RATE )
+      numrates = 0;
+
+  if ( nchannels <= 0 || seconds <= 0 || maxthreads < 0 || numrates == 0 )
+  {
+    fprintf (stderr, "Usage: hotbench [channels] [seconds] [maxthreads] [rates]\n");
+    return 1;
+  }
+
+  benchmini (nchannels, seconds);
+  benchsend (nchannels, seconds);
+  benchpack (nchannels, seconds);
+  benchprocess (nchannels, seconds);
+  for ( t = 0; t <= maxthreads; t++ )
+    benchonesec (t, nchannels, seconds);
+
+  return 0;
+}
@@ -0,0 +1,77 @@
+//
+//  memacct.c
+//  q3302dali
+//
+//  Memory accounting, see memacct.h.
+//
+
+#include <stdio.h>
+#include "memacct.h"
+
+static int64_t current[MEM_POOLS];
+static int64_t peak[MEM_POOLS];
+static int64_t total = 0;
+static int64_t peaktotal = 0;
+static int64_t flushes = 0;
+
+/* Raise a peak to value if it is higher */
+static void raisepeak ( int64_t *peakp, int64_t value )
+{
+  int64_t old = __atomic_load_n (peakp, __ATOMIC_RELAXED);
+
+  while ( value > old &&
+          ! __atomic_compare_exchange_n (peakp, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+    ;
+}
+
+/* Count bytes taken (positive) or given back (negative) in a pool */
+void memacct_add ( int pool, int64_t delta )
+{
+  int64_t now = __atomic_add_fetch (&current[pool], delta, __ATOMIC_RELAXED);
+  int64_t all = __atomic_add_fetch (&total, delta, __ATOMIC_RELAXED);
+
+  if ( delta > 0 )
+  {
+    raisepeak (&peak[pool], now);
+    raisepeak (&peaktotal, all);
+  }
+}
+
+int64_t memacct_total ( void )
+{
+  return __atomic_load_n (&total, __ATOMIC_RELAXED);
+}
+
+int64_t memacct_current ( int pool )
+{
+  return __atomic_load_n (&current[pool], __ATOMIC_RELAXED);
+}
+
+void memacct_flushed ( void )
+{
+  __atomic_add_fetch (&flushes, 1, __ATOMIC_RELAXED);
+}
+
+void memacct_stats ( MemStats *stats )
+{
+  int i;
+
+  for ( i = 0; i < MEM_POOLS; i++ )
+  {
+    stats->current[i] = __atomic_load_n (&current[i], __ATOMIC_RELAXED);
+    stats->peak[i] = __atomic_load_n (&peak[i], __ATOMIC_RELAXED);
+  }
+  stats->total = __atomic_load_n (&total, __ATOMIC_RELAXED);
+  stats->peaktotal = __atomic_load_n (&peaktotal, __ATOMIC_RELAXED);
+  stats->flushes = __atomic_load_n (&flushes, __ATOMIC_RELAXED);
+}
+
+const char *memacct_poolname ( int pool )
+{
+  switch ( pool )
+  {
+    case MEM_TRACES: return "trace buffers";
+    case MEM_QUEUE:  return "DataLink queues";
+  }
+  return "unknown";
+}
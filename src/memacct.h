@@ -0,0 +1,37 @@
+//
+//  memacct.h
+//  q3302dali
+//
+//  Accounting of the memory held by sample data on its way out: samples
+//  waiting in the trace buffers and records waiting in the DataLink
+//  queues.  The totals are kept with atomic adds from every thread so
+//  the limits in MemoryLimit can be checked on the data path, and the
+//  current and peak use are shown in the status output.
+//
+
+#ifndef memacct_h
+#define memacct_h
+
+#include "q3302dali.h"
+
+#define MEM_TRACES 0               /* samples in the trace buffers */
+#define MEM_QUEUE  1               /* records in the DataLink queues */
+#define MEM_POOLS  2
+
+typedef struct memstats_s
+{
+  int64_t current[MEM_POOLS];      /* bytes */
+  int64_t peak[MEM_POOLS];
+  int64_t total;                   /* of all pools */
+  int64_t peaktotal;
+  int64_t flushes;                 /* early flushes to get under a limit */
+} MemStats;
+
+void memacct_add ( int pool, int64_t delta );
+int64_t memacct_total ( void );
+int64_t memacct_current ( int pool );
+void memacct_flushed ( void );
+void memacct_stats ( MemStats *stats );
+const char *memacct_poolname ( int pool );
+
+#endif /* memacct_h */
@@ -0,0 +1,211 @@
+//
+//  outbench.c
+//  q3302dali
+//
+//  Benchmarks of the output paths.  The archive writes the same records
+//  with ArchiveEngine writev and uring, timed from the first record
+//  queued until every day file is written and closed.  DataLink output
+//  is framed as the server receives it and sent over a Unix socket pair
+//  to a thread that reads it all, once as libdali sends, two sends per
+//  record, and once in batches of DLCONN_BATCH records per sendmsg().
+//
+//  Each run prints one line of key=value pairs for regression tracking:
+//  records, seconds, records/s, ns/record and, for DataLink, system
+//  calls/record.
+//
+//  Usage: outbench [channels] [records] [directory]
+//         records are 512 bytes, spread over the channels, written to
+//         day files under directory, /tmp by default
+//
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include "archive.h"
+#include "dlconn.h"
+
+#define BENCH_RECLEN 512
+
+static double benchnow ( void )
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void runend ( const char *name, int nchannels, int64_t records, int64_t syscalls, double start )
+{
+  double elapsed = benchnow () - start;
+
+  if ( elapsed <= 0.0 )
+    elapsed = 1e-9;
+
+  printf ("bench=%s channels=%d records=%lld seconds=%.3f records_per_sec=%.0f ns_per_record=%.0f",
+          name, nchannels, (long long int) records, elapsed, records / elapsed,
+          ( records ) ? elapsed * 1e9 / records : 0.0);
+  if ( syscalls >= 0 && records )
+    printf (" syscalls_per_record=%.3f", (double) syscalls / records);
+  printf ("\n");
+  fflush (stdout);
+}
+
+/* Records of a channel follow each other in time, one per second */
+static void fillheader ( MSRecord *msr, int channel, int index, int nchannels )
+{
+  strcpy (msr->network, "XX");
+  snprintf (msr->station, sizeof(msr->station), "S%03d", channel / 3 % 1000);
+  strcpy (msr->location, "00");
+  snprintf (msr->channel, sizeof(msr->channel), "HH%c", "ZNE"[channel % 3]);
+  msr->starttime = (hptime_t) (1600000000.0 + index / nchannels) * HPTMODULUS;
+}
+
+static void bencharchive ( const char *name, int useuring, const char *directory,
+                           int nchannels, int nrecords )
+{
+  char root[512];
+  char command[600];
+  char record[BENCH_RECLEN];
+  MSRecord msr;
+  double start;
+  int buffersize;
+  int i;
+
+  snprintf (root, sizeof(root), "%s/outbench.%d", directory, (int) getpid ());
+  memset (&msr, 0, sizeof(msr));
+  memset (record, 'x', sizeof(record));
+
+  /* Large enough that no record is dropped */
+  buffersize = (int) ((int64_t) nrecords * ( BENCH_RECLEN + 64 ) / 1024) + 1024;
+
+  start = benchnow ();
+  if ( archive_start (root, 100, 0, nchannels, buffersize, useuring) < 0 )
+    return;
+
+  for ( i = 0; i < nrecords; i++ )
+  {
+    fillheader (&msr, i % nchannels, i, nchannels);
+    archive_write (record, BENCH_RECLEN, &msr);
+  }
+  archive_stop ();
+
+  /* System calls are made on the archive thread and not counted */
+  runend (name, nchannels, nrecords, -1, start);
+
+  snprintf (command, sizeof(command), "rm -rf %s", root);
+  if ( system (command) != 0 )
+    fprintf (stderr, "Cannot remove %s\n", root);
+}
+
+/* Reads everything sent until the socket is closed */
+static void *drain ( void *arg )
+{
+  char buffer[65536];
+  int fd = *(int *) arg;
+
+  while ( read (fd, buffer, sizeof(buffer)) > 0 )
+    ;
+
+  return NULL;
+}
+
+static void benchdatalink ( const char *name, int batch, int nchannels, int nrecords )
+{
+  char headers[DLCONN_BATCH][DLCONN_HEADER_MAX];
+  struct iovec iov[DLCONN_BATCH * 2];
+  DLConnRecord records[DLCONN_BATCH];
+  char streamids[DLCONN_BATCH][50];
+  char record[BENCH_RECLEN];
+  struct msghdr msg;
+  pthread_t reader;
+  MSRecord msr;
+  int64_t syscalls = 0;
+  double start;
+  int fds[2];
+  int count;
+  int len;
+  int i, j;
+
+  if ( socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0 )
+  {
+    fprintf (stderr, "Cannot create socket pair: %s\n", strerror (errno));
+    return;
+  }
+  pthread_create (&reader, NULL, drain, &fds[1]);
+
+  memset (&msr, 0, sizeof(msr));
+  memset (record, 'x', sizeof(record));
+
+  start = benchnow ();
+  for ( i = 0; i < nrecords; i += count )
+  {
+    count = ( batch && nrecords - i > DLCONN_BATCH ) ? DLCONN_BATCH : ( batch ) ? nrecords - i : 1;
+
+    for ( j = 0; j < count; j++ )
+    {
+      fillheader (&msr, ( i + j ) % nchannels, i + j, nchannels);
+      snprintf (streamids[j], sizeof(streamids[j]), "%s_%s_%s_%s/MSEED",
+                msr.network, msr.station, msr.location, msr.channel);
+      records[j].record = record;
+      records[j].reclen = BENCH_RECLEN;
+      records[j].streamid = streamids[j];
+      records[j].starttime = msr.starttime;
+      records[j].endtime = msr.starttime + HPTMODULUS;
+
+      len = dlconn_frame (headers[j], &records[j]);
+      iov[j * 2].iov_base = headers[j];
+      iov[j * 2].iov_len = len;
+      iov[j * 2 + 1].iov_base = record;
+      iov[j * 2 + 1].iov_len = BENCH_RECLEN;
+    }
+
+    if ( batch )
+    {
+      memset (&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count * 2;
+      if ( sendmsg (fds[0], &msg, 0) < 0 )
+        break;
+      syscalls++;
+    }
+    else
+    {
+      if ( send (fds[0], iov[0].iov_base, iov[0].iov_len, 0) < 0 ||
+           send (fds[0], record, BENCH_RECLEN, 0) < 0 )
+        break;
+      syscalls += 2;
+    }
+  }
+  shutdown (fds[0], SHUT_WR);
+  pthread_join (reader, NULL);
+  runend (name, nchannels, i, syscalls, start);
+
+  close (fds[0]);
+  close (fds[1]);
+}
+
+int main ( int argc, char **argv )
+{
+  int nchannels = ( argc > 1 ) ? atoi (argv[1]) : 300;
+  int nrecords = ( argc > 2 ) ? atoi (argv[2]) : 200000;
+  const char *directory = ( argc > 3 ) ? argv[3] : "/tmp";
+
+  if ( nchannels <= 0 || nrecords <= 0 )
+  {
+    fprintf (stderr, "Usage: outbench [channels] [records] [directory]\n");
+    return 1;
+  }
+
+  ms_loginit (NULL, NULL, NULL, NULL);
+
+  benchdatalink ("datalink_single", 0, nchannels, nrecords);
+  benchdatalink ("datalink_batch", 1, nchannels, nrecords);
+  bencharchive ("archive_writev", 0, directory, nchannels, nrecords);
+  bencharchive ("archive_uring", 1, directory, nchannels, nrecords);
+
+  return 0;
+}
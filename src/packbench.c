@@ -0,0 +1,121 @@
+//
+//  packbench.c
+//  q3302dali
+//
+//  Packing throughput benchmark.  Feeds synthetic one-second packets through
+//  lib330Interface_1SecCallback() into the pack workers, with no DataLink
+//  connection so records are packed and counted but not sent, and reports
+//  how throughput scales from inline packing to N worker threads.
+//
+//  Usage: packbench [maxthreads] [channels] [rate] [seconds]
+//
+
+#include <sys/time.h>
+
+/* Build against the real packing code, including its static functions */
+#define main q3302dali_main
+#include "q3302dali.c"
+#undef main
+
+static double benchnow ( void )
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Fill one second of a random walk, compresses much like real seismic data */
+static void fillsamples ( tonesec_call *call, int32 *last, unsigned int *seed )
+{
+  int i;
+
+  for ( i = 0; i < call->rate; i++ )
+  {
+    *last += (int32) (rand_r (seed) % 2001) - 1000;
+    call->samples[i] = *last;
+  }
+}
+
+/* Run one pass with nthreads workers, 0 for inline packing */
+static void benchpass ( int nthreads, int nchannels, int rate, int seconds )
+{
+  tonesec_call *calls;
+  int32 *last;
+  unsigned int seed = 12345;
+  int64_t packets = 0;
+  int64_t records = 0;
+  double start, elapsed;
+  int i, s;
+
+  calls = (tonesec_call *) calloc (nchannels, sizeof(tonesec_call));
+  last = (int32 *) calloc (nchannels, sizeof(int32));
+
+  for ( i = 0; i < nchannels; i++ )
+  {
+    strcpy (calls[i].station_name, "XX-BENCH");
+    strcpy (calls[i].location, "00");
+    sprintf (calls[i].channel, "%c%c%c", 'A' + (i / 260) % 26, 'A' + (i / 10) % 26, '0' + i % 10);
+    calls[i].rate = rate;
+  }
+
+  if ( initpacking (nthreads) < 0 )
+    exit (1);
+
+  /* Every pass has its own times, or duplicate suppression would drop it */
+  start = benchnow ();
+  for ( s = 0; s < seconds; s++ )
+  {
+    for ( i = 0; i < nchannels; i++ )
+    {
+      calls[i].timestamp = 600000000.0 + nthreads * (seconds + 1000.0) + s;
+      fillsamples (&calls[i], &last[i], &seed);
+      lib330Interface_1SecCallback (&calls[i]);
+      packets++;
+    }
+  }
+  packpool_drain ();
+  elapsed = benchnow () - start;
+
+  packpool_stop ();
+  for ( i = 0; i < numpackctx; i++ )
+  {
+    records += packctx[i].reccount;
+    mst_freegroup (&packctx[i].mstg);
+    msr_free (&packctx[i].mstemplate);
+    msr_free (&packctx[i].sendmsr);
+  }
+
+  printf ("threads=%d channels=%d rate=%d packets=%lld records=%lld seconds=%.3f packets_per_sec=%.0f stalls=%lld\n",
+          nthreads, nchannels, rate, (long long int) packets, (long long int) records,
+          elapsed, packets / elapsed, (long long int) packpool_stalls ());
+
+  free (calls);
+  free (last);
+}
+
+int main ( int argc, char **argv )
+{
+  int maxthreads = ( argc > 1 ) ? atoi (argv[1]) : 4;
+  int nchannels = ( argc > 2 ) ? atoi (argv[2]) : 60;
+  int rate = ( argc > 3 ) ? atoi (argv[3]) : 100;
+  int seconds = ( argc > 4 ) ? atoi (argv[4]) : 600;
+  int t;
+
+  ms_loginit (&print_timelog, NULL, &print_timelog, NULL);
+  setupDefaultConfiguration ();
+  runconfig_publish (runconfig_build (&gConfig));
+  verbose = 0;
+
+  if ( rate <= 0 || rate > MAX_RATE || nchannels <= 0 || seconds <= 0 )
+  {
+    fprintf (stderr, "Usage: packbench [maxthreads] [channels] [rate] [seconds]\n");
+    return 1;
+  }
+
+  benchpass (0, nchannels, rate, seconds);
+  for ( t = 1; t <= maxthreads; t++ )
+    benchpass (t, nchannels, rate, seconds);
+
+  return 0;
+}
@@ -0,0 +1,309 @@
+//
+//  packpool.c
+//  q3302dali
+//
+//  Pool of packing worker threads, see packpool.h.
+//
+//  The lib330 station thread is the only producer, so each worker queue is a
+//  plain ring with a producer owned head and a consumer owned tail; no locks
+//  are taken on the data path.  A counting semaphore per worker is used only
+//  to park idle workers.
+//
+
+#include <stdio.h>
+#include <semaphore.h>
+#include "packpool.h"
+#include "placement.h"
+
+typedef struct packworker_s
+{
+  uint64_t head;                   /* next slot to fill, written by producer */
+  char pad1[56];
+  uint64_t tail;                   /* next slot to drain, written by worker */
+  char pad2[56];
+  PackItem *slots;
+  sem_t ready;
+  pthread_t thread;
+  int index;
+} PackWorker;
+
+static PackWorker *workers = NULL;
+static int nworkers = 0;
+static int stopping = 0;
+static int64_t stalls = 0;         /* submits that found the queue full */
+static packpool_handler handler = NULL;
+
+/***************************************************************************
+ * streamhash:
+ *
+ * FNV-1a hash of the stream identifiers, used to pick a worker.
+ ***************************************************************************/
+static uint32_t streamhash ( const char *net, const char *sta,
+                             const char *loc, const char *chan )
+{
+  const char *parts[4];
+  uint32_t hash = 2166136261u;
+  int i;
+
+  parts[0] = net;
+  parts[1] = sta;
+  parts[2] = loc;
+  parts[3] = chan;
+
+  for ( i = 0; i < 4; i++ )
+  {
+    const char *cp = parts[i];
+    while ( *cp )
+    {
+      hash ^= (unsigned char) *cp++;
+      hash *= 16777619u;
+    }
+    hash ^= '_';
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+int packpool_workerfor ( const char *net, const char *sta,
+                         const char *loc, const char *chan )
+{
+  if ( nworkers <= 0 )
+    return 0;
+
+  return (int) (streamhash (net, sta, loc, chan) % (uint32_t) nworkers);
+}
+
+/***************************************************************************
+ * packworker:
+ *
+ * Worker thread, drains its queue in order and hands each packet to the
+ * handler.  Exits once stopping is set and the queue is empty.
+ ***************************************************************************/
+static void *packworker ( void *arg )
+{
+  PackWorker *pw = (PackWorker *) arg;
+  MSRecord *msr = NULL;
+  PackItem *item;
+  uint64_t tail;
+  char name[16];
+
+  snprintf (name, sizeof(name), "pack%d", pw->index);
+  placement_enter (THREAD_PACK, name);
+
+  if ( (msr = msr_init (NULL)) == NULL )
+  {
+    ms_log (2, "Cannot initialize pack worker %d record\n", pw->index);
+    return NULL;
+  }
+
+  for (;;)
+  {
+    while ( sem_wait (&pw->ready) != 0 )
+      ;
+
+    tail = pw->tail;
+    if ( tail == __atomic_load_n (&pw->head, __ATOMIC_ACQUIRE) )
+    {
+      if ( __atomic_load_n (&stopping, __ATOMIC_ACQUIRE) )
+        break;
+      continue;
+    }
+
+    item = &pw->slots[tail & (PACKPOOL_QUEUE_SLOTS - 1)];
+
+    strcpy (msr->network, item->network);
+    strcpy (msr->station, item->station);
+    strcpy (msr->location, item->location);
+    strcpy (msr->channel, item->channel);
+    msr->starttime = item->starttime;
+    msr->samprate = item->samprate;
+    msr->numsamples = item->numsamples;
+    msr->samplecnt = item->numsamples;
+    msr->datasamples = item->samples;
+    msr->sampletype = 'i';
+
+    handler (pw->index, msr, item->timingqual);
+
+    /* Samples belong to the queue slot, not to the record */
+    msr->datasamples = NULL;
+
+    __atomic_store_n (&pw->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  msr->datasamples = NULL;
+  msr_free (&msr);
+
+  return NULL;
+}
+
+/***************************************************************************
+ * packpool_start:
+ *
+ * Allocate queues and start nworkers threads, each calling phandler for
+ * every packet submitted for its streams.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int packpool_start ( int count, packpool_handler phandler )
+{
+  int i;
+
+  if ( count <= 0 )
+    return 0;
+
+  if ( count > PACKPOOL_MAX_WORKERS )
+  {
+    ms_log (1, "PackThreads %d too large, using %d\n", count, PACKPOOL_MAX_WORKERS);
+    count = PACKPOOL_MAX_WORKERS;
+  }
+
+  if ( ! (workers = (PackWorker *) calloc (count, sizeof(PackWorker))) )
+  {
+    ms_log (2, "Cannot allocate pack workers\n");
+    return -1;
+  }
+
+  handler = phandler;
+  stopping = 0;
+  stalls = 0;
+
+  for ( i = 0; i < count; i++ )
+  {
+    PackWorker *pw = &workers[i];
+
+    pw->index = i;
+    if ( ! (pw->slots = (PackItem *) malloc (PACKPOOL_QUEUE_SLOTS * sizeof(PackItem))) )
+    {
+      ms_log (2, "Cannot allocate queue for pack worker %d\n", i);
+      return -1;
+    }
+    sem_init (&pw->ready, 0, 0);
+
+    if ( pthread_create (&pw->thread, NULL, packworker, pw) != 0 )
+    {
+      ms_log (2, "Cannot start pack worker %d\n", i);
+      sem_destroy (&pw->ready);
+      free (pw->slots);
+      pw->slots = NULL;
+      return -1;
+    }
+    nworkers++;
+  }
+
+  ms_log (0, "Started %d pack worker threads\n", nworkers);
+
+  return 0;
+}
+
+/***************************************************************************
+ * packpool_submit:
+ *
+ * Copy a one-second record into the queue of the worker owning its stream.
+ * Must only be called from the lib330 station thread.  If the queue is
+ * full the caller waits, which pushes back on lib330's own buffering.
+ *
+ * Returns 0 on success and -1 if the record cannot be queued.
+ ***************************************************************************/
+int packpool_submit ( MSRecord *msr, int timingqual )
+{
+  PackWorker *pw;
+  PackItem *item;
+  uint64_t head;
+
+  if ( nworkers <= 0 )
+    return -1;
+
+  if ( msr->numsamples > PACKPOOL_MAX_SAMPLES || msr->sampletype != 'i' )
+  {
+    ms_log (2, "Cannot queue %s.%s.%s.%s with %lld samples\n",
+            msr->network, msr->station, msr->location, msr->channel,
+            (long long int) msr->numsamples);
+    return -1;
+  }
+
+  pw = &workers[packpool_workerfor (msr->network, msr->station,
+                                    msr->location, msr->channel)];
+  head = pw->head;
+
+  if ( head - __atomic_load_n (&pw->tail, __ATOMIC_ACQUIRE) >= PACKPOOL_QUEUE_SLOTS )
+  {
+    stalls++;
+    while ( head - __atomic_load_n (&pw->tail, __ATOMIC_ACQUIRE) >= PACKPOOL_QUEUE_SLOTS )
+      dlp_usleep (100);
+  }
+
+  item = &pw->slots[head & (PACKPOOL_QUEUE_SLOTS - 1)];
+
+  strcpy (item->network, msr->network);
+  strcpy (item->station, msr->station);
+  strcpy (item->location, msr->location);
+  strcpy (item->channel, msr->channel);
+  item->starttime = msr->starttime;
+  item->samprate = msr->samprate;
+  item->numsamples = (int32) msr->numsamples;
+  item->timingqual = timingqual;
+  if ( msr->numsamples > 0 )
+    memcpy (item->samples, msr->datasamples, msr->numsamples * sizeof(int32));
+
+  __atomic_store_n (&pw->head, head + 1, __ATOMIC_RELEASE);
+  sem_post (&pw->ready);
+
+  return 0;
+}
+
+/***************************************************************************
+ * packpool_drain:
+ *
+ * Wait until every queued packet has been handled.
+ ***************************************************************************/
+void packpool_drain ( void )
+{
+  int i;
+
+  for ( i = 0; i < nworkers; i++ )
+  {
+    while ( __atomic_load_n (&workers[i].tail, __ATOMIC_ACQUIRE) != workers[i].head )
+      dlp_usleep (1000);
+  }
+}
+
+/***************************************************************************
+ * packpool_stop:
+ *
+ * Drain all queues, then stop and join the workers.  After this returns
+ * the per-worker packing state may be used from the calling thread.
+ ***************************************************************************/
+void packpool_stop ( void )
+{
+  int i;
+
+  if ( ! workers )
+    return;
+
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+
+  for ( i = 0; i < nworkers; i++ )
+    sem_post (&workers[i].ready);
+
+  for ( i = 0; i < nworkers; i++ )
+  {
+    pthread_join (workers[i].thread, NULL);
+    sem_destroy (&workers[i].ready);
+    free (workers[i].slots);
+  }
+
+  free (workers);
+  workers = NULL;
+  nworkers = 0;
+}
+
+int packpool_workers ( void )
+{
+  return nworkers;
+}
+
+int64_t packpool_stalls ( void )
+{
+  return stalls;
+}
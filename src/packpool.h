@@ -0,0 +1,46 @@
+//
+//  packpool.h
+//  q3302dali
+//
+//  Pool of packing worker threads.  One-second packets are copied from the
+//  lib330 callback into a per-worker single-producer/single-consumer queue,
+//  streams are assigned to workers by a hash of NET_STA_LOC_CHAN so each
+//  stream is always packed, in order, by the same worker.
+//
+
+#ifndef packpool_h
+#define packpool_h
+
+#include "q3302dali.h"
+
+#define PACKPOOL_MAX_WORKERS 64
+#define PACKPOOL_QUEUE_SLOTS 512   /* per worker, must be a power of two */
+#define PACKPOOL_MAX_SAMPLES MAX_RATE
+
+/* One second of samples queued for a worker */
+typedef struct packitem_s
+{
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+  hptime_t starttime;
+  double samprate;
+  int32 numsamples;
+  int32 timingqual;                /* clock quality percent, -1 unknown */
+  int32 samples[PACKPOOL_MAX_SAMPLES];
+} PackItem;
+
+/* Called on the worker thread for each queued packet, in stream order */
+typedef void (*packpool_handler) ( int worker, MSRecord *msr, int timingqual );
+
+int packpool_start ( int nworkers, packpool_handler handler );
+int packpool_submit ( MSRecord *msr, int timingqual );
+void packpool_drain ( void );
+void packpool_stop ( void );
+int packpool_workers ( void );
+int packpool_workerfor ( const char *net, const char *sta,
+                         const char *loc, const char *chan );
+int64_t packpool_stalls ( void );
+
+#endif /* packpool_h */
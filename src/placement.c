@@ -0,0 +1,330 @@
+//
+//  placement.c
+//  q3302dali
+//
+//  Thread placement and scheduling, see placement.h.
+//
+//  A new thread inherits the CPU set and policy of the thread creating
+//  it, so every role is set explicitly as soon as any role has settings,
+//  back to the CPU set the process started with where its own are left
+//  out.  CPU time and waiting are read from the kernel schedstat of each
+//  thread: the time it ran, the time it was runnable on a run queue and
+//  the number of times it got a CPU, so the wait per run is the latency
+//  of waking it, e.g. for the lib330 callbacks.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "placement.h"
+
+#define PLACEMENT_MAX_THREADS 64
+
+typedef struct placed_s
+{
+  char name[16];
+  int role;
+  int tid;
+  int policy;
+  int priority;
+
+  /* At the last reset, for rates */
+  double when;
+  double cpuns;
+  double waitns;
+  double runs;
+} Placed;
+
+static const char *rolenames[THREAD_ROLES] = { "main", "lib330", "pack", "datalink", "server", "archive" };
+
+static pthread_mutex_t placelock = PTHREAD_MUTEX_INITIALIZER;
+static Placed placed[PLACEMENT_MAX_THREADS];
+static int numplaced = 0;
+static ThreadSpec roles[THREAD_ROLES];
+static int active = 0;             /* some role has settings */
+static cpu_set_t startcpus;        /* of the process at startup */
+static __thread int entered = 0;
+
+int placement_role ( const char *name )
+{
+  int i;
+
+  for ( i = 0; i < THREAD_ROLES; i++ )
+    if ( ! strcmp (name, rolenames[i]) )
+      return i;
+
+  return -1;
+}
+
+const char *placement_rolename ( int role )
+{
+  return ( role >= 0 && role < THREAD_ROLES ) ? rolenames[role] : "unknown";
+}
+
+/* Policy for fifo, rr or other, -1 if unknown */
+int placement_policy ( const char *name )
+{
+  if ( ! strcmp (name, "fifo") )
+    return SCHED_FIFO;
+  if ( ! strcmp (name, "rr") )
+    return SCHED_RR;
+  if ( ! strcmp (name, "other") )
+    return SCHED_OTHER;
+
+  return -1;
+}
+
+const char *placement_policyname ( int policy )
+{
+  switch ( policy )
+  {
+    case SCHED_FIFO:  return "fifo";
+    case SCHED_RR:    return "rr";
+    case SCHED_OTHER: return "other";
+  }
+  return "unknown";
+}
+
+/* Parse a CPU list such as 0-2,5 into set, returns -1 if it is not one */
+static int parsecpus ( const char *cpus, cpu_set_t *set )
+{
+  const char *p = cpus;
+  char *end;
+  long first, last;
+
+  CPU_ZERO (set);
+
+  while ( *p )
+  {
+    first = strtol (p, &end, 10);
+    if ( end == p || first < 0 || first >= CPU_SETSIZE )
+      return -1;
+    last = first;
+    p = end;
+
+    if ( *p == '-' )
+    {
+      p++;
+      last = strtol (p, &end, 10);
+      if ( end == p || last < first || last >= CPU_SETSIZE )
+        return -1;
+      p = end;
+    }
+
+    for ( ; first <= last; first++ )
+      CPU_SET (first, set);
+
+    if ( *p == ',' )
+      p++;
+    else if ( *p )
+      return -1;
+  }
+
+  return ( CPU_COUNT (set) > 0 ) ? 0 : -1;
+}
+
+/* Check a CPU list from the config file, returns 0 if it is valid */
+int placement_checkcpus ( const char *cpus )
+{
+  cpu_set_t set;
+
+  return parsecpus (cpus, &set);
+}
+
+/***************************************************************************
+ * placement_init:
+ *
+ * Take the settings of each role, indexed by THREAD_ roles, before any
+ * thread is started.  With lockmemory all pages of the process are
+ * locked in memory once they are used, so none is paged out under the
+ * acquisition threads.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int placement_init ( ThreadSpec *specs, int lockmemory )
+{
+  cpu_set_t set;
+  int i;
+
+  if ( sched_getaffinity (0, sizeof(startcpus), &startcpus) < 0 )
+  {
+    ms_log (2, "Cannot get the CPU set of the process: %s\n", strerror (errno));
+    return -1;
+  }
+
+  memcpy (roles, specs, sizeof(roles));
+  active = 0;
+
+  for ( i = 0; i < THREAD_ROLES; i++ )
+  {
+    if ( roles[i].cpus[0] && parsecpus (roles[i].cpus, &set) < 0 )
+    {
+      ms_log (2, "Invalid CPU list for %s threads: %s\n", rolenames[i], roles[i].cpus);
+      return -1;
+    }
+    if ( roles[i].cpus[0] || roles[i].policy != SCHED_OTHER )
+      active = 1;
+  }
+
+  if ( lockmemory )
+  {
+#ifdef MCL_ONFAULT
+    /* Thread stacks are only locked as far as they are used */
+    if ( mlockall (MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0 )
+      return 0;
+#endif
+    if ( mlockall (MCL_CURRENT | MCL_FUTURE) < 0 )
+      ms_log (1, "Cannot lock memory, continuing without: %s\n", strerror (errno));
+  }
+
+  return 0;
+}
+
+/***************************************************************************
+ * placement_enter:
+ *
+ * Register the calling thread under a role and apply the CPU set and
+ * scheduling of the role to it, only the first time a thread calls.
+ * Settings that cannot be applied, usually a real-time policy without
+ * CAP_SYS_NICE or an rtprio limit, are logged and left out.
+ ***************************************************************************/
+void placement_enter ( int role, const char *name )
+{
+  struct sched_param param;
+  ThreadSpec *spec = &roles[role];
+  cpu_set_t set;
+  Placed *p = NULL;
+  int policy = SCHED_OTHER;
+  int rv;
+
+  if ( entered )
+    return;
+  entered = 1;
+
+  pthread_setname_np (pthread_self (), name);
+
+  if ( active )
+  {
+    if ( ! spec->cpus[0] || parsecpus (spec->cpus, &set) < 0 )
+      set = startcpus;
+    if ( (rv = pthread_setaffinity_np (pthread_self (), sizeof(set), &set)) )
+      ms_log (1, "Cannot set CPUs %s for thread %s: %s\n", ( spec->cpus[0] ) ? spec->cpus : "of the process",
+              name, strerror (rv));
+
+    memset (&param, 0, sizeof(param));
+    if ( spec->policy == SCHED_FIFO || spec->policy == SCHED_RR )
+      param.sched_priority = spec->priority;
+    if ( (rv = pthread_setschedparam (pthread_self (), spec->policy, &param)) )
+      ms_log (1, "Cannot set %s priority %d for thread %s: %s\n", placement_policyname (spec->policy),
+              param.sched_priority, name, strerror (rv));
+    else
+      policy = spec->policy;
+  }
+
+  pthread_mutex_lock (&placelock);
+  if ( numplaced < PLACEMENT_MAX_THREADS )
+  {
+    p = &placed[numplaced++];
+    memset (p, 0, sizeof(Placed));
+    strncpy (p->name, name, sizeof(p->name) - 1);
+    p->role = role;
+    p->tid = (int) syscall (SYS_gettid);
+    p->policy = policy;
+    p->priority = ( policy == SCHED_OTHER ) ? 0 : spec->priority;
+  }
+  pthread_mutex_unlock (&placelock);
+}
+
+int placement_threads ( void )
+{
+  int count;
+
+  pthread_mutex_lock (&placelock);
+  count = numplaced;
+  pthread_mutex_unlock (&placelock);
+
+  return count;
+}
+
+/* Run, wait and run count totals of a thread, returns -1 if not known */
+static int schedstat ( int tid, double *cpuns, double *waitns, double *runs )
+{
+  char path[64];
+  FILE *fp;
+  int fields;
+
+  snprintf (path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+  if ( ! (fp = fopen (path, "r")) )
+    return -1;
+  fields = fscanf (fp, "%lf %lf %lf", cpuns, waitns, runs);
+  fclose (fp);
+
+  return ( fields == 3 ) ? 0 : -1;
+}
+
+/***************************************************************************
+ * placement_stats:
+ *
+ * Get a registered thread with its CPU time and waiting since the last
+ * call with reset, reset starts the next interval.  Values that are not
+ * known are -1.
+ *
+ * Returns 0 on success and -1 if there is no thread index or it ended.
+ ***************************************************************************/
+int placement_stats ( int index, ThreadStats *stats, int reset )
+{
+  struct timespec ts;
+  double now, elapsed;
+  double cpuns, waitns, runs;
+  Placed *p;
+
+  pthread_mutex_lock (&placelock);
+  if ( index < 0 || index >= numplaced )
+  {
+    pthread_mutex_unlock (&placelock);
+    return -1;
+  }
+  p = &placed[index];
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+  memset (stats, 0, sizeof(ThreadStats));
+  strcpy (stats->name, p->name);
+  stats->role = p->role;
+  stats->tid = p->tid;
+  stats->policy = p->policy;
+  stats->priority = p->priority;
+  stats->cpu = stats->waiting = stats->slicewait = -1.0;
+
+  if ( schedstat (p->tid, &cpuns, &waitns, &runs) < 0 )
+  {
+    pthread_mutex_unlock (&placelock);
+    return -1;
+  }
+
+  elapsed = now - p->when;
+  if ( p->when > 0.0 && elapsed > 0.0 )
+  {
+    stats->cpu = (cpuns - p->cpuns) / 1e9 / elapsed * 100.0;
+    stats->waiting = (waitns - p->waitns) / 1e9 / elapsed * 100.0;
+    if ( runs > p->runs )
+      stats->slicewait = (waitns - p->waitns) / (runs - p->runs) / 1e3;
+    else
+      stats->slicewait = 0.0;
+  }
+
+  if ( reset || p->when == 0.0 )
+  {
+    p->when = now;
+    p->cpuns = cpuns;
+    p->waitns = waitns;
+    p->runs = runs;
+  }
+  pthread_mutex_unlock (&placelock);
+
+  return 0;
+}
@@ -0,0 +1,58 @@
+//
+//  placement.h
+//  q3302dali
+//
+//  Placement of threads on CPUs and their scheduling.  Every thread says
+//  which role it has when it starts; the CPU set and scheduling policy
+//  configured for the role are applied to it then, and it is listed with
+//  its CPU time and the time it waited to run in the status output.
+//  Threads of roles with no settings run wherever the process started.
+//
+
+#ifndef placement_h
+#define placement_h
+
+#include <sched.h>
+#include "q3302dali.h"
+
+/* Thread roles */
+#define THREAD_MAIN     0          /* main loop, status and reloads */
+#define THREAD_LIB330   1          /* lib330 station thread, the callbacks */
+#define THREAD_PACK     2          /* pack workers */
+#define THREAD_DATALINK 3          /* DataLink connection and shaper */
+#define THREAD_SERVER   4          /* SeedLink server and control socket */
+#define THREAD_ARCHIVE  5          /* archive and checkpoint writers */
+#define THREAD_ROLES    6
+
+/* Settings of a role as read from the config file */
+typedef struct threadspec_s
+{
+  char cpus[64];                   /* CPU list such as 2-3,6, empty for any */
+  int32 policy;                    /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+  int32 priority;                  /* 1 to 99 for SCHED_FIFO and SCHED_RR */
+} ThreadSpec;
+
+typedef struct threadstats_s
+{
+  char name[16];
+  int role;
+  int tid;
+  int policy;                      /* as applied */
+  int priority;
+  double cpu;                      /* percent of one CPU since the last reset */
+  double waiting;                  /* percent of the time runnable but not running */
+  double slicewait;                /* average wait before each run, microseconds */
+} ThreadStats;
+
+int placement_role ( const char *name );
+const char *placement_rolename ( int role );
+int placement_policy ( const char *name );
+const char *placement_policyname ( int policy );
+int placement_checkcpus ( const char *cpus );
+
+int placement_init ( ThreadSpec *specs, int lockmemory );
+void placement_enter ( int role, const char *name );
+int placement_threads ( void );
+int placement_stats ( int index, ThreadStats *stats, int reset );
+
+#endif /* placement_h */
@@ -0,0 +1,229 @@
+//
+//  q3302dali-stat.c
+//  q3302dali
+//
+//  Live view of the statistics segment written with StatsPath, one line
+//  per stream refreshed like top.  Reads the segment only, the data path
+//  of the running q3302dali is not involved.  Needs only statseg.c.
+//
+//  Usage: q3302dali-stat <statsfile> [-i seconds] [-1]
+//    -i  refresh interval, 1 second by default
+//    -1  print once and exit, for scripts
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "statseg.h"
+
+#define HPT_SECONDS 1000000.0      /* libmseed hptime ticks per second */
+
+/* Counters of the previous refresh, for rates */
+typedef struct previous_s
+{
+  int64_t bytes;
+  int64_t records;
+  double when;
+} Previous;
+
+static double nowseconds ( void )
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* SEED data encoding codes */
+static const char *encodingname ( int encoding )
+{
+  switch ( encoding )
+  {
+    case 1:  return "int16";
+    case 3:  return "int32";
+    case 4:  return "float32";
+    case 5:  return "float64";
+    case 10: return "steim1";
+    case 11: return "steim2";
+    case 0:  return "-";
+  }
+  return "other";
+}
+
+/* Seconds since an hptime as text, - for never */
+static void agestr ( char *buf, size_t len, int64_t hptime, double now )
+{
+  if ( hptime <= 0 )
+    snprintf (buf, len, "-");
+  else
+    snprintf (buf, len, "%.1f", now - hptime / HPT_SECONDS);
+}
+
+static void accstr ( char *buf, size_t len, const int32_t *acc )
+{
+  char part[3][16];
+  int i;
+
+  for ( i = 0; i < 3; i++ )
+  {
+    if ( acc[i] < 0 )
+      snprintf (part[i], sizeof(part[i]), "-");
+    else
+      snprintf (part[i], sizeof(part[i]), "%d", acc[i]);
+  }
+  snprintf (buf, len, "%s/%s/%s", part[0], part[1], part[2]);
+}
+
+/* Print one refresh, returns -1 if the segment was closed */
+static int show ( StatSeg *seg, Previous *prev, int clear )
+{
+  StatSegHeader hdr;
+  StatSegStream st;
+  double now = nowseconds ();
+  char bps[64], pkts[64], lastpkt[16], lastsent[16];
+  uint32_t i;
+  int rv;
+
+  if ( (rv = statseg_readstation (seg, &hdr)) < 0 )
+    return -1;
+
+  if ( clear )
+    printf ("\033[H\033[2J");
+
+  if ( rv == 0 )
+  {
+    printf ("Station block busy, retrying\n");
+    return 0;
+  }
+
+  accstr (bps, sizeof(bps), hdr.bps);
+  accstr (pkts, sizeof(pkts), hdr.packets);
+
+  printf ("%s  %s  pid %d, updated %.0fs ago\n", ( hdr.station[0] ) ? hdr.station : "(station unknown)",
+          hdr.libstate, hdr.pid, now - (double) hdr.updated);
+  printf ("Q330 Bps %s, packets %s (min/hour/day), buffer %d%%, clock %d%%\n",
+          bps, pkts, hdr.bufferfill, hdr.clockqual);
+  printf ("DataLink %s, %lld connects, %lld failed, %lld lost, %lld records queued\n\n",
+          hdr.dlstate, (long long) hdr.dlconnects, (long long) hdr.dlfailures,
+          (long long) hdr.dllost, (long long) hdr.queued);
+
+  printf ("%-18s %9s %8s %7s %9s %6s %7s %7s %6s %6s %6s %4s %-7s\n",
+          "STREAM", "PACKETS", "RECORDS", "REC/S", "BYTES/S", "B/SMP", "LAT", "AGE",
+          "SENT", "GAPS", "DUPS", "TQ", "ENC");
+
+  for ( i = 0; i < hdr.numstreams && i < hdr.numslots; i++ )
+  {
+    double elapsed;
+    double recrate = 0.0, byterate = 0.0;
+
+    if ( statseg_readstream (seg, i, &st) <= 0 )
+      continue;
+
+    elapsed = now - prev[i].when;
+    if ( prev[i].when > 0.0 && elapsed > 0.0 )
+    {
+      recrate = (st.records - prev[i].records) / elapsed;
+      byterate = (st.bytes - prev[i].bytes) / elapsed;
+    }
+    prev[i].records = st.records;
+    prev[i].bytes = st.bytes;
+    prev[i].when = now;
+
+    agestr (lastpkt, sizeof(lastpkt), st.lastpacket, now);
+    agestr (lastsent, sizeof(lastsent), st.lastsent, now);
+
+    printf ("%-18s %9lld %8lld %7.2f %9.0f %6.2f %7.2f %7s %6s %6lld %6lld %4d %-7s\n",
+            st.name, (long long) st.packets, (long long) st.records, recrate, byterate,
+            ( st.samples > 0 ) ? (double) st.bytes / st.samples : 0.0,
+            st.latency, lastpkt, lastsent, (long long) st.gaps, (long long) st.duppackets,
+            st.timingqual, encodingname (st.encoding));
+  }
+
+  fflush (stdout);
+
+  return 0;
+}
+
+int main ( int argc, char **argv )
+{
+  StatSeg *seg = NULL;
+  Previous *prev = NULL;
+  const char *path = NULL;
+  double interval = 1.0;
+  int once = 0;
+  int usage = 0;
+  int clear;
+  int i;
+
+  for ( i = 1; i < argc; i++ )
+  {
+    if ( ! strcmp (argv[i], "-1") )
+      once = 1;
+    else if ( ! strcmp (argv[i], "-i") && i + 1 < argc )
+      interval = atof (argv[++i]);
+    else if ( argv[i][0] != '-' && ! path )
+      path = argv[i];
+    else
+      usage = 1;
+  }
+
+  if ( usage || ! path || interval <= 0.0 )
+  {
+    fprintf (stderr, "Usage: q3302dali-stat <statsfile> [-i seconds] [-1]\n");
+    return 1;
+  }
+
+  clear = ! once && isatty (STDOUT_FILENO);
+
+  for (;;)
+  {
+    if ( ! seg )
+    {
+      if ( ! (seg = statseg_open (path)) )
+      {
+        if ( once && ( errno == ENOENT || errno == EAGAIN ) )
+        {
+          fprintf (stderr, "%s: q3302dali is not running\n", path);
+          return 1;
+        }
+        if ( errno != ENOENT && errno != EAGAIN )
+        {
+          fprintf (stderr, "Cannot open %s: %s\n", path, strerror (errno));
+          return 1;
+        }
+        sleep (1);
+        continue;
+      }
+
+      free (prev);
+      if ( ! (prev = (Previous *) calloc (seg->header->numslots, sizeof(Previous))) )
+      {
+        fprintf (stderr, "Cannot allocate %u stream entries\n", seg->header->numslots);
+        return 1;
+      }
+    }
+
+    if ( show (seg, prev, clear) < 0 )
+    {
+      fprintf (stderr, "Statistics segment closed, reopening\n");
+      statseg_close (seg);
+      seg = NULL;
+      if ( once )
+        return 1;
+      continue;
+    }
+
+    if ( once )
+      break;
+
+    usleep ((useconds_t) (interval * 1e6));
+  }
+
+  statseg_close (seg);
+  free (prev);
+
+  return 0;
+}
@@ -6,8 +6,32 @@
 //
 
 #include <stdio.h>
+#include <fnmatch.h>
 #include "q3302dali.h"
 #include "config.h"
+#include "packpool.h"
+#include "chanrules.h"
+#include "decimate.h"
+#include "trigger.h"
+#include "amplitude.h"
+#include "encoding.h"
+#include "statseg.h"
+#include "streams.h"
+#include "runconfig.h"
+#include "slserver.h"
+#include "shmring.h"
+#include "archive.h"
+#include "coverage.h"
+#include "shaper.h"
+#include "dlconn.h"
+#include "startup.h"
+#include "checkpoint.h"
+#include "spool.h"
+#include "soh.h"
+#include "ctlsock.h"
+#include "placement.h"
+#include "memacct.h"
+#include "trace.h"
 
 
 /* Per-trace statistics */
@@ -19,50 +43,207 @@ typedef struct tracestats_s
   hptime_t xmit;
   int64_t pktcount;
   int64_t reccount;
+  int64_t held;                    /* bytes of samples accounted for */
+  StreamInfo *stream;
 } TraceStats;
 
+/* Packing state, one per pack worker or one for the lib330 thread */
+typedef struct packcontext_s
+{
+  pthread_mutex_t lock;            /* Held while packing in the context */
+  MSTraceGroup *mstg;              /* Staging buffer of data for making miniSEED */
+  MSRecord *mstemplate;            /* Template for packed records */
+  MSRecord *sendmsr;               /* Header parsing buffer for sendrecord() */
+  MSTrace *mst;                    /* Trace currently being packed */
+  int64_t reccount;                /* Records sent from this context */
+  hptime_t lastmemflush;           /* Last flush to get under MemoryLimit */
+} PackContext;
+
+static void handleonesec(tonesec_call *data, RunConfig *rc);
+static void handleminiseed(tminiseed_call *data, RunConfig *rc);
+static void splitstationname ( const char *station_name, char *netsta, char **net, char **sta );
+static int initpacking ( int nthreads );
+static void submitrecord ( MSRecord *msr, int timingqual );
+static void submitderived ( MSRecord *msr );
+static void submittrigger ( TriggerEvent *event );
+static void submitamplitudes ( Amplitudes *amp );
+static void restorerecord ( MSRecord *msr, int timingqual );
+static void packworkerhandler ( int worker, MSRecord *msr, int timingqual );
+static void processMseed(PackContext *ctx, MSRecord *msr, int timingqual);
+static void flushstream ( PackContext *ctx, StreamInfo *si );
+static void flushlargest ( PackContext *ctx, int64_t bytes );
+static void accounttrace ( MSTrace *mst );
+static void flushmatching ( PackContext *ctx, const char *pattern );
+static int streamencoding ( MSTrace *mst );
+static void publishstats ( void );
+static void settimingquality ( MSRecord *mstemplate, MSTrace *mst );
+static int packtraces ( PackContext *ctx, MSTrace *mst, int flush, hptime_t flushtime );
+static void sendrecord ( char *record, int reclen, void *handlerdata );
+static int dlwrite ( DLConnRecord *records, int count );
+static void connrecords ( ShaperRecord *records, int count, DLConnRecord *batch );
+static int dlsend ( ShaperRecord *records, int count );
+static int dlspool ( ShaperRecord *records, int count );
+static int dlshed ( ShaperRecord *records, int count );
+static void replayrecord ( DLConnRecord *record );
+static int recordclass ( RunConfig *rc, MSRecord *msr, hptime_t endtime );
+static void usage ();
+static int handle_opts(int argc, char ** argv);
+static void reloadconfig ( void );
+static void setverbosity ( int level );
+static int waitlib ( double seconds, unsigned int statemask, int replies );
+static double monoseconds ( void );
+static int gateenter ( void );
+static void gateexit ( void );
+static int gateclose ( double seconds );
+static void flushcontexts ( void );
+static void *flushcontext ( void *arg );
+static void capturecontext ( int context );
+static int timerstart ( void );
+static void timerstop ( void );
+static void *flushtimer ( void *arg );
+static void watchstart ( int seconds );
+static void watchstop ( void );
+static int watchuntil ( double seconds );
+static void *shutdownwatch ( void *arg );
+static int registerstation ( void );
+static void print_timelog ( char *msg );
+static void logmststats ( MSTrace *mst );
+
 static int verbose     = 0;
 static int stopsig     = 0;        /* 1: termination requested, 2: termination and no flush */
+static volatile sig_atomic_t reloadsig = 0; /* 1: configuration reload requested */
 
 enum tlibstate currentLibState;
+static pthread_mutex_t libstatelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t libstatecond = PTHREAD_COND_INITIALIZER; /* lib330 state changed or ping answered */
+static int libstatechanges = 0;    /* State changes so far */
+static time_t libstatetime = 0;    /* Time of the last state change */
+static int pingreplies = 0;        /* Unregistered pings answered so far */
 tpar_register registrationInfo;
 tpar_create creationInfo;
 tcontext stationContext;
 
 static double janFirst2000 =  946684800.000000;
 
-static char *rsaddr    = 0;        /* DataLink/ringserver receiver address in IP:port format */
-static DLCP *dlcp      = 0;        /* DataLink connection handle */
+static ShmRing *shmring = NULL;    /* Shared-memory record ring, NULL if not configured */
+static StatSeg *statseg = NULL;    /* Shared-memory statistics, NULL if not configured */
 
+static PackContext packctx[PACKPOOL_MAX_WORKERS]; /* Packing state per worker */
+static int numpackctx = 0;         /* Contexts in use, 1 when packing inline */
 
-static MSTraceGroup *mstg = 0;     /* Staging buffer of data for making miniSEED */
+static int stationclockqual = -1;  /* Clock quality from the lib330 status, -1 unknown */
 
-static int flushlatency = 300;     /* Flush data buffers if not updated for latency in seconds */
-static int reconnectinterval = 10; /* Interval to wait between reconnection attempts in seconds */
 static int int32encoding = DE_STEIM2; /* Encoding for 32-bit integer data */
 
+static char coveragefile[1100] = "";  /* Saved duplicate suppression state, empty for none */
+static char checkpointfile[1100] = "";  /* Trace buffer checkpoints, empty for none */
+static char spoolfile[1100] = "";  /* Records not sent at shutdown, empty for none */
+
+/* Thread flushing idle streams */
+static pthread_mutex_t timerlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timercond;
+static int timerdone = 0;
+static int timing = 0;
+static pthread_t timerthread;
+
+static int deregistering = 0;      /* waitlib() keeps waiting despite termination */
+static int datagate = 0;           /* data callbacks running, DATAGATE_CLOSED once shut */
+static int64_t gatedropped = 0;    /* callbacks refused once shut */
+
+/* Shutdown watchdog */
+static pthread_mutex_t watchlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchcond;
+static struct timespec watchbase;  /* start of the shutdown, CLOCK_MONOTONIC */
+static int watchseconds = 0;
+static int watchdone = 0;
+static int watching = 0;
+static pthread_t watchthread;
+
+#define MINI_MAX_RECLEN 8192          /* largest Q330 miniseed record we rename */
 #define MAX_WAIT_STATE_BEFORE_EXIT 240 /* max seconds to sit in WAIT for reg state */
+#define REG_PINGS_BEFORE_REGISTER 5 /* unanswered pings before registering anyway */
+#define REG_MAX_PING_WAIT 16.0     /* max seconds to wait for a ping reply */
+#define DATAGATE_CLOSED 0x40000000
+#define SHUTDOWN_DEREGISTER 0.5    /* share of ShutdownTimeout to deregister */
+#define SHUTDOWN_DRAIN 0.75        /* share after which unsent records are spooled */
+#define FLUSH_TIMER_TICKS 10        /* flush timer checks per second */
 static unsigned long  MAIN_WHILE_USLEEP =(unsigned long)1e5; /* 1 sec=1e6, sleep 1/10 sec */
 
 #ifndef _WIN32
 /********************* Signal handling  routines ******************/
 
+/*********************************************************************
+ * cleanup:
+ *
+ * Shut down within ShutdownTimeout seconds, 0 for as long as it takes.
+ * Queued records go to DataLink at full speed while the station
+ * deregisters, for at most half of that time, then the trace buffers
+ * of all pack contexts are flushed in parallel.  Records not sent three
+ * quarters into the shutdown, or at all with DataLink down, are spooled
+ * and samples that could not be packed are checkpointed, both for the
+ * next start.  A watchdog exits if the rest takes longer still.
+ *********************************************************************/
 void cleanup() {
+  int timeout = gConfig.ShutdownTimeout;
+  double start = monoseconds ();
+  int gateclosed;
+  int i;
+
   if (stopsig == 0) stopsig = 1;
-  lib330Interface_cleanup();
+  watchstart (timeout);
 
-  /* Flush all remaining data streams and close the connections */
-  packtraces (NULL, 1, HPTERROR);
-  if ( dlcp->link != -1 )
-    dl_disconnect (dlcp);
+  shaper_finish (( timeout > 0 ) ? timeout * SHUTDOWN_DRAIN : -1.0, dlspool);
+  lib330Interface_cleanup((int) (timeout * SHUTDOWN_DEREGISTER));
 
-  if ( verbose )
+  /* Data from a lib330 that did not stop is refused from here on */
+  gateclosed = gateclose (( timeout > 0 ) ? start + timeout * SHUTDOWN_DRAIN - monoseconds () : -1.0);
+  timerstop ();
+  if ( gateclosed )
   {
-    MSTrace *mst = mstg->traces;
-    while ( mst )
+    /* Let the pack workers finish queued data, then flush every context */
+    packpool_stop();
+    flushcontexts ();
+  }
+  else
+  {
+    ms_log (2, "lib330 data callbacks still running, trace buffers not flushed\n");
+    stopsig = 2;
+  }
+  spool_stop();
+  shaper_stop();
+
+  /* What could not be packed and sent is kept for the next start */
+  if ( stopsig >= 2 && gateclosed )
+    for ( i = 0; i < numpackctx; i++ )
+      capturecontext (i);
+  checkpoint_stop (stopsig < 2);
+
+  if ( gatedropped )
+    ms_log (1, "Refused %lld lib330 data callbacks after deregistration\n", (long long int) gatedropped);
+
+  if ( coveragefile[0] )
+    coverage_save (coveragefile);
+  ctlsock_stop();
+  dlconn_stop();
+  spool_close();
+  slserver_stop();
+  shmring_close(shmring);
+  shmring = NULL;
+  statseg_close(statseg);
+  statseg = NULL;
+  archive_stop();
+  watchstop ();
+
+  if ( verbose && gateclosed )
+  {
+    for ( i = 0; i < numpackctx; i++ )
     {
-      logmststats (mst);
-      mst = mst->next;
+      MSTrace *mst = packctx[i].mstg->traces;
+      while ( mst )
+      {
+        logmststats (mst);
+        mst = mst->next;
+      }
     }
   }
 
@@ -89,6 +270,11 @@ static void term_handler ( int sig )
   stopsig = 1;
 }
 
+static void hup_handler ( int sig )
+{
+  reloadsig = 1;
+}
+
 static void ThreadSignalHandler ( int sig )
 {
   switch (sig)
@@ -107,9 +293,14 @@ int main ( int argc, char **argv )
   int    retryCount;           /* to prevent flooding the log file */
   int    connected;            /* connection flag */
 
-  int registration_count = 0;
-  int wait_counter = 0;
+  RunConfig *rc;
+  time_t waitsince = 0;
+  time_t lastregistration = 0;
   time_t lastStatusUpdate;
+  time_t lastSoh;
+  time_t lastClockCheck = 0;
+  time_t lastCoverageSave = time(NULL);
+  int rv;
 
 #ifndef _WIN32
   /* Signal handling, use POSIX calls with standardized semantics */
@@ -125,8 +316,10 @@ int main ( int argc, char **argv )
   sigaction(SIGQUIT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
 
-  sa.sa_handler = SIG_IGN;
+  sa.sa_handler = hup_handler;
   sigaction(SIGHUP, &sa, NULL);
+
+  sa.sa_handler = SIG_IGN;
   sigaction(SIGPIPE, &sa, NULL);
 
   /* Signal-handling function that needs to be inherited by threads */
@@ -134,6 +327,8 @@ int main ( int argc, char **argv )
   sigaction(SIGUSR1, &sa, NULL);
 #endif
 
+  startup_begin (STARTUP_CONFIG, "Startup");
+
 /* Initialize the verbosity for the dl_log function */
 dl_loginit (verbose-1, &print_timelog, "", &print_timelog, "");
 
@@ -147,78 +342,201 @@ ms_loginit (&print_timelog, NULL, &print_timelog, NULL);
   // then read config
   handle_opts(argc, argv);
   verbose = gConfig.Verbosity;
-  flushlatency = gConfig.FlushLatency;
-  reconnectinterval = gConfig.ReconnectInterval;
+  dl_loginit (verbose-1, &print_timelog, "", &print_timelog, "");
 
-  lib330Interface_initialize();
+  /* Settings that may change on reload are read by the data path from a snapshot */
+  if ( ! (rc = runconfig_build (&gConfig)) )
+  {
+    exit (1);
+  }
+  runconfig_publish (rc);
+  startup_mark (STARTUP_CONFIG);
 
-  /* Initialize trace buffer */
-  if ( ! (mstg = mst_initgroup ( mstg )) )
+  /* Before any thread starts, each applies the settings of its role */
+  if ( placement_init (gConfig.Threads, gConfig.LockMemory) < 0 )
   {
-    ms_log (2, "Cannot initialize MSTraceList\n");
     exit (1);
-    }
+  }
+  placement_enter (THREAD_MAIN, "main");
+
+  if ( trace_init (gConfig.TraceEvents, gConfig.TraceSample, gConfig.TraceDir) < 0 )
+  {
+    exit (1);
+  }
 
+  /* What was sent before a restart is not sent again */
+  if ( gConfig.ContFileDir[0] )
+  {
+    snprintf (coveragefile, sizeof(coveragefile), "%s/Q3302EW_cont_%s.cov",
+              gConfig.ContFileDir, gConfig.ConfigFileName);
+    if ( (rv = coverage_load (coveragefile)) > 0 )
+      ms_log (0, "Loaded %d sent time spans from %s\n", rv, coveragefile);
+  }
 
-  char tmps[285];
-  sprintf(tmps, "%s:%d", gConfig.datalinkHost, gConfig.datalinkPort);
-  fprintf(stderr, "datalink to %s", tmps);
-  rsaddr = tmps;
-  /* Allocate and initialize DataLink connection description */
-  if ( ! (dlcp = dl_newdlcp (rsaddr, PACKAGE)) )
+  /* Initialize trace buffers and pack workers before any data can arrive */
+  if ( initpacking (gConfig.PackThreads) < 0 )
   {
-    fprintf (stderr, "Cannot allocation DataLink descriptor\n");
     exit (1);
   }
 
-  /* Connect to destination DataLink server */
-  if ( dl_connect (dlcp) < 0 )
+  decimate_init(gConfig.Decimators, gConfig.numDecimators, submitderived);
+  trigger_init(gConfig.Triggers, gConfig.numTriggers, submittrigger);
+  amplitude_init(gConfig.Amplitudes, gConfig.numAmplitudes, submitamplitudes);
+
+  if ( ! rc->datalinkaddr[0] && gConfig.SeedLinkPort <= 0 && ! gConfig.ShmRingPath[0] &&
+       ! gConfig.ArchiveRoot[0] )
   {
-    ms_log (1, "Initial connection to DataLink server (%s) failed, will retry later\n", dlcp->addr);
-    dl_disconnect (dlcp);
+    ms_log (2, "None of DataLinkHost, SeedLinkPort, ShmRingPath or ArchiveRoot is configured\n");
+    exit (1);
   }
-  else if ( verbose )
-    ms_log (1, "Connected to ringserver at %s\n", dlcp->addr);
 
-  /* to prevent flooding the log file during long reconnect attempts */
-  retryCount=0;  /* it may be reset elsewere */
+  /* The DataLink connection is made and kept up by its own thread, connecting
+     while the rest starts up and the station registers */
+  if ( dlconn_start (rc->datalinkaddr, gConfig.ReconnectInterval, gConfig.ReconnectMaxInterval,
+                     gConfig.ConnectTimeout) < 0 )
+  {
+    exit (1);
+  }
 
+  if ( shaper_start (gConfig.DataLinkRate, gConfig.DataLinkBurst, gConfig.DataLinkQueueRecords, dlsend) < 0 )
+  {
+    exit (1);
+  }
+  shaper_setmemorylimit (rc->memorylimit);
+  soh_enable (gConfig.SohInterval > 0 && rc->datalinkaddr[0]);
 
-  // keep trying to register as long as 1) we haven't and 2) we're
-  // not supposed to die and 3) we don't hit the max retry counts (default 5)
-  lib330Interface_startRegistration();
-  registration_count++;
-  while(!lib330Interface_waitForState(LIBSTATE_RUN, 120) && ! stopsig ) {
-    lib330Interface_startRegistration();
-    registration_count++;
-    if (registration_count > gConfig.RegistrationCyclesLimit)
+  /* Records the DataLink server did not get at the last shutdown go out as backfill */
+  if ( gConfig.ContFileDir[0] )
+  {
+    snprintf (spoolfile, sizeof(spoolfile), "%s/Q3302EW_cont_%s.spool",
+              gConfig.ContFileDir, gConfig.ConfigFileName);
+    if ( spool_start (spoolfile, replayrecord) < 0 )
     {
-      stopsig=2; // signal not to enter while loop for processing
-      fprintf(stderr, "q3302ew: regsitration limit of %d tries reached, exiting", registration_count);
+      exit (1);
     }
-    else
+    /* A paused DataLink spools rather than hold back the other destinations */
+    shaper_setspill (dlspool);
+  }
+
+  if ( gConfig.ShmRingPath[0] )
+  {
+    if ( ! (shmring = shmring_create (gConfig.ShmRingPath, gConfig.ShmRingSlots, gConfig.ShmRingSlotSize)) )
+    {
+      ms_log (2, "Cannot create shared-memory ring %s: %s\n", gConfig.ShmRingPath, strerror (errno));
+      exit (1);
+    }
+    ms_log (0, "Shared-memory ring %s, %d slots, next sequence %llu\n", gConfig.ShmRingPath,
+            gConfig.ShmRingSlots, (unsigned long long) shmring->header->writeseq);
+  }
+
+  if ( gConfig.StatsPath[0] )
+  {
+    if ( ! (statseg = statseg_create (gConfig.StatsPath, gConfig.StatsStreams)) )
+    {
+      ms_log (2, "Cannot create statistics segment %s: %s\n", gConfig.StatsPath, strerror (errno));
+      exit (1);
+    }
+    ms_log (0, "Statistics segment %s for %d streams\n", gConfig.StatsPath, gConfig.StatsStreams);
+  }
+
+  if ( gConfig.ArchiveRoot[0] &&
+       archive_start (gConfig.ArchiveRoot, gConfig.ArchiveWriteDelay, gConfig.ArchiveSyncInterval,
+                      gConfig.ArchiveMaxOpenFiles, gConfig.ArchiveBufferSize, gConfig.ArchiveUring) < 0 )
+  {
+    exit (1);
+  }
+
+  if ( gConfig.SeedLinkPort > 0 &&
+       slserver_start (gConfig.SeedLinkPort, gConfig.SeedLinkRingRecords, gConfig.SeedLinkMaxClients) < 0 )
+  {
+    exit (1);
+  }
+
+  if ( gConfig.ControlSocket[0] &&
+       ctlsock_start (gConfig.ControlSocket,
+                      (1 << CTL_DATALINK) | ( ( gConfig.SeedLinkPort > 0 ) ? 1 << CTL_SEEDLINK : 0 ) |
+                      ( ( shmring ) ? 1 << CTL_SHMRING : 0 ) |
+                      ( ( gConfig.ArchiveRoot[0] ) ? 1 << CTL_ARCHIVE : 0 )) < 0 )
+  {
+    exit (1);
+  }
+
+  /* Samples left in the trace buffers by a crash are packed before new data */
+  if ( gConfig.ContFileDir[0] && gConfig.CheckpointInterval > 0 )
+  {
+    snprintf (checkpointfile, sizeof(checkpointfile), "%s/Q3302EW_cont_%s.ckp",
+              gConfig.ContFileDir, gConfig.ConfigFileName);
+    if ( (rv = checkpoint_load (checkpointfile, gConfig.CheckpointMaxAge, restorerecord)) > 0 )
+      ms_log (0, "Restored %d trace buffers from %s\n", rv, checkpointfile);
+    if ( checkpoint_start (checkpointfile, gConfig.CheckpointInterval, numpackctx, capturecontext) < 0 )
     {
-      fprintf(stderr, "q3302ew: retrying registration: %d\n", registration_count);
+      exit (1);
     }
   }
 
+  lib330Interface_initialize();
+
+
+  /* to prevent flooding the log file during long reconnect attempts */
+  retryCount=0;  /* it may be reset elsewere */
+
+
+  // keep trying to register as long as 1) we haven't and 2) we're
+  // not supposed to die and 3) we don't hit the max retry counts (default 5)
+  registerstation();
+
   // now we're registered and getting data.  We'll keep doing so until we're told to stop.
   lastStatusUpdate = time(NULL);
+  lib330Interface_publishSoh();
+  lastSoh = time(NULL);
   while( ! stopsig) {
     if( (time(NULL) - lastStatusUpdate) >= gConfig.statusinterval ) {
       lib330Interface_displayStatusUpdate();
       lastStatusUpdate = time(NULL);
     }
+    if( gConfig.SohInterval > 0 && (time(NULL) - lastSoh) >= gConfig.SohInterval ) {
+      lib330Interface_publishSoh();
+      lastSoh = time(NULL);
+    }
+    if( time(NULL) != lastClockCheck ) {
+      stationclockqual = lib330Interface_getClockQuality();
+      if( statseg ) {
+        publishstats();
+      }
+      lastClockCheck = time(NULL);
+      runconfig_reclaim();
+    }
+    if( reloadsig ) {
+      reloadsig = 0;
+      reloadconfig();
+    }
+    if( (rv = ctlsock_verbosity()) >= 0 ) {
+      setverbosity(rv);
+    }
+    if( coveragefile[0] && time(NULL) - lastCoverageSave >= 60 ) {
+      coverage_save(coveragefile);
+      lastCoverageSave = time(NULL);
+    }
     dlp_usleep (MAIN_WHILE_USLEEP);
-    /* new code to detect if we fall into a WAIT for registration state for too long */
-    if (lib330Interface_waitForState(LIBSTATE_WAIT, 1) == 1) {
-      wait_counter++;
+    /* detect if we fall into a WAIT for registration state for too long,
+       registering again early unless lib330 is sleeping out a duty cycle */
+    now = time(NULL);
+    if (lib330Interface_getLibState() == LIBSTATE_WAIT) {
+      if (!waitsince) {
+        waitsince = lastregistration = now;
+      }
+      if (now - lastregistration >= gConfig.RegistrationTimeout &&
+          !gConfig.Dutycycle_MaxConnectTime && !gConfig.Dutycycle_BufferLevel) {
+        fprintf(stderr, "q3302ew: in wait state for %d seconds, registering again\n", (int)(now - waitsince));
+        lib330Interface_startRegistration();
+        lastregistration = now;
+      }
+      if (now - waitsince >= MAX_WAIT_STATE_BEFORE_EXIT) {
+        fprintf(stderr, "q3302ew: hung in wait state for more than: %d seconds\n", MAX_WAIT_STATE_BEFORE_EXIT);
+        stopsig=2;
+      }
     } else {
-      wait_counter = 0;
-    }
-    if (wait_counter >= MAX_WAIT_STATE_BEFORE_EXIT) {
-      fprintf(stderr, "q3302ew: hung in wait state for more than: %d seconds\n", MAX_WAIT_STATE_BEFORE_EXIT);
-      stopsig=2;
+      waitsince = 0;
     }
   }
   // we've been asked to terminate
@@ -364,6 +682,142 @@ void lib330Interface_displayStatusUpdate() {
   // percent of the buffer left, and the clock quality
   fprintf(stderr, "--- Q330 Packet Buffer Available: %d Clock Quality: %d\n", 100-((int)libStatus.pkt_full),
              (int)libStatus.clock_qual);
+
+  // continuity of the one second data
+  {
+    StreamInfo *si;
+    int64_t gaps = 0, overlaps = 0, tears = 0;
+    for(si = streams_first(); si; si = si->listnext) {
+      gaps += si->gaps;
+      overlaps += si->overlaps;
+      tears += si->tears;
+    }
+    fprintf(stderr, "--- Continuity: %lld gaps, %lld overlaps, %lld time tears in %d streams\n",
+            (long long int) gaps, (long long int) overlaps, (long long int) tears, streams_count());
+  }
+
+  // compression of the records sent, per stream when verbose
+  {
+    StreamInfo *si;
+    int64_t samples = 0, bytes = 0;
+    for(si = streams_first(); si; si = si->listnext) {
+      samples += si->recsamples;
+      bytes += si->recbytes;
+      if(verbose && si->recsamples > 0) {
+        fprintf(stderr, "--- %s: %s, %.2f bytes/sample, ratio %.2f\n", si->srcname,
+                encoding_name(si->lastencoding), (double) si->recbytes / si->recsamples,
+                4.0 * si->recsamples / si->recbytes);
+      }
+    }
+    if(samples > 0) {
+      fprintf(stderr, "--- Compression: %.2f bytes/sample, ratio %.2f, in %lld bytes\n",
+              (double) bytes / samples, 4.0 * samples / bytes, (long long int) bytes);
+    }
+  }
+
+  // DataLink connection
+  {
+    DLConnStats conn;
+    dlconn_stats(&conn);
+    if(conn.state != DLCONN_DISABLED) {
+      fprintf(stderr, "--- DataLink %s: %s since %.24s, %lld connects, %lld failed attempts, %lld lost\n",
+              conn.addr, dlconn_statename(conn.state), ctime(&conn.since), (long long int) conn.connects,
+              (long long int) conn.failures, (long long int) conn.disconnects);
+    }
+  }
+
+  // DataLink shaper queues, longest wait since the last status
+  if(shaper_running()) {
+    ShaperStats stats;
+    fprintf(stderr, "--- DataLink queues:");
+    for(i = 0; i < SHAPER_CLASSES; i++) {
+      shaper_stats(i, &stats, 1);
+      fprintf(stderr, " %s %d queued, %lld sent, %lld failed, max wait %.1fs%s", shaper_classname(i),
+              stats.queued, (long long int) stats.records, (long long int) stats.failed, stats.maxdelay,
+              (i < SHAPER_CLASSES - 1) ? ";" : "\n");
+    }
+  }
+
+  // Memory held by data on its way out, and the stream holding most at a time
+  {
+    MemStats mem;
+    ShaperStats stats;
+    StreamInfo *si, *largest = NULL;
+    int64_t dropped = 0;
+    memacct_stats(&mem);
+    for(i = 0; shaper_running() && i < SHAPER_CLASSES; i++) {
+      shaper_stats(i, &stats, 0);
+      dropped += stats.dropped;
+    }
+    fprintf(stderr, "--- Memory: %s %lld kB (peak %lld kB), %s %lld kB (peak %lld kB), total peak %lld kB",
+            memacct_poolname(MEM_TRACES), (long long int) mem.current[MEM_TRACES] / 1024,
+            (long long int) mem.peak[MEM_TRACES] / 1024, memacct_poolname(MEM_QUEUE),
+            (long long int) mem.current[MEM_QUEUE] / 1024, (long long int) mem.peak[MEM_QUEUE] / 1024,
+            (long long int) mem.peaktotal / 1024);
+    if(gConfig.MemoryLimit > 0 || gConfig.StreamMemoryLimit > 0) {
+      fprintf(stderr, ", %lld early flushes, %lld records dropped", (long long int) mem.flushes,
+              (long long int) dropped);
+    }
+    fprintf(stderr, "\n");
+    for(si = streams_first(); si; si = si->listnext) {
+      if(!largest || si->peakheld > largest->peakheld) {
+        largest = si;
+      }
+    }
+    if(verbose && largest) {
+      fprintf(stderr, "--- Largest trace buffer: %s, %lld bytes now, peak %lld bytes\n", largest->srcname,
+              (long long int) largest->held, (long long int) largest->peakheld);
+    }
+  }
+
+  // Threads, CPU used and time spent waiting to run since the last status
+  {
+    ThreadStats ts;
+    for(i = 0; i < placement_threads(); i++) {
+      if(placement_stats(i, &ts, 1) < 0 || ts.cpu < 0.0) {
+        continue;
+      }
+      fprintf(stderr, "--- Thread %s (%s, tid %d, %s %d): %.1f%% CPU, %.2f%% waiting, %.0f us wait per run\n",
+              ts.name, placement_rolename(ts.role), ts.tid, placement_policyname(ts.policy), ts.priority,
+              ts.cpu, ts.waiting, ts.slicewait);
+    }
+  }
+}
+
+/**
+ * Publish the lib330 status and our own counters as SOH over DataLink
+ **/
+void lib330Interface_publishSoh() {
+  enum tlibstate currentState;
+  enum tliberr lastError;
+  topstat libStatus;
+  string63 stateName;
+  char netsta[20];
+  char *net, *sta;
+
+  currentState = lib_get_state(stationContext, &lastError, &libStatus);
+  lib_get_statestr(currentState, &stateName);
+
+  if(libStatus.station_name[0]) {
+    splitstationname(libStatus.station_name, netsta, &net, &sta);
+    soh_setstation(net, sta);
+  }
+
+  soh_publishstatus(stateName, (currentState == LIBSTATE_RUN) ? &libStatus : NULL);
+}
+
+/**
+ * Current clock quality percent from the lib330 status, or the last known
+ * value when not running
+ **/
+int lib330Interface_getClockQuality() {
+  enum tliberr lastError;
+  topstat libStatus;
+
+  if(lib_get_state(stationContext, &lastError, &libStatus) != LIBSTATE_RUN) {
+    return stationclockqual;
+  }
+  return (int)libStatus.clock_qual;
 }
 
 
@@ -414,6 +868,7 @@ void lib330Interface_initialize() {
   lib_create_context(&(stationContext), &(creationInfo));
   if(creationInfo.resp_err == LIBERR_NOERR) {
     fprintf(stderr, "+++ Station thread created\n");
+    startup_mark(STARTUP_CONTEXT);
   } else {
     lib330Interface_handleError(creationInfo.resp_err);
   }
@@ -428,7 +883,21 @@ void lib330Interface_libStateChanged(enum tlibstate newState) {
 
   lib_get_statestr(newState, &newStateName);
   fprintf(stderr, "+++ State change to '%s'\n", newStateName);
+  soh_publishstate(newStateName);
+
+  /* Time the way back to data after losing the registration */
+  if(currentLibState == LIBSTATE_RUN && newState != LIBSTATE_RUN && !stopsig) {
+    startup_begin(STARTUP_REGISTERED, "Re-registration");
+  } else if(newState == LIBSTATE_RUN) {
+    startup_mark(STARTUP_REGISTERED);
+  }
+
+  pthread_mutex_lock(&libstatelock);
   currentLibState = newState;
+  libstatechanges++;
+  libstatetime = time(NULL);
+  pthread_cond_broadcast(&libstatecond);
+  pthread_mutex_unlock(&libstatelock);
 
   /*
    ** We have no good reason for sitting in RUNWAIT, so lets just go
@@ -473,29 +942,41 @@ void lib330Interface_changeState(enum tlibstate newState, enum tliberr reason) {
   lib_change_state(stationContext, newState, reason);
 }
 
-void lib330Interface_cleanup() {
+/**
+ * Deregister and close lib330, giving up after maxSecondsToWait, or
+ * waiting as long as it takes with 0.  TERM always gets a second.
+ **/
+void lib330Interface_cleanup(int maxSecondsToWait) {
   enum tliberr errcode;
-  int loopCount;
+  time_t until = time(NULL) + maxSecondsToWait;
+  int waited;
   fprintf(stderr, "+++ Cleaning up lib330 Interface\n");
+  deregistering = 1;
   lib330Interface_startDeregistration();
-  loopCount=0;
-  while(lib330Interface_getLibState() != LIBSTATE_IDLE) {
-    loopCount++;
-    if (loopCount % 100 == 0) {
+  waited=0;
+  while(!lib330Interface_waitForState(LIBSTATE_IDLE, 1)) {
+    waited++;
+    if (maxSecondsToWait > 0 && time(NULL) >= until) {
+      fprintf(stderr, "+++ lib330 not idle after %d seconds, leaving it\n", waited);
+      return;
+    }
+    if (waited % 10 == 0) {
       fprintf(stderr, "...wait for lib330Interface_getLibState() == LIBSTATE_IDLE, %d\n", lib330Interface_getLibState());
     }
-    dlp_usleep(MAIN_WHILE_USLEEP);
   }
   fprintf(stderr, "+++ lib330Interface_getLibState() == LIBSTATE_IDLE\n");
   lib330Interface_changeState(LIBSTATE_TERM, LIBERR_CLOSED);
   fprintf(stderr, "+++ lib330Interface_changeState(LIBSTATE_TERM, LIBERR_CLOSED)\n");
-  loopCount=0;
-  while(lib330Interface_getLibState() != LIBSTATE_TERM) {
-    loopCount++;
-    if (loopCount % 100 == 0) {
+  waited=0;
+  while(!lib330Interface_waitForState(LIBSTATE_TERM, 1)) {
+    waited++;
+    if (maxSecondsToWait > 0 && time(NULL) >= until) {
+      fprintf(stderr, "+++ lib330 not terminated after %d seconds, leaving it\n", waited);
+      return;
+    }
+    if (waited % 10 == 0) {
       fprintf(stderr, "...wait for lib330Interface_getLibState() == LIBSTATE_TERM\n");
     }
-    dlp_usleep(MAIN_WHILE_USLEEP);
   }
   fprintf(stderr, "+++ lib330Interface_getLibState() == LIBSTATE_TERM\n");
   errcode = lib_destroy_context(&(stationContext));
@@ -525,91 +1006,569 @@ void lib330Interface_ping() {
  * return value indicated whether we reached the desired state or not
  **/
 int lib330Interface_waitForState(enum tlibstate waitFor, int maxSecondsToWait) {
-  int i;
-  for(i=0; i < maxSecondsToWait; i++) {
-    if(lib330Interface_getLibState() != waitFor) {
-      dlp_usleep(1e6);
-    } else {
-      return 1;
+  return waitlib(maxSecondsToWait, 1u << waitFor, -1);
+}
+
+/*********************************************************************
+ * waitlib:
+ *
+ * Wait up to seconds for lib330 to reach one of the states in statemask,
+ * a bit per enum tlibstate value, or, unless replies is -1, for more
+ * than replies ping replies.  Gives up early on termination, except
+ * while deregistering at shutdown.
+ *
+ * Returns 1 if the state or a reply was seen and 0 otherwise.
+ *********************************************************************/
+static int waitlib ( double seconds, unsigned int statemask, int replies )
+{
+  struct timespec deadline;
+  struct timespec slice;
+  int rv = 1;
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += (time_t) seconds;
+  deadline.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+  if ( deadline.tv_nsec >= 1000000000L )
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock (&libstatelock);
+  while ( ! ( (1u << currentLibState) & statemask ) && ( replies < 0 || pingreplies == replies ) )
+  {
+    /* Wake up every MAIN_WHILE_USLEEP to notice a termination request */
+    clock_gettime (CLOCK_REALTIME, &slice);
+    if ( ( stopsig && ! deregistering ) || slice.tv_sec > deadline.tv_sec ||
+         ( slice.tv_sec == deadline.tv_sec && slice.tv_nsec >= deadline.tv_nsec ) )
+    {
+      rv = 0;
+      break;
+    }
+    slice.tv_nsec += MAIN_WHILE_USLEEP * 1000;
+    if ( slice.tv_nsec >= 1000000000L )
+    {
+      slice.tv_sec++;
+      slice.tv_nsec -= 1000000000L;
     }
+    if ( slice.tv_sec > deadline.tv_sec ||
+         ( slice.tv_sec == deadline.tv_sec && slice.tv_nsec > deadline.tv_nsec ) )
+      slice = deadline;
+    pthread_cond_timedwait (&libstatecond, &libstatelock, &slice);
   }
-  return 0;
+  pthread_mutex_unlock (&libstatelock);
+
+  return rv;
+}  /* End of waitlib() */
+
+/* Monotonic seconds, for the shutdown deadlines */
+static double monoseconds ( void )
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-/**
- * Below here are several callbacks for lib330 to use for various events
- **/
+/*********************************************************************
+ * gateenter:
+ *
+ * Enter a lib330 data callback, paired with gateexit().  Once the gate
+ * is closed at shutdown callbacks return without touching the trace
+ * buffers.
+ *
+ * Returns 1 if the callback may go on and 0 otherwise.
+ *********************************************************************/
+static int gateenter ( void )
+{
+  if ( __atomic_add_fetch (&datagate, 1, __ATOMIC_SEQ_CST) & DATAGATE_CLOSED )
+  {
+    __atomic_sub_fetch (&datagate, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch (&gatedropped, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
 
-void lib330Interface_stateCallback(pointer p){
-  tstate_call *state;
+  return 1;
+}
 
-  state = (tstate_call *)p;
+static void gateexit ( void )
+{
+  __atomic_sub_fetch (&datagate, 1, __ATOMIC_RELEASE);
+}
 
-  if(state->state_type == ST_STATE) {
-    lib330Interface_libStateChanged((enum tlibstate)state->info);
+/*********************************************************************
+ * gateclose:
+ *
+ * Close the gate and wait up to seconds, at least one, or with seconds
+ * negative as long as it takes, for the callbacks inside to return.
+ *
+ * Returns 1 once no callback is inside and 0 otherwise.
+ *********************************************************************/
+static int gateclose ( double seconds )
+{
+  double until = monoseconds () + ( ( seconds < 1.0 ) ? 1.0 : seconds );
+
+  __atomic_or_fetch (&datagate, DATAGATE_CLOSED, __ATOMIC_SEQ_CST);
+  while ( __atomic_load_n (&datagate, __ATOMIC_ACQUIRE) & ~DATAGATE_CLOSED )
+  {
+    if ( seconds >= 0.0 && monoseconds () >= until )
+      return 0;
+    dlp_usleep (10000);
   }
+
+  return 1;
 }
 
-void lib330Interface_msgCallback(pointer p){
-  tmsg_call *msg = (tmsg_call *) p;
-  string95 msgText;
-  char dataTime[32];
+/*********************************************************************
+ * flushcontexts:
+ *
+ * Pack and send what is left in the trace buffers of every pack
+ * context, each on a thread of its own and the first on this one.
+ * lib330 and the pack workers must be done with the contexts.
+ *********************************************************************/
+static void flushcontexts ( void )
+{
+  pthread_t threads[PACKPOOL_MAX_WORKERS];
+  int started[PACKPOOL_MAX_WORKERS];
+  int i;
 
-  lib_get_msg(msg->code, &msgText);
+  for ( i = 1; i < numpackctx; i++ )
+    started[i] = ( pthread_create (&threads[i], NULL, flushcontext, &packctx[i]) == 0 );
 
-  // we don't need to worry about current time, the log system handles that
-  //jul_string(msg->timestamp, &currentTime);
-  if(!msg->datatime) {
-    fprintf(stderr, "{%d} %s %s\n", msg->code, msgText, msg->suffix);
-  } else {
-    //jul_string(msg->datatime, (char *) &dataTime);
-    fprintf(stderr, "{%d} [%s] %s %s\n", msg->code, dataTime, msgText, msg->suffix);
+  packtraces (&packctx[0], NULL, 1, HPTERROR);
+
+  for ( i = 1; i < numpackctx; i++ )
+  {
+    if ( started[i] )
+      pthread_join (threads[i], NULL);
+    else
+      packtraces (&packctx[i], NULL, 1, HPTERROR);
   }
 }
 
-void lib330Interface_1SecCallback(pointer p){
-  tonesec_call *data = (tonesec_call *) p;
+static void *flushcontext ( void *arg )
+{
+  placement_enter (THREAD_PACK, "flush");
+  packtraces ((PackContext *) arg, NULL, 1, HPTERROR);
 
-  static struct blkt_1000_s Blkt1000;
-  static struct blkt_1001_s Blkt1001;
-  MSTrace *mst = NULL;
-  static MSRecord *mstemplate = NULL;
-  static MSRecord *msr = NULL;
+  return NULL;
+}
 
+/* Checkpoint callback, copy the buffers of a pack context under its lock */
+static void capturecontext ( int context )
+{
+  pthread_mutex_lock (&packctx[context].lock);
+  checkpoint_capture (context, packctx[context].mstg);
+  pthread_mutex_unlock (&packctx[context].lock);
+}
 
-  char *sta, *net;
-  char netsta[10];
-  double startTS;
+/*********************************************************************
+ * timerstart:
+ *
+ * Start the thread that, once a second, flushes the streams of every
+ * pack context not updated within FlushLatency.  Streams that go quiet
+ * are sent even when no packet reaches their context anymore.  Flushes
+ * requested on the control socket are done by it within a tick.
+ *
+ * Returns 0 on success and -1 on error.
+ *********************************************************************/
+static int timerstart ( void )
+{
+  pthread_condattr_t attr;
 
-  if (verbose > 2) fprintf(stderr, "OneSec for %s {%d} %d\n", data->channel, data->rate, data->filter_bits);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&timercond, &attr);
+  pthread_condattr_destroy (&attr);
 
-  /* Set up MSRecord template */
-  if ( (msr = msr_init (msr)) == NULL )
+  timerdone = 0;
+
+  if ( pthread_create (&timerthread, NULL, flushtimer, NULL) != 0 )
   {
-    ms_log (2, "Cannot initialize packing template\n");
-    return;
+    ms_log (2, "Cannot start flush timer thread\n");
+    return -1;
   }
+  timing = 1;
 
-  // seperate the station from the net
-  strcpy(netsta, data->station_name);
-  net = netsta;
-  sta = netsta;
-  while(*sta != '-' && *sta != '\0') {
-    sta++;
-  }
-  if(*sta == '-') {
-    *sta = '\0';
-    sta++;
-  } else {
-    char *tmp;
-    tmp = sta;
-    sta = net;
-    net = tmp;
-  }
-  ms_strncpclean (msr->network, net, 2);
-  ms_strncpclean (msr->station, sta, 5);
-  ms_strncpclean (msr->location, data->location, 2);
-  ms_strncpclean (msr->channel, data->channel, 3);
+  return 0;
+}
+
+static void timerstop ( void )
+{
+  if ( ! timing )
+    return;
+
+  pthread_mutex_lock (&timerlock);
+  timerdone = 1;
+  pthread_cond_broadcast (&timercond);
+  pthread_mutex_unlock (&timerlock);
+  pthread_join (timerthread, NULL);
+  timing = 0;
+}
+
+static void *flushtimer ( void *arg )
+{
+  struct timespec deadline;
+  char pattern[CTL_PATTERN_MAX];
+  uint32_t flushseen = 0;
+  RunConfig *rc;
+  hptime_t flushtime;
+  int ticks = 0;
+  int i;
+
+  placement_enter (THREAD_PACK, "timer");
+
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+
+  pthread_mutex_lock (&timerlock);
+  while ( ! timerdone )
+  {
+    deadline.tv_nsec += 1000000000L / FLUSH_TIMER_TICKS;
+    if ( deadline.tv_nsec >= 1000000000L )
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while ( ! timerdone && pthread_cond_timedwait (&timercond, &timerlock, &deadline) != ETIMEDOUT )
+      ;
+    if ( timerdone )
+      break;
+    pthread_mutex_unlock (&timerlock);
+
+    runconfig_enter (RUNCONFIG_READER_TIMER);
+    rc = runconfig_current ();
+
+    if ( ctlsock_flushwanted (&flushseen, pattern, sizeof(pattern)) )
+    {
+      for ( i = 0; i < numpackctx; i++ )
+      {
+        pthread_mutex_lock (&packctx[i].lock);
+        flushmatching (&packctx[i], pattern);
+        pthread_mutex_unlock (&packctx[i].lock);
+      }
+      ctlsock_flushdone (flushseen);
+    }
+
+    if ( ++ticks >= FLUSH_TIMER_TICKS && rc->flushlatency > 0 )
+    {
+      flushtime = dlp_time () - (hptime_t) rc->flushlatency * HPTMODULUS;
+      for ( i = 0; i < numpackctx; i++ )
+      {
+        pthread_mutex_lock (&packctx[i].lock);
+        packtraces (&packctx[i], NULL, 0, flushtime);
+        pthread_mutex_unlock (&packctx[i].lock);
+      }
+    }
+    if ( ticks >= FLUSH_TIMER_TICKS )
+      ticks = 0;
+
+    runconfig_exit (RUNCONFIG_READER_TIMER);
+
+    pthread_mutex_lock (&timerlock);
+  }
+  pthread_mutex_unlock (&timerlock);
+
+  return NULL;
+}
+
+/*********************************************************************
+ * watchstart:
+ *
+ * Start the shutdown watchdog, nothing with seconds 0.  At the drain
+ * deadline it aborts a DataLink write still in progress so the shaper
+ * spools the rest, and after seconds it exits the process.
+ *********************************************************************/
+static void watchstart ( int seconds )
+{
+  pthread_condattr_t attr;
+
+  if ( seconds <= 0 )
+    return;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&watchcond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  clock_gettime (CLOCK_MONOTONIC, &watchbase);
+  watchseconds = seconds;
+  watchdone = 0;
+
+  if ( pthread_create (&watchthread, NULL, shutdownwatch, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start shutdown watchdog thread\n");
+    return;
+  }
+  watching = 1;
+}
+
+static void watchstop ( void )
+{
+  if ( ! watching )
+    return;
+
+  pthread_mutex_lock (&watchlock);
+  watchdone = 1;
+  pthread_cond_broadcast (&watchcond);
+  pthread_mutex_unlock (&watchlock);
+  pthread_join (watchthread, NULL);
+  watching = 0;
+}
+
+/* Wait until seconds into the shutdown, returns 1 if it is done by then */
+static int watchuntil ( double seconds )
+{
+  struct timespec deadline = watchbase;
+
+  deadline.tv_sec += (time_t) seconds;
+  deadline.tv_nsec += (long) (( seconds - (time_t) seconds ) * 1e9);
+  if ( deadline.tv_nsec >= 1000000000L )
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while ( ! watchdone && pthread_cond_timedwait (&watchcond, &watchlock, &deadline) != ETIMEDOUT )
+    ;
+
+  return watchdone;
+}
+
+static void *shutdownwatch ( void *arg )
+{
+  placement_enter (THREAD_MAIN, "watchdog");
+
+  pthread_mutex_lock (&watchlock);
+
+  if ( ! watchuntil (watchseconds * SHUTDOWN_DRAIN) )
+  {
+    ms_log (1, "Shutdown drain deadline reached, spooling what is not sent\n");
+    dlconn_abort ();
+
+    if ( ! watchuntil (watchseconds) )
+    {
+      ms_log (2, "Shutdown took more than ShutdownTimeout %d seconds, exiting\n", watchseconds);
+      _exit (1);
+    }
+  }
+
+  pthread_mutex_unlock (&watchlock);
+
+  return NULL;
+}
+
+/*********************************************************************
+ * registerstation:
+ *
+ * Register with the Q330 and return once lib330 runs.  The station is
+ * pinged first and registration starts as soon as it answers, waiting
+ * twice as long for each unanswered ping and registering anyway after
+ * REG_PINGS_BEFORE_REGISTER of them.  A registration is started again
+ * as soon as lib330 gives up on it (WAIT) or once its state has not
+ * changed for RegistrationTimeout seconds, rather than after a fixed
+ * time.  After RegistrationCyclesLimit registrations termination is
+ * requested.
+ *
+ * Returns 0 once registered and -1 otherwise.
+ *********************************************************************/
+static int registerstation ( void )
+{
+  enum tlibstate state;
+  dltime_t pingsent;
+  time_t regstart;
+  time_t since;
+  double pingwait;
+  int registrations = 0;
+  int changes;
+  int moved;
+  int replies;
+  int pings;
+
+  while ( ! stopsig )
+  {
+    pingwait = 1.0;
+    for ( pings = 0; pings < REG_PINGS_BEFORE_REGISTER && ! stopsig; pings++ )
+    {
+      pthread_mutex_lock (&libstatelock);
+      replies = pingreplies;
+      pthread_mutex_unlock (&libstatelock);
+
+      pingsent = dlp_time ();
+      lib330Interface_ping ();
+      if ( waitlib (pingwait, 0, replies) )
+      {
+        startup_mark (STARTUP_PING);
+        if ( verbose )
+          ms_log (0, "Q330 answered ping in %.0f ms\n", (dlp_time () - pingsent) / 1000.0);
+        break;
+      }
+
+      if ( ! stopsig )
+        ms_log (1, "No ping reply from the Q330 within %.0f s\n", pingwait);
+      pingwait = ( pingwait * 2 < REG_MAX_PING_WAIT ) ? pingwait * 2 : REG_MAX_PING_WAIT;
+    }
+    if ( stopsig )
+      break;
+
+    registrations++;
+    if ( registrations > gConfig.RegistrationCyclesLimit )
+    {
+      stopsig=2; // signal not to enter while loop for processing
+      fprintf(stderr, "q3302ew: regsitration limit of %d tries reached, exiting\n", registrations - 1);
+      break;
+    }
+    if ( registrations > 1 )
+      fprintf(stderr, "q3302ew: retrying registration: %d\n", registrations);
+
+    pthread_mutex_lock (&libstatelock);
+    changes = libstatechanges;
+    pthread_mutex_unlock (&libstatelock);
+    regstart = time (NULL);
+    lib330Interface_startRegistration ();
+
+    while ( ! waitlib (1.0, 1u << LIBSTATE_RUN, -1) )
+    {
+      if ( stopsig )
+        return -1;
+
+      /* Only changes since this registration started count */
+      pthread_mutex_lock (&libstatelock);
+      moved = ( libstatechanges != changes );
+      state = currentLibState;
+      since = ( moved && libstatetime > regstart ) ? libstatetime : regstart;
+      pthread_mutex_unlock (&libstatelock);
+
+      if ( moved && state == LIBSTATE_WAIT )
+      {
+        fprintf(stderr, "q3302ew: registration failed after %d seconds\n", (int) (time (NULL) - regstart));
+        break;
+      }
+      if ( time (NULL) - since >= gConfig.RegistrationTimeout )
+      {
+        fprintf(stderr, "q3302ew: registration stalled for %d seconds\n", (int) (time (NULL) - since));
+        break;
+      }
+    }
+
+    if ( lib330Interface_getLibState () == LIBSTATE_RUN )
+      return 0;
+  }
+
+  return -1;
+}  /* End of registerstation() */
+
+/**
+ * Below here are several callbacks for lib330 to use for various events
+ **/
+
+void lib330Interface_stateCallback(pointer p){
+  tstate_call *state;
+
+  placement_enter(THREAD_LIB330, "lib330");
+  state = (tstate_call *)p;
+
+  if(state->state_type == ST_STATE) {
+    lib330Interface_libStateChanged((enum tlibstate)state->info);
+  } else if(state->state_type == ST_PING) {
+    pthread_mutex_lock(&libstatelock);
+    pingreplies++;
+    pthread_cond_broadcast(&libstatecond);
+    pthread_mutex_unlock(&libstatelock);
+  }
+}
+
+void lib330Interface_msgCallback(pointer p){
+  tmsg_call *msg = (tmsg_call *) p;
+  string95 msgText;
+  char dataTime[32];
+
+  placement_enter(THREAD_LIB330, "lib330");
+  lib_get_msg(msg->code, &msgText);
+
+  // we don't need to worry about current time, the log system handles that
+  //jul_string(msg->timestamp, &currentTime);
+  if(!msg->datatime) {
+    fprintf(stderr, "{%d} %s %s\n", msg->code, msgText, msg->suffix);
+  } else {
+    //jul_string(msg->datatime, (char *) &dataTime);
+    fprintf(stderr, "{%d} [%s] %s %s\n", msg->code, dataTime, msgText, msg->suffix);
+  }
+}
+
+/* Data callbacks run inside a read section of the settings snapshot,
+   and not at all once shutdown has closed the gate */
+void lib330Interface_1SecCallback(pointer p){
+  uint64_t span;
+  placement_enter(THREAD_LIB330, "lib330");
+  if(!gateenter()) {
+    return;
+  }
+  startup_mark(STARTUP_FIRSTPACKET);
+  TRACE_BEGIN(span, onesec, 0);
+  runconfig_enter(RUNCONFIG_READER_LIB330);
+  handleonesec((tonesec_call *) p, runconfig_current());
+  runconfig_exit(RUNCONFIG_READER_LIB330);
+  TRACE_END(span, TRACE_ONESEC, onesec, 0);
+  gateexit();
+}
+
+void lib330Interface_miniCallback(pointer p){
+  uint64_t span;
+  placement_enter(THREAD_LIB330, "lib330");
+  if(!gateenter()) {
+    return;
+  }
+  startup_mark(STARTUP_FIRSTPACKET);
+  TRACE_BEGIN(span, miniseed, ((tminiseed_call *) p)->data_size);
+  runconfig_enter(RUNCONFIG_READER_LIB330);
+  handleminiseed((tminiseed_call *) p, runconfig_current());
+  runconfig_exit(RUNCONFIG_READER_LIB330);
+  TRACE_END(span, TRACE_MINISEED, miniseed, ((tminiseed_call *) p)->data_size);
+  gateexit();
+}
+
+/* one second data from q330 */
+static void handleonesec(tonesec_call *data, RunConfig *rc){
+  static struct blkt_1000_s Blkt1000;
+  static struct blkt_1001_s Blkt1001;
+  MSTrace *mst = NULL;
+  static MSRecord *mstemplate = NULL;
+  static MSRecord *msr = NULL;
+
+
+  char *sta, *net;
+  char netsta[10];
+  const char *loc = data->location;
+  const char *chan = data->channel;
+  const ChanResult *rule;
+  double startTS;
+
+  if (rc->verbose > 2) fprintf(stderr, "OneSec for %s {%d} %d\n", data->channel, data->rate, data->filter_bits);
+
+  splitstationname(data->station_name, netsta, &net, &sta);
+
+  // drop or rename the channel before any packing work is done
+  if (rc->chanrules) {
+    if ( ! (rule = chanrules_lookup(rc->chanrules, net, sta, loc, chan)) || ! rule->accept ) {
+      return;
+    }
+    net = (char *) rule->network;
+    sta = (char *) rule->station;
+    loc = rule->location;
+    chan = rule->channel;
+  }
+
+  /* Set up MSRecord template */
+  if ( (msr = msr_init (msr)) == NULL )
+  {
+    ms_log (2, "Cannot initialize packing template\n");
+    return;
+  }
+
+  ms_strncpclean (msr->network, net, 2);
+  ms_strncpclean (msr->station, sta, 5);
+  ms_strncpclean (msr->location, loc, 2);
+  ms_strncpclean (msr->channel, chan, 3);
   startTS = janFirst2000 + data->timestamp;
   msr->starttime = (hptime_t)(MS_EPOCH2HPTIME (startTS));
 
@@ -628,16 +1587,53 @@ void lib330Interface_1SecCallback(pointer p){
   msr->datasamples = data->samples;
   msr->sampletype = 'i';
 
-  processMseed(msr);
+  // drop or trim data the Q330 re-sends from its buffer after a reconnect
+  if (rc->duplicatewindow > 0 && ! coverage_filter(msr, rc->duplicatewindow, 1)) {
+    msr->datasamples = NULL;
+    return;
+  }
+
+  // detect events and measure amplitudes before the samples wait in a record
+  trigger_record(msr);
+  amplitude_record(msr);
+
+  submitrecord(msr, data->qual_perc);
+
+  // derived lower rate channels
+  decimate_record(msr);
+
+  /* Samples belong to lib330, keep msr_init() from freeing them */
+  msr->datasamples = NULL;
 }
 
 /* miniseed record mode from q330 */
-void lib330Interface_miniCallback(pointer p){
-  MSRecord *msr = NULL;
+static void handleminiseed(tminiseed_call *data, RunConfig *rc){
+  static MSRecord *msr = NULL;
+  static char renamed[MINI_MAX_RECLEN];
   int msr_unpackResult;
-  tminiseed_call *data = (tminiseed_call *) p;
+  char *record = data->data_address;
+  const ChanResult *rule;
+  char *sta, *net;
+  char netsta[10];
 
-  if (verbose > 2) fprintf(stderr, "Miniseed for %s {%d} %d\n", data->channel, data->data_size, data->filter_bits);
+  if (rc->verbose > 2) fprintf(stderr, "Miniseed for %s {%d} %d\n", data->channel, data->data_size, data->filter_bits);
+
+  // drop or rename the channel before unpacking or sending
+  if (rc->chanrules) {
+    splitstationname(data->station_name, netsta, &net, &sta);
+    if ( ! (rule = chanrules_lookup(rc->chanrules, net, sta, data->location, data->channel)) || ! rule->accept ) {
+      return;
+    }
+    if (rule->renamed) {
+      if (data->data_size > MINI_MAX_RECLEN) {
+        ms_log (2, "Cannot rename %d byte record for %s\n", data->data_size, data->channel);
+        return;
+      }
+      memcpy(renamed, data->data_address, data->data_size);
+      chanrules_rewriteheader(renamed, rule);
+      record = renamed;
+    }
+  }
 
   /* Set up MSRecord template */
   if ( (msr = msr_init (msr)) == NULL )
@@ -645,10 +1641,13 @@ void lib330Interface_miniCallback(pointer p){
     ms_log (2, "Cannot initialize packing template\n");
     return;
   }
-  msr_unpackResult = msr_unpack (data->data_address, data->data_size, &msr,
-              0, verbose);
+  msr_unpackResult = msr_unpack (record, data->data_size, &msr,
+              0, rc->verbose);
   if (msr_unpackResult == MS_NOERROR) {
-    sendrecord ( data->data_address, data->data_size, NULL );
+    if (rc->duplicatewindow > 0 && ! coverage_filter(msr, rc->duplicatewindow, 0)) {
+      return;
+    }
+    sendrecord ( record, data->data_size, NULL );
   } else {
     ms_log (2, "Cannot unpack ms record %d\n", msr_unpackResult);
     return;
@@ -656,62 +1655,456 @@ void lib330Interface_miniCallback(pointer p){
 
 }
 
-static void processMseed(MSRecord *msr)
+/*********************************************************************
+ * splitstationname:
+ *
+ * Separate the lib330 NET-STA station name into network and station,
+ * using netsta (at least 10 bytes) as storage for both.
+ *********************************************************************/
+static void splitstationname ( const char *station_name, char *netsta, char **net, char **sta )
+{
+  strcpy(netsta, station_name);
+  *net = netsta;
+  *sta = netsta;
+  while(**sta != '-' && **sta != '\0') {
+    (*sta)++;
+  }
+  if(**sta == '-') {
+    **sta = '\0';
+    (*sta)++;
+  } else {
+    char *tmp;
+    tmp = *sta;
+    *sta = *net;
+    *net = tmp;
+  }
+}
+
+/*********************************************************************
+ * initpacking:
+ *
+ * Set up the packing contexts and the idle flush timer and, if nthreads
+ * is positive, start that many pack worker threads.  With no workers all
+ * packing is done inline on the lib330 callback thread using the first
+ * context.
+ *
+ * Returns 0 on success and -1 on error.
+ *********************************************************************/
+static int initpacking ( int nthreads )
+{
+  int i;
+
+  if ( nthreads > PACKPOOL_MAX_WORKERS )
+    nthreads = PACKPOOL_MAX_WORKERS;
+
+  numpackctx = ( nthreads > 0 ) ? nthreads : 1;
+
+  for ( i = 0; i < numpackctx; i++ )
+  {
+    memset (&packctx[i], 0, sizeof(PackContext));
+    pthread_mutex_init (&packctx[i].lock, NULL);
+    if ( ! (packctx[i].mstg = mst_initgroup (NULL)) )
+    {
+      ms_log (2, "Cannot initialize MSTraceList\n");
+      return -1;
+    }
+  }
+
+  if ( timerstart () < 0 )
+    return -1;
+
+  if ( nthreads > 0 )
+    return packpool_start (nthreads, packworkerhandler);
+
+  return 0;
+}
+
+/*********************************************************************
+ * submitrecord:
+ *
+ * Hand a record of integer samples to packing, either queued for the
+ * pack worker owning its stream or packed inline.  Only called from the
+ * lib330 callback thread.
+ *********************************************************************/
+static void submitrecord ( MSRecord *msr, int timingqual )
+{
+  uint64_t span;
+
+  if ( packpool_workers() > 0 )
+  {
+    packpool_submit (msr, timingqual);
+  }
+  else
+  {
+    TRACE_BEGIN (span, process, msr->samplecnt);
+    pthread_mutex_lock (&packctx[0].lock);
+    processMseed (&packctx[0], msr, timingqual);
+    pthread_mutex_unlock (&packctx[0].lock);
+    TRACE_END (span, TRACE_PROCESS, process, msr->samplecnt);
+  }
+}
+
+/* Derived records carry the station clock quality */
+static void submitderived ( MSRecord *msr )
+{
+  submitrecord (msr, -1);
+}
+
+/*********************************************************************
+ * submittrigger:
+ *
+ * Send a trigger event to DataLink as JSON, stream NET_STA_LOC_CHAN/JSON,
+ * in the live class so it is not held behind backfill or SOH.
+ *********************************************************************/
+static void submittrigger ( TriggerEvent *event )
+{
+  char json[400];
+  char streamid[100];
+  char timestr[30];
+  char ontimestr[30];
+  int len;
+
+  ms_hptime2isotimestr (event->time, timestr, 1);
+  ms_hptime2isotimestr (event->ontime, ontimestr, 1);
+
+  len = snprintf (json, sizeof(json), "{\"type\":\"trigger\",\"network\":\"%s\",\"station\":\"%s\","
+                  "\"location\":\"%s\",\"channel\":\"%s\",\"state\":\"%s\",\"time\":\"%sZ\","
+                  "\"on_time\":\"%sZ\",\"ratio\":%.2f}",
+                  event->network, event->station, event->location, event->channel,
+                  ( event->on ) ? "on" : "off", timestr, ontimestr, event->ratio);
+  snprintf (streamid, sizeof(streamid), "%s_%s_%s_%s/JSON",
+            event->network, event->station, event->location, event->channel);
+
+  ms_log (0, "Trigger %s %s at %s, STA/LTA %.2f\n", ( event->on ) ? "on" : "off",
+          streamid, timestr, event->ratio);
+
+  if ( runconfig_current ()->datalinkaddr[0] )
+    shaper_submit (SHAPER_LIVE, json, len, streamid, event->time, event->time);
+}
+
+/*********************************************************************
+ * submitamplitudes:
+ *
+ * Send the amplitudes of a one-second packet to DataLink as JSON,
+ * stream NET_STA_LOC_CHAN/JSON, in the live class.
+ *********************************************************************/
+static void submitamplitudes ( Amplitudes *amp )
+{
+  char json[400];
+  char streamid[100];
+  char timestr[30];
+  char peaktimestr[30];
+  char pgv[40] = "";
+  int len;
+
+  if ( ! runconfig_current ()->datalinkaddr[0] )
+    return;
+
+  ms_hptime2isotimestr (amp->starttime, timestr, 1);
+  ms_hptime2isotimestr (amp->peaktime, peaktimestr, 1);
+  if ( amp->velocity )
+    snprintf (pgv, sizeof(pgv), ",\"pgv\":%.6g", amp->pgv);
+
+  len = snprintf (json, sizeof(json), "{\"type\":\"amplitude\",\"network\":\"%s\",\"station\":\"%s\","
+                  "\"location\":\"%s\",\"channel\":\"%s\",\"time\":\"%sZ\",\"samples\":%d,"
+                  "\"peak\":%.6g,\"peak_time\":\"%sZ\",\"rms\":%.6g%s}",
+                  amp->network, amp->station, amp->location, amp->channel, timestr, amp->numsamples,
+                  amp->peak, peaktimestr, amp->rms, pgv);
+  snprintf (streamid, sizeof(streamid), "%s_%s_%s_%s/JSON",
+            amp->network, amp->station, amp->location, amp->channel);
+
+  shaper_submit (SHAPER_LIVE, json, len, streamid, amp->starttime, amp->starttime);
+}
+
+/*********************************************************************
+ * restorerecord:
+ *
+ * Pack samples read back from a checkpoint like a one-second packet,
+ * dropping or trimming what was already sent.  Called from main()
+ * before lib330 delivers any data.
+ *********************************************************************/
+static void restorerecord ( MSRecord *msr, int timingqual )
+{
+  RunConfig *rc = runconfig_current ();
+
+  if ( rc->duplicatewindow > 0 && ! coverage_filter (msr, rc->duplicatewindow, 1) )
+    return;
+
+  submitrecord (msr, timingqual);
+}
+
+/*********************************************************************
+ * packworkerhandler:
+ *
+ * Called on a pack worker thread for each one-second record.
+ *********************************************************************/
+static void packworkerhandler ( int worker, MSRecord *msr, int timingqual )
+{
+  uint64_t span;
+
+  TRACE_BEGIN (span, process, msr->samplecnt);
+  runconfig_enter (RUNCONFIG_READER_WORKER(worker));
+  pthread_mutex_lock (&packctx[worker].lock);
+  processMseed (&packctx[worker], msr, timingqual);
+  pthread_mutex_unlock (&packctx[worker].lock);
+  runconfig_exit (RUNCONFIG_READER_WORKER(worker));
+  TRACE_END (span, TRACE_PROCESS, process, msr->samplecnt);
+}
+
+/*********************************************************************
+ * processMseed:
+ *
+ * Track continuity of the packet, add it to the trace buffer of the
+ * context and pack any complete records.  timingqual is the clock
+ * quality percent of the packet, -1 to use the station clock quality.
+ * Called with the lock of the context held.
+ *********************************************************************/
+static void processMseed(PackContext *ctx, MSRecord *msr, int timingqual)
+{
+  RunConfig *rc = runconfig_current();
+  MSTrace *mst = NULL;
+  StreamInfo *si;
+  hptime_t offset;
+  hptime_t now;
+  double timetol = -1.0;
+  int64_t over;
+  int dropped;
+  int event;
+  int recordspacked = 0;
+
+  /* Explicit continuity check, one comparison per packet */
+  if ( (si = streams_get (msr->network, msr->station, msr->location, msr->channel)) )
+  {
+    event = streams_continuity (si, msr, rc->continuitytolerance, &offset);
+    if ( event >= CONT_GAP && rc->continuitylog )
+    {
+      char stime[50];
+      ms_hptime2seedtimestr (msr->starttime, stime, 1);
+      ms_log (1, "%s %s of %.6f seconds at %s\n", si->srcname,
+              streams_eventname (event), (double) offset / HPTMODULUS, stime);
+    }
+    si->timingqual = ( timingqual >= 0 ) ? timingqual : stationclockqual;
+    if ( msr->samprate > 0.0 )
+      timetol = rc->continuitytolerance / msr->samprate;
+  }
+
+  /* Add data to trace buffer, creating new entry or extending as needed */
+  if ( ! (mst = mst_addmsrtogroup (ctx->mstg, msr, 1, timetol, -1.0)) )
+  {
+    ms_log (3, "Cannot add data to trace buffer!\n");
+    return;
+  }
+
+  /* To keep small variations in the sample rate or time base from accumulating
+   * to large errors, re-base the time of the buffer by back projecting from
+   * the endtime, which is calculated from the tracebuf starttime and number
+   * of samples.  In essence, this maintains a time line based on the starttime
+   * of received tracebufs.  It also retains the variations of the sample rate
+   * and other characteristics of the original data stream to some degree. */
+
+  mst->starttime = mst->endtime - (hptime_t) (((double)(mst->numsamples - 1) / mst->samprate * HPTMODULUS) + 0.5);
+
+  /* Allocate & init per-trace stats structure if needed */
+  if ( ! mst->prvtptr )
+  {
+    if ( ! (mst->prvtptr = malloc (sizeof(TraceStats))) )
+    {
+      ms_log (3, "Cannot allocate buffer for trace stats!\n");
+      return;
+    }
+
+    ((TraceStats *)mst->prvtptr)->earliest = HPTERROR;
+    ((TraceStats *)mst->prvtptr)->latest = HPTERROR;
+    ((TraceStats *)mst->prvtptr)->update = HPTERROR;
+    ((TraceStats *)mst->prvtptr)->xmit = HPTERROR;
+    ((TraceStats *)mst->prvtptr)->pktcount = 0;
+    ((TraceStats *)mst->prvtptr)->reccount = 0;
+    ((TraceStats *)mst->prvtptr)->held = 0;
+  }
+
+  ((TraceStats *)mst->prvtptr)->stream = si;
+  accounttrace (mst);
+
+  now = dlp_time();
+  ((TraceStats *)mst->prvtptr)->update = now;
+  ((TraceStats *)mst->prvtptr)->pktcount += 1;
+
+  if ( si )
+  {
+    si->packets += 1;
+    si->lastpacket = now;
+    si->dataend = mst->endtime;
+    si->latency = (double) (now - mst->endtime) / HPTMODULUS;
+  }
+
+  /* Pick the encoding of integer streams from a trial of what is buffered */
+  if ( rc->adaptiveencoding > 0 && si && mst->sampletype == 'i' &&
+       mst->numsamples >= ENCODING_MIN_TRIAL &&
+       now - si->lasttrial >= (hptime_t) rc->adaptiveencoding * HPTMODULUS )
+  {
+    int current = ( si->encoding ) ? si->encoding : int32encoding;
+    int chosen = encoding_choose ((int32 *) mst->datasamples, mst->numsamples, current);
+
+    si->lasttrial = now;
+    if ( chosen != current && rc->verbose )
+      ms_log (1, "Encoding %s as %s instead of %s\n", si->srcname,
+              encoding_name (chosen), encoding_name (current));
+    si->encoding = chosen;
+  }
+
+  if ( (recordspacked = packtraces (ctx, mst, 0, HPTERROR)) < 0 )
+  {
+    ms_log (3, "Cannot pack trace buffer or send records!\n");
+    ms_log (3, "  %s.%s.%s.%s %lld\n",
+            mst->network, mst->station, mst->location, mst->channel,
+            (long long int) mst->numsamples);
+    return;
+  }
+
+  /* Early flushes and shedding of backfill to stay within the memory limits */
+  if ( rc->streammemorylimit > 0 && si && si->held > rc->streammemorylimit )
+  {
+    if ( rc->verbose )
+      ms_log (1, "%s holds %lld bytes, over StreamMemoryLimit, flushing\n",
+              si->srcname, (long long int) si->held);
+    memacct_flushed ();
+    flushstream (ctx, si);
+  }
+
+  if ( rc->memorylimit > 0 && memacct_total () > rc->memorylimit &&
+       now - ctx->lastmemflush >= HPTMODULUS )
+  {
+    ctx->lastmemflush = now;
+
+    /* Flushing cannot shrink full queues, queued backfill goes first */
+    if ( (dropped = shaper_shed (SHAPER_BACKFILL, memacct_total () - rc->memorylimit, dlshed)) > 0 )
+      ms_log (1, "Over MemoryLimit, shed %d queued backfill records\n", dropped);
+
+    /* Early flushes only while the trace buffers hold most of it, largest streams first */
+    if ( (over = memacct_total () - rc->memorylimit) > 0 &&
+         memacct_current (MEM_TRACES) > memacct_current (MEM_QUEUE) )
+    {
+      memacct_flushed ();
+      flushlargest (ctx, over);
+    }
+  }
+}
+
+/*********************************************************************
+ * flushstream:
+ *
+ * Flush every trace buffer of a stream in the context, segments left
+ * by gaps included, to keep within a memory limit.
+ *********************************************************************/
+static void flushstream ( PackContext *ctx, StreamInfo *si )
+{
+  MSTrace *mst;
+
+  for ( mst = ctx->mstg->traces; mst; mst = mst->next )
+    if ( mst->prvtptr && ((TraceStats *) mst->prvtptr)->stream == si && mst->numsamples > 0 )
+      packtraces (ctx, mst, 1, HPTERROR);
+}
+
+/*********************************************************************
+ * flushlargest:
+ *
+ * Flush the streams of the context holding the most samples, largest
+ * first, until at least bytes have left the trace buffers, for
+ * MemoryLimit.  Streams holding little are left to fill their records.
+ *********************************************************************/
+static void flushlargest ( PackContext *ctx, int64_t bytes )
+{
+  StreamInfo *largest;
+  StreamInfo *si;
+  MSTrace *mst;
+  int64_t freed = 0;
+  int64_t held;
+
+  while ( freed < bytes )
+  {
+    largest = NULL;
+    for ( mst = ctx->mstg->traces; mst; mst = mst->next )
+      if ( mst->prvtptr && (si = ((TraceStats *) mst->prvtptr)->stream) && si->held > 0 &&
+           ( ! largest || si->held > largest->held ) )
+        largest = si;
+    if ( ! largest )
+      break;
+
+    if ( runconfig_current ()->verbose )
+      ms_log (1, "%s holds %lld bytes, over MemoryLimit, flushing\n",
+              largest->srcname, (long long int) largest->held);
+
+    held = largest->held;
+    flushstream (ctx, largest);
+    if ( largest->held >= held )
+      break;
+    freed += held - largest->held;
+  }
+}
+
+/*********************************************************************
+ * accounttrace:
+ *
+ * Bring the memory accounted for a trace buffer up to date with the
+ * samples it holds, for its stream and in total.
+ *********************************************************************/
+static void accounttrace ( MSTrace *mst )
 {
-  MSTrace *mst = NULL;
-  int recordspacked = 0;
-  /* Add data to trace buffer, creating new entry or extending as needed */
-  if ( ! (mst = mst_addmsrtogroup (mstg, msr, 1, -1.0, -1.0)) )
-  {
-    ms_log (3, "Cannot add data to trace buffer!\n");
-    return;
-  }
+  TraceStats *stats = (TraceStats *) mst->prvtptr;
+  int64_t held;
+  int64_t delta;
 
-  /* To keep small variations in the sample rate or time base from accumulating
-   * to large errors, re-base the time of the buffer by back projecting from
-   * the endtime, which is calculated from the tracebuf starttime and number
-   * of samples.  In essence, this maintains a time line based on the starttime
-   * of received tracebufs.  It also retains the variations of the sample rate
-   * and other characteristics of the original data stream to some degree. */
+  if ( ! stats )
+    return;
 
-  mst->starttime = mst->endtime - (hptime_t) (((double)(mst->numsamples - 1) / mst->samprate * HPTMODULUS) + 0.5);
+  held = ( mst->numsamples > 0 ) ? mst->numsamples * ms_samplesize (mst->sampletype) : 0;
+  if ( (delta = held - stats->held) == 0 )
+    return;
+  stats->held = held;
 
-  /* Allocate & init per-trace stats structure if needed */
-  if ( ! mst->prvtptr )
+  if ( stats->stream )
   {
-    if ( ! (mst->prvtptr = malloc (sizeof(TraceStats))) )
-    {
-      ms_log (3, "Cannot allocate buffer for trace stats!\n");
-      return;
-    }
-
-    ((TraceStats *)mst->prvtptr)->earliest = HPTERROR;
-    ((TraceStats *)mst->prvtptr)->latest = HPTERROR;
-    ((TraceStats *)mst->prvtptr)->update = HPTERROR;
-    ((TraceStats *)mst->prvtptr)->xmit = HPTERROR;
-    ((TraceStats *)mst->prvtptr)->pktcount = 0;
-    ((TraceStats *)mst->prvtptr)->reccount = 0;
+    stats->stream->held += delta;
+    if ( stats->stream->held > stats->stream->peakheld )
+      stats->stream->peakheld = stats->stream->held;
   }
+  memacct_add (MEM_TRACES, delta);
+}
 
-  ((TraceStats *)mst->prvtptr)->update = dlp_time();
-  ((TraceStats *)mst->prvtptr)->pktcount += 1;
+/*********************************************************************
+ * flushmatching:
+ *
+ * Flush the trace buffers of the context whose NET_STA_LOC_CHAN
+ * matches the glob pattern, all of them if it is empty, for a flush
+ * requested on the control socket.
+ *********************************************************************/
+static void flushmatching ( PackContext *ctx, const char *pattern )
+{
+  MSTrace *mst;
+  char srcname[50];
 
-  if ( (recordspacked = packtraces (mst, 0, HPTERROR)) < 0 )
+  if ( ! pattern[0] )
   {
-    ms_log (3, "Cannot pack trace buffer or send records!\n");
-    ms_log (3, "  %s.%s.%s.%s %lld\n",
-            mst->network, mst->station, mst->location, mst->channel,
-            (long long int) mst->numsamples);
+    packtraces (ctx, NULL, 1, HPTERROR);
     return;
   }
+
+  for ( mst = ctx->mstg->traces; mst; mst = mst->next )
+  {
+    snprintf (srcname, sizeof(srcname), "%s_%s_%s_%s",
+              mst->network, mst->station, mst->location, mst->channel);
+    if ( mst->numsamples > 0 && ! fnmatch (pattern, srcname, 0) )
+      packtraces (ctx, mst, 1, HPTERROR);
+  }
 }
 
 /*********************************************************************
  * packtraces:
  *
  * Package remaining data in buffer(s) into miniSEED records.  If mst
- * is NULL all streams will be packed, otherwise only the specified
- * stream will be packed.
+ * is NULL all streams in the context will be packed, otherwise only the
+ * specified stream will be packed.  The lock of the context must be
+ * held, or no other thread be using it.
  *
  * If the flush argument is true the stream buffers will be flushed
  * completely, otherwise records are only packed when enough samples
@@ -719,21 +2112,23 @@ static void processMseed(MSRecord *msr)
  *
  * Returns the number of records packed on success and -1 on error.
  *********************************************************************/
-static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime )
+static int packtraces ( PackContext *ctx, MSTrace *mst, int flush, hptime_t flushtime )
 {
-  static struct blkt_1000_s Blkt1000;
-  static struct blkt_1001_s Blkt1001;
-  static MSRecord *mstemplate = NULL;
+  RunConfig *rc = runconfig_current();
+  struct blkt_1000_s Blkt1000;
+  struct blkt_1001_s Blkt1001;
+  MSRecord *mstemplate;
 
   MSTrace *prevmst;
-  void *handlerdata = mst;
+  void *handlerdata = ctx;
   int trpackedrecords = 0;
   int packedrecords = 0;
   int flushflag = flush;
   int encoding = -1;
+  uint64_t span;
 
   /* Set up MSRecord template, include blockette 1000 and 1001 */
-  if ( (mstemplate = msr_init (mstemplate)) == NULL )
+  if ( (mstemplate = ctx->mstemplate = msr_init (ctx->mstemplate)) == NULL )
   {
     ms_log (2, "Cannot initialize packing template\n");
     return -1;
@@ -758,16 +2153,21 @@ static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime )
     else if ( mst->sampletype == 'd' )
       encoding = DE_FLOAT64;
     else
-      encoding = int32encoding;
+      encoding = streamencoding (mst);
 
     strcpy (mstemplate->network, mst->network);
     strcpy (mstemplate->station, mst->station);
     strcpy (mstemplate->location, mst->location);
     strcpy (mstemplate->channel, mst->channel);
+    settimingquality (mstemplate, mst);
 
-    trpackedrecords = mst_pack (mst, sendrecord, handlerdata, 512,
+    ctx->mst = mst;
+    TRACE_BEGIN (span, pack, mst->numsamples);
+    trpackedrecords = mst_pack (mst, sendrecord, handlerdata, rc->reclen,
                                 encoding, 1, NULL, flushflag,
-                                verbose-2, mstemplate);
+                                rc->verbose-2, mstemplate);
+    TRACE_END (span, TRACE_PACK, pack, trpackedrecords);
+    accounttrace (mst);
 
     if ( trpackedrecords == -1 )
       return -1;
@@ -776,7 +2176,7 @@ static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime )
   }
   else
   {
-    mst = mstg->traces;
+    mst = ctx->mstg->traces;
     prevmst = NULL;
 
     while ( mst && stopsig < 2 )
@@ -788,9 +2188,10 @@ static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime )
         else if ( mst->sampletype == 'd' )
           encoding = DE_FLOAT64;
         else
-          encoding = int32encoding;
+          encoding = streamencoding (mst);
 
         /* Flush data buffer if update time is less than flushtime */
+        flushflag = flush;
         if ( flush == 0 && mst->prvtptr && flushtime != HPTERROR )
           if (((TraceStats *)mst->prvtptr)->update < flushtime )
           {
@@ -803,10 +2204,15 @@ static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime )
         strcpy (mstemplate->station, mst->station);
         strcpy (mstemplate->location, mst->location);
         strcpy (mstemplate->channel, mst->channel);
+        settimingquality (mstemplate, mst);
 
-        trpackedrecords = mst_pack (mst, sendrecord, handlerdata, 512,
+        ctx->mst = mst;
+        TRACE_BEGIN (span, pack, mst->numsamples);
+        trpackedrecords = mst_pack (mst, sendrecord, handlerdata, rc->reclen,
                                     encoding, 1, NULL, flushflag,
-                                    verbose-2, mstemplate);
+                                    rc->verbose-2, mstemplate);
+        TRACE_END (span, TRACE_PACK, pack, trpackedrecords);
+        accounttrace (mst);
 
         if ( trpackedrecords == -1 )
           return -1;
@@ -819,11 +2225,12 @@ static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime )
       {
         MSTrace *nextmst = mst->next;
 
-        if ( verbose )
+        if ( rc->verbose )
           logmststats (mst);
+        accounttrace (mst);
 
         if ( ! prevmst )
-          mstg->traces = mst->next;
+          ctx->mstg->traces = mst->next;
         else
           prevmst->next = mst->next;
 
@@ -839,36 +2246,171 @@ static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime )
     }
   }
 
+  ctx->mst = NULL;
+
   return packedrecords;
 }  /* End of packtraces() */
 
+/*********************************************************************
+ * streamencoding:
+ *
+ * Encoding for an integer trace buffer, the one chosen for the stream
+ * by trial or the default.
+ *********************************************************************/
+static int streamencoding ( MSTrace *mst )
+{
+  TraceStats *stats = (TraceStats *) mst->prvtptr;
+
+  if ( stats && stats->stream && stats->stream->encoding && runconfig_current()->adaptiveencoding > 0 )
+    return stats->stream->encoding;
+
+  return int32encoding;
+}
+
+/*********************************************************************
+ * publishstats:
+ *
+ * Copy the lib330 status and the counters of every stream to the
+ * statistics segment, once a second from the main thread.  The data
+ * path only updates the counters in StreamInfo.
+ *********************************************************************/
+static void publishstats ( void )
+{
+  static int fullwarned = 0;
+  StatSegHeader *hdr = statseg->header;
+  enum tlibstate state;
+  enum tliberr lastError;
+  topstat libStatus;
+  string63 stateName;
+  DLConnStats conn;
+  ShaperStats queue;
+  StatSegStream *slot;
+  StreamInfo *si;
+  int i;
+
+  state = lib_get_state(stationContext, &lastError, &libStatus);
+  lib_get_statestr(state, &stateName);
+  dlconn_stats(&conn);
+
+  statseg_beginstation (statseg);
+  hdr->updated = (uint64_t) time (NULL);
+  strncpy (hdr->station, libStatus.station_name, sizeof(hdr->station) - 1);
+  strncpy (hdr->libstate, stateName, sizeof(hdr->libstate) - 1);
+  strncpy (hdr->dlstate, dlconn_statename (conn.state), sizeof(hdr->dlstate) - 1);
+  for ( i = (int) AD_MINUTE; i <= (int) AD_DAY; i++ )
+  {
+    hdr->bps[i] = ( state == LIBSTATE_RUN ) ? (int32_t) libStatus.accstats[AC_READ][i] : -1;
+    hdr->packets[i] = ( state == LIBSTATE_RUN ) ? (int32_t) libStatus.accstats[AC_PACKETS][i] : -1;
+  }
+  hdr->bufferfill = ( state == LIBSTATE_RUN ) ? (int32_t) libStatus.pkt_full : -1;
+  hdr->clockqual = stationclockqual;
+  hdr->dlconnects = conn.connects;
+  hdr->dlfailures = conn.failures;
+  hdr->dllost = conn.disconnects;
+  hdr->queued = 0;
+  for ( i = 0; shaper_running () && i < SHAPER_CLASSES; i++ )
+  {
+    shaper_stats (i, &queue, 0);
+    hdr->queued += queue.queued;
+  }
+  statseg_endstation (statseg);
+
+  for ( si = streams_first (); si; si = si->listnext )
+  {
+    if ( ! (slot = statseg_beginstream (statseg, si->index)) )
+    {
+      if ( ! fullwarned++ )
+        ms_log (1, "StatsStreams is too small for %d streams\n", streams_count ());
+      continue;
+    }
+
+    strncpy (slot->name, si->srcname, sizeof(slot->name) - 1);
+    slot->packets = si->packets;
+    slot->records = si->records;
+    slot->samples = si->recsamples;
+    slot->bytes = si->recbytes;
+    slot->gaps = si->gaps;
+    slot->overlaps = si->overlaps;
+    slot->tears = si->tears;
+    slot->duppackets = si->duppackets;
+    slot->lastpacket = si->lastpacket;
+    slot->lastsent = si->lastsent;
+    slot->dataend = si->dataend;
+    slot->latency = si->latency;
+    slot->timingqual = si->timingqual;
+    slot->encoding = si->lastencoding;
+    statseg_endstream (slot);
+  }
+}
+
+/*********************************************************************
+ * settimingquality:
+ *
+ * Set the blockette 1001 timing quality of the packing template from
+ * the last clock quality of the stream, and flag the time tag as
+ * questionable when it is below QuestionableTimingQuality.
+ *********************************************************************/
+static void settimingquality ( MSRecord *mstemplate, MSTrace *mst )
+{
+  TraceStats *stats = (TraceStats *) mst->prvtptr;
+  int qual = ( stats && stats->stream ) ? stats->stream->timingqual : -1;
+
+  if ( mstemplate->Blkt1001 )
+    mstemplate->Blkt1001->timing_qual = ( qual >= 0 ) ? qual : 0;
+
+  if ( qual >= 0 && qual < runconfig_current()->questionabletimingqual )
+  {
+    if ( ! mstemplate->fsdh &&
+         ! (mstemplate->fsdh = (struct fsdh_s *) calloc (1, sizeof(struct fsdh_s))) )
+      return;
+    mstemplate->fsdh->dq_flags |= 0x80;
+  }
+  else if ( mstemplate->fsdh )
+  {
+    mstemplate->fsdh->dq_flags &= ~0x80;
+  }
+}
+
 /*********************************************************************
  * sendrecord:
  *
- * Routine called to send a record to the DataLink server.
+ * Routine called to send a record to the DataLink server, the
+ * SeedLink and shared-memory rings and the archive.  The handlerdata is
+ * the PackContext the record was packed in, or NULL for records from the
+ * lib330 thread that were not packed here.  With DataLinkRate set the
+ * record is queued for the shaper thread, otherwise it is written here.
  *
  * Returns 0
  *********************************************************************/
 static void sendrecord ( char *record, int reclen, void *handlerdata )
 {
-  static MSRecord *msr = NULL;
-  MSTrace *mst = handlerdata;
+  static MSRecord *minimsr = NULL;
+  RunConfig *rc = runconfig_current();
+  PackContext *ctx = handlerdata;
+  MSRecord **msrp = ( ctx ) ? &ctx->sendmsr : &minimsr;
+  MSRecord *msr;
+  MSTrace *mst = ( ctx ) ? ctx->mst : NULL;
   TraceStats *stats;
+  StreamInfo *si;
   hptime_t endtime;
   char streamid[100];
-  int writeack = 0;
+  uint64_t span;
   int rv;
 
   if ( ! record )
     return;
 
   /* Parse Mini-SEED header */
-  if ( (rv = msr_unpack (record, reclen, &msr, 0, 0)) != MS_NOERROR )
+  TRACE_BEGIN (span, unpack, reclen);
+  rv = msr_unpack (record, reclen, msrp, 0, 0);
+  TRACE_END (span, TRACE_UNPACK, unpack, reclen);
+  if ( rv != MS_NOERROR )
   {
     ms_recsrcname (record, streamid, 0);
     ms_log (2, "Error unpacking %s: %s", streamid, ms_errorstr(rv));
     return;
   }
+  msr = *msrp;
 
   /* Generate stream ID for this record: NET_STA_LOC_CHAN/MSEED */
   msr_srcname (msr, streamid, 0);
@@ -877,35 +2419,37 @@ static void sendrecord ( char *record, int reclen, void *handlerdata )
   /* Determine high precision end time */
   endtime = msr_endtime (msr);
 
-  if ( verbose >= 2 )
+  if ( rc->verbose >= 2 )
     ms_log (1, "Sending %s  %06d\n", streamid, msr->sequence_number);
 
-  /* Send record to server, loop */
-  while ( dl_write (dlcp, record, reclen, streamid, msr->starttime, endtime, writeack) < 0 )
+  startup_mark (STARTUP_FIRSTRECORD);
+
+  /* Local SeedLink clients are served from their own ring */
+  if ( ! ctlsock_skip (CTL_SEEDLINK) )
+    slserver_write (record, reclen, msr);
+
+  if ( shmring && ! ctlsock_skip (CTL_SHMRING) &&
+       shmring_write (shmring, record, reclen, msr->network, msr->station,
+                      msr->location, msr->channel, msr->starttime, endtime) < 0 )
   {
-    if ( dlcp->link == -1 )
-      dl_disconnect (dlcp);
+    ms_log (2, "Record of %d bytes for %s does not fit ShmRingSlotSize\n", reclen, streamid);
+  }
 
-    if ( stopsig )
-    {
-      ms_log (2, "Termination signal with no connection to DataLink, the data buffers will be lost");
-      stopsig = 2;
-      break;
-    }
+  if ( ! ctlsock_skip (CTL_ARCHIVE) )
+    archive_write (record, reclen, msr);
 
-    if ( ! reconnectinterval )
-    {
-      ms_log (2, "ReconnectionInterval is 0, exiting...");
-      stopsig = 2;
-      break;
-    }
-    else if ( dl_connect (dlcp) < 0 )
-    {
-      ms_log (2, "Error re-connecting to DataLink server: %s, sleeping\n", dlcp->addr);
-      dlp_usleep (reconnectinterval * (unsigned long)1e6);
-    }
+  /* Send record to server, through the shaper on limited links */
+  if ( shaper_running () )
+    shaper_submit (recordclass (rc, msr, endtime), record, reclen, streamid, msr->starttime, endtime);
+  else
+  {
+    DLConnRecord r = { record, reclen, streamid, msr->starttime, endtime };
+    dlwrite (&r, 1);
   }
 
+  if ( ctx )
+    ctx->reccount += 1;
+
   /* Update stats */
   if ( mst )
   {
@@ -920,9 +2464,228 @@ static void sendrecord ( char *record, int reclen, void *handlerdata )
     stats->xmit = dlp_time();
     stats->reccount += 1;
   }
+
+  si = ( mst ) ? ((TraceStats *) mst->prvtptr)->stream
+               : streams_get (msr->network, msr->station, msr->location, msr->channel);
+
+  /* Sending and compression per stream, for monitoring and sizing links */
+  if ( si )
+  {
+    si->lastsent = ( mst ) ? stats->xmit : dlp_time ();
+    si->records += 1;
+    si->recsamples += msr->samplecnt;
+    si->recbytes += reclen;
+    si->lastencoding = msr->encoding;
+  }
+
+  /* Saved coverage ends with what was actually sent */
+  if ( rc->duplicatewindow > 0 && msr->samprate > 0.0 && si )
+    coverage_sent (si, endtime + (hptime_t) (HPTMODULUS / msr->samprate + 0.5));
 }  /* End of sendrecord() */
 
 
+/*********************************************************************
+ * dlwrite:
+ *
+ * Write records to the DataLink server in one batch.  Waits for the
+ * connection thread to (re)connect as long as needed unless termination
+ * is requested, then they are spooled for the next start if there is a
+ * spool.  With no DataLink server configured the records are dropped.
+ * Records larger than the server accepts are flagged refused.
+ *
+ * Returns 0 on success, 1 if records were refused and -1 if the records
+ * were not written.
+ *********************************************************************/
+static int dlwrite ( DLConnRecord *records, int count )
+{
+  int rv;
+
+  for (;;)
+  {
+    rv = dlconn_writebatch (records, count, ( stopsig ) ? 0 : 1);
+
+    if ( rv == 0 )
+      return 0;
+
+    if ( rv == DLCONN_EREFUSED )
+      return 1;
+
+    if ( rv == DLCONN_ENOLINK )
+      return -1;
+
+    if ( rv == DLCONN_EFAILED )
+    {
+      if ( ! stopsig )
+        ms_log (2, "ReconnectInterval is 0, exiting...\n");
+      if ( spool_write (records, count) == 0 )
+      {
+        if ( ! stopsig )
+          stopsig = 1;
+        return 0;
+      }
+      stopsig = 2;
+      return -1;
+    }
+
+    if ( stopsig )
+    {
+      if ( spool_write (records, count) == 0 )
+        return 0;
+      if ( stopsig != 2 )
+        ms_log (2, "Termination signal with no connection to DataLink, the data buffers will be lost\n");
+      stopsig = 2;
+      return -1;
+    }
+  }
+}  /* End of dlwrite() */
+
+/* Shaper records as DataLink records, count at most SHAPER_BATCH */
+static void connrecords ( ShaperRecord *records, int count, DLConnRecord *batch )
+{
+  int i;
+
+  for ( i = 0; i < count; i++ )
+  {
+    batch[i].record = records[i].data;
+    batch[i].reclen = records[i].reclen;
+    batch[i].streamid = records[i].streamid;
+    batch[i].starttime = records[i].starttime;
+    batch[i].endtime = records[i].endtime;
+    batch[i].refused = 0;
+  }
+}
+
+/*********************************************************************
+ * dlsend:
+ *
+ * Shaper callback, write a batch of queued records with dlwrite().
+ * Records the server refused are flagged failed.
+ *
+ * Returns 0 on success and -1 if the records were not written.
+ *********************************************************************/
+static int dlsend ( ShaperRecord *records, int count )
+{
+  DLConnRecord batch[SHAPER_BATCH];
+  int rv;
+  int i;
+
+  connrecords (records, count, batch);
+
+  if ( (rv = dlwrite (batch, count)) > 0 )
+  {
+    for ( i = 0; i < count; i++ )
+      records[i].failed = batch[i].refused;
+    rv = 0;
+  }
+
+  return rv;
+}  /* End of dlsend() */
+
+/*********************************************************************
+ * dlspool:
+ *
+ * Shaper spill callback, spool a batch of records that were not sent in
+ * time at shutdown or found their queue full while DataLink is paused.
+ *
+ * Returns 0 on success and -1 if the records were lost.
+ *********************************************************************/
+static int dlspool ( ShaperRecord *records, int count )
+{
+  DLConnRecord batch[SHAPER_BATCH];
+
+  connrecords (records, count, batch);
+
+  if ( spool_write (batch, count) < 0 )
+  {
+    ms_log (2, "No spool for %d DataLink records not sent, they are lost\n", count);
+    return -1;
+  }
+
+  return 0;
+}  /* End of dlspool() */
+
+/*********************************************************************
+ * dlshed:
+ *
+ * Shaper callback for backfill records shed to stay within MemoryLimit,
+ * spool them for sending after the next start.  Without a spool the
+ * loss is logged for each stream.
+ *
+ * Returns 0 if the records were spooled and -1 if they are lost.
+ *********************************************************************/
+static int dlshed ( ShaperRecord *records, int count )
+{
+  DLConnRecord batch[SHAPER_BATCH];
+  int lost;
+  int i, j, k, n;
+
+  for ( i = 0; i < count; i += n )
+  {
+    n = ( count - i < SHAPER_BATCH ) ? count - i : SHAPER_BATCH;
+    connrecords (records + i, n, batch);
+    if ( spool_write (batch, n) < 0 )
+      break;
+  }
+  if ( i >= count )
+    return 0;
+
+  /* Once for each stream among the records not spooled */
+  for ( j = i; j < count; j++ )
+  {
+    for ( k = i; k < j && strcmp (records[k].streamid, records[j].streamid); k++ )
+      ;
+    if ( k < j )
+      continue;
+
+    for ( lost = 0, k = j; k < count; k++ )
+      lost += ! strcmp (records[k].streamid, records[j].streamid);
+    ms_log (2, "Over MemoryLimit with no spool, %d queued backfill records of %s lost\n",
+            lost, records[j].streamid);
+  }
+
+  return -1;
+}  /* End of dlshed() */
+
+/*********************************************************************
+ * replayrecord:
+ *
+ * Spool callback, queue a record spooled at the last shutdown as
+ * backfill.
+ *********************************************************************/
+static void replayrecord ( DLConnRecord *record )
+{
+  if ( shaper_running () )
+    shaper_submit (SHAPER_BACKFILL, record->record, record->reclen, record->streamid,
+                   record->starttime, record->endtime);
+  else
+    dlwrite (record, 1);
+}  /* End of replayrecord() */
+
+/*********************************************************************
+ * recordclass:
+ *
+ * Priority class of a record for the DataLink shaper: backfill if it
+ * ended more than BackfillAge seconds ago, SOH if it is a log or has no
+ * or a low sample rate or matches a SohChannel pattern, live otherwise.
+ *********************************************************************/
+static int recordclass ( RunConfig *rc, MSRecord *msr, hptime_t endtime )
+{
+  int i;
+
+  if ( rc->backfillage > 0 &&
+       endtime < dlp_time () - (hptime_t) rc->backfillage * HPTMODULUS )
+    return SHAPER_BACKFILL;
+
+  if ( msr->samprate < 1.0 )
+    return SHAPER_SOH;
+
+  for ( i = 0; i < rc->numsohchannels; i++ )
+    if ( ! fnmatch (rc->sohchannels[i], msr->channel, 0) )
+      return SHAPER_SOH;
+
+  return SHAPER_LIVE;
+}
+
 /***************************************************************************
  * usage():
  *
@@ -966,6 +2729,157 @@ static int handle_opts(int argc, char ** argv)  {
   return 1;
 }
 
+/* Restore a setting that cannot change without re-registering */
+#define RELOAD_KEEP(field) \
+  if ( memcmp (&gConfig.field, &saved.field, sizeof(gConfig.field)) ) { \
+    ms_log (1, "Reload: %s changed, restart required to apply\n", #field); \
+    memcpy (&gConfig.field, &saved.field, sizeof(gConfig.field)); \
+  }
+
+/***************************************************************************
+ * reloadconfig:
+ *
+ * Re-read the configuration file on SIGHUP, called from the main loop.
+ * Settings used by the lib330 registration, the pack worker count and
+ * the decimators keep their running values.  Everything read on the
+ * data path is published as a new settings snapshot, and the DataLink
+ * connection thread moves to a new address if it changed.  On error the running
+ * configuration is kept.
+ ***************************************************************************/
+static void reloadconfig ( void )
+{
+  static Configuration saved;
+  RunConfig *rc;
+  RunConfig *oldrc = runconfig_current ();
+
+  ms_log (1, "Reloading configuration from %s\n", gConfig.ConfigFileName);
+
+  saved = gConfig;
+  memset (&gConfig, 0, sizeof(Configuration));
+  if ( readConfig (saved.ConfigFileName) == -1 )
+  {
+    ms_log (2, "Cannot reload configuration, keeping current settings\n");
+    gConfig = saved;
+    return;
+  }
+
+  RELOAD_KEEP (IPAddress);
+  RELOAD_KEEP (baseport);
+  RELOAD_KEEP (dataport);
+  RELOAD_KEEP (serialnumber);
+  RELOAD_KEEP (authcode);
+  RELOAD_KEEP (ContFileDir);
+  RELOAD_KEEP (LogLevel);
+  RELOAD_KEEP (SourcePortControl);
+  RELOAD_KEEP (SourcePortData);
+  RELOAD_KEEP (FailedRegistrationsBeforeSleep);
+  RELOAD_KEEP (MinutesToSleepBeforeRetry);
+  RELOAD_KEEP (Dutycycle_MaxConnectTime);
+  RELOAD_KEEP (Dutycycle_SleepTime);
+  RELOAD_KEEP (Dutycycle_BufferLevel);
+  RELOAD_KEEP (miniseedMode);
+  RELOAD_KEEP (onesecMode);
+  RELOAD_KEEP (PackThreads);
+  RELOAD_KEEP (Threads);
+  RELOAD_KEEP (LockMemory);
+  RELOAD_KEEP (TraceEvents);
+  RELOAD_KEEP (TraceDir);
+  RELOAD_KEEP (SeedLinkPort);
+  RELOAD_KEEP (SeedLinkRingRecords);
+  RELOAD_KEEP (SeedLinkMaxClients);
+  RELOAD_KEEP (ShmRingPath);
+  RELOAD_KEEP (ShmRingSlots);
+  RELOAD_KEEP (ShmRingSlotSize);
+  RELOAD_KEEP (StatsPath);
+  RELOAD_KEEP (StatsStreams);
+  RELOAD_KEEP (ControlSocket);
+  RELOAD_KEEP (ArchiveRoot);
+  RELOAD_KEEP (ArchiveWriteDelay);
+  RELOAD_KEEP (ArchiveSyncInterval);
+  RELOAD_KEEP (ArchiveMaxOpenFiles);
+  RELOAD_KEEP (ArchiveBufferSize);
+  RELOAD_KEEP (ArchiveUring);
+  RELOAD_KEEP (DataLinkRate);
+  RELOAD_KEEP (DataLinkBurst);
+  RELOAD_KEEP (DataLinkQueueRecords);
+  RELOAD_KEEP (CheckpointInterval);
+  if ( gConfig.numDecimators != saved.numDecimators ||
+       memcmp (gConfig.Decimators, saved.Decimators, saved.numDecimators * sizeof(DecimateSpec)) )
+  {
+    ms_log (1, "Reload: Decimate changed, restart required to apply\n");
+    memcpy (gConfig.Decimators, saved.Decimators, sizeof(gConfig.Decimators));
+    gConfig.numDecimators = saved.numDecimators;
+  }
+  if ( gConfig.numTriggers != saved.numTriggers ||
+       memcmp (gConfig.Triggers, saved.Triggers, saved.numTriggers * sizeof(TriggerSpec)) )
+  {
+    ms_log (1, "Reload: Trigger changed, restart required to apply\n");
+    memcpy (gConfig.Triggers, saved.Triggers, sizeof(gConfig.Triggers));
+    gConfig.numTriggers = saved.numTriggers;
+  }
+  if ( gConfig.numAmplitudes != saved.numAmplitudes ||
+       memcmp (gConfig.Amplitudes, saved.Amplitudes, saved.numAmplitudes * sizeof(AmplitudeSpec)) )
+  {
+    ms_log (1, "Reload: Amplitude changed, restart required to apply\n");
+    memcpy (gConfig.Amplitudes, saved.Amplitudes, sizeof(gConfig.Amplitudes));
+    gConfig.numAmplitudes = saved.numAmplitudes;
+  }
+
+  if ( ! (rc = runconfig_build (&gConfig)) )
+  {
+    gConfig = saved;
+    return;
+  }
+
+  if ( ! rc->datalinkaddr[0] && gConfig.SeedLinkPort <= 0 && ! gConfig.ShmRingPath[0] && ! gConfig.ArchiveRoot[0] )
+  {
+    ms_log (1, "Reload: DataLinkHost is needed without SeedLinkPort, ShmRingPath or ArchiveRoot, keeping %s\n",
+            oldrc->datalinkaddr);
+    strcpy (rc->datalinkaddr, oldrc->datalinkaddr);
+  }
+
+  /* The connection thread switches servers once the current write is done */
+  if ( strcmp (rc->datalinkaddr, oldrc->datalinkaddr) )
+  {
+    ms_log (1, "DataLink server changed to %s\n", ( rc->datalinkaddr[0] ) ? rc->datalinkaddr : "none");
+    dlconn_setaddr (rc->datalinkaddr);
+  }
+  dlconn_setbackoff (gConfig.ReconnectInterval, gConfig.ReconnectMaxInterval, gConfig.ConnectTimeout);
+  soh_enable (gConfig.SohInterval > 0 && rc->datalinkaddr[0]);
+  shaper_setmemorylimit (rc->memorylimit);
+  trace_setsample (gConfig.TraceSample);
+
+  verbose = gConfig.Verbosity;
+  dl_loginit (verbose-1, &print_timelog, "", &print_timelog, "");
+
+  runconfig_publish (rc);
+
+  if ( verbose )
+    printConfigStructToLog ();
+  ms_log (1, "Configuration reloaded\n");
+}  /* End of reloadconfig() */
+
+/***************************************************************************
+ * setverbosity:
+ *
+ * Apply a Verbosity set on the control socket, it lasts until the next
+ * reload of the configuration file.
+ ***************************************************************************/
+static void setverbosity ( int level )
+{
+  RunConfig *rc;
+
+  gConfig.Verbosity = level;
+  if ( ! (rc = runconfig_build (&gConfig)) )
+    return;
+  strcpy (rc->datalinkaddr, runconfig_current ()->datalinkaddr);
+
+  verbose = level;
+  dl_loginit (verbose-1, &print_timelog, "", &print_timelog, "");
+  runconfig_publish (rc);
+  ms_log (1, "Control: Verbosity set to %d\n", level);
+}  /* End of setverbosity() */
+
 /***************************************************************************
  * print_timelog:
  *
@@ -1014,4 +2928,18 @@ static void logmststats ( MSTrace *mst )
   ms_log (0, "  pktcount: %lld, reccount: %lld\n",
           (long long int) stats->pktcount,
           (long long int) stats->reccount);
+  if ( stats->stream )
+    ms_log (0, "  gaps: %lld (%.3f s), overlaps: %lld (%.3f s), time tears: %lld, timing quality: %d\n",
+            (long long int) stats->stream->gaps, stats->stream->gapseconds,
+            (long long int) stats->stream->overlaps, stats->stream->overlapseconds,
+            (long long int) stats->stream->tears, stats->stream->timingqual);
+  if ( stats->stream && stats->stream->recsamples > 0 )
+    ms_log (0, "  %s, %.2f bytes/sample, compression ratio %.2f\n",
+            encoding_name (stats->stream->lastencoding),
+            (double) stats->stream->recbytes / stats->stream->recsamples,
+            4.0 * stats->stream->recsamples / stats->stream->recbytes);
+  if ( stats->stream && stats->stream->duppackets )
+    ms_log (0, "  duplicates dropped: %lld packets, %lld samples\n",
+            (long long int) stats->stream->duppackets,
+            (long long int) stats->stream->dupsamples);
 }  /* End of logmststats() */
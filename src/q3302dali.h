@@ -28,6 +28,7 @@
 #include <libdali.h>
 
 #include <sys/types.h>
+#include <errno.h>
 
 #define PACKAGE "q3302dali"
 
@@ -59,10 +60,6 @@
 #endif
 
 
-static void logit_msg( const char * );
-static void logit_err( const char * );
-
-
 void lib330Interface_initialize();
 void lib330Interface_handlerError(enum tliberr errcode);
 void lib330Interface_initializeCreationInfo();
@@ -73,23 +70,18 @@ void lib330Interface_1SecCallback(pointer p);
 void lib330Interface_miniCallback(pointer p);
 void lib330Interface_libStateChanged(enum tlibstate newState);
 void lib330Interface_displayStatusUpdate();
+void lib330Interface_publishSoh();
+int lib330Interface_getClockQuality();
 void lib330Interface_startDataFlow();
 void lib330Interface_startRegistration();
 void lib330Interface_changeState(enum tlibstate newState, enum tliberr reason);
 void lib330Interface_startDeregistration();
 void lib330Interface_ping();
-void lib330Interface_cleanup();
+void lib330Interface_cleanup(int maxSecondsToWait);
 int lib330Interface_waitForState(enum tlibstate waitFor, int maxSecondsToWait);
 enum tlibstate lib330Interface_getLibState();
 
 void cleanup();
 void cleanupAndExit(int i);
-static void processMseed(MSRecord *msr);
-static int packtraces ( MSTrace *mst, int flush, hptime_t flushtime );
-static void sendrecord ( char *record, int reclen, void *handlerdata );
-static void usage ();
-static int handle_opts(int argc, char ** argv);
-static void print_timelog ( char *msg );
-static void logmststats ( MSTrace *mst );
 
 #endif /* q3302dali_h */
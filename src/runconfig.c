@@ -0,0 +1,163 @@
+//
+//  runconfig.c
+//  q3302dali
+//
+//  Data path settings snapshot, see runconfig.h.
+//
+//  Reclamation is epoch based.  A reader records the global epoch when it
+//  enters a read section and clears it on exit.  Publishing a snapshot
+//  bumps the epoch and retires the old snapshot tagged with the new epoch;
+//  it is freed once no reader is still inside a section entered before
+//  that epoch.  Only the main thread publishes and reclaims.
+//
+
+#include <stdio.h>
+#include "runconfig.h"
+
+typedef struct retired_s
+{
+  RunConfig *rc;
+  uint64_t epoch;
+  struct retired_s *next;
+} Retired;
+
+typedef struct readerslot_s
+{
+  uint64_t seen;                   /* epoch at entry, 0 when outside */
+  char pad[56];
+} ReaderSlot;
+
+static RunConfig *current = NULL;
+static uint64_t epoch = 1;
+static ReaderSlot readers[RUNCONFIG_MAX_READERS];
+static Retired *retired = NULL;
+
+/***************************************************************************
+ * runconfig_build:
+ *
+ * Create a snapshot from a configuration, compiling the channel rules.
+ *
+ * Returns the new snapshot or NULL on error.
+ ***************************************************************************/
+RunConfig *runconfig_build ( Configuration *config )
+{
+  RunConfig *rc;
+
+  if ( ! (rc = (RunConfig *) calloc (1, sizeof(RunConfig))) )
+  {
+    ms_log (2, "Cannot allocate run configuration\n");
+    return NULL;
+  }
+
+  rc->verbose = config->Verbosity;
+  rc->flushlatency = config->FlushLatency;
+  rc->reclen = config->RecordLength;
+  rc->continuitytolerance = config->ContinuityTolerance;
+  rc->continuitylog = config->ContinuityLog;
+  rc->questionabletimingqual = config->QuestionableTimingQuality;
+  rc->duplicatewindow = config->DuplicateWindow;
+  rc->backfillage = config->BackfillAge;
+  rc->adaptiveencoding = config->AdaptiveEncoding;
+  rc->memorylimit = (int64_t) config->MemoryLimit * 1024;
+  rc->streammemorylimit = (int64_t) config->StreamMemoryLimit * 1024;
+  memcpy (rc->sohchannels, config->SohChannels, sizeof(rc->sohchannels));
+  rc->numsohchannels = config->numSohChannels;
+  rc->chanrules = chanrules_compile (config->ChanRules, config->numChanRules);
+  if ( config->datalinkHost[0] )
+    snprintf (rc->datalinkaddr, sizeof(rc->datalinkaddr), "%s:%d",
+              config->datalinkHost, config->datalinkPort);
+
+  return rc;
+}
+
+static void freesnapshot ( RunConfig *rc )
+{
+  chanrules_free (rc->chanrules);
+  free (rc);
+}
+
+/***************************************************************************
+ * runconfig_publish:
+ *
+ * Make rc the current snapshot and retire the previous one.
+ ***************************************************************************/
+void runconfig_publish ( RunConfig *rc )
+{
+  RunConfig *old = __atomic_exchange_n (&current, rc, __ATOMIC_SEQ_CST);
+  uint64_t newepoch = __atomic_add_fetch (&epoch, 1, __ATOMIC_SEQ_CST);
+  Retired *r;
+
+  if ( old )
+  {
+    if ( ! (r = (Retired *) malloc (sizeof(Retired))) )
+    {
+      ms_log (2, "Cannot retire run configuration, leaking it\n");
+    }
+    else
+    {
+      r->rc = old;
+      r->epoch = newepoch;
+      r->next = retired;
+      retired = r;
+    }
+  }
+
+  runconfig_reclaim ();
+}
+
+/***************************************************************************
+ * runconfig_current:
+ *
+ * Returns the current snapshot.  Outside the main thread it may only be
+ * used between runconfig_enter() and runconfig_exit().
+ ***************************************************************************/
+RunConfig *runconfig_current ( void )
+{
+  return __atomic_load_n (&current, __ATOMIC_SEQ_CST);
+}
+
+void runconfig_enter ( int reader )
+{
+  __atomic_store_n (&readers[reader].seen, __atomic_load_n (&epoch, __ATOMIC_SEQ_CST),
+                    __ATOMIC_SEQ_CST);
+}
+
+void runconfig_exit ( int reader )
+{
+  __atomic_store_n (&readers[reader].seen, 0, __ATOMIC_RELEASE);
+}
+
+/***************************************************************************
+ * runconfig_reclaim:
+ *
+ * Free retired snapshots that no reader can still be using.
+ ***************************************************************************/
+void runconfig_reclaim ( void )
+{
+  Retired **rp = &retired;
+  uint64_t oldest = UINT64_MAX;
+  int i;
+
+  for ( i = 0; i < RUNCONFIG_MAX_READERS; i++ )
+  {
+    uint64_t seen = __atomic_load_n (&readers[i].seen, __ATOMIC_SEQ_CST);
+    if ( seen && seen < oldest )
+      oldest = seen;
+  }
+
+  while ( *rp )
+  {
+    Retired *r = *rp;
+
+    if ( r->epoch <= oldest )
+    {
+      *rp = r->next;
+      freesnapshot (r->rc);
+      free (r);
+    }
+    else
+    {
+      rp = &r->next;
+    }
+  }
+}
@@ -0,0 +1,50 @@
+//
+//  runconfig.h
+//  q3302dali
+//
+//  Immutable snapshot of the settings used on the data path.  The main
+//  thread builds a new snapshot when the config is reloaded and publishes
+//  it with a single pointer store; data path threads read whichever
+//  snapshot is current.  Old snapshots are freed once every reader thread
+//  has left the section it was in when the snapshot was replaced.
+//
+
+#ifndef runconfig_h
+#define runconfig_h
+
+#include "config.h"
+#include "packpool.h"
+#include "chanrules.h"
+
+#define RUNCONFIG_MAX_READERS (PACKPOOL_MAX_WORKERS + 2)
+#define RUNCONFIG_READER_LIB330 0
+#define RUNCONFIG_READER_WORKER(n) (1 + (n))
+#define RUNCONFIG_READER_TIMER (PACKPOOL_MAX_WORKERS + 1)
+
+typedef struct runconfig_s
+{
+  int verbose;
+  int flushlatency;                /* seconds, 0 to disable idle flushing */
+  int reclen;
+  double continuitytolerance;
+  int continuitylog;
+  int questionabletimingqual;
+  int duplicatewindow;             /* seconds, 0 to disable duplicate suppression */
+  int backfillage;                 /* seconds, older records are backfill */
+  int adaptiveencoding;            /* seconds between trial encodings, 0 to disable */
+  int64_t memorylimit;             /* bytes in trace buffers and queues, 0 for none */
+  int64_t streammemorylimit;       /* bytes in the trace buffers of a stream, 0 for none */
+  char sohchannels[MAX_SOH_CHANNELS][16];
+  int numsohchannels;
+  ChanRules *chanrules;            /* NULL for no rules */
+  char datalinkaddr[285];          /* host:port, empty for no DataLink */
+} RunConfig;
+
+RunConfig *runconfig_build ( Configuration *config );
+void runconfig_publish ( RunConfig *rc );
+RunConfig *runconfig_current ( void );
+void runconfig_enter ( int reader );
+void runconfig_exit ( int reader );
+void runconfig_reclaim ( void );
+
+#endif /* runconfig_h */
@@ -0,0 +1,527 @@
+//
+//  shaper.c
+//  q3302dali
+//
+//  DataLink output shaping, see shaper.h.
+//
+//  A token bucket of burst bytes refills at rate bytes per second; a
+//  record costs its length plus an allowance for the DataLink header.
+//  When the bucket is short the thread waits for exactly the missing
+//  tokens and then chooses again, so a live record queued meanwhile goes
+//  ahead of the backfill record that was waiting.  Behind the first record
+//  of a class every following one the bucket still covers is taken into
+//  the same batch, up to SHAPER_BATCH and the wrap of the queue.  Each
+//  class has its own bounded queue; a full queue blocks the thread
+//  submitting to it, which holds data back in lib330 and the Q330 buffer
+//  instead of dropping it.  With a memory limit a submitter also waits
+//  while the data held in the trace buffers and queues is over it, until
+//  its own class is empty.  While held nothing is sent and the queues fill
+//  up like with a slow link, but a submitter finding its queue full spills
+//  its record rather than wait, so a pause holds back nothing else.  Once
+//  finishing the hold and the rate no longer apply, and from the spill
+//  time on batches go to the spill function; a submitter finding a full
+//  queue while stopping spills its record rather than drop it.
+//
+
+#include <stdio.h>
+#include <time.h>
+#include "shaper.h"
+#include "placement.h"
+#include "memacct.h"
+
+#define SHAPER_OVERHEAD 64         /* DataLink header and stream ID per record */
+
+typedef struct shaperqueue_s
+{
+  ShaperRecord *entries;
+  int head;
+  int count;
+  int sending;                     /* records at the head being sent */
+  ShaperStats stats;
+} ShaperQueue;
+
+static ShaperQueue queues[SHAPER_CLASSES];
+static int maxentries = 0;
+static double rate = 0.0;          /* bytes per second */
+static double burst = 0.0;         /* bucket size in bytes */
+static double tokens = 0.0;
+static double lastrefill = 0.0;
+static ShaperSend sendfunc = NULL;
+static ShaperSend spillfunc = NULL;
+static double spillat = 0.0;       /* monotonic seconds, 0 for never */
+static int64_t memorylimit = 0;    /* bytes, 0 for none */
+
+static pthread_mutex_t shaperlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notempty;
+static pthread_cond_t notfull;
+static int holding = 0;            /* paused, nothing is sent */
+static int64_t holdlost = 0;       /* records not spilled during the hold */
+static int finishing = 0;          /* ignore the rate */
+static int stopping = 0;
+static int running = 0;
+static pthread_t shaperthread;
+
+static void *shaper_thread ( void *arg );
+
+static double monotime ( void )
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***************************************************************************
+ * shaper_start:
+ *
+ * Start sending through send at no more than rate bytes per second with
+ * bursts of up to burst bytes, queueing up to queuerecords records per
+ * class.  With rate 0 records are sent as fast as send returns, still in
+ * priority order.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int shaper_start ( int bytespersec, int burstbytes, int queuerecords, ShaperSend send )
+{
+  pthread_condattr_t attr;
+  int i;
+
+  if ( bytespersec < 0 || burstbytes <= 0 || queuerecords <= 0 )
+  {
+    ms_log (2, "DataLink burst and queue size must be positive\n");
+    return -1;
+  }
+
+  for ( i = 0; i < SHAPER_CLASSES; i++ )
+  {
+    memset (&queues[i], 0, sizeof(ShaperQueue));
+    if ( ! (queues[i].entries = (ShaperRecord *) calloc (queuerecords, sizeof(ShaperRecord))) )
+    {
+      ms_log (2, "Cannot allocate DataLink queue of %d records\n", queuerecords);
+      return -1;
+    }
+  }
+  maxentries = queuerecords;
+  rate = bytespersec;
+  burst = burstbytes;
+  tokens = burst;
+  lastrefill = monotime ();
+  sendfunc = send;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&notempty, &attr);
+  pthread_cond_init (&notfull, NULL);
+  pthread_condattr_destroy (&attr);
+
+  spillfunc = NULL;
+  spillat = 0.0;
+  finishing = 0;
+  stopping = 0;
+
+  if ( pthread_create (&shaperthread, NULL, shaper_thread, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start DataLink shaper thread\n");
+    return -1;
+  }
+  running = 1;
+
+  if ( bytespersec > 0 )
+    ms_log (0, "DataLink output limited to %d bytes/s, bursts of %d bytes\n", bytespersec, burstbytes);
+
+  return 0;
+}
+
+int shaper_running ( void )
+{
+  return running;
+}
+
+/***************************************************************************
+ * shaper_submit:
+ *
+ * Queue a record in a priority class, waiting while that class queue is
+ * full.  While held or stopping the record is spilled instead.  Safe to
+ * call from any thread.
+ ***************************************************************************/
+void shaper_submit ( int priority, char *record, int reclen, char *streamid,
+                     hptime_t starttime, hptime_t endtime )
+{
+  ShaperQueue *q = &queues[priority];
+  ShaperRecord *e;
+  ShaperRecord r;
+  int first = 0;
+  int held;
+  int rv;
+
+  pthread_mutex_lock (&shaperlock);
+
+  if ( ! q->entries )
+  {
+    pthread_mutex_unlock (&shaperlock);
+    return;
+  }
+
+  while ( ( q->count == maxentries ||
+            ( memorylimit > 0 && q->count > 0 && memacct_total () + reclen > memorylimit ) ) &&
+          ! stopping && ! ( holding && ! finishing ) )
+    pthread_cond_wait (&notfull, &shaperlock);
+
+  held = holding && ! finishing && ! stopping;
+
+  if ( ( stopping && q->count == maxentries ) ||
+       ( held && ( q->count == maxentries ||
+                   ( memorylimit > 0 && q->count > 0 && memacct_total () + reclen > memorylimit ) ) ) )
+  {
+    rv = -1;
+    pthread_mutex_unlock (&shaperlock);
+    if ( spillfunc )
+    {
+      memset (&r, 0, sizeof(r));
+      r.data = record;
+      r.reclen = reclen;
+      strncpy (r.streamid, streamid, sizeof(r.streamid) - 1);
+      r.starttime = starttime;
+      r.endtime = endtime;
+      rv = spillfunc (&r, 1);
+    }
+
+    pthread_mutex_lock (&shaperlock);
+    if ( rv == 0 )
+      q->stats.spilled++;
+    else
+      q->stats.failed++;
+    if ( rv < 0 && held )
+      first = ( holdlost++ == 0 );
+    pthread_mutex_unlock (&shaperlock);
+
+    /* Once per hold, the count follows on release */
+    if ( first )
+      ms_log (2, "DataLink paused with its queue full and no spool, dropping %s\n", streamid);
+    else if ( rv < 0 && ! held )
+      ms_log (2, "DataLink queue full while stopping, dropping %s\n", streamid);
+    return;
+  }
+
+  e = &q->entries[(q->head + q->count) % maxentries];
+  if ( e->cap < reclen )
+  {
+    char *data = (char *) realloc (e->data, reclen);
+    if ( ! data )
+    {
+      pthread_mutex_unlock (&shaperlock);
+      ms_log (2, "Cannot allocate DataLink queue entry\n");
+      return;
+    }
+    e->data = data;
+    e->cap = reclen;
+  }
+
+  memcpy (e->data, record, reclen);
+  e->reclen = reclen;
+  strncpy (e->streamid, streamid, sizeof(e->streamid) - 1);
+  e->streamid[sizeof(e->streamid) - 1] = '\0';
+  e->starttime = starttime;
+  e->endtime = endtime;
+  e->queued = monotime ();
+  e->failed = 0;
+  q->count++;
+  memacct_add (MEM_QUEUE, reclen);
+
+  pthread_cond_signal (&notempty);
+  pthread_mutex_unlock (&shaperlock);
+}
+
+static void *shaper_thread ( void *arg )
+{
+  ShaperQueue *q;
+  ShaperRecord *e;
+  ShaperSend send;
+  struct timespec deadline;
+  double now;
+  double cost;
+  double wait;
+  double delay;
+  int count;
+  int rv;
+  int c, i;
+
+  placement_enter (THREAD_DATALINK, "shaper");
+
+  pthread_mutex_lock (&shaperlock);
+
+  for (;;)
+  {
+    for ( c = 0; c < SHAPER_CLASSES && ! queues[c].count; c++ )
+      ;
+
+    if ( c == SHAPER_CLASSES )
+    {
+      if ( stopping )
+        break;
+      pthread_cond_wait (&notempty, &shaperlock);
+      continue;
+    }
+
+    /* Held, the queues fill up and hold back the packing threads */
+    if ( holding && ! finishing )
+    {
+      pthread_cond_wait (&notempty, &shaperlock);
+      continue;
+    }
+
+    q = &queues[c];
+    e = &q->entries[q->head];
+
+    now = monotime ();
+    tokens += ( now - lastrefill ) * rate;
+    if ( tokens > burst )
+      tokens = burst;
+    lastrefill = now;
+
+    /* A record larger than the bucket goes once the bucket is full */
+    cost = e->reclen + SHAPER_OVERHEAD;
+    if ( cost > burst )
+      cost = burst;
+
+    /* Queued data is sent at full speed once finishing */
+    if ( rate > 0.0 && tokens < cost && ! finishing )
+    {
+      wait = now + ( cost - tokens ) / rate;
+      deadline.tv_sec = (time_t) wait;
+      deadline.tv_nsec = (long) (( wait - deadline.tv_sec ) * 1e9);
+      pthread_cond_timedwait (&notempty, &shaperlock, &deadline);
+      continue;
+    }
+    tokens -= cost;
+
+    /* Follow with what else is queued, as far as the bucket allows */
+    for ( count = 1; count < SHAPER_BATCH && count < q->count && q->head + count < maxentries; count++ )
+    {
+      cost = e[count].reclen + SHAPER_OVERHEAD;
+      if ( rate > 0.0 && tokens < cost && ! finishing )
+        break;
+      tokens -= cost;
+    }
+
+    /* Entries being sent are left alone by submitters and shedding until popped */
+    send = ( spillfunc && spillat > 0.0 && now >= spillat ) ? spillfunc : sendfunc;
+    q->sending = count;
+    pthread_mutex_unlock (&shaperlock);
+    rv = send (e, count);
+    pthread_mutex_lock (&shaperlock);
+    q->sending = 0;
+
+    for ( i = 0; i < count; i++ )
+    {
+      if ( rv < 0 || e[i].failed )
+      {
+        q->stats.failed++;
+      }
+      else if ( send == spillfunc )
+      {
+        q->stats.spilled++;
+      }
+      else
+      {
+        delay = now - e[i].queued;
+        if ( delay > q->stats.maxdelay )
+          q->stats.maxdelay = delay;
+        q->stats.records++;
+        q->stats.bytes += e[i].reclen;
+      }
+      memacct_add (MEM_QUEUE, -e[i].reclen);
+    }
+
+    q->head = ( q->head + count ) % maxentries;
+    q->count -= count;
+    pthread_cond_broadcast (&notfull);
+  }
+
+  pthread_mutex_unlock (&shaperlock);
+
+  return NULL;
+}
+
+/* Stop or resume sending, queued records are kept and the rest spilled meanwhile */
+void shaper_hold ( int hold )
+{
+  int64_t lost;
+
+  pthread_mutex_lock (&shaperlock);
+  holding = hold;
+  lost = holdlost;
+  holdlost = 0;
+  pthread_cond_broadcast (&notempty);
+  pthread_cond_broadcast (&notfull);
+  pthread_mutex_unlock (&shaperlock);
+
+  if ( lost )
+    ms_log (2, "Dropped %lld DataLink records while paused\n", (long long int) lost);
+}
+
+/***************************************************************************
+ * shaper_setspill:
+ *
+ * Hand records that find their queue full while held to spill, which
+ * must not block for long.  shaper_finish() sets its own.
+ ***************************************************************************/
+void shaper_setspill ( ShaperSend spill )
+{
+  pthread_mutex_lock (&shaperlock);
+  spillfunc = spill;
+  pthread_mutex_unlock (&shaperlock);
+}
+
+/* Limit for the data held in trace buffers and queues, 0 for none */
+void shaper_setmemorylimit ( int64_t bytes )
+{
+  pthread_mutex_lock (&shaperlock);
+  memorylimit = bytes;
+  pthread_cond_broadcast (&notfull);
+  pthread_mutex_unlock (&shaperlock);
+}
+
+/***************************************************************************
+ * shaper_shed:
+ *
+ * Drop records of a class until at least bytes are freed, the newest
+ * first.  The oldest record and any being sent are kept.  The records
+ * dropped are handed to spill, unless NULL, in queue order once the
+ * queues are unlocked again; their buffers are taken from the queue
+ * entries rather than copied.
+ *
+ * Returns the number of records dropped.
+ ***************************************************************************/
+int shaper_shed ( int priority, int64_t bytes, ShaperSend spill )
+{
+  ShaperQueue *q = &queues[priority];
+  ShaperRecord *shed = NULL;
+  ShaperRecord *e;
+  int64_t freed = 0;
+  int dropped = 0;
+  int i;
+
+  pthread_mutex_lock (&shaperlock);
+
+  while ( q->entries && q->count - dropped > 1 && q->count - dropped > q->sending && freed < bytes )
+  {
+    freed += q->entries[(q->head + q->count - dropped - 1) % maxentries].reclen;
+    dropped++;
+  }
+
+  if ( dropped && spill && ! (shed = (ShaperRecord *) malloc (dropped * sizeof(ShaperRecord))) )
+    ms_log (2, "Cannot allocate %d shed DataLink records, they are lost\n", dropped);
+
+  /* The records dropped follow the ones kept */
+  for ( i = 0; i < dropped; i++ )
+  {
+    e = &q->entries[(q->head + q->count - dropped + i) % maxentries];
+    memacct_add (MEM_QUEUE, -e->reclen);
+    if ( shed )
+    {
+      shed[i] = *e;
+      e->data = NULL;
+      e->cap = 0;
+    }
+  }
+  q->count -= dropped;
+  q->stats.dropped += dropped;
+
+  if ( dropped )
+    pthread_cond_broadcast (&notfull);
+  pthread_mutex_unlock (&shaperlock);
+
+  if ( shed )
+  {
+    spill (shed, dropped);
+    for ( i = 0; i < dropped; i++ )
+      free (shed[i].data);
+    free (shed);
+  }
+
+  return dropped;
+}
+
+/* Counters of a class, reset clears the longest wait */
+void shaper_stats ( int priority, ShaperStats *stats, int reset )
+{
+  pthread_mutex_lock (&shaperlock);
+  *stats = queues[priority].stats;
+  stats->queued = queues[priority].count;
+  if ( reset )
+    queues[priority].stats.maxdelay = 0.0;
+  pthread_mutex_unlock (&shaperlock);
+}
+
+const char *shaper_classname ( int priority )
+{
+  switch ( priority )
+  {
+    case SHAPER_LIVE:     return "live";
+    case SHAPER_SOH:      return "soh";
+    case SHAPER_BACKFILL: return "backfill";
+  }
+  return "unknown";
+}
+
+/***************************************************************************
+ * shaper_finish:
+ *
+ * Send what is queued and submitted from now on ignoring the rate.  Once
+ * seconds have passed, unless seconds is negative, the records still
+ * queued are handed to spill instead, which must not block for long.
+ ***************************************************************************/
+void shaper_finish ( double seconds, ShaperSend spill )
+{
+  pthread_mutex_lock (&shaperlock);
+  finishing = 1;
+  spillfunc = spill;
+  spillat = ( seconds >= 0.0 ) ? monotime () + seconds : 0.0;
+  pthread_cond_broadcast (&notempty);
+  pthread_mutex_unlock (&shaperlock);
+}
+
+/***************************************************************************
+ * shaper_stop:
+ *
+ * Send everything still queued, ignoring the rate, and stop the thread.
+ * After shaper_finish() records queued past its deadline are spilled.
+ ***************************************************************************/
+void shaper_stop ( void )
+{
+  int64_t spilled = 0;
+  int64_t failed = 0;
+  int i, j;
+
+  if ( ! running )
+    return;
+
+  pthread_mutex_lock (&shaperlock);
+  finishing = 1;
+  stopping = 1;
+  pthread_cond_broadcast (&notempty);
+  pthread_cond_broadcast (&notfull);
+  pthread_mutex_unlock (&shaperlock);
+  pthread_join (shaperthread, NULL);
+
+  /* Late submitters find no queue */
+  pthread_mutex_lock (&shaperlock);
+  running = 0;
+  for ( i = 0; i < SHAPER_CLASSES; i++ )
+  {
+    spilled += queues[i].stats.spilled;
+    failed += queues[i].stats.failed;
+    for ( j = 0; j < maxentries; j++ )
+      free (queues[i].entries[j].data);
+    free (queues[i].entries);
+    queues[i].entries = NULL;
+    queues[i].count = 0;
+  }
+  pthread_mutex_unlock (&shaperlock);
+
+  if ( spilled )
+    ms_log (1, "%lld DataLink records were spilled, not sent in time or held\n", (long long int) spilled);
+  if ( failed )
+    ms_log (2, "%lld DataLink records could not be sent or spilled\n", (long long int) failed);
+}
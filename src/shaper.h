@@ -0,0 +1,68 @@
+//
+//  shaper.h
+//  q3302dali
+//
+//  DataLink output queue and shaping for constrained links.  Records are
+//  queued by priority class and sent by a thread of their own, optionally
+//  at no more than a configured rate, always taking the highest class
+//  with data first, so backfill only uses the capacity left over by live
+//  data and SOH.  The packing threads never wait on the network unless a
+//  queue is full.  Records of a class that are already queued and within
+//  the rate go to the sender together, so a backlog costs one network
+//  write per batch rather than one per record.  At shutdown the queues
+//  are sent at full speed and whatever is still queued at a deadline is
+//  handed to a spill function instead.
+//
+
+#ifndef shaper_h
+#define shaper_h
+
+#include "q3302dali.h"
+
+#define SHAPER_LIVE     0          /* recent waveform data */
+#define SHAPER_SOH      1          /* state of health channels and logs */
+#define SHAPER_BACKFILL 2          /* data older than the backfill age */
+#define SHAPER_CLASSES  3
+
+#define SHAPER_BATCH    64         /* most records handed to the sender at once */
+
+typedef struct shaperrecord_s
+{
+  char *data;
+  int cap;
+  int reclen;
+  char streamid[100];
+  hptime_t starttime;
+  hptime_t endtime;
+  double queued;                   /* monotonic seconds */
+  int failed;                      /* set by the sender for a record not sent */
+} ShaperRecord;
+
+/* Send records in queue order, called on the shaper thread, returns 0 or -1 if not sent */
+typedef int (*ShaperSend) ( ShaperRecord *records, int count );
+
+typedef struct shaperstats_s
+{
+  int64_t records;                 /* sent */
+  int64_t bytes;
+  int64_t failed;                  /* the sender or spill function failed on */
+  int64_t dropped;                 /* shed to stay within the memory limit */
+  int64_t spilled;                 /* not sent in time at shutdown, or held */
+  int queued;                      /* records waiting now */
+  double maxdelay;                 /* longest wait in seconds since the last reset */
+} ShaperStats;
+
+int shaper_start ( int rate, int burst, int queuerecords, ShaperSend send );
+int shaper_running ( void );
+void shaper_submit ( int priority, char *record, int reclen, char *streamid,
+                     hptime_t starttime, hptime_t endtime );
+void shaper_hold ( int hold );
+void shaper_setspill ( ShaperSend spill );
+void shaper_setmemorylimit ( int64_t bytes );
+int shaper_shed ( int priority, int64_t bytes, ShaperSend spill );
+void shaper_stats ( int priority, ShaperStats *stats, int reset );
+const char *shaper_classname ( int priority );
+void shaper_finish ( double seconds, ShaperSend spill );
+void shaper_stop ( void );
+
+#endif /* shaper_h */
@@ -0,0 +1,324 @@
+//
+//  shmring.c
+//  q3302dali
+//
+//  Memory-mapped record ring, see shmring.h.
+//
+//  A writer that restarts with the same slot size and count keeps the
+//  ring and continues its sequence, so readers carry on without noticing.
+//  If the geometry changes the old file is marked closed and unlinked and
+//  a new one is created at the same path.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+static ShmRingSlot *slotat ( ShmRing *ring, uint64_t seq )
+{
+  return (ShmRingSlot *) (ring->slots + ( seq % ring->header->numslots ) * ring->stride);
+}
+
+/* Map an open ring file, returns 0 on success */
+static int mapring ( ShmRing *ring, size_t size, int prot )
+{
+  void *map = mmap (NULL, size, prot, MAP_SHARED, ring->fd, 0);
+
+  if ( map == MAP_FAILED )
+    return -1;
+
+  ring->header = (ShmRingHeader *) map;
+  ring->slots = (char *) map + sizeof(ShmRingHeader);
+  ring->mapsize = size;
+
+  return 0;
+}
+
+/* Check an existing ring file, returns 1 if it matches the geometry */
+static int ringmatches ( ShmRing *ring, uint32_t numslots, uint32_t slotsize )
+{
+  ShmRingHeader *hdr = ring->header;
+
+  return ! memcmp (hdr->magic, SHMRING_MAGIC, sizeof(hdr->magic)) &&
+         hdr->version == SHMRING_VERSION && hdr->state == SHMRING_LIVE &&
+         hdr->numslots == numslots && hdr->slotsize == slotsize &&
+         hdr->writeseq > 0;
+}
+
+/***************************************************************************
+ * shmring_create:
+ *
+ * Create or reuse the ring file at path for writing.  slotsize is
+ * rounded up to a multiple of 64.
+ *
+ * Returns the ring or NULL on error, with errno set.
+ ***************************************************************************/
+ShmRing *shmring_create ( const char *path, uint32_t numslots, uint32_t slotsize )
+{
+  ShmRing *ring;
+  struct stat st;
+  size_t size;
+
+  if ( numslots == 0 || slotsize == 0 )
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if ( ! (ring = (ShmRing *) calloc (1, sizeof(ShmRing))) )
+    return NULL;
+  ring->fd = -1;
+
+  slotsize = ( slotsize + 63 ) & ~63u;
+  ring->writer = 1;
+  ring->stride = sizeof(ShmRingSlot) + slotsize;
+  size = sizeof(ShmRingHeader) + (size_t) numslots * ring->stride;
+  pthread_mutex_init (&ring->lock, NULL);
+
+  if ( (ring->fd = open (path, O_RDWR | O_CREAT, 0644)) < 0 )
+    goto error;
+
+  if ( fstat (ring->fd, &st) < 0 )
+    goto error;
+
+  /* Keep a compatible ring, its readers continue where they were */
+  if ( (size_t) st.st_size == size )
+  {
+    if ( mapring (ring, size, PROT_READ | PROT_WRITE) < 0 )
+      goto error;
+    if ( ringmatches (ring, numslots, slotsize) )
+      return ring;
+    munmap (ring->header, ring->mapsize);
+    ring->header = NULL;
+  }
+
+  /* Retire an incompatible ring so its readers reopen the path */
+  if ( (size_t) st.st_size >= sizeof(ShmRingHeader) )
+  {
+    if ( mapring (ring, sizeof(ShmRingHeader), PROT_READ | PROT_WRITE) == 0 )
+    {
+      __atomic_store_n (&ring->header->state, SHMRING_CLOSED, __ATOMIC_RELEASE);
+      munmap (ring->header, ring->mapsize);
+      ring->header = NULL;
+    }
+  }
+  if ( st.st_size > 0 )
+  {
+    close (ring->fd);
+    unlink (path);
+    if ( (ring->fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 )
+      goto error;
+  }
+
+  if ( ftruncate (ring->fd, size) < 0 || mapring (ring, size, PROT_READ | PROT_WRITE) < 0 )
+    goto error;
+
+  /* The magic is written last, readers reject the file until then */
+  ring->header->version = SHMRING_VERSION;
+  ring->header->state = SHMRING_LIVE;
+  ring->header->slotsize = slotsize;
+  ring->header->numslots = numslots;
+  ring->header->created = (uint64_t) time (NULL);
+  ring->header->writeseq = 1;
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  memcpy (ring->header->magic, SHMRING_MAGIC, sizeof(ring->header->magic));
+
+  return ring;
+
+ error:
+  {
+    int saved = errno;
+    shmring_close (ring);
+    errno = saved;
+  }
+  return NULL;
+}
+
+/***************************************************************************
+ * shmring_write:
+ *
+ * Append a record.  Safe to call from several threads of the writer.
+ *
+ * Returns 0 on success and -1 if the record does not fit a slot.
+ ***************************************************************************/
+int shmring_write ( ShmRing *ring, const char *record, uint32_t reclen,
+                    const char *net, const char *sta, const char *loc, const char *chan,
+                    int64_t starttime, int64_t endtime )
+{
+  ShmRingSlot *slot;
+  uint64_t seq;
+
+  if ( reclen > ring->header->slotsize )
+    return -1;
+
+  pthread_mutex_lock (&ring->lock);
+
+  seq = ring->header->writeseq;
+  slot = slotat (ring, seq);
+
+  __atomic_store_n (&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  slot->starttime = starttime;
+  slot->endtime = endtime;
+  slot->reclen = reclen;
+  strncpy (slot->network, net, sizeof(slot->network) - 1);
+  strncpy (slot->station, sta, sizeof(slot->station) - 1);
+  strncpy (slot->location, loc, sizeof(slot->location) - 1);
+  strncpy (slot->channel, chan, sizeof(slot->channel) - 1);
+  memcpy (slot->data, record, reclen);
+
+  __atomic_store_n (&slot->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n (&ring->header->writeseq, seq + 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock (&ring->lock);
+
+  return 0;
+}
+
+/***************************************************************************
+ * shmring_open:
+ *
+ * Map an existing ring read-only for reading.
+ *
+ * Returns the ring or NULL on error, with errno set.
+ ***************************************************************************/
+ShmRing *shmring_open ( const char *path )
+{
+  ShmRing *ring;
+  struct stat st;
+  ShmRingHeader *hdr;
+
+  if ( ! (ring = (ShmRing *) calloc (1, sizeof(ShmRing))) )
+    return NULL;
+  ring->fd = -1;
+  pthread_mutex_init (&ring->lock, NULL);
+
+  if ( (ring->fd = open (path, O_RDONLY)) < 0 || fstat (ring->fd, &st) < 0 )
+    goto error;
+
+  if ( (size_t) st.st_size < sizeof(ShmRingHeader) )
+  {
+    errno = EAGAIN;
+    goto error;
+  }
+
+  if ( mapring (ring, st.st_size, PROT_READ) < 0 )
+    goto error;
+
+  hdr = ring->header;
+  ring->stride = sizeof(ShmRingSlot) + hdr->slotsize;
+  if ( memcmp (hdr->magic, SHMRING_MAGIC, sizeof(hdr->magic)) || hdr->version != SHMRING_VERSION ||
+       hdr->numslots == 0 ||
+       (size_t) st.st_size < sizeof(ShmRingHeader) + (size_t) hdr->numslots * ring->stride )
+  {
+    errno = EINVAL;
+    goto error;
+  }
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+  return ring;
+
+ error:
+  {
+    int saved = errno;
+    shmring_close (ring);
+    errno = saved;
+  }
+  return NULL;
+}
+
+/* Position a cursor at the oldest record still in the ring */
+void shmring_oldest ( ShmRing *ring, ShmRingCursor *cursor )
+{
+  uint64_t next = __atomic_load_n (&ring->header->writeseq, __ATOMIC_ACQUIRE);
+
+  cursor->seq = ( next > ring->header->numslots ) ? next - ring->header->numslots : 1;
+  cursor->lost = 0;
+}
+
+/* Position a cursor at the next record written */
+void shmring_newest ( ShmRing *ring, ShmRingCursor *cursor )
+{
+  cursor->seq = __atomic_load_n (&ring->header->writeseq, __ATOMIC_ACQUIRE);
+  cursor->lost = 0;
+}
+
+/***************************************************************************
+ * shmring_next:
+ *
+ * Get the record at the cursor and advance it.  The record is used in
+ * place; once done call shmring_valid() with the sequence it was read
+ * at, cursor->seq - 1, to confirm it was not overwritten meanwhile.
+ * Records overwritten before they were reached are counted in
+ * cursor->lost and skipped.
+ *
+ * Returns 1 with *slotp set, 0 if there is no new record, or -1 if the
+ * ring was replaced and the path must be reopened.
+ ***************************************************************************/
+int shmring_next ( ShmRing *ring, ShmRingCursor *cursor, const ShmRingSlot **slotp )
+{
+  ShmRingHeader *hdr = ring->header;
+  uint64_t next;
+  uint64_t oldest;
+  ShmRingSlot *slot;
+
+  if ( __atomic_load_n (&hdr->state, __ATOMIC_ACQUIRE) != SHMRING_LIVE )
+    return -1;
+
+  for (;;)
+  {
+    next = __atomic_load_n (&hdr->writeseq, __ATOMIC_ACQUIRE);
+    if ( cursor->seq == 0 || cursor->seq > next )
+      cursor->seq = next;
+    if ( cursor->seq == next )
+      return 0;
+
+    oldest = ( next > hdr->numslots ) ? next - hdr->numslots : 1;
+    if ( cursor->seq < oldest )
+    {
+      cursor->lost += oldest - cursor->seq;
+      cursor->seq = oldest;
+    }
+
+    slot = slotat (ring, cursor->seq);
+    if ( __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) == cursor->seq )
+    {
+      *slotp = slot;
+      cursor->seq++;
+      return 1;
+    }
+
+    /* Already being reused for a later record */
+    cursor->lost++;
+    cursor->seq++;
+  }
+}
+
+/* Returns 1 if the slot still holds record seq */
+int shmring_valid ( const ShmRingSlot *slot, uint64_t seq )
+{
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  return __atomic_load_n (&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* Unmap and close a ring, a writer leaves it in place for a restart */
+void shmring_close ( ShmRing *ring )
+{
+  if ( ! ring )
+    return;
+
+  if ( ring->header )
+    munmap (ring->header, ring->mapsize);
+  if ( ring->fd >= 0 )
+    close (ring->fd);
+  pthread_mutex_destroy (&ring->lock);
+  free (ring);
+}
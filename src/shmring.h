@@ -0,0 +1,86 @@
+//
+//  shmring.h
+//  q3302dali
+//
+//  Memory-mapped record ring for consumers on the same host.  One writer
+//  appends records to fixed-size slots numbered by sequence; readers map
+//  the file read-only and keep their own cursor, so a reader never blocks
+//  the writer and a crashed reader leaves nothing behind in the ring.
+//
+//  Each slot is guarded by its sequence number: it is cleared while the
+//  slot is written and set once the record is complete.  Readers use a
+//  record in place and then call shmring_valid() to confirm the slot was
+//  not reused meanwhile.  Only libc is needed, readers may build this file
+//  on its own.
+//
+
+#ifndef shmring_h
+#define shmring_h
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define SHMRING_MAGIC "Q330RNG"
+#define SHMRING_VERSION 1
+#define SHMRING_LIVE 1
+#define SHMRING_CLOSED 2           /* replaced by a new ring, reopen the path */
+
+typedef struct shmring_header_s
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t state;
+  uint32_t slotsize;               /* record bytes per slot, multiple of 64 */
+  uint32_t numslots;
+  uint64_t created;                /* writer start time, seconds */
+  char pad0[32];
+  uint64_t writeseq;               /* sequence of the next record, from 1 */
+  char pad1[56];
+} ShmRingHeader;
+
+typedef struct shmring_slot_s
+{
+  uint64_t seq;                    /* 0 while being written */
+  int64_t starttime;               /* libmseed hptime */
+  int64_t endtime;
+  uint32_t reclen;
+  char network[4];
+  char station[8];
+  char location[4];
+  char channel[4];
+  char pad[16];
+  char data[];                     /* slotsize bytes, 64 byte aligned */
+} ShmRingSlot;
+
+typedef struct shmring_s
+{
+  int fd;
+  int writer;
+  ShmRingHeader *header;
+  char *slots;
+  size_t mapsize;
+  size_t stride;
+  pthread_mutex_t lock;            /* serializes writers in this process */
+} ShmRing;
+
+/* Reader position, owned by the consumer */
+typedef struct shmring_cursor_s
+{
+  uint64_t seq;                    /* next sequence to read */
+  uint64_t lost;                   /* records overwritten before being read */
+} ShmRingCursor;
+
+ShmRing *shmring_create ( const char *path, uint32_t numslots, uint32_t slotsize );
+int shmring_write ( ShmRing *ring, const char *record, uint32_t reclen,
+                    const char *net, const char *sta, const char *loc, const char *chan,
+                    int64_t starttime, int64_t endtime );
+
+ShmRing *shmring_open ( const char *path );
+void shmring_oldest ( ShmRing *ring, ShmRingCursor *cursor );
+void shmring_newest ( ShmRing *ring, ShmRingCursor *cursor );
+int shmring_next ( ShmRing *ring, ShmRingCursor *cursor, const ShmRingSlot **slotp );
+int shmring_valid ( const ShmRingSlot *slot, uint64_t seq );
+
+void shmring_close ( ShmRing *ring );
+
+#endif /* shmring_h */
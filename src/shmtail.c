@@ -0,0 +1,90 @@
+//
+//  shmtail.c
+//  q3302dali
+//
+//  Example shared-memory ring reader.  Prints one line per record read
+//  from the ring written with ShmRingPath, reopening the ring if the
+//  writer replaces it.  Needs only shmring.c.
+//
+//  Usage: shmtail <ringfile> [-a]
+//    -a  start with the oldest record in the ring instead of new records
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "shmring.h"
+
+int main ( int argc, char **argv )
+{
+  ShmRing *ring = NULL;
+  ShmRingCursor cursor;
+  const ShmRingSlot *slot;
+  uint64_t seq;
+  uint64_t lost = 0;
+  char line[128];
+  int all = ( argc > 2 && ! strcmp (argv[2], "-a") );
+  int rv;
+
+  if ( argc < 2 )
+  {
+    fprintf (stderr, "Usage: shmtail <ringfile> [-a]\n");
+    return 1;
+  }
+
+  for (;;)
+  {
+    if ( ! ring )
+    {
+      if ( ! (ring = shmring_open (argv[1])) )
+      {
+        if ( errno != ENOENT && errno != EAGAIN )
+        {
+          fprintf (stderr, "Cannot open %s: %s\n", argv[1], strerror (errno));
+          return 1;
+        }
+        sleep (1);
+        continue;
+      }
+
+      if ( all )
+        shmring_oldest (ring, &cursor);
+      else
+        shmring_newest (ring, &cursor);
+    }
+
+    if ( (rv = shmring_next (ring, &cursor, &slot)) < 0 )
+    {
+      fprintf (stderr, "Ring replaced, reopening\n");
+      shmring_close (ring);
+      ring = NULL;
+      all = 1;
+      continue;
+    }
+
+    if ( rv == 0 )
+    {
+      usleep (10000);
+      continue;
+    }
+
+    seq = cursor.seq - 1;
+    snprintf (line, sizeof(line), "%llu %s_%s_%s_%s %lld %u",
+              (unsigned long long) seq, slot->network, slot->station, slot->location,
+              slot->channel, (long long) slot->starttime, slot->reclen);
+
+    /* Only print what was read from an unchanged slot */
+    if ( shmring_valid (slot, seq) )
+      printf ("%s\n", line);
+
+    if ( cursor.lost != lost )
+    {
+      fprintf (stderr, "Lost %llu records\n", (unsigned long long) (cursor.lost - lost));
+      lost = cursor.lost;
+    }
+  }
+
+  return 0;
+}
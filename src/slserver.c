@@ -0,0 +1,1426 @@
+//
+//  slserver.c
+//  q3302dali
+//
+//  Embedded SeedLink server, see slserver.h.
+//
+//  Records are copied into the ring once under a write lock.  A single
+//  server thread owns every client socket; it holds the read lock only for
+//  non-blocking sendmsg() calls that point straight at the ring slots, so
+//  no client ever gets its own copy of a record.  When a socket accepts
+//  part of a frame the rest is copied to the client output buffer, which
+//  is drained before any further frames are sent.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <ctype.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "slserver.h"
+#include "placement.h"
+
+#define SL_LINE_MAX 256            /* longest command line accepted */
+#define SL_OUTBUF_MAX (1024*1024)  /* most queued replies and partial frames */
+#define SL_BATCH 256               /* frames per client per wakeup */
+#define SL_V3_RECLEN 512
+
+typedef struct slslot_s
+{
+  uint64_t seq;                    /* 0 while empty */
+  char *data;
+  int cap;
+  int reclen;
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+  char type;                       /* D, E, C, T, L or O */
+  hptime_t starttime;
+  hptime_t endtime;
+} SLSlot;
+
+typedef struct slselect_s
+{
+  char location[16];
+  char channel[16];
+  char type;                       /* 0 for any */
+  int negate;
+} SLSelect;
+
+typedef struct slstation_s
+{
+  char network[16];                /* glob patterns */
+  char station[16];
+  SLSelect *selects;
+  int numselects;
+  uint64_t startseq;               /* 0 until set, then first sequence wanted */
+  hptime_t begintime;
+  hptime_t endtime;
+} SLStation;
+
+typedef struct slclient_s
+{
+  int fd;
+  char addr[64];
+  int proto;                       /* 3 or 4 */
+  int multistation;
+  int streaming;
+  int fetch;                       /* send END once caught up */
+  SLStation *stations;
+  int numstations;
+  uint64_t cursor;                 /* next sequence to consider */
+  char inbuf[SL_LINE_MAX];
+  int inlen;
+  char *outbuf;
+  int outlen;
+  int outpos;
+  int outcap;
+  int64_t frames;
+} SLClient;
+
+/* Growable text buffer for INFO responses */
+typedef struct slbuf_s
+{
+  char *data;
+  int len;
+  int cap;
+} SLBuf;
+
+static SLSlot *slots = NULL;
+static int numslots = 0;
+static uint64_t nextseq = 1;       /* sequence of the next record written */
+static pthread_rwlock_t ringlock = PTHREAD_RWLOCK_INITIALIZER;
+
+static SLClient **clients = NULL;
+static int maxclients = 0;
+static int numclients = 0;
+static int listenfd = -1;
+static int wakefd[2] = { -1, -1 };
+static int wakepending = 0;
+static int stopping = 0;
+static int running = 0;
+static pthread_t serverthread;
+static time_t started;
+
+static void *slserver_thread ( void *arg );
+
+/***************************************************************************
+ * slserver_start:
+ *
+ * Allocate the record ring and start listening for SeedLink clients on
+ * port.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int slserver_start ( int port, int ringrecords, int clientlimit )
+{
+  struct sockaddr_in addr;
+  int one = 1;
+
+  if ( ringrecords <= 0 || clientlimit <= 0 )
+  {
+    ms_log (2, "SeedLink ring size and client limit must be positive\n");
+    return -1;
+  }
+
+  if ( ! (slots = (SLSlot *) calloc (ringrecords, sizeof(SLSlot))) ||
+       ! (clients = (SLClient **) calloc (clientlimit, sizeof(SLClient *))) )
+  {
+    ms_log (2, "Cannot allocate SeedLink ring of %d records\n", ringrecords);
+    return -1;
+  }
+  numslots = ringrecords;
+  maxclients = clientlimit;
+
+  if ( (listenfd = socket (AF_INET, SOCK_STREAM, 0)) < 0 )
+  {
+    ms_log (2, "Cannot create SeedLink socket: %s\n", strerror (errno));
+    return -1;
+  }
+  setsockopt (listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset (&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_ANY);
+  addr.sin_port = htons (port);
+
+  if ( bind (listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+       listen (listenfd, 16) < 0 )
+  {
+    ms_log (2, "Cannot listen for SeedLink on port %d: %s\n", port, strerror (errno));
+    close (listenfd);
+    listenfd = -1;
+    return -1;
+  }
+  fcntl (listenfd, F_SETFL, fcntl (listenfd, F_GETFL) | O_NONBLOCK);
+
+  if ( pipe (wakefd) < 0 )
+  {
+    ms_log (2, "Cannot create SeedLink wakeup pipe: %s\n", strerror (errno));
+    return -1;
+  }
+  fcntl (wakefd[0], F_SETFL, fcntl (wakefd[0], F_GETFL) | O_NONBLOCK);
+  fcntl (wakefd[1], F_SETFL, fcntl (wakefd[1], F_GETFL) | O_NONBLOCK);
+
+  started = time (NULL);
+  stopping = 0;
+
+  if ( pthread_create (&serverthread, NULL, slserver_thread, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start SeedLink server thread\n");
+    return -1;
+  }
+  running = 1;
+
+  ms_log (0, "SeedLink server listening on port %d, ring of %d records\n", port, numslots);
+
+  return 0;
+}
+
+/***************************************************************************
+ * recordtype:
+ *
+ * SeedLink packet type of a miniSEED record from its parsed header.
+ ***************************************************************************/
+static char recordtype ( MSRecord *msr )
+{
+  BlktLink *blkt;
+
+  for ( blkt = msr->blkts; blkt; blkt = blkt->next )
+  {
+    if ( blkt->blkt_type == 500 )
+      return 'T';
+    if ( blkt->blkt_type == 200 || blkt->blkt_type == 201 )
+      return 'E';
+    if ( blkt->blkt_type >= 300 && blkt->blkt_type <= 400 )
+      return 'C';
+  }
+
+  if ( msr->encoding == DE_ASCII )
+    return 'L';
+  if ( msr->samplecnt == 0 )
+    return 'O';
+
+  return 'D';
+}
+
+/***************************************************************************
+ * slserver_write:
+ *
+ * Add a record to the ring, msr is its parsed header.  Safe to call from
+ * any thread, does nothing if the server is not running.
+ ***************************************************************************/
+void slserver_write ( char *record, int reclen, MSRecord *msr )
+{
+  SLSlot *slot;
+
+  if ( ! running || reclen > SLSERVER_MAX_RECLEN )
+    return;
+
+  pthread_rwlock_wrlock (&ringlock);
+
+  if ( ! slots )
+  {
+    pthread_rwlock_unlock (&ringlock);
+    return;
+  }
+
+  slot = &slots[nextseq % numslots];
+  if ( slot->cap < reclen )
+  {
+    char *data = (char *) realloc (slot->data, reclen);
+    if ( ! data )
+    {
+      pthread_rwlock_unlock (&ringlock);
+      ms_log (2, "Cannot allocate SeedLink ring slot\n");
+      return;
+    }
+    slot->data = data;
+    slot->cap = reclen;
+  }
+
+  memcpy (slot->data, record, reclen);
+  slot->reclen = reclen;
+  strcpy (slot->network, msr->network);
+  strcpy (slot->station, msr->station);
+  strcpy (slot->location, msr->location);
+  strcpy (slot->channel, msr->channel);
+  slot->type = recordtype (msr);
+  slot->starttime = msr->starttime;
+  slot->endtime = msr_endtime (msr);
+  slot->seq = nextseq;
+  __atomic_store_n (&nextseq, nextseq + 1, __ATOMIC_RELEASE);
+
+  pthread_rwlock_unlock (&ringlock);
+
+  /* One wakeup per batch of records, the server clears the flag */
+  if ( __atomic_exchange_n (&wakepending, 1, __ATOMIC_ACQ_REL) == 0 )
+  {
+    if ( write (wakefd[1], "w", 1) < 0 && errno != EAGAIN )
+      ms_log (2, "Cannot wake SeedLink server: %s\n", strerror (errno));
+  }
+}
+
+/* Oldest sequence still in the ring, ring lock or server thread only */
+static uint64_t oldestseq ( uint64_t next )
+{
+  return ( next > (uint64_t) numslots ) ? next - numslots : 1;
+}
+
+static int bufprintf ( SLBuf *buf, const char *fmt, ... )
+{
+  va_list ap;
+  int needed;
+
+  for (;;)
+  {
+    va_start (ap, fmt);
+    needed = vsnprintf (buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end (ap);
+
+    if ( needed < 0 )
+      return -1;
+    if ( buf->len + needed < buf->cap )
+      break;
+
+    buf->cap = ( buf->cap + needed + 1 ) * 2;
+    if ( ! (buf->data = (char *) realloc (buf->data, buf->cap)) )
+    {
+      buf->len = buf->cap = 0;
+      return -1;
+    }
+  }
+
+  buf->len += needed;
+  return 0;
+}
+
+/***************************************************************************
+ * clientqueue:
+ *
+ * Append data to the output buffer of a client.
+ *
+ * Returns 0 on success and -1 if the client should be dropped.
+ ***************************************************************************/
+static int clientqueue ( SLClient *cl, const char *data, int len )
+{
+  if ( cl->outpos > 0 && cl->outpos == cl->outlen )
+    cl->outpos = cl->outlen = 0;
+
+  if ( cl->outlen + len > cl->outcap )
+  {
+    int cap = ( cl->outcap ) ? cl->outcap : 4096;
+    char *outbuf;
+
+    while ( cap < cl->outlen + len )
+      cap *= 2;
+    if ( cap > SL_OUTBUF_MAX || ! (outbuf = (char *) realloc (cl->outbuf, cap)) )
+      return -1;
+    cl->outbuf = outbuf;
+    cl->outcap = cap;
+  }
+
+  memcpy (cl->outbuf + cl->outlen, data, len);
+  cl->outlen += len;
+
+  return 0;
+}
+
+static int clientreply ( SLClient *cl, const char *reply )
+{
+  return clientqueue (cl, reply, strlen (reply));
+}
+
+/* Error reply, v4 clients get an error code and description */
+static int clienterror ( SLClient *cl, const char *code, const char *desc )
+{
+  char reply[200];
+
+  if ( cl->proto >= 4 )
+    snprintf (reply, sizeof(reply), "ERROR %s %s\r\n", code, desc);
+  else
+    snprintf (reply, sizeof(reply), "ERROR\r\n");
+
+  return clientreply (cl, reply);
+}
+
+/***************************************************************************
+ * framehead:
+ *
+ * Build the SeedLink header for a ring slot.
+ *
+ * Returns the header length.
+ ***************************************************************************/
+static int framehead ( SLClient *cl, SLSlot *slot, char *head )
+{
+  char staid[24];
+  uint32_t len = slot->reclen;
+  uint64_t seq = slot->seq;
+  int idlen, i;
+
+  if ( cl->proto < 4 )
+  {
+    sprintf (head, "SL%06X", (unsigned int) (seq & 0xFFFFFF));
+    return 8;
+  }
+
+  idlen = snprintf (staid, sizeof(staid), "%s_%s", slot->network, slot->station);
+
+  head[0] = 'S';
+  head[1] = 'E';
+  head[2] = '2';
+  head[3] = slot->type;
+  for ( i = 0; i < 4; i++ )
+    head[4 + i] = (char) ((len >> (8 * i)) & 0xFF);
+  for ( i = 0; i < 8; i++ )
+    head[8 + i] = (char) ((seq >> (8 * i)) & 0xFF);
+  head[16] = (char) idlen;
+  memcpy (head + 17, staid, idlen);
+
+  return 17 + idlen;
+}
+
+static int selectmatch ( SLStation *st, SLSlot *slot )
+{
+  int positive = 0;
+  int matched = 0;
+  int i;
+
+  for ( i = 0; i < st->numselects; i++ )
+  {
+    SLSelect *sel = &st->selects[i];
+    int match = ! fnmatch (sel->location, slot->location, 0) &&
+                ! fnmatch (sel->channel, slot->channel, 0) &&
+                ( ! sel->type || sel->type == slot->type );
+
+    if ( sel->negate )
+    {
+      if ( match )
+        return 0;
+    }
+    else
+    {
+      positive = 1;
+      if ( match )
+        matched = 1;
+    }
+  }
+
+  return ! positive || matched;
+}
+
+/* Does the client want this record, ring lock held */
+static int clientwants ( SLClient *cl, SLSlot *slot )
+{
+  int i;
+
+  if ( cl->proto < 4 && slot->reclen != SL_V3_RECLEN )
+    return 0;
+
+  for ( i = 0; i < cl->numstations; i++ )
+  {
+    SLStation *st = &cl->stations[i];
+
+    if ( slot->seq < st->startseq )
+      continue;
+    if ( fnmatch (st->network, slot->network, 0) || fnmatch (st->station, slot->station, 0) )
+      continue;
+    if ( st->begintime != HPTERROR && slot->endtime < st->begintime )
+      continue;
+    if ( st->endtime != HPTERROR && slot->starttime > st->endtime )
+      continue;
+    if ( selectmatch (st, slot) )
+      return 1;
+  }
+
+  return 0;
+}
+
+/***************************************************************************
+ * clientflush:
+ *
+ * Send queued output, then frames from the ring, until the socket would
+ * block or the client is caught up.
+ *
+ * Returns 0 on success and -1 if the client should be dropped.
+ ***************************************************************************/
+static int clientflush ( SLClient *cl )
+{
+  char head[64];
+  struct iovec iov[2];
+  struct msghdr mh;
+  uint64_t next;
+  ssize_t sent;
+  int headlen;
+  int batch = 0;
+
+  while ( cl->outpos < cl->outlen )
+  {
+    sent = send (cl->fd, cl->outbuf + cl->outpos, cl->outlen - cl->outpos,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+    if ( sent < 0 )
+      return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1;
+    cl->outpos += sent;
+  }
+  cl->outpos = cl->outlen = 0;
+
+  if ( ! cl->streaming )
+    return 0;
+
+  pthread_rwlock_rdlock (&ringlock);
+
+  next = nextseq;
+  if ( cl->cursor < oldestseq (next) )
+  {
+    ms_log (1, "SeedLink client %s fell behind, skipped %llu records\n", cl->addr,
+            (unsigned long long) (oldestseq (next) - cl->cursor));
+    cl->cursor = oldestseq (next);
+  }
+
+  while ( cl->cursor < next && batch < SL_BATCH )
+  {
+    SLSlot *slot = &slots[cl->cursor % numslots];
+
+    if ( ! clientwants (cl, slot) )
+    {
+      cl->cursor++;
+      continue;
+    }
+
+    headlen = framehead (cl, slot, head);
+    iov[0].iov_base = head;
+    iov[0].iov_len = headlen;
+    iov[1].iov_base = slot->data;
+    iov[1].iov_len = slot->reclen;
+    memset (&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+
+    sent = sendmsg (cl->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if ( sent < 0 )
+    {
+      pthread_rwlock_unlock (&ringlock);
+      return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1;
+    }
+
+    cl->cursor++;
+    cl->frames++;
+    batch++;
+
+    /* Keep the rest of a partly sent frame, the slot may be reused */
+    if ( sent < headlen + slot->reclen )
+    {
+      int rv = 0;
+      if ( sent < headlen )
+        rv = clientqueue (cl, head + sent, headlen - sent);
+      if ( rv == 0 )
+        rv = clientqueue (cl, slot->data + ( ( sent > headlen ) ? sent - headlen : 0 ),
+                          slot->reclen - ( ( sent > headlen ) ? sent - headlen : 0 ));
+      pthread_rwlock_unlock (&ringlock);
+      return rv;
+    }
+  }
+
+  pthread_rwlock_unlock (&ringlock);
+
+  if ( cl->fetch && cl->cursor >= next )
+  {
+    cl->streaming = 0;
+    return clientreply (cl, "END");
+  }
+
+  return 0;
+}
+
+static SLStation *addstation ( SLClient *cl, const char *net, const char *sta )
+{
+  SLStation *stations;
+  SLStation *st;
+
+  if ( ! (stations = (SLStation *) realloc (cl->stations, (cl->numstations + 1) * sizeof(SLStation))) )
+    return NULL;
+  cl->stations = stations;
+
+  st = &cl->stations[cl->numstations++];
+  memset (st, 0, sizeof(SLStation));
+  strncpy (st->network, net, sizeof(st->network) - 1);
+  strncpy (st->station, sta, sizeof(st->station) - 1);
+  st->begintime = HPTERROR;
+  st->endtime = HPTERROR;
+
+  return st;
+}
+
+/* Station being configured, uni-station mode uses one implicit entry */
+static SLStation *currentstation ( SLClient *cl )
+{
+  if ( cl->numstations > 0 )
+    return &cl->stations[cl->numstations - 1];
+
+  return addstation (cl, "*", "*");
+}
+
+/***************************************************************************
+ * parseselect:
+ *
+ * Parse a SELECT pattern: v3 [LL]CCC[.T] or v4 LOC_B_S_SS[.T], either
+ * with a leading ! to exclude.
+ *
+ * Returns 0 on success and -1 on a malformed pattern.
+ ***************************************************************************/
+static int parseselect ( const char *pattern, SLSelect *sel )
+{
+  char pat[64];
+  char *dot;
+  char *us;
+  int len;
+
+  memset (sel, 0, sizeof(SLSelect));
+
+  if ( *pattern == '!' )
+  {
+    sel->negate = 1;
+    pattern++;
+  }
+  strncpy (pat, pattern, sizeof(pat) - 1);
+  pat[sizeof(pat) - 1] = '\0';
+
+  if ( (dot = strchr (pat, '.')) )
+  {
+    *dot = '\0';
+    sel->type = toupper ((unsigned char) dot[1]);
+  }
+
+  len = strlen (pat);
+  if ( ! strcmp (pat, "*") || len == 0 )
+  {
+    strcpy (sel->location, "*");
+    strcpy (sel->channel, "*");
+  }
+  else if ( (us = strchr (pat, '_')) )
+  {
+    char *src, *dst;
+
+    *us = '\0';
+    strncpy (sel->location, pat, sizeof(sel->location) - 1);
+    for ( src = us + 1, dst = sel->channel; *src && dst < sel->channel + sizeof(sel->channel) - 1; src++ )
+      if ( *src != '_' )
+        *dst++ = *src;
+    *dst = '\0';
+  }
+  else if ( len <= 3 )
+  {
+    strcpy (sel->location, "*");
+    strcpy (sel->channel, pat);
+  }
+  else if ( len == 5 )
+  {
+    memcpy (sel->location, pat, 2);
+    sel->location[2] = '\0';
+    strcpy (sel->channel, pat + 2);
+  }
+  else
+  {
+    return -1;
+  }
+
+  /* Empty locations are written as -- or blanks, ?? matches them too */
+  if ( ! strcmp (sel->location, "--") || ! strcmp (sel->location, "  ") )
+    sel->location[0] = '\0';
+  else if ( strspn (sel->location, "?*") == strlen (sel->location) )
+    strcpy (sel->location, "*");
+
+  return 0;
+}
+
+/* Parse a v3 YYYY,MM,DD,hh,mm,ss or v4 ISO time */
+static hptime_t parsetime ( const char *str )
+{
+  char iso[64];
+  int year, month, mday, hour = 0, min = 0, sec = 0;
+  int yday;
+  int len;
+
+  if ( strchr (str, ',') )
+  {
+    if ( sscanf (str, "%d,%d,%d,%d,%d,%d", &year, &month, &mday, &hour, &min, &sec) < 3 ||
+         ms_md2doy (year, month, mday, &yday) )
+      return HPTERROR;
+    return ms_time2hptime (year, yday, hour, min, sec, 0);
+  }
+
+  strncpy (iso, str, sizeof(iso) - 1);
+  iso[sizeof(iso) - 1] = '\0';
+  len = strlen (iso);
+  if ( len > 0 && (iso[len - 1] == 'Z' || iso[len - 1] == 'z') )
+    iso[len - 1] = '\0';
+
+  return ms_timestr2hptime (iso);
+}
+
+/***************************************************************************
+ * resolveseq:
+ *
+ * First sequence to send after the last sequence a client received.  v3
+ * sequence numbers are the low 24 bits in hex, v4 are decimal.  If the
+ * next record has left the ring the oldest one is used.
+ ***************************************************************************/
+static uint64_t resolveseq ( SLClient *cl, const char *str )
+{
+  uint64_t next = __atomic_load_n (&nextseq, __ATOMIC_ACQUIRE);
+  uint64_t oldest = oldestseq (next);
+  uint64_t seq;
+
+  if ( ! strcasecmp (str, "ALL") )
+    return oldest;
+  if ( ! strcmp (str, "-1") || ! strcasecmp (str, "NEXT") )
+    return next;
+
+  if ( cl->proto < 4 )
+  {
+    uint64_t want = ( strtoull (str, NULL, 16) + 1 ) & 0xFFFFFF;
+
+    seq = ( next & ~(uint64_t) 0xFFFFFF ) | want;
+    if ( seq > next )
+      seq = ( seq >= 0x1000000 ) ? seq - 0x1000000 : 0;
+  }
+  else
+  {
+    seq = strtoull (str, NULL, 10) + 1;
+    if ( seq > next )
+      seq = next;
+  }
+
+  if ( seq < oldest )
+  {
+    ms_log (1, "SeedLink client %s resume point is no longer in the ring\n", cl->addr);
+    seq = oldest;
+  }
+
+  return seq;
+}
+
+static void startstreaming ( SLClient *cl, int fetch )
+{
+  uint64_t next = __atomic_load_n (&nextseq, __ATOMIC_ACQUIRE);
+  int i;
+
+  currentstation (cl);
+
+  cl->cursor = UINT64_MAX;
+  for ( i = 0; i < cl->numstations; i++ )
+  {
+    if ( ! cl->stations[i].startseq )
+      cl->stations[i].startseq = next;
+    if ( cl->stations[i].startseq < cl->cursor )
+      cl->cursor = cl->stations[i].startseq;
+  }
+
+  cl->streaming = 1;
+  cl->fetch = fetch;
+}
+
+/* First and last ring slot of a stream, for INFO responses */
+typedef struct slstreaminfo_s
+{
+  SLSlot *first;
+  SLSlot *last;
+} SLStreamInfo;
+
+static int samestream ( SLSlot *a, SLSlot *b )
+{
+  return a->type == b->type && ! strcmp (a->channel, b->channel) &&
+         ! strcmp (a->location, b->location) && ! strcmp (a->station, b->station) &&
+         ! strcmp (a->network, b->network);
+}
+
+/***************************************************************************
+ * collectstreams:
+ *
+ * Scan the ring for the streams it holds, with their sequence and time
+ * ranges.  Ring lock held.
+ *
+ * Returns the number of streams in *infop, which the caller frees.
+ ***************************************************************************/
+
+static int collectstreams ( SLStreamInfo **infop )
+{
+  SLStreamInfo *info = NULL;
+  int count = 0;
+  int cap = 0;
+  uint64_t seq;
+  uint64_t next = nextseq;
+  int i;
+
+  for ( seq = oldestseq (next); seq < next; seq++ )
+  {
+    SLSlot *slot = &slots[seq % numslots];
+
+    for ( i = count - 1; i >= 0; i-- )
+      if ( samestream (info[i].last, slot) )
+        break;
+
+    if ( i >= 0 )
+    {
+      info[i].last = slot;
+      continue;
+    }
+
+    if ( count == cap )
+    {
+      SLStreamInfo *grown;
+      cap = ( cap ) ? cap * 2 : 64;
+      if ( ! (grown = (SLStreamInfo *) realloc (info, cap * sizeof(SLStreamInfo))) )
+        break;
+      info = grown;
+    }
+    info[count].first = slot;
+    info[count].last = slot;
+    count++;
+  }
+
+  *infop = info;
+  return count;
+}
+
+static int stationorder ( const void *a, const void *b )
+{
+  const SLStreamInfo *sa = a;
+  const SLStreamInfo *sb = b;
+  int cmp;
+
+  if ( (cmp = strcmp (sa->first->network, sb->first->network)) )
+    return cmp;
+  if ( (cmp = strcmp (sa->first->station, sb->first->station)) )
+    return cmp;
+  if ( (cmp = strcmp (sa->first->location, sb->first->location)) )
+    return cmp;
+  return strcmp (sa->first->channel, sb->first->channel);
+}
+
+static void infotime ( hptime_t t, int iso, char *str )
+{
+  char *cp;
+
+  if ( iso )
+  {
+    ms_hptime2isotimestr (t, str, 1);
+    strcat (str, "Z");
+  }
+  else
+  {
+    ms_hptime2mdtimestr (t, str, 1);
+    for ( cp = str; *cp; cp++ )
+      if ( *cp == '-' )
+        *cp = '/';
+  }
+}
+
+/***************************************************************************
+ * buildinfo:
+ *
+ * Write the INFO response for level as XML (v3) or JSON (v4).
+ *
+ * Returns 0 on success and -1 for an unsupported level.
+ ***************************************************************************/
+static int buildinfo ( SLClient *cl, const char *level, SLBuf *buf )
+{
+  SLStreamInfo *info = NULL;
+  char stime[64], btime[64], etime[64];
+  int json = ( cl->proto >= 4 );
+  int streams = ! strcasecmp (level, "STREAMS");
+  int count, i, j, k;
+
+  infotime (MS_EPOCH2HPTIME (started), json, stime);
+
+  if ( json )
+    bufprintf (buf, "{\"software\":\"SeedLink v4.0 (%s %s)\",\"organization\":\"%s\",\"started\":\"%s\"",
+               Q3302DALI_NAME, Q3302DALI_VERSION, Q3302DALI_NAME, stime);
+  else
+    bufprintf (buf, "<?xml version=\"1.0\"?>\n<seedlink software=\"SeedLink v3.1 (%s %s)\" "
+               "organization=\"%s\" started=\"%s\">\n",
+               Q3302DALI_NAME, Q3302DALI_VERSION, Q3302DALI_NAME, stime);
+
+  if ( ! strcasecmp (level, "ID") )
+  {
+  }
+  else if ( ! strcasecmp (level, "CAPABILITIES") )
+  {
+    if ( json )
+      bufprintf (buf, ",\"capability\":[\"SLPROTO:3.1\",\"SLPROTO:4.0\",\"TIME\",\"NSWILDCARD\"]");
+    else
+      bufprintf (buf, "<capability name=\"dialup\"/>\n<capability name=\"multistation\"/>\n"
+                 "<capability name=\"window-extraction\"/>\n<capability name=\"info:id\"/>\n"
+                 "<capability name=\"info:capabilities\"/>\n<capability name=\"info:stations\"/>\n"
+                 "<capability name=\"info:streams\"/>\n");
+  }
+  else if ( ! strcasecmp (level, "STATIONS") || streams )
+  {
+    pthread_rwlock_rdlock (&ringlock);
+    count = collectstreams (&info);
+    qsort (info, count, sizeof(SLStreamInfo), stationorder);
+
+    if ( json )
+      bufprintf (buf, ",\"station\":[");
+
+    for ( i = 0; i < count; i = j )
+    {
+      uint64_t beginseq = info[i].first->seq;
+      uint64_t endseq = info[i].last->seq;
+
+      for ( j = i + 1; j < count &&
+            ! strcmp (info[j].first->network, info[i].first->network) &&
+            ! strcmp (info[j].first->station, info[i].first->station); j++ )
+      {
+        if ( info[j].first->seq < beginseq )
+          beginseq = info[j].first->seq;
+        if ( info[j].last->seq > endseq )
+          endseq = info[j].last->seq;
+      }
+
+      if ( json )
+        bufprintf (buf, "%s{\"id\":\"%s_%s\",\"description\":\"\",\"start_seq\":%llu,\"end_seq\":%llu%s",
+                   ( i ) ? "," : "", info[i].first->network, info[i].first->station,
+                   (unsigned long long) beginseq, (unsigned long long) endseq,
+                   ( streams ) ? ",\"stream\":[" : "}");
+      else
+        bufprintf (buf, "<station name=\"%s\" network=\"%s\" description=\"\" begin_seq=\"%06X\" "
+                   "end_seq=\"%06X\" stream_check=\"enabled\"%s>\n",
+                   info[i].first->station, info[i].first->network,
+                   (unsigned int) (beginseq & 0xFFFFFF), (unsigned int) (endseq & 0xFFFFFF),
+                   ( streams ) ? "" : "/");
+
+      if ( ! streams )
+        continue;
+
+      for ( k = i; k < j; k++ )
+      {
+        infotime (info[k].first->starttime, json, btime);
+        infotime (info[k].last->endtime, json, etime);
+        if ( json )
+        {
+          const char *chan = info[k].first->channel;
+          bufprintf (buf, "%s{\"id\":\"%s_%.1s_%.1s_%s\",\"format\":\"2\",\"subformat\":\"%c\","
+                     "\"start_time\":\"%s\",\"end_time\":\"%s\"}",
+                     ( k > i ) ? "," : "", info[k].first->location,
+                     chan, ( *chan ) ? chan + 1 : chan, ( strlen (chan) > 2 ) ? chan + 2 : "",
+                     info[k].first->type, btime, etime);
+        }
+        else
+        {
+          bufprintf (buf, "<stream location=\"%s\" seedname=\"%s\" type=\"%c\" begin_time=\"%s\" "
+                     "end_time=\"%s\" begin_recno=\"0\" end_recno=\"0\" gap_check=\"disabled\" "
+                     "gap_treshold=\"0\"/>\n",
+                     info[k].first->location, info[k].first->channel, info[k].first->type,
+                     btime, etime);
+        }
+      }
+
+      bufprintf (buf, ( json ) ? "]}" : "</station>\n");
+    }
+
+    pthread_rwlock_unlock (&ringlock);
+    free (info);
+
+    if ( json )
+      bufprintf (buf, "]");
+  }
+  else
+  {
+    return -1;
+  }
+
+  bufprintf (buf, ( json ) ? "}" : "</seedlink>\n");
+
+  return ( buf->data ) ? 0 : -1;
+}
+
+/* Collect packed INFO records in a buffer */
+static void inforecord ( char *record, int reclen, void *handlerdata )
+{
+  SLBuf *records = (SLBuf *) handlerdata;
+  char *grown;
+
+  if ( records->len + reclen > records->cap )
+  {
+    records->cap = ( records->len + reclen ) * 2;
+    if ( ! (grown = (char *) realloc (records->data, records->cap)) )
+      return;
+    records->data = grown;
+  }
+  memcpy (records->data + records->len, record, reclen);
+  records->len += reclen;
+}
+
+/***************************************************************************
+ * sendinfo:
+ *
+ * Queue an INFO response.  v3 clients get the XML as ASCII miniSEED log
+ * records framed with SLINFO, v4 clients get one JSON frame.
+ *
+ * Returns 0 on success and -1 if the client should be dropped.
+ ***************************************************************************/
+static int sendinfo ( SLClient *cl, const char *level )
+{
+  SLBuf text = { NULL, 0, 0 };
+  SLBuf records = { NULL, 0, 0 };
+  MSRecord *msr;
+  int64_t packed;
+  int rv = 0;
+  int i;
+
+  if ( buildinfo (cl, level, &text) < 0 )
+  {
+    free (text.data);
+    return clienterror (cl, "ARGUMENTS", "unsupported INFO level");
+  }
+
+  if ( cl->proto >= 4 )
+  {
+    char head[17];
+    uint32_t len = text.len;
+
+    head[0] = 'S';
+    head[1] = 'E';
+    head[2] = 'J';
+    head[3] = 'I';
+    for ( i = 0; i < 4; i++ )
+      head[4 + i] = (char) ((len >> (8 * i)) & 0xFF);
+    for ( i = 0; i < 8; i++ )
+      head[8 + i] = (char) 0xFF;
+    head[16] = 0;
+
+    if ( clientqueue (cl, head, sizeof(head)) < 0 || clientqueue (cl, text.data, text.len) < 0 )
+      rv = -1;
+    free (text.data);
+    return rv;
+  }
+
+  if ( ! (msr = msr_init (NULL)) )
+  {
+    free (text.data);
+    return -1;
+  }
+  strcpy (msr->network, "SL");
+  strcpy (msr->station, "INFO");
+  strcpy (msr->channel, "LOG");
+  msr->dataquality = 'D';
+  msr->starttime = dlp_time ();
+  msr->reclen = SL_V3_RECLEN;
+  msr->encoding = DE_ASCII;
+  msr->byteorder = 1;
+  msr->sampletype = 'a';
+  msr->datasamples = text.data;
+  msr->numsamples = text.len;
+  msr->samplecnt = text.len;
+
+  if ( msr_pack (msr, inforecord, &records, &packed, 1, 0) < 0 )
+    rv = clienterror (cl, "INTERNAL", "cannot pack INFO");
+
+  for ( i = 0; rv == 0 && i + SL_V3_RECLEN <= records.len; i += SL_V3_RECLEN )
+  {
+    int last = ( i + 2 * SL_V3_RECLEN > records.len );
+    if ( clientqueue (cl, ( last ) ? "SLINFO  " : "SLINFO *", 8) < 0 ||
+         clientqueue (cl, records.data + i, SL_V3_RECLEN) < 0 )
+      rv = -1;
+  }
+
+  msr->datasamples = NULL;
+  msr_free (&msr);
+  free (text.data);
+  free (records.data);
+
+  return rv;
+}
+
+/***************************************************************************
+ * clientcommand:
+ *
+ * Handle one command line from a client.
+ *
+ * Returns 0 on success and -1 if the client should be dropped.
+ ***************************************************************************/
+static int clientcommand ( SLClient *cl, char *line )
+{
+  char *argv[8];
+  int argc = 0;
+  char *tok;
+  char *save = NULL;
+  SLStation *st;
+
+  for ( tok = strtok_r (line, " \t", &save); tok && argc < 8; tok = strtok_r (NULL, " \t", &save) )
+    argv[argc++] = tok;
+
+  if ( argc == 0 )
+    return 0;
+
+  if ( cl->streaming )
+  {
+    /* Commands after streaming has started are ignored except BYE */
+    return ( ! strcasecmp (argv[0], "BYE") ) ? -1 : 0;
+  }
+
+  if ( ! strcasecmp (argv[0], "HELLO") )
+  {
+    char reply[200];
+    snprintf (reply, sizeof(reply), "SeedLink v%s (%s %s) :: SLPROTO:4.0 SLPROTO:3.1 CAP EXTREPLY NSWILDCARD\r\n%s\r\n",
+              ( cl->proto >= 4 ) ? "4.0" : "3.1", Q3302DALI_NAME, Q3302DALI_VERSION, Q3302DALI_NAME);
+    return clientreply (cl, reply);
+  }
+  else if ( ! strcasecmp (argv[0], "SLPROTO") )
+  {
+    if ( argc < 2 )
+      return clienterror (cl, "ARGUMENTS", "SLPROTO needs a version");
+    if ( ! strcmp (argv[1], "4.0") )
+      cl->proto = 4;
+    else if ( ! strcmp (argv[1], "3.1") || ! strcmp (argv[1], "3.0") )
+      cl->proto = 3;
+    else
+      return clienterror (cl, "UNSUPPORTED", "protocol version not supported");
+    return clientreply (cl, "OK\r\n");
+  }
+  else if ( ! strcasecmp (argv[0], "USERAGENT") || ! strcasecmp (argv[0], "CAPABILITIES") )
+  {
+    return clientreply (cl, "OK\r\n");
+  }
+  else if ( ! strcasecmp (argv[0], "STATION") )
+  {
+    char net[16] = "*";
+    char sta[16];
+    char *us;
+
+    if ( argc < 2 )
+      return clienterror (cl, "ARGUMENTS", "STATION needs a station");
+
+    strncpy (sta, argv[1], sizeof(sta) - 1);
+    sta[sizeof(sta) - 1] = '\0';
+    if ( argc > 2 )
+    {
+      strncpy (net, argv[2], sizeof(net) - 1);
+      net[sizeof(net) - 1] = '\0';
+    }
+    else if ( (us = strchr (argv[1], '_')) )
+    {
+      *us = '\0';
+      strncpy (net, argv[1], sizeof(net) - 1);
+      net[sizeof(net) - 1] = '\0';
+      strncpy (sta, us + 1, sizeof(sta) - 1);
+    }
+
+    /* Uni-station settings made before the first STATION are dropped */
+    if ( ! cl->multistation )
+      cl->numstations = 0;
+    cl->multistation = 1;
+
+    if ( ! addstation (cl, net, sta) )
+      return -1;
+    return clientreply (cl, "OK\r\n");
+  }
+  else if ( ! strcasecmp (argv[0], "SELECT") )
+  {
+    SLSelect sel;
+    SLSelect *selects;
+
+    if ( ! (st = currentstation (cl)) )
+      return -1;
+
+    if ( argc < 2 )
+    {
+      st->numselects = 0;
+      return clientreply (cl, "OK\r\n");
+    }
+
+    if ( parseselect (argv[1], &sel) < 0 )
+      return clienterror (cl, "ARGUMENTS", "malformed selector");
+
+    if ( ! (selects = (SLSelect *) realloc (st->selects, (st->numselects + 1) * sizeof(SLSelect))) )
+      return -1;
+    st->selects = selects;
+    st->selects[st->numselects++] = sel;
+    return clientreply (cl, "OK\r\n");
+  }
+  else if ( ! strcasecmp (argv[0], "DATA") || ! strcasecmp (argv[0], "FETCH") ||
+            ! strcasecmp (argv[0], "TIME") )
+  {
+    int arg = 1;
+
+    if ( ! (st = currentstation (cl)) )
+      return -1;
+
+    /* DATA and FETCH take a resume point, TIME searches the whole ring,
+     * without either only new records are sent */
+    st->startseq = 0;
+    if ( ! strcasecmp (argv[0], "TIME") )
+    {
+      if ( argc < 2 )
+        return clienterror (cl, "ARGUMENTS", "TIME needs a start time");
+      st->startseq = oldestseq (__atomic_load_n (&nextseq, __ATOMIC_ACQUIRE));
+    }
+    else if ( argc > 1 )
+    {
+      st->startseq = resolveseq (cl, argv[arg++]);
+    }
+
+    if ( argc > arg && (st->begintime = parsetime (argv[arg++])) == HPTERROR )
+      return clienterror (cl, "ARGUMENTS", "malformed start time");
+    if ( argc > arg && (st->endtime = parsetime (argv[arg++])) == HPTERROR )
+      return clienterror (cl, "ARGUMENTS", "malformed end time");
+
+    if ( cl->multistation )
+      return clientreply (cl, "OK\r\n");
+
+    startstreaming (cl, ! strcasecmp (argv[0], "FETCH") || st->endtime != HPTERROR);
+    return 0;
+  }
+  else if ( ! strcasecmp (argv[0], "END") || ! strcasecmp (argv[0], "ENDFETCH") )
+  {
+    int fetch = ! strcasecmp (argv[0], "ENDFETCH");
+    int i;
+
+    for ( i = 0; i < cl->numstations; i++ )
+      if ( cl->stations[i].endtime != HPTERROR )
+        fetch = 1;
+
+    startstreaming (cl, fetch);
+    return 0;
+  }
+  else if ( ! strcasecmp (argv[0], "INFO") )
+  {
+    return sendinfo (cl, ( argc > 1 ) ? argv[1] : "ID");
+  }
+  else if ( ! strcasecmp (argv[0], "BYE") )
+  {
+    return -1;
+  }
+
+  return clienterror (cl, "UNSUPPORTED", "unknown command");
+}
+
+/* Read and handle command lines, returns -1 if the client should be dropped */
+static int clientread ( SLClient *cl )
+{
+  ssize_t got;
+  int start = 0;
+  int i;
+
+  got = recv (cl->fd, cl->inbuf + cl->inlen, sizeof(cl->inbuf) - cl->inlen, MSG_DONTWAIT);
+  if ( got == 0 )
+    return -1;
+  if ( got < 0 )
+    return ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) ? 0 : -1;
+
+  cl->inlen += got;
+
+  for ( i = 0; i < cl->inlen; i++ )
+  {
+    if ( cl->inbuf[i] == '\r' || cl->inbuf[i] == '\n' )
+    {
+      cl->inbuf[i] = '\0';
+      if ( clientcommand (cl, cl->inbuf + start) < 0 )
+        return -1;
+      start = i + 1;
+    }
+  }
+
+  if ( start == 0 && cl->inlen == sizeof(cl->inbuf) )
+  {
+    ms_log (1, "SeedLink client %s sent an overlong command\n", cl->addr);
+    return -1;
+  }
+
+  memmove (cl->inbuf, cl->inbuf + start, cl->inlen - start);
+  cl->inlen -= start;
+
+  return 0;
+}
+
+static void clientaccept ( void )
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  SLClient *cl;
+  int fd;
+  int i;
+
+  while ( (fd = accept (listenfd, (struct sockaddr *) &addr, &addrlen)) >= 0 )
+  {
+    if ( numclients >= maxclients )
+    {
+      ms_log (1, "SeedLink client limit of %d reached, refusing %s\n", maxclients, inet_ntoa (addr.sin_addr));
+      close (fd);
+      continue;
+    }
+
+    if ( ! (cl = (SLClient *) calloc (1, sizeof(SLClient))) )
+    {
+      close (fd);
+      continue;
+    }
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    cl->fd = fd;
+    cl->proto = 3;
+    snprintf (cl->addr, sizeof(cl->addr), "%s:%d", inet_ntoa (addr.sin_addr), ntohs (addr.sin_port));
+
+    for ( i = 0; clients[i]; i++ )
+      ;
+    clients[i] = cl;
+    __atomic_add_fetch (&numclients, 1, __ATOMIC_RELAXED);
+
+    ms_log (1, "SeedLink client connected from %s\n", cl->addr);
+    addrlen = sizeof(addr);
+  }
+}
+
+static void clientclose ( int index )
+{
+  SLClient *cl = clients[index];
+  int i;
+
+  ms_log (1, "SeedLink client %s disconnected, %lld records sent\n", cl->addr, (long long int) cl->frames);
+
+  close (cl->fd);
+  for ( i = 0; i < cl->numstations; i++ )
+    free (cl->stations[i].selects);
+  free (cl->stations);
+  free (cl->outbuf);
+  free (cl);
+
+  clients[index] = NULL;
+  __atomic_sub_fetch (&numclients, 1, __ATOMIC_RELAXED);
+}
+
+/* A client has something to send: queued output or wanted ring records */
+static int clientpending ( SLClient *cl )
+{
+  return cl->outpos < cl->outlen ||
+         ( cl->streaming && cl->cursor < __atomic_load_n (&nextseq, __ATOMIC_ACQUIRE) );
+}
+
+/***************************************************************************
+ * slserver_thread:
+ *
+ * Accept clients, read their commands and send them records until
+ * slserver_stop() is called.
+ ***************************************************************************/
+static void *slserver_thread ( void *arg )
+{
+  struct pollfd *fds;
+  int *index;
+  char drain[64];
+  int nfds;
+  int i;
+
+  placement_enter (THREAD_SERVER, "seedlink");
+
+  fds = (struct pollfd *) calloc (maxclients + 2, sizeof(struct pollfd));
+  index = (int *) calloc (maxclients + 2, sizeof(int));
+  if ( ! fds || ! index )
+  {
+    ms_log (2, "Cannot allocate SeedLink poll set\n");
+    return NULL;
+  }
+
+  while ( ! __atomic_load_n (&stopping, __ATOMIC_ACQUIRE) )
+  {
+    fds[0].fd = listenfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakefd[0];
+    fds[1].events = POLLIN;
+    nfds = 2;
+
+    for ( i = 0; i < maxclients; i++ )
+    {
+      if ( ! clients[i] )
+        continue;
+      fds[nfds].fd = clients[i]->fd;
+      fds[nfds].events = POLLIN | ( clientpending (clients[i]) ? POLLOUT : 0 );
+      index[nfds] = i;
+      nfds++;
+    }
+
+    if ( poll (fds, nfds, 1000) < 0 )
+    {
+      if ( errno != EINTR )
+        ms_log (2, "SeedLink poll error: %s\n", strerror (errno));
+      continue;
+    }
+
+    if ( fds[1].revents & POLLIN )
+    {
+      __atomic_store_n (&wakepending, 0, __ATOMIC_RELEASE);
+      while ( read (wakefd[0], drain, sizeof(drain)) > 0 )
+        ;
+    }
+
+    for ( i = 2; i < nfds; i++ )
+    {
+      SLClient *cl = clients[index[i]];
+
+      if ( ( fds[i].revents & (POLLERR | POLLNVAL) ) ||
+           ( ( fds[i].revents & (POLLIN | POLLHUP) ) && clientread (cl) < 0 ) ||
+           ( clientpending (cl) && clientflush (cl) < 0 ) )
+        clientclose (index[i]);
+    }
+
+    if ( fds[0].revents & POLLIN )
+      clientaccept ();
+  }
+
+  for ( i = 0; i < maxclients; i++ )
+    if ( clients[i] )
+      clientclose (i);
+
+  free (fds);
+  free (index);
+
+  return NULL;
+}
+
+/***************************************************************************
+ * slserver_stop:
+ *
+ * Disconnect all clients, stop the server thread and free the ring.
+ ***************************************************************************/
+void slserver_stop ( void )
+{
+  int i;
+
+  if ( ! running )
+    return;
+
+  running = 0;
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+  if ( write (wakefd[1], "s", 1) < 0 && errno != EAGAIN )
+    ms_log (2, "Cannot wake SeedLink server: %s\n", strerror (errno));
+  pthread_join (serverthread, NULL);
+
+  close (listenfd);
+  close (wakefd[0]);
+  close (wakefd[1]);
+  listenfd = wakefd[0] = wakefd[1] = -1;
+
+  /* Writers may still be inside slserver_write() */
+  pthread_rwlock_wrlock (&ringlock);
+  for ( i = 0; i < numslots; i++ )
+    free (slots[i].data);
+  free (slots);
+  slots = NULL;
+  numslots = 0;
+  pthread_rwlock_unlock (&ringlock);
+
+  free (clients);
+  clients = NULL;
+}
+
+int slserver_clients ( void )
+{
+  return __atomic_load_n (&numclients, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,23 @@
+//
+//  slserver.h
+//  q3302dali
+//
+//  Embedded SeedLink server.  Every record sent to DataLink is also copied
+//  once into an in-memory ring of records, clients are served directly
+//  from the ring slots with a cursor per client.  SeedLink v3.1 and v4.0
+//  framing are supported, a client selects v4 with SLPROTO 4.0.
+//
+
+#ifndef slserver_h
+#define slserver_h
+
+#include "q3302dali.h"
+
+#define SLSERVER_MAX_RECLEN 8192   /* v3 clients only receive 512 byte records */
+
+int slserver_start ( int port, int ringrecords, int maxclients );
+void slserver_write ( char *record, int reclen, MSRecord *msr );
+void slserver_stop ( void );
+int slserver_clients ( void );
+
+#endif /* slserver_h */
@@ -0,0 +1,291 @@
+//
+//  soh.c
+//  q3302dali
+//
+//  In-band state of health, see soh.h.
+//
+//  A status document is published every SohInterval seconds from the main
+//  loop and an event document on every lib330 state change.  Counters are
+//  totals since startup, so a subscriber that misses a document loses
+//  nothing but resolution.  Values lib330 does not know yet are null.
+//  Documents larger than a DataLink packet go out in numbered parts.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "soh.h"
+#include "streams.h"
+#include "shaper.h"
+#include "dlconn.h"
+#include "encoding.h"
+
+#define SOH_MAX_JSON 8192
+#define SOH_DEFAULT_PKTSIZE 512    /* ringserver default, until the server says */
+#define SOH_MEMBER_MAX 1024
+#define SOH_PART_TAIL 16           /* kept free for ,"more":true} */
+
+/* A document being published in parts */
+typedef struct SohDoc_s {
+  char buf[SOH_MAX_JSON];
+  int pos;
+  int limit;                       /* largest part, in bytes */
+  int part;
+  int members;                     /* members in the current part */
+  const char *type;
+  const char *state;
+} SohDoc;
+
+static pthread_mutex_t sohlock = PTHREAD_MUTEX_INITIALIZER;
+static char sohnet[11] = "";
+static char sohsta[11] = "";
+static int enabled = 0;
+
+/* Turn publishing on or off, from the main thread */
+void soh_enable ( int on )
+{
+  __atomic_store_n (&enabled, on, __ATOMIC_RELEASE);
+}
+
+/* Station the documents are published for, from the lib330 status */
+void soh_setstation ( const char *net, const char *sta )
+{
+  pthread_mutex_lock (&sohlock);
+  strncpy (sohnet, net, sizeof(sohnet) - 1);
+  strncpy (sohsta, sta, sizeof(sohsta) - 1);
+  pthread_mutex_unlock (&sohlock);
+}
+
+/* Append to buf at *pos, keeping track of truncation */
+static void append ( char *buf, int buflen, int *pos, const char *format, ... )
+{
+  va_list ap;
+  int n;
+
+  if ( *pos >= buflen )
+    return;
+
+  va_start (ap, format);
+  n = vsnprintf (buf + *pos, buflen - *pos, format, ap);
+  va_end (ap);
+
+  *pos += ( n > 0 ) ? n : 0;
+}
+
+/* A lib330 accumulator triple, minute/hour/day, as a JSON array */
+static void appendacc ( char *buf, int buflen, int *pos, const char *name, longint *acc )
+{
+  int i;
+
+  append (buf, buflen, pos, ",\"%s\":[", name);
+  for ( i = (int) AD_MINUTE; i <= (int) AD_DAY; i++ )
+  {
+    if ( (int) acc[i] != (int) INVALID_ENTRY )
+      append (buf, buflen, pos, "%s%d", ( i > AD_MINUTE ) ? "," : "", (int) acc[i]);
+    else
+      append (buf, buflen, pos, "%snull", ( i > AD_MINUTE ) ? "," : "");
+  }
+  append (buf, buflen, pos, "]");
+}
+
+/* The common start of every document */
+static void appendheader ( char *buf, int buflen, int *pos, const char *type, const char *state )
+{
+  char timestr[30];
+  time_t now = time (NULL);
+
+  strftime (timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%SZ", gmtime (&now));
+
+  pthread_mutex_lock (&sohlock);
+  append (buf, buflen, pos, "{\"type\":\"%s\",\"network\":\"%s\",\"station\":\"%s\",\"time\":\"%s\",\"state\":\"%s\"",
+          type, sohnet, sohsta, timestr, state);
+  pthread_mutex_unlock (&sohlock);
+}
+
+/* Queue a document as SOH, never ahead of live data */
+static void publish ( char *json, int len )
+{
+  char streamid[100];
+  hptime_t now;
+
+  pthread_mutex_lock (&sohlock);
+  snprintf (streamid, sizeof(streamid), "%s_%s/JSON", sohnet, sohsta);
+  pthread_mutex_unlock (&sohlock);
+
+  now = MS_EPOCH2HPTIME ((double) time (NULL));
+  shaper_submit (SHAPER_SOH, json, len, streamid, now, now);
+}
+
+/* Start the next part of a document */
+static void docstart ( SohDoc *doc )
+{
+  doc->pos = 0;
+  doc->members = 0;
+  doc->part++;
+  appendheader (doc->buf, sizeof(doc->buf), &doc->pos, doc->type, doc->state);
+  append (doc->buf, sizeof(doc->buf), &doc->pos, ",\"part\":%d", doc->part);
+}
+
+/* Start a document, in parts no larger than the server takes in a packet */
+static void docbegin ( SohDoc *doc, const char *type, const char *state )
+{
+  DLConnStats conn;
+
+  dlconn_stats (&conn);
+  doc->limit = ( conn.maxpktsize > 0 ) ? conn.maxpktsize : SOH_DEFAULT_PKTSIZE;
+  if ( doc->limit > (int) sizeof(doc->buf) )
+    doc->limit = sizeof(doc->buf);
+  doc->type = type;
+  doc->state = state;
+  doc->part = 0;
+  docstart (doc);
+}
+
+/* Close and publish the current part, more if another one follows */
+static void docpublish ( SohDoc *doc, int more )
+{
+  if ( more )
+    append (doc->buf, sizeof(doc->buf), &doc->pos, ",\"more\":true");
+  append (doc->buf, sizeof(doc->buf), &doc->pos, "}");
+
+  if ( doc->pos <= doc->limit )
+    publish (doc->buf, doc->pos);
+  else
+    ms_log (2, "SOH %s document does not fit a DataLink packet of %d bytes\n", doc->type, doc->limit);
+}
+
+/* Add a member, ",\"name\":value", moving on to a new part if it does not fit */
+static void docmember ( SohDoc *doc, const char *member, int len )
+{
+  if ( len >= SOH_MEMBER_MAX )
+    return;
+
+  if ( doc->members && doc->pos + len + SOH_PART_TAIL > doc->limit )
+  {
+    docpublish (doc, 1);
+    docstart (doc);
+  }
+
+  if ( doc->pos + len + SOH_PART_TAIL > doc->limit )
+  {
+    ms_log (2, "SOH %s member of %d bytes does not fit a DataLink packet of %d bytes\n",
+            doc->type, len, doc->limit);
+    return;
+  }
+
+  memcpy (doc->buf + doc->pos, member, len);
+  doc->pos += len;
+  doc->buf[doc->pos] = '\0';
+  doc->members++;
+}
+
+/***************************************************************************
+ * soh_publishstatus:
+ *
+ * Publish the status document for the lib330 state and status, from the
+ * main loop.  status may be NULL when lib330 has none.  A document that
+ * would not fit the largest packet the DataLink server accepts is split
+ * into parts, each with the common header, its part number and "more"
+ * on all but the last.  The bytes per sample of each stream follow in
+ * compression documents split the same way.
+ ***************************************************************************/
+void soh_publishstatus ( const char *state, topstat *status )
+{
+  SohDoc doc;
+  DLConnStats conn;
+  ShaperStats stats;
+  StreamInfo *si;
+  char member[SOH_MEMBER_MAX];
+  int64_t gaps = 0, overlaps = 0, tears = 0;
+  int64_t duppackets = 0, dupsamples = 0;
+  int64_t recsamples = 0, recbytes = 0;
+  int len;
+  int i;
+
+  if ( ! __atomic_load_n (&enabled, __ATOMIC_ACQUIRE) || ! shaper_running () || ! sohsta[0] )
+    return;
+
+  docbegin (&doc, "status", state);
+
+  if ( status )
+  {
+    len = 0;
+    appendacc (member, sizeof(member), &len, "bps", status->accstats[AC_READ]);
+    appendacc (member, sizeof(member), &len, "packets", status->accstats[AC_PACKETS]);
+    append (member, sizeof(member), &len, ",\"buffer_fill\":%d,\"clock_quality\":%d",
+            (int) status->pkt_full, (int) status->clock_qual);
+    docmember (&doc, member, len);
+  }
+
+  for ( si = streams_first (); si; si = si->listnext )
+  {
+    gaps += si->gaps;
+    overlaps += si->overlaps;
+    tears += si->tears;
+    duppackets += si->duppackets;
+    dupsamples += si->dupsamples;
+    recsamples += si->recsamples;
+    recbytes += si->recbytes;
+  }
+  len = 0;
+  append (member, sizeof(member), &len, ",\"streams\":%d,\"gaps\":%lld,\"overlaps\":%lld,\"tears\":%lld"
+          ",\"duplicate_packets\":%lld,\"duplicate_samples\":%lld",
+          streams_count (), (long long int) gaps, (long long int) overlaps, (long long int) tears,
+          (long long int) duppackets, (long long int) dupsamples);
+  if ( recsamples > 0 )
+    append (member, sizeof(member), &len, ",\"bytes_per_sample\":%.3f", (double) recbytes / recsamples);
+  docmember (&doc, member, len);
+
+  dlconn_stats (&conn);
+  len = 0;
+  append (member, sizeof(member), &len, ",\"datalink\":{\"state\":\"%s\",\"connects\":%lld,\"failures\":%lld,\"lost\":%lld}",
+          dlconn_statename (conn.state), (long long int) conn.connects,
+          (long long int) conn.failures, (long long int) conn.disconnects);
+  docmember (&doc, member, len);
+
+  len = 0;
+  append (member, sizeof(member), &len, ",\"queues\":{");
+  for ( i = 0; i < SHAPER_CLASSES; i++ )
+  {
+    shaper_stats (i, &stats, 0);
+    append (member, sizeof(member), &len, "%s\"%s\":{\"queued\":%d,\"sent\":%lld,\"bytes\":%lld,\"failed\":%lld}",
+            ( i ) ? "," : "", shaper_classname (i), stats.queued,
+            (long long int) stats.records, (long long int) stats.bytes, (long long int) stats.failed);
+  }
+  append (member, sizeof(member), &len, "}");
+  docmember (&doc, member, len);
+
+  docpublish (&doc, 0);
+
+  /* Bytes per sample sent of each stream */
+  if ( recsamples <= 0 )
+    return;
+
+  docbegin (&doc, "compression", state);
+  for ( si = streams_first (); si; si = si->listnext )
+  {
+    if ( si->recsamples <= 0 )
+      continue;
+    len = 0;
+    append (member, sizeof(member), &len, ",\"%s\":{\"encoding\":\"%s\",\"bytes_per_sample\":%.3f}",
+            si->srcname, encoding_name (si->lastencoding), (double) si->recbytes / si->recsamples);
+    docmember (&doc, member, len);
+  }
+  docpublish (&doc, 0);
+}
+
+/* Publish a state change event, from the lib330 thread */
+void soh_publishstate ( const char *state )
+{
+  char json[256];
+  int pos = 0;
+
+  if ( ! __atomic_load_n (&enabled, __ATOMIC_ACQUIRE) || ! shaper_running () || ! sohsta[0] )
+    return;
+
+  appendheader (json, sizeof(json), &pos, "state", state);
+  append (json, sizeof(json), &pos, "}");
+
+  if ( pos < (int) sizeof(json) )
+    publish (json, pos);
+}
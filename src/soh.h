@@ -0,0 +1,22 @@
+//
+//  soh.h
+//  q3302dali
+//
+//  State of health published in band.  The lib330 status, registration
+//  state changes and the counters of our own queues and connections are
+//  encoded as compact JSON and sent through the DataLink output queue as
+//  SOH, with stream ID NET_STA/JSON, so monitoring can subscribe to them
+//  at the ringserver.
+//
+
+#ifndef soh_h
+#define soh_h
+
+#include "q3302dali.h"
+
+void soh_enable ( int enabled );
+void soh_setstation ( const char *net, const char *sta );
+void soh_publishstatus ( const char *state, topstat *status );
+void soh_publishstate ( const char *state );
+
+#endif /* soh_h */
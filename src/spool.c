@@ -0,0 +1,400 @@
+//
+//  spool.c
+//  q3302dali
+//
+//  Spool of unsent DataLink records, see spool.h.
+//
+//  Each record is appended with a fixed header of its own, so the file
+//  is written with one writev() per record and read back in order
+//  without an index.  On start the spool is renamed to a .replay file
+//  the thread reads, leaving the spool free for the next shutdown; if
+//  the process stops before the replay is done the records not yet read
+//  are spooled again and the replay file is removed.  After a crash
+//  during a replay the records spooled since are appended to the replay
+//  file, and records handed back before the crash may be sent twice.
+//  Records spooled while running, as by a paused DataLink, are replayed
+//  the same way on request, after the replay running then if there is one.
+//
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "spool.h"
+#include "placement.h"
+
+#define SPOOL_MAGIC 0x314c5053     /* "SPL1" */
+#define SPOOL_MAX_RECLEN 65536
+
+/* Written before each record */
+typedef struct spoolentry_s
+{
+  int32_t magic;
+  int32_t reclen;
+  int64_t starttime;
+  int64_t endtime;
+  char streamid[100];
+} SpoolEntry;
+
+static char spoolpath[1100] = "";
+static char replaypath[1110] = "";
+static int spoolfd = -1;           /* opened by the first write */
+static int64_t spooled = 0;        /* records written */
+static pthread_mutex_t spoollock = PTHREAD_MUTEX_INITIALIZER;
+
+static SpoolReplay replayfunc = NULL;
+static int stopping = 0;
+static int replaying = 0;          /* the thread is to be joined */
+static int reading = 0;            /* the thread reads, under the spool lock */
+static int again = 0;              /* replay the spool once more when done */
+static pthread_t replaythread;
+
+static void *spool_thread ( void *arg );
+
+/* Append the contents of file from to file to */
+static int appendfile ( const char *from, const char *to )
+{
+  char buffer[65536];
+  ssize_t n;
+  int in, out;
+  int rv = 0;
+
+  if ( (in = open (from, O_RDONLY | O_CLOEXEC)) < 0 )
+    return -1;
+  if ( (out = open (to, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0 )
+  {
+    close (in);
+    return -1;
+  }
+
+  while ( (n = read (in, buffer, sizeof(buffer))) > 0 )
+    if ( write (out, buffer, n) != n )
+    {
+      rv = -1;
+      break;
+    }
+  if ( n < 0 || fsync (out) < 0 )
+    rv = -1;
+
+  close (in);
+  close (out);
+
+  return rv;
+}
+
+/* Move the spool to the replay file, after what is left there */
+static int movespool ( void )
+{
+  if ( access (spoolpath, F_OK) != 0 )
+    return 0;
+
+  if ( access (replaypath, F_OK) == 0 )
+  {
+    if ( appendfile (spoolpath, replaypath) < 0 || unlink (spoolpath) < 0 )
+    {
+      ms_log (2, "Cannot append %s to %s: %s\n", spoolpath, replaypath, strerror (errno));
+      return -1;
+    }
+  }
+  else if ( rename (spoolpath, replaypath) < 0 )
+  {
+    ms_log (2, "Cannot rename %s: %s\n", spoolpath, strerror (errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/***************************************************************************
+ * spool_start:
+ *
+ * Spool to path from now on and, if records were spooled by an earlier
+ * run, start handing them to replay.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int spool_start ( const char *path, SpoolReplay replay )
+{
+  strncpy (spoolpath, path, sizeof(spoolpath) - 1);
+  snprintf (replaypath, sizeof(replaypath), "%s.replay", spoolpath);
+  replayfunc = replay;
+
+  /* A replay cut short by a crash goes first */
+  if ( movespool () < 0 )
+    return -1;
+
+  if ( access (replaypath, F_OK) != 0 )
+    return 0;
+
+  stopping = 0;
+  reading = 1;
+
+  if ( pthread_create (&replaythread, NULL, spool_thread, NULL) != 0 )
+  {
+    ms_log (2, "Cannot start spool thread\n");
+    reading = 0;
+    return -1;
+  }
+  replaying = 1;
+
+  return 0;
+}
+
+/***************************************************************************
+ * spool_replay:
+ *
+ * Start handing the records spooled so far to the replay function, as
+ * after a start.  With a replay still running they follow once it is
+ * done.  Safe to call from any thread.
+ ***************************************************************************/
+void spool_replay ( void )
+{
+  pthread_mutex_lock (&spoollock);
+
+  /* Nothing spooled since the start or the last replay */
+  if ( spoolfd < 0 || stopping )
+  {
+    pthread_mutex_unlock (&spoollock);
+    return;
+  }
+
+  if ( reading )
+  {
+    again = 1;
+    pthread_mutex_unlock (&spoollock);
+    return;
+  }
+
+  /* Done reading, the thread returns without the lock */
+  if ( replaying )
+    pthread_join (replaythread, NULL);
+  replaying = 0;
+
+  close (spoolfd);
+  spoolfd = -1;
+  if ( movespool () == 0 )
+  {
+    reading = 1;
+    if ( pthread_create (&replaythread, NULL, spool_thread, NULL) == 0 )
+      replaying = 1;
+    else
+    {
+      ms_log (2, "Cannot start spool thread\n");
+      reading = 0;
+    }
+  }
+
+  pthread_mutex_unlock (&spoollock);
+}
+
+/***************************************************************************
+ * spool_write:
+ *
+ * Append records to the spool, in order.  Safe to call from any thread.
+ *
+ * Returns 0 on success and -1 if no spool is configured or the records
+ * could not be written.
+ ***************************************************************************/
+int spool_write ( DLConnRecord *records, int count )
+{
+  SpoolEntry entry;
+  struct iovec iov[2];
+  int i;
+
+  pthread_mutex_lock (&spoollock);
+
+  if ( spoolfd < 0 )
+  {
+    if ( ! spoolpath[0] )
+    {
+      pthread_mutex_unlock (&spoollock);
+      return -1;
+    }
+    if ( (spoolfd = open (spoolpath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0 )
+    {
+      ms_log (2, "Cannot open spool %s: %s\n", spoolpath, strerror (errno));
+      spoolpath[0] = '\0';
+      pthread_mutex_unlock (&spoollock);
+      return -1;
+    }
+    ms_log (1, "Spooling records not sent to DataLink to %s\n", spoolpath);
+  }
+
+  for ( i = 0; i < count; i++ )
+  {
+    memset (&entry, 0, sizeof(entry));
+    entry.magic = SPOOL_MAGIC;
+    entry.reclen = records[i].reclen;
+    entry.starttime = records[i].starttime;
+    entry.endtime = records[i].endtime;
+    strncpy (entry.streamid, records[i].streamid, sizeof(entry.streamid) - 1);
+
+    iov[0].iov_base = &entry;
+    iov[0].iov_len = sizeof(entry);
+    iov[1].iov_base = records[i].record;
+    iov[1].iov_len = records[i].reclen;
+
+    if ( writev (spoolfd, iov, 2) != (ssize_t) ( sizeof(entry) + records[i].reclen ) )
+    {
+      ms_log (2, "Cannot write spool %s: %s\n", spoolpath, strerror (errno));
+      pthread_mutex_unlock (&spoollock);
+      return -1;
+    }
+    spooled++;
+  }
+
+  pthread_mutex_unlock (&spoollock);
+
+  return 0;
+}
+
+/* Read the next record, returns 1 on success, 0 at the end and -1 if damaged */
+static int readentry ( FILE *fp, SpoolEntry *entry, char **data, int *cap )
+{
+  char *newdata;
+
+  if ( fread (entry, sizeof(SpoolEntry), 1, fp) != 1 )
+    return ( feof (fp) ) ? 0 : -1;
+
+  if ( entry->magic != SPOOL_MAGIC || entry->reclen <= 0 || entry->reclen > SPOOL_MAX_RECLEN )
+    return -1;
+  entry->streamid[sizeof(entry->streamid) - 1] = '\0';
+
+  if ( entry->reclen > *cap )
+  {
+    if ( ! (newdata = (char *) realloc (*data, entry->reclen)) )
+      return -1;
+    *data = newdata;
+    *cap = entry->reclen;
+  }
+
+  return ( fread (*data, entry->reclen, 1, fp) == 1 ) ? 1 : -1;
+}
+
+/* Hand back the records of the replay file, in order */
+static void replayfile ( void )
+{
+  SpoolEntry entry;
+  DLConnRecord r;
+  char *data = NULL;
+  int64_t replayed = 0;
+  int64_t kept = 0;
+  FILE *fp;
+  int cap = 0;
+  int rv;
+
+  if ( ! (fp = fopen (replaypath, "r")) )
+  {
+    ms_log (2, "Cannot read %s: %s\n", replaypath, strerror (errno));
+    return;
+  }
+
+  while ( (rv = readentry (fp, &entry, &data, &cap)) > 0 )
+  {
+    r.record = data;
+    r.reclen = entry.reclen;
+    r.streamid = entry.streamid;
+    r.starttime = entry.starttime;
+    r.endtime = entry.endtime;
+    r.refused = 0;
+
+    /* Stopping, the rest waits for the next start */
+    if ( __atomic_load_n (&stopping, __ATOMIC_ACQUIRE) )
+    {
+      if ( spool_write (&r, 1) < 0 )
+        break;
+      kept++;
+    }
+    else
+    {
+      replayfunc (&r);
+      replayed++;
+    }
+  }
+
+  if ( rv < 0 )
+    ms_log (2, "Spool %s is truncated or damaged after %lld records\n",
+            replaypath, (long long int) ( replayed + kept ));
+
+  fclose (fp);
+  free (data);
+
+  /* Read to the end or to the damage, otherwise tried again next start */
+  if ( rv <= 0 && unlink (replaypath) < 0 )
+    ms_log (2, "Cannot remove %s: %s\n", replaypath, strerror (errno));
+
+  ms_log (0, "Queued %lld spooled records for DataLink, %lld spooled again\n",
+          (long long int) replayed, (long long int) kept);
+}
+
+static void *spool_thread ( void *arg )
+{
+  int more;
+
+  placement_enter (THREAD_DATALINK, "spool");
+
+  do
+  {
+    replayfile ();
+
+    /* Records spooled meanwhile follow if a replay was asked for */
+    pthread_mutex_lock (&spoollock);
+    more = again && ! stopping && spoolfd >= 0;
+    again = 0;
+    if ( more )
+    {
+      close (spoolfd);
+      spoolfd = -1;
+      more = ( movespool () == 0 );
+    }
+    if ( ! more )
+      reading = 0;
+    pthread_mutex_unlock (&spoollock);
+  } while ( more );
+
+  return NULL;
+}
+
+/***************************************************************************
+ * spool_stop:
+ *
+ * End a replay still running, spooling the records not handed back yet.
+ * Waits for the replay function to return.
+ ***************************************************************************/
+void spool_stop ( void )
+{
+  int joinable;
+
+  pthread_mutex_lock (&spoollock);
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+  joinable = replaying;
+  replaying = 0;
+  pthread_mutex_unlock (&spoollock);
+
+  if ( joinable )
+    pthread_join (replaythread, NULL);
+}
+
+/***************************************************************************
+ * spool_close:
+ *
+ * Sync and close the spool once nothing writes to it anymore.
+ ***************************************************************************/
+void spool_close ( void )
+{
+  pthread_mutex_lock (&spoollock);
+
+  if ( spoolfd >= 0 )
+  {
+    if ( fsync (spoolfd) < 0 )
+      ms_log (2, "Cannot sync spool %s: %s\n", spoolpath, strerror (errno));
+    close (spoolfd);
+    spoolfd = -1;
+    ms_log (1, "Spooled %lld records to %s for sending after the next start\n",
+            (long long int) spooled, spoolpath);
+  }
+  spoolpath[0] = '\0';
+  spooled = 0;
+
+  pthread_mutex_unlock (&spoollock);
+}
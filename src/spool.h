@@ -0,0 +1,28 @@
+//
+//  spool.h
+//  q3302dali
+//
+//  Spool of packed records that could not be sent to the DataLink server
+//  when the process stopped, or found its queue full while paused.  They
+//  are appended to a file next to the checkpoint and, after the next
+//  start or the resume, a thread of their own hands them back in the
+//  order they were spooled, so a DataLink server that is down or too slow
+//  during a shutdown, or a long pause, costs no data.
+//
+
+#ifndef spool_h
+#define spool_h
+
+#include "q3302dali.h"
+#include "dlconn.h"
+
+/* Called on the spool thread with each record read back */
+typedef void (*SpoolReplay) ( DLConnRecord *record );
+
+int spool_start ( const char *path, SpoolReplay replay );
+int spool_write ( DLConnRecord *records, int count );
+void spool_replay ( void );
+void spool_stop ( void );
+void spool_close ( void );
+
+#endif /* spool_h */
@@ -0,0 +1,108 @@
+//
+//  startup.c
+//  q3302dali
+//
+//  Startup timing, see startup.h.
+//
+//  Steps are marked from whichever thread reaches them, the data path
+//  among them, so a step already marked costs a single atomic load.
+//
+
+#include <stdio.h>
+#include <time.h>
+#include "startup.h"
+
+static const char *phasenames[STARTUP_PHASES] = {
+  "configuration", "station context", "DataLink connection", "ping reply",
+  "registration", "first packet", "first record"
+};
+
+static pthread_mutex_t startuplock = PTHREAD_MUTEX_INITIALIZER;
+static double t0 = 0.0;            /* monotonic seconds at startup_begin() */
+static double elapsed[STARTUP_PHASES];
+static int marked[STARTUP_PHASES];
+static int firstphase = 0;
+static const char *label = "Startup";
+
+static double monotime ( void )
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/***************************************************************************
+ * startup_begin:
+ *
+ * Start timing the steps from first on, labelled what in the log.  Called
+ * at the start of main() and again when the registration is lost.
+ ***************************************************************************/
+void startup_begin ( int first, const char *what )
+{
+  int i;
+
+  pthread_mutex_lock (&startuplock);
+  t0 = monotime ();
+  label = what;
+  firstphase = first;
+  for ( i = first; i < STARTUP_PHASES; i++ )
+    __atomic_store_n (&marked[i], 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&startuplock);
+}
+
+/***************************************************************************
+ * startup_mark:
+ *
+ * Note that a step was reached, logging the time it took the first time.
+ * Reaching the first record also logs every step of this round in one
+ * line.
+ ***************************************************************************/
+void startup_mark ( int phase )
+{
+  char summary[400];
+  int len;
+  int i;
+
+  if ( __atomic_load_n (&marked[phase], __ATOMIC_ACQUIRE) )
+    return;
+
+  pthread_mutex_lock (&startuplock);
+
+  if ( marked[phase] )
+  {
+    pthread_mutex_unlock (&startuplock);
+    return;
+  }
+
+  elapsed[phase] = monotime () - t0;
+  __atomic_store_n (&marked[phase], 1, __ATOMIC_RELEASE);
+  ms_log (0, "%s: %s after %.3f s\n", label, phasenames[phase], elapsed[phase]);
+
+  if ( phase == STARTUP_FIRSTRECORD )
+  {
+    len = 0;
+    summary[0] = '\0';
+    for ( i = firstphase; i < STARTUP_PHASES && len < (int) sizeof(summary); i++ )
+    {
+      if ( marked[i] )
+        len += snprintf (summary + len, sizeof(summary) - len, "%s%s %.3f s",
+                         ( len ) ? ", " : "", phasenames[i], elapsed[i]);
+    }
+    ms_log (0, "%s steps: %s\n", label, summary);
+  }
+
+  pthread_mutex_unlock (&startuplock);
+}
+
+/* Seconds since startup_begin() */
+double startup_elapsed ( void )
+{
+  double start;
+
+  pthread_mutex_lock (&startuplock);
+  start = t0;
+  pthread_mutex_unlock (&startuplock);
+
+  return monotime () - start;
+}
@@ -0,0 +1,29 @@
+//
+//  startup.h
+//  q3302dali
+//
+//  Startup timing.  The time from the start of the process, or from the
+//  loss of the registration, to each step on the way to the first record
+//  written out is logged once, so a slow restart can be traced to the
+//  step responsible.
+//
+
+#ifndef startup_h
+#define startup_h
+
+#include "q3302dali.h"
+
+#define STARTUP_CONFIG      0      /* configuration read */
+#define STARTUP_CONTEXT     1      /* lib330 station context created */
+#define STARTUP_DATALINK    2      /* DataLink server connected */
+#define STARTUP_PING        3      /* Q330 answered a ping */
+#define STARTUP_REGISTERED  4      /* lib330 running */
+#define STARTUP_FIRSTPACKET 5      /* first data from lib330 */
+#define STARTUP_FIRSTRECORD 6      /* first record written out */
+#define STARTUP_PHASES      7
+
+void startup_begin ( int first, const char *what );
+void startup_mark ( int phase );
+double startup_elapsed ( void );
+
+#endif /* startup_h */
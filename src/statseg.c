@@ -0,0 +1,288 @@
+//
+//  statseg.c
+//  q3302dali
+//
+//  Memory-mapped statistics segment, see statseg.h.
+//
+//  The writer always starts a new file: an existing one is marked closed
+//  and unlinked first, so readers of a previous run reopen the path.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "statseg.h"
+
+/* Map an open segment file, returns 0 on success */
+static int mapseg ( StatSeg *seg, size_t size, int prot )
+{
+  void *map = mmap (NULL, size, prot, MAP_SHARED, seg->fd, 0);
+
+  if ( map == MAP_FAILED )
+    return -1;
+
+  seg->header = (StatSegHeader *) map;
+  seg->slots = (StatSegStream *) ((char *) map + sizeof(StatSegHeader));
+  seg->mapsize = size;
+
+  return 0;
+}
+
+/***************************************************************************
+ * statseg_create:
+ *
+ * Create the segment file at path for writing, with room for numslots
+ * streams.
+ *
+ * Returns the segment or NULL on error, with errno set.
+ ***************************************************************************/
+StatSeg *statseg_create ( const char *path, uint32_t numslots )
+{
+  StatSeg *seg;
+  size_t size = sizeof(StatSegHeader) + (size_t) numslots * sizeof(StatSegStream);
+  int fd;
+
+  if ( numslots == 0 )
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if ( ! (seg = (StatSeg *) calloc (1, sizeof(StatSeg))) )
+    return NULL;
+  seg->writer = 1;
+
+  /* Retire a file left by an earlier run so its readers reopen the path */
+  if ( (fd = open (path, O_RDWR)) >= 0 )
+  {
+    StatSegHeader *old = mmap (NULL, sizeof(StatSegHeader), PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0);
+    if ( old != MAP_FAILED )
+    {
+      __atomic_store_n (&old->state, STATSEG_CLOSED, __ATOMIC_RELEASE);
+      munmap (old, sizeof(StatSegHeader));
+    }
+    close (fd);
+    unlink (path);
+  }
+
+  if ( (seg->fd = open (path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 ||
+       ftruncate (seg->fd, size) < 0 ||
+       mapseg (seg, size, PROT_READ | PROT_WRITE) < 0 )
+  {
+    int saved = errno;
+    statseg_close (seg);
+    errno = saved;
+    return NULL;
+  }
+
+  /* The magic is written last, readers reject the file until then */
+  seg->header->version = STATSEG_VERSION;
+  seg->header->state = STATSEG_LIVE;
+  seg->header->numslots = numslots;
+  seg->header->slotsize = sizeof(StatSegStream);
+  seg->header->created = (uint64_t) time (NULL);
+  seg->header->pid = (int32_t) getpid ();
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  memcpy (seg->header->magic, STATSEG_MAGIC, sizeof(seg->header->magic));
+
+  return seg;
+}
+
+/* Start and finish a seqlock write, the counter is odd in between */
+static void beginwrite ( uint32_t *seq )
+{
+  __atomic_store_n (seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static void endwrite ( uint32_t *seq )
+{
+  __atomic_store_n (seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Update the station block between these calls */
+void statseg_beginstation ( StatSeg *seg )
+{
+  beginwrite (&seg->header->seq);
+}
+
+void statseg_endstation ( StatSeg *seg )
+{
+  endwrite (&seg->header->seq);
+}
+
+/***************************************************************************
+ * statseg_beginstream:
+ *
+ * Open a stream slot for update, slots are used in order so numstreams
+ * grows to cover it.  Finish with statseg_endstream().
+ *
+ * Returns the slot or NULL if the segment is full.
+ ***************************************************************************/
+StatSegStream *statseg_beginstream ( StatSeg *seg, uint32_t slot )
+{
+  StatSegStream *stream;
+
+  if ( slot >= seg->header->numslots )
+    return NULL;
+
+  stream = &seg->slots[slot];
+  beginwrite (&stream->seq);
+
+  if ( slot >= seg->header->numstreams )
+    __atomic_store_n (&seg->header->numstreams, slot + 1, __ATOMIC_RELEASE);
+
+  return stream;
+}
+
+void statseg_endstream ( StatSegStream *stream )
+{
+  endwrite (&stream->seq);
+}
+
+/***************************************************************************
+ * statseg_open:
+ *
+ * Map an existing segment read-only for reading.
+ *
+ * Returns the segment or NULL on error, with errno set, EAGAIN if the
+ * writer has not finished creating it or has stopped.
+ ***************************************************************************/
+StatSeg *statseg_open ( const char *path )
+{
+  StatSeg *seg;
+  StatSegHeader *hdr;
+  struct stat st;
+
+  if ( ! (seg = (StatSeg *) calloc (1, sizeof(StatSeg))) )
+    return NULL;
+
+  if ( (seg->fd = open (path, O_RDONLY)) < 0 || fstat (seg->fd, &st) < 0 )
+    goto error;
+
+  if ( (size_t) st.st_size < sizeof(StatSegHeader) )
+  {
+    errno = EAGAIN;
+    goto error;
+  }
+
+  if ( mapseg (seg, st.st_size, PROT_READ) < 0 )
+    goto error;
+
+  hdr = seg->header;
+  if ( memcmp (hdr->magic, STATSEG_MAGIC, sizeof(hdr->magic)) )
+  {
+    errno = EAGAIN;
+    goto error;
+  }
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+  /* A stopped writer's file, wait for the next one */
+  if ( __atomic_load_n (&hdr->state, __ATOMIC_ACQUIRE) != STATSEG_LIVE )
+  {
+    errno = EAGAIN;
+    goto error;
+  }
+
+  if ( hdr->version != STATSEG_VERSION || hdr->slotsize != sizeof(StatSegStream) ||
+       sizeof(StatSegHeader) + (size_t) hdr->numslots * hdr->slotsize > (size_t) st.st_size )
+  {
+    errno = EPROTO;
+    goto error;
+  }
+
+  return seg;
+
+ error:
+  {
+    int saved = errno;
+    statseg_close (seg);
+    errno = saved;
+  }
+  return NULL;
+}
+
+/* Copy a seqlock guarded block, returns 1 if the copy is consistent */
+static int readblock ( const uint32_t *seq, const void *block, void *copy, size_t size )
+{
+  uint32_t before, after;
+  int tries;
+
+  for ( tries = 0; tries < 100; tries++ )
+  {
+    before = __atomic_load_n (seq, __ATOMIC_ACQUIRE);
+    if ( before & 1 )
+      continue;
+
+    memcpy (copy, block, size);
+
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    after = __atomic_load_n (seq, __ATOMIC_RELAXED);
+    if ( before == after )
+      return 1;
+  }
+
+  return 0;
+}
+
+/***************************************************************************
+ * statseg_readstation:
+ *
+ * Copy the header with a consistent station block.
+ *
+ * Returns 1 on success, 0 if the writer kept changing it and -1 if the
+ * segment was closed, reopen the path.
+ ***************************************************************************/
+int statseg_readstation ( StatSeg *seg, StatSegHeader *copy )
+{
+  if ( __atomic_load_n (&seg->header->state, __ATOMIC_ACQUIRE) != STATSEG_LIVE )
+    return -1;
+
+  return readblock (&seg->header->seq, seg->header, copy, sizeof(StatSegHeader));
+}
+
+/***************************************************************************
+ * statseg_readstream:
+ *
+ * Copy a consistent stream slot.
+ *
+ * Returns 1 on success, 0 if the slot is not in use or the writer kept
+ * changing it.
+ ***************************************************************************/
+int statseg_readstream ( StatSeg *seg, uint32_t slot, StatSegStream *copy )
+{
+  if ( slot >= __atomic_load_n (&seg->header->numstreams, __ATOMIC_ACQUIRE) ||
+       slot >= seg->header->numslots )
+    return 0;
+
+  return readblock (&seg->slots[slot].seq, &seg->slots[slot], copy, sizeof(StatSegStream));
+}
+
+/***************************************************************************
+ * statseg_close:
+ *
+ * Unmap the segment, a writer marks it closed first.
+ ***************************************************************************/
+void statseg_close ( StatSeg *seg )
+{
+  if ( ! seg )
+    return;
+
+  if ( seg->header )
+  {
+    if ( seg->writer )
+      __atomic_store_n (&seg->header->state, STATSEG_CLOSED, __ATOMIC_RELEASE);
+    munmap (seg->header, seg->mapsize);
+  }
+  if ( seg->fd >= 0 )
+    close (seg->fd);
+
+  free (seg);
+}
@@ -0,0 +1,98 @@
+//
+//  statseg.h
+//  q3302dali
+//
+//  Memory-mapped statistics segment.  Once a second the main thread copies
+//  the lib330 status and the counters of every stream into a file, usually
+//  on tmpfs, where monitors such as q3302dali-stat read them at any time
+//  without involving the data path.
+//
+//  The station block and each stream slot carry a sequence counter that is
+//  odd while the block is written (a seqlock).  Readers copy a block and
+//  keep the copy only if the counter was even and unchanged across it.
+//  There is one writer, so writers take no lock.  Only libc is needed,
+//  readers may build this file on its own.
+//
+
+#ifndef statseg_h
+#define statseg_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATSEG_MAGIC "Q330STA"
+#define STATSEG_VERSION 1
+#define STATSEG_LIVE 1
+#define STATSEG_CLOSED 2           /* writer stopped or replaced the file */
+
+typedef struct statseg_header_s
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t state;
+  uint32_t numslots;               /* stream slots in the file */
+  uint32_t slotsize;               /* sizeof(StatSegStream) of the writer */
+  uint64_t created;                /* writer start time, seconds */
+  int32_t pid;
+  char pad0[28];
+
+  /* Station block, guarded by seq */
+  uint32_t seq;
+  uint32_t numstreams;             /* slots in use */
+  uint64_t updated;                /* seconds */
+  int64_t dlconnects;              /* DataLink connection */
+  int64_t dlfailures;
+  int64_t dllost;
+  int64_t queued;                  /* records waiting in the shaper */
+  int32_t bps[3];                  /* minute, hour, day, -1 unknown */
+  int32_t packets[3];
+  int32_t bufferfill;              /* percent, -1 unknown */
+  int32_t clockqual;
+  char station[12];                /* NET-STA from lib330 */
+  char libstate[32];
+  char dlstate[16];
+} StatSegHeader;
+
+typedef struct statseg_stream_s
+{
+  uint32_t seq;
+  uint32_t pad0;
+  char name[32];                   /* NET_STA_LOC_CHAN */
+  int64_t packets;                 /* one-second packets received */
+  int64_t records;                 /* records sent */
+  int64_t samples;                 /* samples in them */
+  int64_t bytes;
+  int64_t gaps;
+  int64_t overlaps;
+  int64_t tears;
+  int64_t duppackets;
+  int64_t lastpacket;              /* arrival of the last packet, hptime */
+  int64_t lastsent;                /* of the last record sent, hptime */
+  int64_t dataend;                 /* end of the latest data, hptime */
+  double latency;                  /* arrival - data end of the last packet, s */
+  int32_t timingqual;              /* percent, -1 unknown */
+  int32_t encoding;                /* of the last record, SEED code */
+} StatSegStream;
+
+typedef struct statseg_s
+{
+  int fd;
+  int writer;
+  StatSegHeader *header;
+  StatSegStream *slots;
+  size_t mapsize;
+} StatSeg;
+
+StatSeg *statseg_create ( const char *path, uint32_t numslots );
+void statseg_beginstation ( StatSeg *seg );
+void statseg_endstation ( StatSeg *seg );
+StatSegStream *statseg_beginstream ( StatSeg *seg, uint32_t slot );
+void statseg_endstream ( StatSegStream *stream );
+
+StatSeg *statseg_open ( const char *path );
+int statseg_readstation ( StatSeg *seg, StatSegHeader *copy );
+int statseg_readstream ( StatSeg *seg, uint32_t slot, StatSegStream *copy );
+
+void statseg_close ( StatSeg *seg );
+
+#endif /* statseg_h */
@@ -0,0 +1,186 @@
+//
+//  streams.c
+//  q3302dali
+//
+//  Per-stream state table and continuity tracking, see streams.h.
+//
+
+#include <stdio.h>
+#include "streams.h"
+
+#define STREAM_BUCKETS 1024        /* power of two */
+
+static StreamInfo *buckets[STREAM_BUCKETS];
+static StreamInfo *listhead = NULL;
+static int numstreams = 0;
+static pthread_rwlock_t streamlock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t namehash ( const char *name )
+{
+  uint32_t hash = 2166136261u;
+
+  while ( *name )
+  {
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static StreamInfo *findlocked ( const char *srcname, uint32_t bucket )
+{
+  StreamInfo *si;
+
+  for ( si = buckets[bucket]; si; si = si->next )
+    if ( ! strcmp (si->srcname, srcname) )
+      return si;
+
+  return NULL;
+}
+
+/***************************************************************************
+ * streams_get:
+ *
+ * Find the entry for a stream, creating it if needed.
+ *
+ * Returns the entry or NULL on allocation error.
+ ***************************************************************************/
+StreamInfo *streams_get ( const char *net, const char *sta,
+                          const char *loc, const char *chan )
+{
+  StreamInfo *si;
+  char srcname[50];
+  uint32_t bucket;
+
+  snprintf (srcname, sizeof(srcname), "%s_%s_%s_%s", net, sta, loc, chan);
+  bucket = namehash (srcname) & (STREAM_BUCKETS - 1);
+
+  pthread_rwlock_rdlock (&streamlock);
+  si = findlocked (srcname, bucket);
+  pthread_rwlock_unlock (&streamlock);
+
+  if ( si )
+    return si;
+
+  pthread_rwlock_wrlock (&streamlock);
+  if ( ! (si = findlocked (srcname, bucket)) )
+  {
+    if ( (si = (StreamInfo *) calloc (1, sizeof(StreamInfo))) )
+    {
+      strcpy (si->srcname, srcname);
+      strncpy (si->network, net, 10);
+      strncpy (si->station, sta, 10);
+      strncpy (si->location, loc, 10);
+      strncpy (si->channel, chan, 10);
+      si->nexttime = HPTERROR;
+      si->timingqual = -1;
+      si->coverage.sentend = HPTERROR;
+      si->lastpacket = HPTERROR;
+      si->dataend = HPTERROR;
+      si->lastsent = HPTERROR;
+      si->index = numstreams;
+
+      si->next = buckets[bucket];
+      buckets[bucket] = si;
+      si->listnext = listhead;
+      __atomic_store_n (&listhead, si, __ATOMIC_RELEASE);
+      numstreams++;
+    }
+    else
+    {
+      ms_log (2, "Cannot allocate stream state for %s\n", srcname);
+    }
+  }
+  pthread_rwlock_unlock (&streamlock);
+
+  return si;
+}
+
+/***************************************************************************
+ * streams_first:
+ *
+ * Returns the most recently created entry, follow listnext for the rest.
+ * The list may be walked without locking while streams are added.
+ ***************************************************************************/
+StreamInfo *streams_first ( void )
+{
+  return __atomic_load_n (&listhead, __ATOMIC_ACQUIRE);
+}
+
+int streams_count ( void )
+{
+  return numstreams;
+}
+
+/***************************************************************************
+ * streams_continuity:
+ *
+ * Compare the start of a packet with the end of the previous packet of
+ * the stream and count any discontinuity.  Differences within tolerance
+ * sample periods are continuous.  If offset is not NULL it is set to the
+ * difference between the actual and expected start time.
+ *
+ * Returns one of the CONT_ event codes.
+ ***************************************************************************/
+int streams_continuity ( StreamInfo *si, MSRecord *msr, double tolerance,
+                         hptime_t *offset )
+{
+  hptime_t period;
+  hptime_t diff;
+  int event = CONT_OK;
+
+  if ( offset )
+    *offset = 0;
+
+  if ( msr->samprate <= 0.0 )
+    return CONT_OK;
+
+  period = (hptime_t) (HPTMODULUS / msr->samprate + 0.5);
+
+  if ( si->nexttime == HPTERROR || si->samprate != msr->samprate )
+  {
+    event = CONT_FIRST;
+  }
+  else
+  {
+    diff = msr->starttime - si->nexttime;
+    if ( offset )
+      *offset = diff;
+
+    if ( diff >= period )
+    {
+      si->gaps++;
+      si->gapseconds += (double) diff / HPTMODULUS;
+      event = CONT_GAP;
+    }
+    else if ( diff <= -period )
+    {
+      si->overlaps++;
+      si->overlapseconds += (double) -diff / HPTMODULUS;
+      event = CONT_OVERLAP;
+    }
+    else if ( llabs (diff) > tolerance * period )
+    {
+      si->tears++;
+      event = CONT_TEAR;
+    }
+  }
+
+  si->samprate = msr->samprate;
+  si->nexttime = msr->starttime + (hptime_t) (msr->numsamples * (HPTMODULUS / msr->samprate) + 0.5);
+
+  return event;
+}
+
+const char *streams_eventname ( int event )
+{
+  switch ( event )
+  {
+    case CONT_FIRST:   return "start";
+    case CONT_GAP:     return "gap";
+    case CONT_OVERLAP: return "overlap";
+    case CONT_TEAR:    return "time tear";
+  }
+  return "continuous";
+}
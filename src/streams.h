@@ -0,0 +1,92 @@
+//
+//  streams.h
+//  q3302dali
+//
+//  Table of per-stream state that outlives the trace buffers, keyed by
+//  NET_STA_LOC_CHAN.  Entries are created on first use and never freed, so
+//  pointers to them stay valid.  The table itself is locked, the fields of
+//  an entry belong to the thread that packs the stream unless noted.
+//
+
+#ifndef streams_h
+#define streams_h
+
+#include "q3302dali.h"
+
+/* Continuity events */
+#define CONT_OK      0
+#define CONT_FIRST   1             /* first packet, or after a rate change */
+#define CONT_GAP     2             /* at least one sample period missing */
+#define CONT_OVERLAP 3             /* at least one sample period repeated */
+#define CONT_TEAR    4             /* time slip shorter than a sample period */
+
+#define COVERAGE_MAX_SPANS 16       /* oldest spans are forgotten beyond this */
+
+/* Time ranges of a stream already accepted for sending, see coverage.c */
+typedef struct coverage_s
+{
+  hptime_t start[COVERAGE_MAX_SPANS]; /* sorted, not overlapping */
+  hptime_t end[COVERAGE_MAX_SPANS];   /* end of the last sample period */
+  int count;
+  hptime_t sentend;                /* end of the latest record sent, atomic */
+} Coverage;
+
+typedef struct streaminfo_s
+{
+  char srcname[50];                /* NET_STA_LOC_CHAN */
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+  int index;                       /* creation order, from 0 */
+
+  /* Arrival of the one-second packets, only set by the stream's pack worker */
+  int64_t packets;
+  hptime_t lastpacket;             /* arrival time of the last one */
+  hptime_t dataend;                /* end of the latest data */
+  double latency;                  /* arrival - data end of the last one, seconds */
+  hptime_t lastsent;               /* time the last record was sent */
+
+  /* Continuity of the one-second packets */
+  hptime_t nexttime;               /* expected start of the next packet */
+  double samprate;
+  int64_t gaps;
+  int64_t overlaps;
+  int64_t tears;
+  double gapseconds;
+  double overlapseconds;
+  int timingqual;                  /* last clock quality percent, -1 unknown */
+
+  /* Duplicate suppression, coverage is locked in coverage.c */
+  Coverage coverage;
+  int64_t duppackets;              /* packets or records dropped whole */
+  int64_t dupsamples;              /* samples dropped, whole or trimmed */
+  int dropping;                    /* in a run of duplicates */
+
+  /* Compression, the encoding is only set by the stream's pack worker */
+  int encoding;                    /* for integer data, 0 for the default */
+  hptime_t lasttrial;              /* of the last trial encoding */
+  int64_t records;                 /* records sent */
+  int64_t recsamples;              /* samples in them */
+  int64_t recbytes;                /* their length */
+  int lastencoding;                /* of the last record sent */
+
+  /* Samples held in the trace buffers, only set by the stream's pack worker */
+  int64_t held;                    /* bytes */
+  int64_t peakheld;
+
+  void *amplitude;                 /* amplitude state, only used from the lib330 thread */
+
+  struct streaminfo_s *next;       /* hash chain */
+  struct streaminfo_s *listnext;   /* creation order */
+} StreamInfo;
+
+StreamInfo *streams_get ( const char *net, const char *sta,
+                          const char *loc, const char *chan );
+StreamInfo *streams_first ( void );
+int streams_count ( void );
+int streams_continuity ( StreamInfo *si, MSRecord *msr, double tolerance,
+                         hptime_t *offset );
+const char *streams_eventname ( int event );
+
+#endif /* streams_h */
@@ -0,0 +1,294 @@
+//
+//  trace.c
+//  q3302dali
+//
+//  Built-in tracer, see trace.h.
+//
+//  Every thread that ends a span gets a ring of the configured number of
+//  events on its first one and is the only writer of it, so recording
+//  takes no lock.  A dump reads the rings while they are written: each
+//  event carries its index, cleared while the event is rewritten, and an
+//  event whose index is not the expected one before and after copying it
+//  was overwritten and is left out.  With a sample rate of N only every
+//  Nth span of a thread is timed at all.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+typedef struct traceevent_s
+{
+  uint64_t seq;                    /* index + 1, 0 while being written */
+  uint64_t start;                  /* monotonic nanoseconds */
+  uint64_t end;
+  int64_t arg;
+  int stage;
+} TraceEvent;
+
+typedef struct tracebuf_s
+{
+  char name[16];
+  int tid;
+  uint64_t head;                   /* events written */
+  TraceEvent *events;
+  struct tracebuf_s *next;
+} TraceBuf;
+
+int trace_active = 0;
+
+static const char *stagenames[TRACE_STAGES] = {
+  "lib330_onesec", "lib330_miniseed", "processMseed", "mst_pack", "msr_unpack", "dl_write", "archive_write"
+};
+
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuf *buffers = NULL;
+static int maxevents = 0;          /* per thread, 0 if the tracer is not set up */
+static int samplerate = 1;
+static char dumpdir[255] = "";     /* dumps are written here, empty for none */
+static __thread TraceBuf *mybuffer = NULL;
+static __thread unsigned int tick = 0;
+static __thread int nobuffer = 0;  /* allocation failed */
+
+static uint64_t nowns ( void )
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/***************************************************************************
+ * trace_init:
+ *
+ * Keep the last events spans of each thread, timing one span in every
+ * sample, and start tracing if events is positive.  Dumps go to dir,
+ * none are written if it is empty.  Called before any traced thread
+ * starts.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+int trace_init ( int events, int sample, const char *dir )
+{
+  if ( events < 0 || sample < 1 )
+  {
+    ms_log (2, "TraceEvents must not be negative and TraceSample must be positive\n");
+    return -1;
+  }
+
+  maxevents = events;
+  samplerate = sample;
+  strncpy (dumpdir, dir, sizeof(dumpdir) - 1);
+  trace_active = ( events > 0 );
+
+  if ( events > 0 )
+    ms_log (0, "Tracing the last %d spans per thread, one in %d\n", events, sample);
+
+  return 0;
+}
+
+/* Turn tracing on or off, returns -1 if the tracer was not set up */
+int trace_enable ( int on )
+{
+  if ( maxevents <= 0 )
+    return -1;
+
+  __atomic_store_n (&trace_active, on, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void trace_setsample ( int sample )
+{
+  if ( sample >= 1 )
+    __atomic_store_n (&samplerate, sample, __ATOMIC_RELAXED);
+}
+
+/* Start time of a span, or 0 if this one is not sampled */
+uint64_t trace_sample ( void )
+{
+  int sample = __atomic_load_n (&samplerate, __ATOMIC_RELAXED);
+
+  if ( sample > 1 && ++tick % sample )
+    return 0;
+
+  return nowns ();
+}
+
+/* Ring of the calling thread, registered for dumps */
+static TraceBuf *newbuffer ( void )
+{
+  TraceBuf *buf;
+
+  if ( ! (buf = (TraceBuf *) calloc (1, sizeof(TraceBuf))) ||
+       ! (buf->events = (TraceEvent *) calloc (maxevents, sizeof(TraceEvent))) )
+  {
+    free (buf);
+    ms_log (2, "Cannot allocate trace buffer of %d events\n", maxevents);
+    return NULL;
+  }
+
+  if ( pthread_getname_np (pthread_self (), buf->name, sizeof(buf->name)) != 0 )
+    strcpy (buf->name, "unknown");
+  buf->tid = (int) syscall (SYS_gettid);
+
+  pthread_mutex_lock (&tracelock);
+  buf->next = buffers;
+  buffers = buf;
+  pthread_mutex_unlock (&tracelock);
+
+  return buf;
+}
+
+/* Record a span of stage that began at start, arg describes its work */
+void trace_end ( int stage, uint64_t start, int64_t arg )
+{
+  TraceBuf *buf = mybuffer;
+  TraceEvent *e;
+  uint64_t index;
+
+  if ( ! buf )
+  {
+    if ( nobuffer || maxevents <= 0 || ! (buf = mybuffer = newbuffer ()) )
+    {
+      nobuffer = 1;
+      return;
+    }
+  }
+
+  index = buf->head;
+  e = &buf->events[index % maxevents];
+
+  __atomic_store_n (&e->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  e->start = start;
+  e->end = nowns ();
+  e->arg = arg;
+  e->stage = stage;
+  __atomic_store_n (&e->seq, index + 1, __ATOMIC_RELEASE);
+  __atomic_store_n (&buf->head, index + 1, __ATOMIC_RELEASE);
+}
+
+/***************************************************************************
+ * trace_dump:
+ *
+ * Write the spans that ended in the last seconds as a Chrome trace to
+ * the file name in the dump directory, through a temporary file so a
+ * reader never sees part of one.  The name must be a plain file name;
+ * neither it nor the temporary file is followed if it is a symbolic
+ * link.
+ *
+ * Returns the number of spans written or -1 with errno set, ENODATA if
+ * the tracer is not set up, EPERM without a dump directory and EINVAL
+ * for a name that is not a plain file name.
+ ***************************************************************************/
+int trace_dump ( const char *name, double seconds )
+{
+  char path[600];
+  char tmppath[610];
+  TraceBuf *buf;
+  TraceEvent *e;
+  TraceEvent copy;
+  uint64_t since;
+  uint64_t head;
+  uint64_t first;
+  uint64_t i;
+  FILE *fp;
+  int count = 0;
+  int err;
+  int fd;
+
+  if ( maxevents <= 0 )
+  {
+    errno = ENODATA;
+    return -1;
+  }
+
+  if ( ! dumpdir[0] )
+  {
+    errno = EPERM;
+    return -1;
+  }
+  if ( ! name[0] || strchr (name, '/') || ! strcmp (name, ".") || ! strcmp (name, "..") ||
+       strlen (name) > 250 )
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  snprintf (path, sizeof(path), "%s/%s", dumpdir, name);
+  snprintf (tmppath, sizeof(tmppath), "%s.tmp", path);
+
+  /* A file left at the temporary name, or planted there, is replaced */
+  if ( unlink (tmppath) < 0 && errno != ENOENT )
+    return -1;
+  if ( (fd = open (tmppath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644)) < 0 )
+    return -1;
+  if ( ! (fp = fdopen (fd, "w")) )
+  {
+    err = errno;
+    close (fd);
+    unlink (tmppath);
+    errno = err;
+    return -1;
+  }
+
+  since = nowns () - (uint64_t) ( seconds * 1e9 );
+
+  fprintf (fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf (fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+           (int) getpid (), PACKAGE);
+
+  pthread_mutex_lock (&tracelock);
+  for ( buf = buffers; buf; buf = buf->next )
+  {
+    fprintf (fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+             (int) getpid (), buf->tid, buf->name);
+
+    head = __atomic_load_n (&buf->head, __ATOMIC_ACQUIRE);
+    first = ( head > (uint64_t) maxevents ) ? head - maxevents : 0;
+
+    for ( i = first; i < head; i++ )
+    {
+      e = &buf->events[i % maxevents];
+      if ( __atomic_load_n (&e->seq, __ATOMIC_ACQUIRE) != i + 1 )
+        continue;
+      copy = *e;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if ( __atomic_load_n (&e->seq, __ATOMIC_RELAXED) != i + 1 )
+        continue;
+
+      if ( copy.end < since || copy.stage < 0 || copy.stage >= TRACE_STAGES )
+        continue;
+
+      fprintf (fp, ",\n{\"name\":\"%s\",\"cat\":\"q3302dali\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+               "\"pid\":%d,\"tid\":%d,\"args\":{\"n\":%lld}}",
+               stagenames[copy.stage], copy.start / 1e3, ( copy.end - copy.start ) / 1e3,
+               (int) getpid (), buf->tid, (long long) copy.arg);
+      count++;
+    }
+  }
+  pthread_mutex_unlock (&tracelock);
+
+  fprintf (fp, "\n]}\n");
+
+  if ( fclose (fp) != 0 || rename (tmppath, path) < 0 )
+  {
+    err = errno;
+    unlink (tmppath);
+    errno = err;
+    return -1;
+  }
+
+  return count;
+}
+
+const char *trace_stagename ( int stage )
+{
+  return ( stage >= 0 && stage < TRACE_STAGES ) ? stagenames[stage] : "unknown";
+}
@@ -0,0 +1,63 @@
+//
+//  trace.h
+//  q3302dali
+//
+//  Tracing of the stages of the data path.  Each stage has a static
+//  tracepoint pair, stage__begin and stage__end in provider q3302dali,
+//  for perf and bpftrace when built with -DHAVE_SDT, and a span in the
+//  built-in tracer, which keeps the most recent spans of every thread
+//  and writes those of the last seconds as a Chrome trace (JSON, for
+//  chrome://tracing or Perfetto) to a file in the configured directory
+//  on request from the control socket.
+//  With the tracer off a span costs one relaxed load.
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include "q3302dali.h"
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(probe, arg) DTRACE_PROBE1 (q3302dali, probe, arg)
+#else
+#define TRACE_PROBE(probe, arg) do { } while (0)
+#endif
+
+/* Stages */
+#define TRACE_ONESEC   0           /* lib330 one second callback */
+#define TRACE_MINISEED 1           /* lib330 miniseed callback */
+#define TRACE_PROCESS  2           /* processMseed() */
+#define TRACE_PACK     3           /* mst_pack() */
+#define TRACE_UNPACK   4           /* msr_unpack() in sendrecord() */
+#define TRACE_DLWRITE  5           /* DataLink write of a batch */
+#define TRACE_ARCHIVE  6           /* archive write of a batch */
+#define TRACE_STAGES   7
+
+/* Begin a span, var is its start or 0 if it is not traced */
+#define TRACE_BEGIN(var, probe, arg)                                   \
+  do {                                                                 \
+    TRACE_PROBE (probe##__begin, arg);                                 \
+    (var) = ( __atomic_load_n (&trace_active, __ATOMIC_RELAXED) ) ?    \
+            trace_sample () : 0;                                       \
+  } while (0)
+
+#define TRACE_END(var, stage, probe, arg)                              \
+  do {                                                                 \
+    TRACE_PROBE (probe##__end, arg);                                   \
+    if ( var )                                                         \
+      trace_end (stage, var, arg);                                     \
+  } while (0)
+
+extern int trace_active;
+
+uint64_t trace_sample ( void );
+void trace_end ( int stage, uint64_t start, int64_t arg );
+
+int trace_init ( int events, int sample, const char *dir );
+int trace_enable ( int on );
+void trace_setsample ( int sample );
+int trace_dump ( const char *name, double seconds );
+const char *trace_stagename ( int stage );
+
+#endif /* trace_h */
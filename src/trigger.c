@@ -0,0 +1,408 @@
+//
+//  trigger.c
+//  q3302dali
+//
+//  STA/LTA trigger on one-second data, see trigger.h.
+//
+//  The prefilter is a second order Butterworth highpass at the low corner
+//  and lowpass at the high corner, each a biquad in transposed direct
+//  form II.  The averages are the recursive (exponential) ones of the
+//  squared filtered samples, so each sample costs a few multiplies and no
+//  division: the thresholds are compared as sta >= on * lta, the ratio is
+//  only computed while triggered.  The LTA is held while triggered so a
+//  long event does not raise its own off threshold.
+//
+//  After a start, gap or rate change the filters are primed with the
+//  first sample and no trigger is declared until a full LTA window has
+//  been seen, during which both averages are plain means.  A trigger that
+//  is on when its channel restarts is turned off at the end of the data.
+//
+//  Triggers are only used from the lib330 callback thread.
+//
+
+#include <stdio.h>
+#include <math.h>
+#include "trigger.h"
+
+typedef struct biquad_s
+{
+  double b0, b1, b2, a1, a2;       /* normalized, a0 is 1 */
+  double z1, z2;
+} Biquad;
+
+typedef struct trigger_s
+{
+  int spec;                        /* index of the config spec */
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+  double rate;
+  int usable;                      /* 0 when the spec does not suit the rate */
+  int numfilters;
+  Biquad filters[2];
+  double csta;                     /* 1 / samples in each average */
+  double clta;
+  int64_t seen;                    /* samples since the last restart */
+  int64_t ltasamples;
+  double sta;
+  double lta;
+  int on;
+  hptime_t ontime;
+  double peak;
+  hptime_t nexttime;               /* expected time of the next sample */
+} Trigger;
+
+/* A config spec with the location and channel split out */
+typedef struct triggermatch_s
+{
+  char srcloc[11];
+  char srcchan[11];
+  int anysrcloc;
+  TriggerSpec spec;
+} TriggerMatch;
+
+static TriggerMatch *matches = NULL;
+static int nummatches = 0;
+static Trigger **triggers = NULL;
+static int numtriggers = 0;
+static trigger_handler handler = NULL;
+
+/* Butterworth (Q = 1/sqrt(2)) biquad by the bilinear transform */
+static void designbiquad ( Biquad *bq, double corner, double rate, int highpass )
+{
+  double w0 = 2.0 * M_PI * corner / rate;
+  double alpha = sin (w0) / M_SQRT2;
+  double cosw = cos (w0);
+  double a0 = 1.0 + alpha;
+
+  if ( highpass )
+  {
+    bq->b0 = (1.0 + cosw) / 2.0 / a0;
+    bq->b1 = -(1.0 + cosw) / a0;
+  }
+  else
+  {
+    bq->b0 = (1.0 - cosw) / 2.0 / a0;
+    bq->b1 = (1.0 - cosw) / a0;
+  }
+  bq->b2 = bq->b0;
+  bq->a1 = -2.0 * cosw / a0;
+  bq->a2 = (1.0 - alpha) / a0;
+}
+
+/* Set the state to the steady response to a constant x, returns the output */
+static double primebiquad ( Biquad *bq, double x )
+{
+  double y = x * (bq->b0 + bq->b1 + bq->b2) / (1.0 + bq->a1 + bq->a2);
+
+  bq->z2 = bq->b2 * x - bq->a2 * y;
+  bq->z1 = bq->b1 * x - bq->a1 * y + bq->z2;
+
+  return y;
+}
+
+static inline double runbiquad ( Biquad *bq, double x )
+{
+  double y = bq->b0 * x + bq->z1;
+
+  bq->z1 = bq->b1 * x - bq->a1 * y + bq->z2;
+  bq->z2 = bq->b2 * x - bq->a2 * y;
+
+  return y;
+}
+
+/* Split CHAN or LOC.CHAN, an empty location is written as .CHAN or --.CHAN */
+static void splitlocchan ( const char *spec, char *loc, char *chan, int *anyloc )
+{
+  const char *dot = strchr (spec, '.');
+
+  if ( dot )
+  {
+    int len = dot - spec;
+    if ( len > 2 )
+      len = 2;
+    strncpy (loc, spec, len);
+    loc[len] = '\0';
+    if ( ! strcmp (loc, "--") )
+      loc[0] = '\0';
+    strncpy (chan, dot + 1, 3);
+    chan[3] = '\0';
+    *anyloc = 0;
+  }
+  else
+  {
+    loc[0] = '\0';
+    strncpy (chan, spec, 3);
+    chan[3] = '\0';
+    *anyloc = 1;
+  }
+}
+
+/***************************************************************************
+ * trigger_init:
+ *
+ * Check the trigger specs, events are passed to thandler.
+ *
+ * Returns the number of usable triggers.
+ ***************************************************************************/
+int trigger_init ( TriggerSpec *specs, int numspecs, trigger_handler thandler )
+{
+  int i;
+
+  handler = thandler;
+  nummatches = 0;
+
+  if ( numspecs <= 0 )
+    return 0;
+
+  if ( ! (matches = (TriggerMatch *) calloc (numspecs, sizeof(TriggerMatch))) )
+  {
+    ms_log (2, "Cannot allocate triggers\n");
+    return 0;
+  }
+
+  for ( i = 0; i < numspecs; i++ )
+  {
+    TriggerSpec *ts = &specs[i];
+    TriggerMatch *tm = &matches[nummatches];
+
+    if ( ts->sta <= 0.0 || ts->lta <= ts->sta || ts->on <= 1.0 ||
+         ts->off <= 0.0 || ts->off >= ts->on )
+    {
+      ms_log (2, "Trigger %s: needs 0 < STA < LTA and 0 < off < on, 1 < on\n", ts->source);
+      continue;
+    }
+    if ( ts->lowcorner < 0.0 || ts->highcorner < 0.0 ||
+         ( ts->highcorner > 0.0 && ts->highcorner <= ts->lowcorner ) )
+    {
+      ms_log (2, "Trigger %s: the high corner must be above the low corner\n", ts->source);
+      continue;
+    }
+
+    memset (tm, 0, sizeof(TriggerMatch));
+    splitlocchan (ts->source, tm->srcloc, tm->srcchan, &tm->anysrcloc);
+    tm->spec = *ts;
+
+    ms_log (0, "Triggering on %s, STA %gs LTA %gs on %g off %g, %g-%g Hz\n",
+            ts->source, ts->sta, ts->lta, ts->on, ts->off, ts->lowcorner, ts->highcorner);
+    nummatches++;
+  }
+
+  return nummatches;
+}
+
+/* Find or create the trigger for a spec and input stream */
+static Trigger *findtrigger ( int spec, MSRecord *msr )
+{
+  Trigger **grown;
+  Trigger *t;
+  int i;
+
+  for ( i = 0; i < numtriggers; i++ )
+  {
+    t = triggers[i];
+    if ( t->spec == spec && ! strcmp (t->network, msr->network) &&
+         ! strcmp (t->station, msr->station) &&
+         ! strcmp (t->location, msr->location) )
+      return t;
+  }
+
+  if ( ! (grown = (Trigger **) realloc (triggers, (numtriggers + 1) * sizeof(Trigger *))) )
+    return NULL;
+  triggers = grown;
+
+  if ( ! (t = (Trigger *) calloc (1, sizeof(Trigger))) )
+    return NULL;
+
+  t->spec = spec;
+  strcpy (t->network, msr->network);
+  strcpy (t->station, msr->station);
+  strcpy (t->location, msr->location);
+  strcpy (t->channel, msr->channel);
+  t->nexttime = HPTERROR;
+
+  triggers[numtriggers++] = t;
+
+  return t;
+}
+
+/* Design the filters and averages for the stream's sample rate */
+static void setrate ( Trigger *t, double rate )
+{
+  TriggerSpec *ts = &matches[t->spec].spec;
+  double nyquist = rate / 2.0;
+
+  t->rate = rate;
+  t->numfilters = 0;
+  t->usable = ( ts->lowcorner < 0.8 * nyquist && ts->sta * rate >= 1.0 );
+
+  if ( ! t->usable )
+  {
+    ms_log (1, "Trigger %s on %s_%s_%s_%s does not suit %g sps, not used\n", ts->source,
+            t->network, t->station, t->location, t->channel, rate);
+    return;
+  }
+
+  if ( ts->lowcorner > 0.0 )
+    designbiquad (&t->filters[t->numfilters++], ts->lowcorner, rate, 1);
+  if ( ts->highcorner > 0.0 && ts->highcorner < 0.8 * nyquist )
+    designbiquad (&t->filters[t->numfilters++], ts->highcorner, rate, 0);
+
+  t->csta = 1.0 / (ts->sta * rate);
+  t->clta = 1.0 / (ts->lta * rate);
+  t->ltasamples = (int64_t) (ts->lta * rate + 0.5);
+}
+
+/* Pass an event for the trigger to the handler */
+static void emit ( Trigger *t, int on, hptime_t time, double ratio )
+{
+  TriggerEvent event;
+
+  strcpy (event.network, t->network);
+  strcpy (event.station, t->station);
+  strcpy (event.location, t->location);
+  strcpy (event.channel, t->channel);
+  event.on = on;
+  event.time = time;
+  event.ontime = t->ontime;
+  event.ratio = ratio;
+
+  handler (&event);
+}
+
+/* Restart the filters and averages at a sample */
+static void resettrigger ( Trigger *t, double value )
+{
+  int j;
+
+  if ( t->on )
+  {
+    emit (t, 0, t->nexttime, t->peak);
+    t->on = 0;
+  }
+
+  for ( j = 0; j < t->numfilters; j++ )
+    value = primebiquad (&t->filters[j], value);
+
+  t->seen = 0;
+  t->sta = 0.0;
+  t->lta = 0.0;
+}
+
+/* Run one record through a trigger */
+static void triggerrecord ( Trigger *t, MSRecord *msr )
+{
+  TriggerSpec *ts = &matches[t->spec].spec;
+  int32 *samples = (int32 *) msr->datasamples;
+  double period = HPTMODULUS / msr->samprate;
+  double sta = t->sta;
+  double lta = t->lta;
+  int64_t i;
+  int j;
+
+  if ( t->rate != msr->samprate )
+  {
+    resettrigger (t, samples[0]);
+    setrate (t, msr->samprate);
+    t->nexttime = HPTERROR;
+  }
+
+  if ( ! t->usable )
+    return;
+
+  if ( t->nexttime == HPTERROR || llabs (msr->starttime - t->nexttime) > period / 2 )
+  {
+    resettrigger (t, samples[0]);
+    sta = lta = 0.0;
+  }
+
+  for ( i = 0; i < msr->numsamples; i++ )
+  {
+    double y = samples[i];
+    double energy;
+
+    for ( j = 0; j < t->numfilters; j++ )
+      y = runbiquad (&t->filters[j], y);
+    energy = y * y;
+
+    /* Plain means until the windows are full */
+    if ( t->seen < t->ltasamples )
+    {
+      double c = 1.0 / ++t->seen;
+      sta += ( c > t->csta ? c : t->csta ) * (energy - sta);
+      lta += c * (energy - lta);
+      continue;
+    }
+
+    sta += t->csta * (energy - sta);
+
+    if ( ! t->on )
+    {
+      lta += t->clta * (energy - lta);
+      if ( sta >= ts->on * lta && lta > 0.0 )
+      {
+        t->on = 1;
+        t->ontime = msr->starttime + (hptime_t) (i * period + 0.5);
+        t->peak = sta / lta;
+        emit (t, 1, t->ontime, t->peak);
+      }
+    }
+    else
+    {
+      double ratio = sta / lta;
+
+      if ( ratio > t->peak )
+        t->peak = ratio;
+      if ( ratio <= ts->off )
+      {
+        t->on = 0;
+        emit (t, 0, msr->starttime + (hptime_t) (i * period + 0.5), t->peak);
+      }
+    }
+  }
+
+  t->sta = sta;
+  t->lta = lta;
+  t->nexttime = msr->starttime + (hptime_t) (msr->numsamples * period + 0.5);
+}
+
+/***************************************************************************
+ * trigger_record:
+ *
+ * Feed a one-second record of integer samples to every trigger whose
+ * source matches it.
+ ***************************************************************************/
+void trigger_record ( MSRecord *msr )
+{
+  Trigger *t;
+  int i;
+
+  if ( nummatches == 0 || msr->samprate <= 0.0 || msr->numsamples <= 0 ||
+       msr->sampletype != 'i' )
+    return;
+
+  for ( i = 0; i < nummatches; i++ )
+  {
+    if ( strcmp (matches[i].srcchan, msr->channel) ||
+         ( ! matches[i].anysrcloc && strcmp (matches[i].srcloc, msr->location) ) )
+      continue;
+
+    if ( (t = findtrigger (i, msr)) )
+      triggerrecord (t, msr);
+  }
+}
+
+void trigger_free ( void )
+{
+  int i;
+
+  for ( i = 0; i < numtriggers; i++ )
+    free (triggers[i]);
+  free (triggers);
+  free (matches);
+  triggers = NULL;
+  matches = NULL;
+  numtriggers = 0;
+  nummatches = 0;
+}
@@ -0,0 +1,50 @@
+//
+//  trigger.h
+//  q3302dali
+//
+//  Recursive STA/LTA event trigger on one-second data.  Samples are
+//  bandpass filtered and the ratio of the short and long term averages of
+//  their energy is tracked as they arrive, so trigger on and off events
+//  leave with the second of data that caused them instead of waiting for
+//  records to fill.
+//
+
+#ifndef trigger_h
+#define trigger_h
+
+#include "q3302dali.h"
+
+#define MAX_TRIGGERS 64
+
+/* A trigger as read from the config file */
+typedef struct triggerspec_s
+{
+  char source[16];                 /* CHAN or LOC.CHAN of the input */
+  double sta;                      /* short term average, seconds */
+  double lta;                      /* long term average, seconds */
+  double on;                       /* STA/LTA ratio to trigger on */
+  double off;                      /* ratio to trigger off */
+  double lowcorner;                /* bandpass in Hz, 0 for none */
+  double highcorner;
+} TriggerSpec;
+
+typedef struct triggerevent_s
+{
+  char network[11];
+  char station[11];
+  char location[11];
+  char channel[11];
+  int on;                          /* 1 trigger on, 0 trigger off */
+  hptime_t time;                   /* of the sample crossing the threshold */
+  hptime_t ontime;                 /* of the trigger on, for both events */
+  double ratio;                    /* STA/LTA at trigger on, the peak at off */
+} TriggerEvent;
+
+/* Receives trigger events, on the lib330 callback thread */
+typedef void (*trigger_handler) ( TriggerEvent *event );
+
+int trigger_init ( TriggerSpec *specs, int numspecs, trigger_handler handler );
+void trigger_record ( MSRecord *msr );
+void trigger_free ( void );
+
+#endif /* trigger_h */
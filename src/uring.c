@@ -0,0 +1,303 @@
+//
+//  uring.c
+//  q3302dali
+//
+//  io_uring on the raw system calls, see uring.h.
+//
+//  Use is synchronous in batches: writes are queued in the submission
+//  ring, then uring_submit() hands all of them to the kernel and reaps
+//  completions until every one is back, so the rings are empty between
+//  batches and the completion ring, twice the submission ring, never
+//  overflows.  Writes go to the current file position, which for the
+//  O_APPEND files of the archive is the end; linked writes start only
+//  once the previous one completed in full, so a file is written in the
+//  order its records were queued.  The kernel shares the ring indexes,
+//  so they are read with acquire and written with release ordering.
+//
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#ifdef __NR_io_uring_setup
+
+#include <linux/io_uring.h>
+
+struct uring_s
+{
+  int fd;
+  unsigned int entries;            /* of the submission ring */
+  unsigned int tail;               /* submission tail not yet published */
+  unsigned int queued;             /* writes queued since the last submit */
+  unsigned int *sqtail;
+  unsigned int *sqmask;
+  unsigned int *sqarray;
+  unsigned int *cqhead;
+  unsigned int *cqtail;
+  unsigned int *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_sqe *last;       /* most recently queued */
+  struct io_uring_cqe *cqes;
+  void *sqmap;
+  size_t sqmapsize;
+  void *cqmap;
+  size_t cqmapsize;
+  size_t sqessize;
+};
+
+static int setup ( unsigned int entries, struct io_uring_params *params )
+{
+  return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int enter ( int fd, unsigned int submit, unsigned int wait, unsigned int flags )
+{
+  return (int) syscall (__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+/***************************************************************************
+ * uring_open:
+ *
+ * Set up rings for at least entries queued writes.  Needs a kernel that
+ * writes at the current file position, 5.6 or later.
+ *
+ * Returns the ring or NULL with errno set.
+ ***************************************************************************/
+Uring *uring_open ( unsigned int entries )
+{
+  struct io_uring_params params;
+  Uring *ring;
+  char *sq, *cq;
+  int err;
+
+  if ( ! (ring = (Uring *) calloc (1, sizeof(Uring))) )
+    return NULL;
+
+  memset (&params, 0, sizeof(params));
+  if ( (ring->fd = setup (entries, &params)) < 0 )
+  {
+    err = errno;
+    free (ring);
+    errno = err;
+    return NULL;
+  }
+
+  if ( ! ( params.features & IORING_FEAT_RW_CUR_POS ) )
+  {
+    close (ring->fd);
+    free (ring);
+    errno = ENOSYS;
+    return NULL;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sqmapsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cqmapsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* Both rings may share one mapping */
+  if ( params.features & IORING_FEAT_SINGLE_MMAP )
+  {
+    if ( ring->cqmapsize > ring->sqmapsize )
+      ring->sqmapsize = ring->cqmapsize;
+    ring->cqmapsize = ring->sqmapsize;
+  }
+
+  ring->sqmap = mmap (NULL, ring->sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  if ( ring->sqmap == MAP_FAILED )
+    goto failed;
+
+  if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    ring->cqmap = ring->sqmap;
+  else if ( (ring->cqmap = mmap (NULL, ring->cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED )
+    goto failed;
+
+  ring->sqes = (struct io_uring_sqe *) mmap (NULL, ring->sqessize, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if ( ring->sqes == MAP_FAILED )
+    goto failed;
+
+  sq = (char *) ring->sqmap;
+  cq = (char *) ring->cqmap;
+  ring->sqtail = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sqmask = (unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned int *) (sq + params.sq_off.array);
+  ring->cqhead = (unsigned int *) (cq + params.cq_off.head);
+  ring->cqtail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cqmask = (unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  ring->tail = *ring->sqtail;
+
+  return ring;
+
+ failed:
+  err = errno;
+  if ( ring->sqes && ring->sqes != MAP_FAILED )
+    munmap (ring->sqes, ring->sqessize);
+  if ( ring->cqmap && ring->cqmap != MAP_FAILED && ring->cqmap != ring->sqmap )
+    munmap (ring->cqmap, ring->cqmapsize);
+  if ( ring->sqmap && ring->sqmap != MAP_FAILED )
+    munmap (ring->sqmap, ring->sqmapsize);
+  close (ring->fd);
+  free (ring);
+  errno = err;
+  return NULL;
+}
+
+/* Writes that can be queued before the next submit */
+int uring_space ( Uring *ring )
+{
+  return (int) ( ring->entries - ring->queued );
+}
+
+/***************************************************************************
+ * uring_writev:
+ *
+ * Queue a vectored write of cnt iovecs to fd at its current position.
+ * The iovec array must stay in place until the submit returns.  With
+ * link the next queued write starts once this one has completed in
+ * full; a failed or short write cancels the writes linked after it.
+ *
+ * Returns 0 on success and -1 if the ring is full.
+ ***************************************************************************/
+int uring_writev ( Uring *ring, int fd, struct iovec *iov, int cnt, int link, uint64_t tag )
+{
+  struct io_uring_sqe *sqe;
+  unsigned int index;
+
+  if ( ring->queued == ring->entries )
+    return -1;
+
+  index = ring->tail & *ring->sqmask;
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->flags = ( link ) ? IOSQE_IO_LINK : 0;
+  sqe->fd = fd;
+  sqe->off = (uint64_t) -1;
+  sqe->addr = (uint64_t) (uintptr_t) iov;
+  sqe->len = (uint32_t) cnt;
+  sqe->user_data = tag;
+
+  ring->sqarray[index] = index;
+  ring->tail++;
+  ring->queued++;
+  ring->last = sqe;
+
+  return 0;
+}
+
+/* End a chain at the last queued write, before a submit splits it */
+void uring_endlink ( Uring *ring )
+{
+  if ( ring->last )
+    ring->last->flags &= ~IOSQE_IO_LINK;
+}
+
+/***************************************************************************
+ * uring_submit:
+ *
+ * Submit the queued writes and wait for all of them, calling done for
+ * each completion.
+ *
+ * Returns 0 on success and -1 with errno set if the kernel refused the
+ * submission; writes not reported to done are in an unknown state.
+ ***************************************************************************/
+int uring_submit ( Uring *ring, UringDone done, void *arg )
+{
+  struct io_uring_cqe *cqe;
+  unsigned int pending = ring->queued;
+  unsigned int outstanding = 0;
+  unsigned int head;
+  int rv;
+
+  __atomic_store_n (ring->sqtail, ring->tail, __ATOMIC_RELEASE);
+  ring->queued = 0;
+  ring->last = NULL;
+
+  while ( pending || outstanding )
+  {
+    if ( (rv = enter (ring->fd, pending, 1, IORING_ENTER_GETEVENTS)) < 0 )
+    {
+      if ( errno == EINTR || errno == EAGAIN || errno == EBUSY )
+      {
+        /* Completions are reaped below, making room */
+        if ( ! outstanding )
+          continue;
+      }
+      else
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      pending -= rv;
+      outstanding += rv;
+    }
+
+    head = *ring->cqhead;
+    while ( head != __atomic_load_n (ring->cqtail, __ATOMIC_ACQUIRE) )
+    {
+      cqe = &ring->cqes[head & *ring->cqmask];
+      done (cqe->user_data, cqe->res, arg);
+      head++;
+      outstanding--;
+    }
+    __atomic_store_n (ring->cqhead, head, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+void uring_close ( Uring *ring )
+{
+  if ( ! ring )
+    return;
+
+  munmap (ring->sqes, ring->sqessize);
+  if ( ring->cqmap != ring->sqmap )
+    munmap (ring->cqmap, ring->cqmapsize);
+  munmap (ring->sqmap, ring->sqmapsize);
+  close (ring->fd);
+  free (ring);
+}
+
+#else /* no io_uring */
+
+Uring *uring_open ( unsigned int entries )
+{
+  errno = ENOSYS;
+  return NULL;
+}
+
+int uring_space ( Uring *ring )
+{
+  return 0;
+}
+
+int uring_writev ( Uring *ring, int fd, struct iovec *iov, int cnt, int link, uint64_t tag )
+{
+  return -1;
+}
+
+void uring_endlink ( Uring *ring )
+{
+}
+
+int uring_submit ( Uring *ring, UringDone done, void *arg )
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void uring_close ( Uring *ring )
+{
+}
+
+#endif /* __NR_io_uring_setup */
@@ -0,0 +1,31 @@
+//
+//  uring.h
+//  q3302dali
+//
+//  Minimal io_uring submission and completion rings on the raw system
+//  calls, for writing many buffers with one system call.  Writes queued
+//  to the same file can be linked so the kernel runs them in order.  On
+//  systems or kernels without io_uring uring_open() fails with ENOSYS and
+//  callers keep their writev() path.
+//
+
+#ifndef uring_h
+#define uring_h
+
+#include <sys/uio.h>
+#include "q3302dali.h"
+
+typedef struct uring_s Uring;
+
+/* Called for each completion with the tag of the write and its result,
+   bytes written or a negative errno */
+typedef void (*UringDone) ( uint64_t tag, int result, void *arg );
+
+Uring *uring_open ( unsigned int entries );
+int uring_space ( Uring *ring );
+int uring_writev ( Uring *ring, int fd, struct iovec *iov, int cnt, int link, uint64_t tag );
+void uring_endlink ( Uring *ring );
+int uring_submit ( Uring *ring, UringDone done, void *arg );
+void uring_close ( Uring *ring );
+
+#endif /* uring_h */